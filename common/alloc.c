@@ -247,6 +247,7 @@ int group_dereference (ptr, file, line)
 	if (group -> statements)
 		executable_statement_dereference (&group -> statements,
 						  file, line);
+	group_option_set_forget (group);
 	if (group -> next)
 		group_dereference (&group -> next, file, line);
 	dfree (group, file, line);
@@ -950,6 +951,8 @@ int option_state_dereference (ptr, file, line)
 		    universes [i] -> option_state_dereference)
 			((*(universes [i] -> option_state_dereference))
 			 (universes [i], options, file, line));
+	if (options -> arena)
+		packet_arena_dereference (&options -> arena, file, line);
 
 	dfree (options, file, line);
 	return 1;
@@ -1120,17 +1123,203 @@ int packet_dereference (ptr, file, line)
 		interface_dereference (&packet -> interface, MDL);
 	if (packet -> shared_network)
 		shared_network_dereference (&packet -> shared_network, MDL);
-	for (i = 0; i < packet -> class_count && i < PACKET_MAX_CLASSES; i++) {
+	for (i = 0; i < packet -> class_count; i++) {
 		if (packet -> classes [i])
 			omapi_object_dereference ((omapi_object_t **)
 						  &packet -> classes [i], MDL);
 	}
+	if (packet -> classes && packet -> classes != packet -> class_store)
+		dfree (packet -> classes, MDL);
+	if (packet -> class_set &&
+	    packet -> class_set != packet -> class_set_store)
+		dfree (packet -> class_set, MDL);
+	if (packet -> permit_cache)
+		dfree (packet -> permit_cache, MDL);
+	/* With the option state gone this normally releases the copy of
+	   the packet and all of its option caches at once. */
+	if (packet -> arena)
+		packet_arena_dereference (&packet -> arena, MDL);
 	packet -> raw = (struct dhcp_packet *)free_packets;
 	free_packets = packet;
 	dmalloc_reuse (free_packets, __FILE__, __LINE__, 0);
 	return 1;
 }
 
+static struct packet_arena *free_packet_arenas;
+
+#if defined (DEBUG_MEMORY_LEAKAGE) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_free_packet_arenas ()
+{
+	struct packet_arena *a, *n;
+	for (a = free_packet_arenas; a; a = n) {
+		n = a -> next;
+		if (a -> buffer)
+			buffer_dereference (&a -> buffer, MDL);
+		dfree (a, MDL);
+	}
+	free_packet_arenas = (struct packet_arena *)0;
+}
+#endif
+
+/* Allocate an arena holding a copy of the len bytes of a received
+   packet at raw.   Options parsed out of the packet while raw is still
+   valid point into the copy rather than into buffers of their own. */
+int packet_arena_allocate (ptr, raw, len, file, line)
+	struct packet_arena **ptr;
+	const unsigned char *raw;
+	unsigned len;
+	const char *file;
+	int line;
+{
+	struct packet_arena *a;
+
+	if (!ptr) {
+		log_error ("%s(%d): null pointer", file, line);
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		return 0;
+#endif
+	}
+	if (*ptr) {
+		log_error ("%s(%d): non-null pointer", file, line);
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		*ptr = (struct packet_arena *)0;
+#endif
+	}
+
+	if (free_packet_arenas) {
+		a = free_packet_arenas;
+		free_packet_arenas = a -> next;
+		dmalloc_reuse (a, file, line, 1);
+	} else {
+		a = dmalloc (sizeof *a, file, line);
+		if (!a)
+			return 0;
+	}
+
+	/* Keep the buffer of the last packet if it's big enough; one
+	   extra byte leaves room to NUL terminate the last option. */
+	if (a -> buffer && a -> buffer_size < len + 1)
+		buffer_dereference (&a -> buffer, file, line);
+	if (!a -> buffer) {
+		a -> buffer_size = len + 1 < DHCP_MTU_MAX ? DHCP_MTU_MAX
+							  : len + 1;
+		if (!buffer_allocate (&a -> buffer, a -> buffer_size,
+				      file, line)) {
+			a -> next = free_packet_arenas;
+			free_packet_arenas = a;
+			return 0;
+		}
+	}
+	memcpy (a -> buffer -> data, raw, len);
+	a -> buffer -> data [len] = 0;
+	a -> raw = raw;
+	a -> length = len;
+	a -> used = 0;
+	a -> next = (struct packet_arena *)0;
+	a -> refcnt = 0;
+	return packet_arena_reference (ptr, a, file, line);
+}
+
+int packet_arena_reference (ptr, bp, file, line)
+	struct packet_arena **ptr;
+	struct packet_arena *bp;
+	const char *file;
+	int line;
+{
+	if (!ptr) {
+		log_error ("%s(%d): null pointer", file, line);
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		return 0;
+#endif
+	}
+	if (*ptr) {
+		log_error ("%s(%d): non-null pointer", file, line);
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		*ptr = (struct packet_arena *)0;
+#endif
+	}
+	*ptr = bp;
+	bp -> refcnt++;
+	rc_register (file, line, ptr, bp, bp -> refcnt, 0, RC_MISC);
+	return 1;
+}
+
+int packet_arena_dereference (ptr, file, line)
+	struct packet_arena **ptr;
+	const char *file;
+	int line;
+{
+	struct packet_arena *a;
+
+	if (!ptr || !*ptr) {
+		log_error ("%s(%d): null pointer", file, line);
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		return 0;
+#endif
+	}
+
+	a = *ptr;
+	*ptr = (struct packet_arena *)0;
+	--a -> refcnt;
+	rc_register (file, line, ptr, a, a -> refcnt, 1, RC_MISC);
+	if (a -> refcnt > 0)
+		return 1;
+
+	if (a -> refcnt < 0) {
+		log_error ("%s(%d): negative refcnt!", file, line);
+#if defined (DEBUG_RC_HISTORY)
+		dump_rc_history (a);
+#endif
+#if defined (POINTER_DEBUG)
+		abort ();
+#else
+		return 0;
+#endif
+	}
+
+	/* Every cache carved from the arena held a reference, so none of
+	   them is in use any more.   The copy of the packet may still be
+	   referenced by a data string that was copied out of an option,
+	   in which case it's left to that and a new one is made next time. */
+	if (a -> buffer && a -> buffer -> refcnt > 1)
+		buffer_dereference (&a -> buffer, file, line);
+	a -> raw = (const unsigned char *)0;
+	a -> next = free_packet_arenas;
+	free_packet_arenas = a;
+	dmalloc_reuse (free_packet_arenas, __FILE__, __LINE__, 0);
+	return 1;
+}
+
+/* Carve an option cache out of a packet arena, or allocate one the usual
+   way if there's no arena or it's used up. */
+int packet_arena_option_cache (cptr, arena, file, line)
+	struct option_cache **cptr;
+	struct packet_arena *arena;
+	const char *file;
+	int line;
+{
+	struct option_cache *rval;
+
+	if (!arena || arena -> used == PACKET_ARENA_CACHES)
+		return option_cache_allocate (cptr, file, line);
+
+	rval = &arena -> caches [arena -> used++];
+	memset (rval, 0, sizeof *rval);
+	packet_arena_reference (&rval -> arena, arena, file, line);
+	return option_cache_reference (cptr, rval, file, line);
+}
+
 int dns_zone_allocate (ptr, file, line)
 	struct dns_zone **ptr;
 	const char *file;
@@ -0,0 +1,1147 @@
+/* bytecode.c
+
+   Compilation of expressions into flat programs, and the stack machine
+   that runs them. */
+
+/*
+ * Copyright (c) 2020 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * Expressions that are evaluated for every packet - class matches,
+ * spawn submatches, "if" conditions and computed options such as
+ * ddns-hostname - are compiled when the configuration is read into a
+ * program for a small stack machine.  Running the program gives the
+ * same result as walking the tree in tree.c, but intermediate strings
+ * are either slices of the strings they came from or are built in a
+ * scratch area that is reused, rather than each getting a buffer of its
+ * own.  Only the final result is copied into a buffer, and only if it
+ * was built in the scratch area.
+ *
+ * Operators the machine doesn't implement are compiled into a call back
+ * into the tree walker for that subexpression, so any expression can be
+ * compiled.  The machine isn't used when DEBUG_EXPRESSIONS is defined,
+ * so that the tree walker's debugging output is complete.
+ */
+
+#include "dhcpd.h"
+#include <ctype.h>
+
+enum expr_opcode {
+	EOP_CONST_DATA,
+	EOP_CONST_INT,
+	EOP_OPTION,
+	EOP_CONFIG_OPTION,
+	EOP_HARDWARE,
+	EOP_PACKET,
+	EOP_SUBSTRING,
+	EOP_SUFFIX,
+	EOP_LCASE,
+	EOP_UCASE,
+	EOP_CONCAT,
+	EOP_ENCODE_INT8,
+	EOP_ENCODE_INT16,
+	EOP_ENCODE_INT32,
+	EOP_BINARY_TO_ASCII,
+	EOP_REVERSE,
+	EOP_LEASED_ADDRESS,
+	EOP_HOST_DECL_NAME,
+	EOP_EXTRACT_INT8,
+	EOP_EXTRACT_INT16,
+	EOP_EXTRACT_INT32,
+	EOP_CHECK,
+	EOP_EXISTS,
+	EOP_KNOWN,
+	EOP_STATIC,
+	EOP_VARIABLE_EXISTS,
+	EOP_EQUAL,
+	EOP_NOT,
+	EOP_AND_JUMP,		/* Left operand of "and"; jump if not true. */
+	EOP_AND,		/* Right operand of "and". */
+	EOP_OR_JUMP,		/* Left operand of "or"; jump if true. */
+	EOP_OR,			/* Combine the operands of "or". */
+	EOP_JUMP_VALID,		/* Jump if the top value is valid, else pop. */
+	EOP_PUSH_INVALID,
+	EOP_TREE_DATA,		/* Evaluate a subexpression with the tree */
+	EOP_TREE_NUMERIC,	/* walker. */
+	EOP_TREE_BOOLEAN
+};
+
+struct expr_insn {
+	enum expr_opcode op;
+	int arg;			/* Jump target, held string or, for
+					   EOP_EQUAL, operand context. */
+	struct expression *expr;	/* Not referenced; the program is
+					   freed with the expression. */
+};
+
+/* Programs needing deeper stacks or holding more strings than this are
+   left to the tree walker. */
+#define EXPR_PROGRAM_MAX_DEPTH	32
+#define EXPR_PROGRAM_MAX_HELD	32
+
+/* A value on the stack.   Data values don't hold a reference to their
+   buffer: it belongs to the expression, to a string held by the running
+   program, or the data are in the scratch area. */
+struct expr_value {
+	int valid;
+	int scratch;
+	unsigned long num;
+	struct data_string data;
+};
+
+struct expr_compiler {
+	struct expr_program *program;
+	int max;
+	int depth;
+};
+
+static int expr_emit (struct expr_compiler *, enum expr_opcode,
+		      struct expression *, int, int);
+static int expr_compile_node (struct expr_compiler *, struct expression *,
+			      enum expression_context);
+
+/* Scratch area for strings built while a program runs.   It's a list of
+   chunks that are never moved or freed, so a program can run another
+   (when an option it looks up is itself computed, or a class it checks
+   has a compiled match) without invalidating its own intermediates. */
+#define EXPR_SCRATCH_SIZE	4096
+
+struct expr_scratch {
+	struct expr_scratch *next;
+	unsigned size, used;
+	unsigned char data [1];
+};
+
+static struct expr_scratch *scratch_head, *scratch_cur;
+
+static unsigned char *
+scratch_alloc(unsigned len)
+{
+	struct expr_scratch *s, *prev;
+	unsigned size;
+
+	s = scratch_cur;
+	if (s != NULL && s->size - s->used >= len) {
+		s->used += len;
+		return &s->data[s->used - len];
+	}
+
+	/* Move on to the next chunk, putting in a new one if there isn't
+	   one or it's too small. */
+	prev = s;
+	s = prev ? prev->next : scratch_head;
+	if (s == NULL || s->size < len) {
+		struct expr_scratch *n;
+
+		size = len > EXPR_SCRATCH_SIZE ? len : EXPR_SCRATCH_SIZE;
+		n = dmalloc(sizeof *n + size - 1, MDL);
+		if (n == NULL)
+			return NULL;
+		n->size = size;
+		n->next = s;
+		if (prev)
+			prev->next = n;
+		else
+			scratch_head = n;
+		s = n;
+	}
+	s->used = len;
+	scratch_cur = s;
+	return s->data;
+}
+
+/* Compile an expression that's evaluated in the given context, if it's
+   worth it.   Failure isn't an error: the tree walker is used instead. */
+void compile_expression (expr, context)
+	struct expression *expr;
+	enum expression_context context;
+{
+	struct expr_compiler c;
+
+	if (expr == NULL || expr->program != NULL)
+		return;
+	if (context != context_boolean && context != context_data &&
+	    context != context_numeric)
+		return;
+
+	memset(&c, 0, sizeof c);
+	c.program = dmalloc(sizeof *c.program, MDL);
+	if (c.program == NULL)
+		return;
+	c.program->context = context;
+
+	/* A single instruction does nothing the tree walker wouldn't. */
+	if (!expr_compile_node(&c, expr, context) || c.program->count < 2) {
+		free_expression_program(&c.program, MDL);
+		return;
+	}
+	expr->program = c.program;
+}
+
+void free_expression_program (program, file, line)
+	struct expr_program **program;
+	const char *file;
+	int line;
+{
+	if ((*program)->code != NULL)
+		dfree((*program)->code, file, line);
+	dfree(*program, file, line);
+	*program = NULL;
+}
+
+static int
+expr_emit(struct expr_compiler *c, enum expr_opcode op,
+	  struct expression *expr, int arg, int delta)
+{
+	struct expr_program *program = c->program;
+	struct expr_insn *code;
+
+	if (program->count == c->max) {
+		c->max = c->max ? c->max * 2 : 16;
+		code = dmalloc(c->max * sizeof *code, MDL);
+		if (code == NULL)
+			return -1;
+		if (program->code != NULL) {
+			memcpy(code, program->code,
+			       program->count * sizeof *code);
+			dfree(program->code, MDL);
+		}
+		program->code = code;
+	}
+
+	c->depth += delta;
+	if (c->depth > program->depth)
+		program->depth = c->depth;
+	if (program->depth > EXPR_PROGRAM_MAX_DEPTH)
+		return -1;
+
+	code = &program->code[program->count];
+	code->op = op;
+	code->arg = arg;
+	code->expr = expr;
+	return program->count++;
+}
+
+/* Emit an instruction that leaves a string held by the program. */
+static int
+expr_emit_held(struct expr_compiler *c, enum expr_opcode op,
+	       struct expression *expr)
+{
+	if (c->program->held == EXPR_PROGRAM_MAX_HELD)
+		return 0;
+	return expr_emit(c, op, expr, c->program->held++, 1) >= 0;
+}
+
+/* The context in which evaluate_expression() evaluates an operand of
+   "=", or context_any if it's only known at run time. */
+static enum expression_context
+expr_operand_context(struct expression *expr)
+{
+	if (is_boolean_expression(expr))
+		return context_boolean;
+	if (is_numeric_expression(expr))
+		return context_numeric;
+	if (is_data_expression(expr))
+		return context_data;
+	return context_any;
+}
+
+static int
+expr_compile_boolean(struct expr_compiler *c, struct expression *expr)
+{
+	enum expression_context left, right;
+	int jump;
+
+	switch (expr->op) {
+	      case expr_check:
+		return expr_emit(c, EOP_CHECK, expr, 0, 1) >= 0;
+
+	      case expr_exists:
+		return expr_emit(c, EOP_EXISTS, expr, 0, 1) >= 0;
+
+	      case expr_known:
+		return expr_emit(c, EOP_KNOWN, expr, 0, 1) >= 0;
+
+	      case expr_static:
+		return expr_emit(c, EOP_STATIC, expr, 0, 1) >= 0;
+
+	      case expr_variable_exists:
+		return expr_emit(c, EOP_VARIABLE_EXISTS, expr, 0, 1) >= 0;
+
+	      case expr_equal:
+	      case expr_not_equal:
+		left = expr_operand_context(expr->data.equal[0]);
+		right = expr_operand_context(expr->data.equal[1]);
+		if (left == context_any || right == context_any)
+			break;
+		if (!expr_compile_node(c, expr->data.equal[0], left) ||
+		    !expr_compile_node(c, expr->data.equal[1], right))
+			return 0;
+		return expr_emit(c, EOP_EQUAL, expr,
+				 left == right ? left : context_any, -1) >= 0;
+
+	      case expr_and:
+		if (!expr_compile_node(c, expr->data.and[0], context_boolean))
+			return 0;
+		jump = expr_emit(c, EOP_AND_JUMP, expr, 0, -1);
+		if (jump < 0 ||
+		    !expr_compile_node(c, expr->data.and[1], context_boolean) ||
+		    expr_emit(c, EOP_AND, expr, 0, 0) < 0)
+			return 0;
+		c->program->code[jump].arg = c->program->count;
+		return 1;
+
+	      case expr_or:
+		if (!expr_compile_node(c, expr->data.or[0], context_boolean))
+			return 0;
+		jump = expr_emit(c, EOP_OR_JUMP, expr, 0, 0);
+		if (jump < 0 ||
+		    !expr_compile_node(c, expr->data.or[1], context_boolean) ||
+		    expr_emit(c, EOP_OR, expr, 0, -1) < 0)
+			return 0;
+		c->program->code[jump].arg = c->program->count;
+		return 1;
+
+	      case expr_not:
+		if (!expr_compile_node(c, expr->data.not, context_boolean))
+			return 0;
+		return expr_emit(c, EOP_NOT, expr, 0, 0) >= 0;
+
+	      default:
+		break;
+	}
+	return expr_emit(c, EOP_TREE_BOOLEAN, expr, 0, 1) >= 0;
+}
+
+static int
+expr_compile_numeric(struct expr_compiler *c, struct expression *expr)
+{
+	enum expr_opcode op;
+
+	switch (expr->op) {
+	      case expr_const_int:
+		return expr_emit(c, EOP_CONST_INT, expr, 0, 1) >= 0;
+
+	      case expr_extract_int8:
+		op = EOP_EXTRACT_INT8;
+		goto extract;
+	      case expr_extract_int16:
+		op = EOP_EXTRACT_INT16;
+		goto extract;
+	      case expr_extract_int32:
+		op = EOP_EXTRACT_INT32;
+	      extract:
+		if (!expr_compile_node(c, expr->data.extract_int,
+				       context_data))
+			return 0;
+		return expr_emit(c, op, expr, 0, 0) >= 0;
+
+	      default:
+		break;
+	}
+	return expr_emit(c, EOP_TREE_NUMERIC, expr, 0, 1) >= 0;
+}
+
+static int
+expr_compile_data(struct expr_compiler *c, struct expression *expr)
+{
+	enum expr_opcode op;
+	int jump;
+
+	switch (expr->op) {
+	      case expr_const_data:
+		return expr_emit(c, EOP_CONST_DATA, expr, 0, 1) >= 0;
+
+	      case expr_option:
+		return expr_emit_held(c, EOP_OPTION, expr);
+
+	      case expr_config_option:
+		return expr_emit_held(c, EOP_CONFIG_OPTION, expr);
+
+	      case expr_hardware:
+		return expr_emit(c, EOP_HARDWARE, expr, 0, 1) >= 0;
+
+	      case expr_leased_address:
+		return expr_emit(c, EOP_LEASED_ADDRESS, expr, 0, 1) >= 0;
+
+	      case expr_host_decl_name:
+		return expr_emit(c, EOP_HOST_DECL_NAME, expr, 0, 1) >= 0;
+
+	      case expr_packet:
+		/* The tree walker doesn't evaluate the offset and length
+		   if there's no packet, so only constant ones are done
+		   here. */
+		if (expr->data.packet.offset->op != expr_const_int ||
+		    expr->data.packet.len->op != expr_const_int)
+			break;
+		return expr_emit(c, EOP_PACKET, expr, 0, 1) >= 0;
+
+	      case expr_substring:
+		if (!expr_compile_node(c, expr->data.substring.expr,
+				       context_data) ||
+		    !expr_compile_node(c, expr->data.substring.offset,
+				       context_numeric) ||
+		    !expr_compile_node(c, expr->data.substring.len,
+				       context_numeric))
+			return 0;
+		return expr_emit(c, EOP_SUBSTRING, expr, 0, -2) >= 0;
+
+	      case expr_suffix:
+		if (!expr_compile_node(c, expr->data.suffix.expr,
+				       context_data) ||
+		    !expr_compile_node(c, expr->data.suffix.len,
+				       context_numeric))
+			return 0;
+		return expr_emit(c, EOP_SUFFIX, expr, 0, -1) >= 0;
+
+	      case expr_lcase:
+	      case expr_ucase:
+		if (!expr_compile_node(c, expr->data.lcase, context_data))
+			return 0;
+		return expr_emit(c, expr->op == expr_lcase
+				    ? EOP_LCASE : EOP_UCASE,
+				 expr, 0, 0) >= 0;
+
+	      case expr_concat:
+		if (!expr_compile_node(c, expr->data.concat[0],
+				       context_data) ||
+		    !expr_compile_node(c, expr->data.concat[1],
+				       context_data))
+			return 0;
+		return expr_emit(c, EOP_CONCAT, expr, 0, -1) >= 0;
+
+	      case expr_encode_int8:
+		op = EOP_ENCODE_INT8;
+		goto encode;
+	      case expr_encode_int16:
+		op = EOP_ENCODE_INT16;
+		goto encode;
+	      case expr_encode_int32:
+		op = EOP_ENCODE_INT32;
+	      encode:
+		if (!expr_compile_node(c, expr->data.encode_int,
+				       context_numeric))
+			return 0;
+		return expr_emit(c, op, expr, 0, 0) >= 0;
+
+	      case expr_binary_to_ascii:
+		if (!expr_compile_node(c, expr->data.b2a.base,
+				       context_numeric) ||
+		    !expr_compile_node(c, expr->data.b2a.width,
+				       context_numeric) ||
+		    !expr_compile_node(c, expr->data.b2a.separator,
+				       context_data) ||
+		    !expr_compile_node(c, expr->data.b2a.buffer,
+				       context_data))
+			return 0;
+		return expr_emit(c, EOP_BINARY_TO_ASCII, expr, 0, -3) >= 0;
+
+	      case expr_reverse:
+		if (!expr_compile_node(c, expr->data.reverse.width,
+				       context_numeric) ||
+		    !expr_compile_node(c, expr->data.reverse.buffer,
+				       context_data))
+			return 0;
+		return expr_emit(c, EOP_REVERSE, expr, 0, -1) >= 0;
+
+	      case expr_pick_first_value:
+		if (!expr_compile_node(c, expr->data.pick_first_value.car,
+				       context_data))
+			return 0;
+		jump = expr_emit(c, EOP_JUMP_VALID, expr, 0, -1);
+		if (jump < 0)
+			return 0;
+		if (expr->data.pick_first_value.cdr != NULL) {
+			if (!expr_compile_node
+			    (c, expr->data.pick_first_value.cdr, context_data))
+				return 0;
+		} else if (expr_emit(c, EOP_PUSH_INVALID, expr, 0, 1) < 0)
+			return 0;
+		c->program->code[jump].arg = c->program->count;
+		return 1;
+
+	      default:
+		break;
+	}
+	return expr_emit_held(c, EOP_TREE_DATA, expr);
+}
+
+static int
+expr_compile_node(struct expr_compiler *c, struct expression *expr,
+		  enum expression_context context)
+{
+	if (expr == NULL)
+		return 0;
+
+	switch (context) {
+	      case context_boolean:
+		return expr_compile_boolean(c, expr);
+	      case context_numeric:
+		return expr_compile_numeric(c, expr);
+	      case context_data:
+		return expr_compile_data(c, expr);
+	      default:
+		return 0;
+	}
+}
+
+/* Run a program, leaving its result in *result.   Data in the result
+   may point into the strings held by the program or into the scratch
+   area, so the caller must take what it needs before calling
+   expr_release(). */
+static void
+expr_run(struct expr_program *program, struct expr_value *result,
+	 struct data_string *held, struct packet *packet, struct lease *lease,
+	 struct client_state *client_state, struct option_state *in_options,
+	 struct option_state *cfg_options, struct binding_scope **scope)
+{
+	struct expr_value stack[EXPR_PROGRAM_MAX_DEPTH];
+	struct expr_value *top, *sp = stack;
+	struct expr_insn *insn;
+	struct expression *expr;
+	struct binding *binding;
+	struct option_state *options;
+	unsigned long offset, len, i;
+	unsigned char *s;
+	int pc, status, equal;
+
+	memset(held, 0, program->held * sizeof *held);
+
+	for (pc = 0; pc < program->count; pc++) {
+		insn = &program->code[pc];
+		expr = insn->expr;
+		top = sp - 1;
+
+		switch (insn->op) {
+		      case EOP_CONST_DATA:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			sp->data = expr->data.const_data;
+			sp++;
+			break;
+
+		      case EOP_CONST_INT:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			sp->num = expr->data.const_int;
+			sp++;
+			break;
+
+		      case EOP_OPTION:
+		      case EOP_CONFIG_OPTION:
+			options = (insn->op == EOP_OPTION
+				   ? in_options : cfg_options);
+			memset(sp, 0, sizeof *sp);
+			if (options != NULL &&
+			    get_option(&held[insn->arg],
+				       expr->data.option->universe,
+				       packet, lease, client_state,
+				       in_options, cfg_options, options,
+				       scope, expr->data.option->code, MDL)) {
+				sp->valid = 1;
+				sp->data = held[insn->arg];
+			}
+			sp++;
+			break;
+
+		      case EOP_HARDWARE:
+			memset(sp, 0, sizeof *sp);
+			/* On the client, hardware is our hardware. */
+			if (client_state) {
+				sp->data.data =
+				    client_state->interface->hw_address.hbuf;
+				sp->data.len =
+				    client_state->interface->hw_address.hlen;
+				sp->valid = 1;
+			} else if (packet != NULL && packet->raw != NULL) {
+				if (packet->raw->hlen >
+				    sizeof(packet->raw->chaddr)) {
+					log_error("data: hardware: invalid "
+						  "hlen (%d)\n",
+						  packet->raw->hlen);
+				} else if ((s = scratch_alloc
+					    (packet->raw->hlen + 1)) != NULL) {
+					s[0] = packet->raw->htype;
+					memcpy(&s[1], packet->raw->chaddr,
+					       packet->raw->hlen);
+					sp->data.data = s;
+					sp->data.len = packet->raw->hlen + 1;
+					sp->scratch = sp->valid = 1;
+				} else
+					log_error("data: hardware: "
+						  "no memory for buffer.");
+			} else if (lease != NULL) {
+				s = scratch_alloc(lease->hardware_addr.hlen);
+				if (s != NULL) {
+					memcpy(s, lease->hardware_addr.hbuf,
+					       lease->hardware_addr.hlen);
+					sp->data.data = s;
+					sp->data.len =
+						lease->hardware_addr.hlen;
+					sp->scratch = sp->valid = 1;
+				} else
+					log_error("data: hardware: "
+						  "no memory for buffer.");
+			} else
+				log_error("data: hardware: no raw packet or "
+					  "lease is available");
+			sp++;
+			break;
+
+		      case EOP_PACKET:
+			memset(sp, 0, sizeof *sp);
+			offset = expr->data.packet.offset->data.const_int;
+			len = expr->data.packet.len->data.const_int;
+			if (!packet || !packet->raw)
+				log_error("data: packet: raw packet "
+					  "not available");
+			else if (offset < packet->packet_length) {
+				if (offset + len > packet->packet_length)
+					len = packet->packet_length - offset;
+				if ((s = scratch_alloc(len)) != NULL) {
+					memcpy(s, ((unsigned char *)
+						   (packet->raw)) + offset,
+					       len);
+					sp->data.data = s;
+					sp->data.len = len;
+					sp->scratch = sp->valid = 1;
+				} else
+					log_error("data: packet: "
+						  "no buffer memory.");
+			}
+			sp++;
+			break;
+
+		      case EOP_SUBSTRING:
+			sp -= 2;
+			top = sp - 1;
+			if (top->valid && sp[0].valid && sp[1].valid) {
+				offset = sp[0].num;
+				len = sp[1].num;
+				/* If the offset is after end of the string,
+				   the result is an empty string. */
+				if (top->data.len > offset) {
+					top->data.len -= offset;
+					if (top->data.len > len) {
+						top->data.len = len;
+						top->data.terminated = 0;
+					}
+					top->data.data += offset;
+				} else {
+					memset(top, 0, sizeof *top);
+					top->valid = 1;
+				}
+			} else
+				top->valid = 0;
+			break;
+
+		      case EOP_SUFFIX:
+			sp--;
+			top = sp - 1;
+			if (top->valid && sp->valid) {
+				len = sp->num;
+				if (top->data.len > len) {
+					top->data.data += top->data.len - len;
+					top->data.len = len;
+				}
+			} else
+				top->valid = 0;
+			break;
+
+		      case EOP_LCASE:
+		      case EOP_UCASE:
+			if (!top->valid)
+				break;
+			s = scratch_alloc(top->data.len +
+					  top->data.terminated);
+			if (s == NULL) {
+				log_error("data: lcase: no buffer memory.");
+				top->valid = 0;
+				break;
+			}
+			memcpy(s, top->data.data,
+			       top->data.len + top->data.terminated);
+			for (i = 0; i < top->data.len; i++)
+				s[i] = (insn->op == EOP_LCASE
+					? tolower(s[i]) : toupper(s[i]));
+			top->data.buffer = NULL;
+			top->data.data = s;
+			top->scratch = 1;
+			break;
+
+		      case EOP_CONCAT:
+			sp--;
+			top = sp - 1;
+			if (!top->valid || !sp->valid) {
+				top->valid = 0;
+				break;
+			}
+			len = top->data.len + sp->data.len;
+			s = scratch_alloc(len + sp->data.terminated);
+			if (s == NULL) {
+				log_error("data: concat: no memory");
+				top->valid = 0;
+				break;
+			}
+			memcpy(s, top->data.data, top->data.len);
+			memcpy(&s[top->data.len], sp->data.data,
+			       sp->data.len + sp->data.terminated);
+			memset(&top->data, 0, sizeof top->data);
+			top->data.data = s;
+			top->data.len = len;
+			top->scratch = 1;
+			break;
+
+		      case EOP_ENCODE_INT8:
+		      case EOP_ENCODE_INT16:
+		      case EOP_ENCODE_INT32:
+			if (!top->valid)
+				break;
+			len = (insn->op == EOP_ENCODE_INT8 ? 1 :
+			       insn->op == EOP_ENCODE_INT16 ? 2 : 4);
+			if ((s = scratch_alloc(len)) == NULL) {
+				log_error("data: encode_int: no memory");
+				top->valid = 0;
+				break;
+			}
+			if (len == 1)
+				s[0] = top->num;
+			else if (len == 2)
+				putUShort(s, top->num);
+			else
+				putULong(s, top->num);
+			memset(&top->data, 0, sizeof top->data);
+			top->data.data = s;
+			top->data.len = len;
+			top->scratch = 1;
+			break;
+
+		      case EOP_BINARY_TO_ASCII: {
+			struct expr_value *base = sp - 4, *width = sp - 3;
+			struct expr_value *sep = sp - 2, *buf = sp - 1;
+			unsigned buflen;
+
+			sp -= 3;
+			top = base;
+			status = 0;
+			if (!base->valid || !width->valid ||
+			    !sep->valid || !buf->valid)
+				goto b2a_out;
+
+			offset = base->num;
+			len = width->num;
+			if (len != 8 && len != 16 && len != 32) {
+				log_info("binary_to_ascii: %s %ld!",
+					 "invalid width", len);
+				goto b2a_out;
+			}
+			len /= 8;
+
+			/* The buffer must be a multiple of the number's
+			   width. */
+			if (buf->data.len % len) {
+				log_info("binary-to-ascii: %s %d %s %ld!",
+					 "length of buffer", buf->data.len,
+					 "not a multiple of width", len);
+				goto b2a_out;
+			}
+
+			/* Count the width of the output. */
+			buflen = 0;
+			for (i = 0; i < buf->data.len; i += len) {
+				buflen += converted_length(&buf->data.data[i],
+							   offset, len);
+				if (i + len != buf->data.len)
+					buflen += sep->data.len;
+			}
+
+			if ((s = scratch_alloc(buflen + 1)) == NULL) {
+				log_error("data: binary-to-ascii: no memory");
+				goto b2a_out;
+			}
+			buflen = 0;
+			for (i = 0; i < buf->data.len; i += len) {
+				buflen += binary_to_ascii(&s[buflen],
+							  &buf->data.data[i],
+							  offset, len);
+				if (i + len != buf->data.len) {
+					memcpy(&s[buflen], sep->data.data,
+					       sep->data.len);
+					buflen += sep->data.len;
+				}
+			}
+			/* NUL terminate. */
+			s[buflen] = 0;
+			memset(&top->data, 0, sizeof top->data);
+			top->data.data = s;
+			top->data.len = buflen;
+			top->data.terminated = 1;
+			top->scratch = 1;
+			status = 1;
+		      b2a_out:
+			top->valid = status;
+			break;
+		      }
+
+		      case EOP_REVERSE:
+			sp--;
+			top = sp - 1;
+			status = 0;
+			len = top->num;
+			if (!top->valid || !sp->valid)
+				;
+			else if (len == 0 || sp->data.len % len) {
+				log_info("reverse: %s %d %s %ld!",
+					 "length of buffer", sp->data.len,
+					 "not a multiple of width", len);
+			} else if ((s = scratch_alloc(sp->data.len)) == NULL) {
+				log_error("data: reverse: no memory");
+			} else {
+				for (i = 0; i < sp->data.len; i += len)
+					memcpy(&s[i], &sp->data.data
+					       [sp->data.len - i - len], len);
+				memset(&top->data, 0, sizeof top->data);
+				top->data.data = s;
+				top->data.len = sp->data.len;
+				top->scratch = 1;
+				status = 1;
+			}
+			top->valid = status;
+			break;
+
+		      case EOP_LEASED_ADDRESS:
+			memset(sp, 0, sizeof *sp);
+			if (!lease) {
+				log_debug("data: \"leased-address\" "
+					  "configuration directive: there is "
+					  "no lease associated with this "
+					  "client.");
+			} else if ((s = scratch_alloc(lease->ip_addr.len))
+				   != NULL) {
+				memcpy(s, lease->ip_addr.iabuf,
+				       lease->ip_addr.len);
+				sp->data.data = s;
+				sp->data.len = lease->ip_addr.len;
+				sp->scratch = sp->valid = 1;
+			} else
+				log_error("data: leased-address: no memory.");
+			sp++;
+			break;
+
+		      case EOP_HOST_DECL_NAME:
+			memset(sp, 0, sizeof *sp);
+			if (!lease || !lease->host) {
+				log_error("data: host_decl_name: "
+					  "not available");
+			} else if ((s = scratch_alloc
+				    (strlen(lease->host->name) + 1)) != NULL) {
+				strcpy((char *)s, lease->host->name);
+				sp->data.data = s;
+				sp->data.len = strlen(lease->host->name);
+				sp->data.terminated = 1;
+				sp->scratch = sp->valid = 1;
+			} else
+				log_error("data: host-decl-name: no memory.");
+			sp++;
+			break;
+
+		      case EOP_EXTRACT_INT8:
+			if (top->valid)
+				top->num = (top->data.data != NULL
+					    ? top->data.data[0] : 0);
+			break;
+
+		      case EOP_EXTRACT_INT16:
+			if (top->valid && top->data.len >= 2)
+				top->num = getUShort(top->data.data);
+			else
+				top->valid = 0;
+			break;
+
+		      case EOP_EXTRACT_INT32:
+			if (top->valid && top->data.len >= 4)
+				top->num = getULong(top->data.data);
+			else
+				top->valid = 0;
+			break;
+
+		      case EOP_CHECK:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			sp->num = check_collection(packet, lease,
+						   expr->data.check);
+			sp++;
+			break;
+
+		      case EOP_EXISTS:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			if (in_options &&
+			    get_option(&sp->data,
+				       expr->data.exists->universe,
+				       packet, lease, client_state,
+				       in_options, cfg_options, in_options,
+				       scope, expr->data.exists->code, MDL)) {
+				sp->num = 1;
+				data_string_forget(&sp->data, MDL);
+			}
+			sp++;
+			break;
+
+		      case EOP_KNOWN:
+			memset(sp, 0, sizeof *sp);
+			if (packet) {
+				sp->valid = 1;
+				sp->num = packet->known;
+			}
+			sp++;
+			break;
+
+		      case EOP_STATIC:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			sp->num = lease && (lease->flags & STATIC_LEASE);
+			sp++;
+			break;
+
+		      case EOP_VARIABLE_EXISTS:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = 1;
+			if (scope && *scope) {
+				binding = find_binding(*scope,
+						       expr->data.variable);
+				sp->num = binding && binding->value;
+			}
+			sp++;
+			break;
+
+		      case EOP_EQUAL:
+			sp--;
+			top = sp - 1;
+			if (top->valid && sp->valid) {
+				if (insn->arg == context_any)
+					equal = 0;
+				else if (insn->arg == context_data)
+					equal = (top->data.len ==
+						 sp->data.len &&
+						 !memcmp(top->data.data,
+							 sp->data.data,
+							 sp->data.len));
+				else
+					equal = top->num == sp->num;
+			} else
+				equal = !top->valid && !sp->valid;
+			memset(top, 0, sizeof *top);
+			top->valid = 1;
+			top->num = (expr->op == expr_equal) == equal;
+			break;
+
+		      case EOP_NOT:
+			top->num = top->valid ? !top->num : 0;
+			break;
+
+		      case EOP_AND_JUMP:
+			/* If the left side isn't true, neither side is
+			   valid. */
+			if (!top->valid || !top->num) {
+				top->valid = 0;
+				top->num = 0;
+				pc = insn->arg - 1;
+			} else
+				sp--;
+			break;
+
+		      case EOP_AND:
+			top->num = top->valid && top->num;
+			break;
+
+		      case EOP_OR_JUMP:
+			if (top->valid && top->num) {
+				top->num = 1;
+				pc = insn->arg - 1;
+			}
+			break;
+
+		      case EOP_OR:
+			sp--;
+			top = sp - 1;
+			top->valid = top->valid || sp->valid;
+			top->num = top->valid && (top->num || sp->num);
+			break;
+
+		      case EOP_JUMP_VALID:
+			if (top->valid)
+				pc = insn->arg - 1;
+			else
+				sp--;
+			break;
+
+		      case EOP_PUSH_INVALID:
+			memset(sp, 0, sizeof *sp);
+			sp++;
+			break;
+
+		      case EOP_TREE_DATA:
+			memset(sp, 0, sizeof *sp);
+			if (evaluate_data_expression(&held[insn->arg], packet,
+						     lease, client_state,
+						     in_options, cfg_options,
+						     scope, expr, MDL)) {
+				sp->valid = 1;
+				sp->data = held[insn->arg];
+			}
+			sp++;
+			break;
+
+		      case EOP_TREE_NUMERIC:
+			memset(sp, 0, sizeof *sp);
+			sp->valid = evaluate_numeric_expression
+				(&sp->num, packet, lease, client_state,
+				 in_options, cfg_options, scope, expr);
+			if (!sp->valid)
+				sp->num = 0;
+			sp++;
+			break;
+
+		      case EOP_TREE_BOOLEAN:
+			/* Keep the result even if it's not valid: "or"
+			   looks at it, as the tree walker does. */
+			memset(sp, 0, sizeof *sp);
+			status = 0;
+			sp->valid = evaluate_boolean_expression
+				(&status, packet, lease, client_state,
+				 in_options, cfg_options, scope, expr);
+			sp->num = status;
+			sp++;
+			break;
+		}
+	}
+
+	*result = stack[0];
+}
+
+static void
+expr_release(struct expr_program *program, struct data_string *held,
+	     struct expr_scratch *chunk, unsigned used)
+{
+	int i;
+
+	for (i = 0; i < program->held; i++)
+		data_string_forget(&held[i], MDL);
+
+	/* Give back the scratch space the program used. */
+	scratch_cur = chunk;
+	if (chunk != NULL)
+		chunk->used = used;
+}
+
+int evaluate_boolean_program (result, packet, lease, client_state,
+			      in_options, cfg_options, scope, program)
+	int *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expr_program *program;
+{
+	struct data_string held[EXPR_PROGRAM_MAX_HELD];
+	struct expr_scratch *chunk = scratch_cur;
+	unsigned used = chunk ? chunk->used : 0;
+	struct expr_value value;
+
+	expr_run(program, &value, held, packet, lease, client_state,
+		 in_options, cfg_options, scope);
+	if (value.valid)
+		*result = value.num;
+	expr_release(program, held, chunk, used);
+	return value.valid;
+}
+
+int evaluate_numeric_program (result, packet, lease, client_state,
+			      in_options, cfg_options, scope, program)
+	unsigned long *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expr_program *program;
+{
+	struct data_string held[EXPR_PROGRAM_MAX_HELD];
+	struct expr_scratch *chunk = scratch_cur;
+	unsigned used = chunk ? chunk->used : 0;
+	struct expr_value value;
+
+	expr_run(program, &value, held, packet, lease, client_state,
+		 in_options, cfg_options, scope);
+	if (value.valid)
+		*result = value.num;
+	expr_release(program, held, chunk, used);
+	return value.valid;
+}
+
+int evaluate_data_program (result, packet, lease, client_state,
+			   in_options, cfg_options, scope, program, file, line)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expr_program *program;
+	const char *file;
+	int line;
+{
+	struct data_string held[EXPR_PROGRAM_MAX_HELD];
+	struct expr_scratch *chunk = scratch_cur;
+	unsigned used = chunk ? chunk->used : 0;
+	struct expr_value value;
+
+	expr_run(program, &value, held, packet, lease, client_state,
+		 in_options, cfg_options, scope);
+
+	/* Strings built in the scratch area get a buffer of their own;
+	   anything else is referenced where it is. */
+	if (value.valid && value.scratch) {
+		if (buffer_allocate(&result->buffer,
+				    value.data.len + value.data.terminated,
+				    file, line)) {
+			memcpy(result->buffer->data, value.data.data,
+			       value.data.len + value.data.terminated);
+			result->data = result->buffer->data;
+			result->len = value.data.len;
+			result->terminated = value.data.terminated;
+		} else {
+			log_error("data: no memory for result.");
+			value.valid = 0;
+		}
+	} else if (value.valid)
+		data_string_copy(result, &value.data, file, line);
+
+	expr_release(program, held, chunk, used);
+	return value.valid;
+}
@@ -174,6 +174,7 @@ isc_result_t dhcp_group_set_value  (omapi_object_t *h,
 					    "network client", 0);
 			if (status != ISC_R_SUCCESS || parse == NULL)
 				return status;
+			statements_generation++;
 			if (!(parse_executable_statements
 			      (&group -> group -> statements, parse, &lose,
 			       context_any))) {
@@ -481,6 +482,26 @@ isc_result_t dhcp_control_get_value (omapi_object_t *h, omapi_object_t *id,
 		return omapi_make_int_value (value,
 					     name, (int)control -> state, MDL);
 
+	/* Timer population and the cost of finding timers in the index;
+	   timeout-probes / timeout-ops is the average chain walked. */
+	if (!omapi_ds_strcmp (name, "timeouts"))
+		return omapi_make_uint_value (value, name,
+					      timeout_stats.count, MDL);
+	if (!omapi_ds_strcmp (name, "timeouts-peak"))
+		return omapi_make_uint_value (value, name,
+					      timeout_stats.peak, MDL);
+	if (!omapi_ds_strcmp (name, "timeout-ops"))
+		return omapi_make_uint_value (value, name,
+					      timeout_stats.ops, MDL);
+	if (!omapi_ds_strcmp (name, "timeout-probes"))
+		return omapi_make_uint_value (value, name,
+					      timeout_stats.probes, MDL);
+
+	/* Size and chain lengths of the main hash tables. */
+	if (!omapi_ds_strcmp (name, "hash-report"))
+		return omapi_make_string_value (value, name, hash_reports (),
+						MDL);
+
 	/* Try to find some inner object that can take the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
 		status = ((*(h -> inner -> type -> get_value))
@@ -543,6 +564,30 @@ isc_result_t dhcp_control_stuff_values (omapi_object_t *c,
 	if (status != ISC_R_SUCCESS)
 		return status;
 
+	status = omapi_connection_put_named_uint32 (c, "timeouts",
+						    timeout_stats.count);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_named_uint32 (c, "timeouts-peak",
+						    timeout_stats.peak);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_named_uint32 (c, "timeout-ops",
+						    timeout_stats.ops);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_named_uint32 (c, "timeout-probes",
+						    timeout_stats.probes);
+	if (status != ISC_R_SUCCESS)
+		return status;
+
+	status = omapi_connection_put_name (c, "hash-report");
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_string (c, hash_reports ());
+	if (status != ISC_R_SUCCESS)
+		return status;
+
 	/* Write out the inner object, if any. */
 	if (h -> inner && h -> inner -> type -> stuff_values) {
 		status = ((*(h -> inner -> type -> stuff_values))
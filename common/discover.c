@@ -48,6 +48,7 @@ int quiet_interface_discovery;
 u_int16_t local_port = 0;
 u_int16_t remote_port = 0;
 u_int16_t relay_port = 0;
+int receive_batch_size = DEFAULT_RECEIVE_BATCH_SIZE;
 int dhcpv4_over_dhcpv6 = 0;
 int (*dhcp_interface_setup_hook) (struct interface_info *, struct iaddr *);
 int (*dhcp_interface_discovery_hook) (struct interface_info *);
@@ -1102,6 +1103,7 @@ isc_result_t got_one (h)
 		struct dhcp_packet packet;
 	} u;
 	struct interface_info *ip;
+	int counted = 0;
 
 	if (h -> type != dhcp_type_interface)
 		return DHCP_R_INVALIDARG;
@@ -1115,6 +1117,11 @@ isc_result_t got_one (h)
 	}
 	if (result == 0)
 		return ISC_R_UNEXPECTED;
+	if (!counted) {
+		ip -> rx_wakeups++;
+		counted = 1;
+	}
+	ip -> rx_frames++;
 
 	/*
 	 * If we didn't at least get the fixed portion of the BOOTP
@@ -1124,9 +1131,14 @@ isc_result_t got_one (h)
 	 * a bug caused short packets to not work and nobody has
 	 * complained, it seems rational to tighten up that
 	 * restriction.
+	 * Frames still sitting in the read buffer will not raise
+	 * another wakeup, so keep draining them.
 	 */
-	if (result < DHCP_FIXED_NON_UDP)
+	if (result < DHCP_FIXED_NON_UDP) {
+		if (ip -> rbuf_offset != ip -> rbuf_len)
+			goto again;
 		return ISC_R_UNEXPECTED;
+	}
 
 #if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
 	{
@@ -1156,7 +1168,8 @@ isc_result_t got_one (h)
 	}
 
 	/* If there is buffered data, read again.    This is for, e.g.,
-	   bpf, which may return two packets at once. */
+	   bpf, which may return two packets at once, or lpf when it is
+	   receiving in batches. */
 	if (ip -> rbuf_offset != ip -> rbuf_len)
 		goto again;
 	return ISC_R_SUCCESS;
@@ -1353,6 +1366,17 @@ isc_result_t dhcp_interface_stuff_values (omapi_object_t *c,
 	if (status != ISC_R_SUCCESS)
 		return status;
 
+	/* Receive counters; rx-frames / rx-wakeups is the average
+	   number of frames handled per wakeup. */
+	status = omapi_connection_put_named_uint32 (c, "rx-wakeups",
+						    interface -> rx_wakeups);
+	if (status != ISC_R_SUCCESS)
+		return status;
+	status = omapi_connection_put_named_uint32 (c, "rx-frames",
+						    interface -> rx_frames);
+	if (status != ISC_R_SUCCESS)
+		return status;
+
 	/* Write out the inner object, if any. */
 	if (h -> inner && h -> inner -> type -> stuff_values) {
 		status = ((*(h -> inner -> type -> stuff_values))
@@ -32,6 +32,157 @@
 
 struct timeout *timeouts;
 static struct timeout *free_timeouts;
+struct timeout_stats timeout_stats;
+
+/*
+ * Besides the timeouts list, which is doubly linked so an entry can be
+ * unlinked without a search, every scheduled timeout sits in a hash
+ * table keyed on its "what" pointer.  That lets add_timeout() and
+ * cancel_timeout() find the timeout they supersede or cancel without
+ * walking every timeout in the server.  The table doubles in size
+ * whenever it holds more than two timeouts per bucket.
+ */
+#define TIMEOUT_HASH_MIN_BITS 8
+
+static struct timeout **timeout_hash;
+static unsigned timeout_hash_bits;
+
+static unsigned
+timeout_bucket(const void *what, unsigned bits)
+{
+	unsigned long p = (unsigned long)what;
+	u_int32_t h;
+
+	/* Allocations are aligned, so the low bits carry nothing. */
+	h = (u_int32_t)(p >> 4) ^ (u_int32_t)((p >> 16) >> 16);
+	h *= 2654435761U;
+	return (h >> (32 - bits));
+}
+
+static void
+timeout_index_grow(void)
+{
+	struct timeout **table, *q, *next;
+	unsigned bits, i, b;
+
+	bits = timeout_hash_bits ? timeout_hash_bits + 1
+				 : TIMEOUT_HASH_MIN_BITS;
+	table = dmalloc(sizeof(*table) << bits, MDL);
+	if (table == NULL) {
+		/* Longer chains are slower but still correct. */
+		if (timeout_hash != NULL)
+			return;
+		log_fatal("add_timeout: no memory for timeout index!");
+	}
+
+	for (i = 0; timeout_hash && i < (1U << timeout_hash_bits); i++) {
+		for (q = timeout_hash[i]; q; q = next) {
+			next = q->hnext;
+			b = timeout_bucket(q->what, bits);
+			q->hnext = table[b];
+			table[b] = q;
+		}
+	}
+
+	if (timeout_hash != NULL)
+		dfree(timeout_hash, MDL);
+	timeout_hash = table;
+	timeout_hash_bits = bits;
+}
+
+/* Put q on the timeouts list after "after", or at the head if that
+   is NULL, and into the index. */
+static void
+timeout_link(struct timeout *q, struct timeout *after)
+{
+	unsigned b;
+
+	if (after) {
+		q->prev = after;
+		q->next = after->next;
+		after->next = q;
+	} else {
+		q->prev = NULL;
+		q->next = timeouts;
+		timeouts = q;
+	}
+	if (q->next)
+		q->next->prev = q;
+
+	if (timeout_hash == NULL ||
+	    timeout_stats.count >= (2U << timeout_hash_bits))
+		timeout_index_grow();
+	b = timeout_bucket(q->what, timeout_hash_bits);
+	q->hnext = timeout_hash[b];
+	timeout_hash[b] = q;
+
+	if (++timeout_stats.count > timeout_stats.peak)
+		timeout_stats.peak = timeout_stats.count;
+}
+
+static void
+timeout_unlink(struct timeout *q)
+{
+	struct timeout **qp;
+
+	if (q->prev)
+		q->prev->next = q->next;
+	else
+		timeouts = q->next;
+	if (q->next)
+		q->next->prev = q->prev;
+	q->next = q->prev = NULL;
+
+	for (qp = &timeout_hash[timeout_bucket(q->what, timeout_hash_bits)];
+	     *qp; qp = &(*qp)->hnext) {
+		timeout_stats.probes++;
+		if (*qp == q) {
+			*qp = q->hnext;
+			break;
+		}
+	}
+	q->hnext = NULL;
+	timeout_stats.count--;
+}
+
+/* Find the timeout scheduled for what, and for where unless that's
+   NULL, in which case any function matches. */
+static struct timeout *
+timeout_find(void (*where)(void *), void *what)
+{
+	struct timeout *q;
+
+	timeout_stats.ops++;
+	if (timeout_hash == NULL)
+		return (NULL);
+
+	for (q = timeout_hash[timeout_bucket(what, timeout_hash_bits)];
+	     q; q = q->hnext) {
+		timeout_stats.probes++;
+		if ((where == NULL || q->func == where) && q->what == what)
+			return (q);
+	}
+	return (NULL);
+}
+
+/* Check that t is still a scheduled timeout before we use it. */
+static int
+timeout_scheduled(struct timeout *t)
+{
+	struct timeout *q;
+
+	timeout_stats.ops++;
+	if (timeout_hash == NULL)
+		return (0);
+
+	for (q = timeout_hash[timeout_bucket(t->what, timeout_hash_bits)];
+	     q; q = q->hnext) {
+		timeout_stats.probes++;
+		if (q == t)
+			return (1);
+	}
+	return (0);
+}
 
 void set_time(TIME t)
 {
@@ -55,7 +206,7 @@ struct timeval *process_outstanding_timeouts (struct timeval *tvp)
 		    ((timeouts -> when . tv_sec == cur_tv . tv_sec) &&
 		     (timeouts -> when . tv_usec <= cur_tv . tv_usec))) {
 			t = timeouts;
-			timeouts = timeouts -> next;
+			timeout_unlink (t);
 			(*(t -> func)) (t -> what);
 			if (t -> unref)
 				(*t -> unref) (&t -> what, MDL);
@@ -140,26 +291,16 @@ isclib_timer_callback(isc_task_t  *taskp,
 		      isc_event_t *eventp)
 {
 	struct timeout *t = (struct timeout *)eventp->ev_arg;
-	struct timeout *q, *r;
+	struct timeout *q;
 
 	/* Get the current time... */
 	gettimeofday (&cur_tv, (struct timezone *)0);
 
-	/*
-	 * Find the timeout on the dhcp list and remove it.
-	 * As the list isn't ordered we search the entire list
-	 */
-
-	r = NULL;
-	for (q = timeouts; q; q = q->next) {
-		if (q == t) {
-			if (r)
-				r->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		r = q;
+	/* Find the timeout in the index and remove it. */
+	q = NULL;
+	if (timeout_scheduled(t)) {
+		q = t;
+		timeout_unlink(q);
 	}
 
 	/*
@@ -201,7 +342,7 @@ void add_timeout (when, where, what, ref, unref)
 	tvref_t ref;
 	tvunref_t unref;
 {
-	struct timeout *t, *q;
+	struct timeout *q;
 	int usereset = 0;
 	isc_result_t status;
 	int64_t sec;
@@ -210,18 +351,10 @@ void add_timeout (when, where, what, ref, unref)
 	isc_time_t expires;
 
 	/* See if this timeout supersedes an existing timeout. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q->next) {
-		if ((where == NULL || q->func == where) &&
-		    q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			usereset = 1;
-			break;
-		}
-		t = q;
+	q = timeout_find(where, what);
+	if (q) {
+		timeout_unlink(q);
+		usereset = 1;
 	}
 
 	/* If we didn't supersede a timeout, allocate a timeout
@@ -297,6 +430,8 @@ void add_timeout (when, where, what, ref, unref)
 
 #if defined (TRACING)
 	if (trace_playback()) {
+		struct timeout *t;
+
 		/*
 		 * If we are doing playback we need to handle the timers
 		 * within this code rather than having the isclib handle
@@ -312,8 +447,7 @@ void add_timeout (when, where, what, ref, unref)
 		if (!timeouts || (timeouts->when.tv_sec > q-> when.tv_sec) ||
 		    ((timeouts->when.tv_sec == q->when.tv_sec) &&
 		     (timeouts->when.tv_usec > q->when.tv_usec))) {
-			q->next = timeouts;
-			timeouts = q;
+			timeout_link(q, NULL);
 			return;
 		}
 
@@ -322,26 +456,22 @@ void add_timeout (when, where, what, ref, unref)
 			if ((t->next->when.tv_sec > q->when.tv_sec) ||
 			    ((t->next->when.tv_sec == q->when.tv_sec) &&
 			     (t->next->when.tv_usec > q->when.tv_usec))) {
-				q->next = t->next;
-				t->next = q;
+				timeout_link(q, t);
 				return;
 			}
 		}
 
 		/* End of list. */
-		t->next = q;
-		q->next = (struct timeout *)0;
+		timeout_link(q, t);
 		return;
 	}
 #endif
 	/*
 	 * Don't bother sorting the DHCP list, just add it to the front.
-	 * Eventually the list should be removed as we migrate the callers
-	 * to the native ISC timer functions, if it becomes a performance
-	 * problem before then we may need to order the list.
+	 * The ISC timer code keeps the expiry order for us and the index
+	 * finds entries for add_timeout() and cancel_timeout().
 	 */
-	q->next  = timeouts;
-	timeouts = q;
+	timeout_link(q, NULL);
 
 	isc_interval_set(&interval, sec, usec * 1000);
 	status = isc_time_nowplusinterval(&expires, &interval);
@@ -378,20 +508,12 @@ void cancel_timeout (where, what)
 	void (*where) (void *);
 	void *what;
 {
-	struct timeout *t, *q;
-
-	/* Look for this timeout on the list, and unlink it if we find it. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q -> next) {
-		if (q->func == where && q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		t = q;
-	}
+	struct timeout *q;
+
+	/* Look for this timeout in the index, and unlink it if we find it. */
+	q = timeout_find(where, what);
+	if (q)
+		timeout_unlink(q);
 
 	/*
 	 * If we found the timeout, cancel it and put it on the free list.
@@ -420,6 +542,7 @@ void cancel_all_timeouts ()
 	struct timeout *t, *n;
 	for (t = timeouts; t; t = n) {
 		n = t->next;
+		timeout_unlink(t);
 		isc_timer_detach(&t->isc_timeout);
 		if (t->unref && t->what)
 			(*t->unref) (&t->what, MDL);
@@ -435,5 +558,11 @@ void relinquish_timeouts ()
 		n = t->next;
 		dfree(t, MDL);
 	}
+
+	if (timeout_hash != NULL) {
+		dfree(timeout_hash, MDL);
+		timeout_hash = NULL;
+		timeout_hash_bits = 0;
+	}
 }
 #endif
@@ -32,6 +32,14 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+static int switch_table_lookup (struct executable_statement **,
+				struct packet *, struct lease *,
+				struct client_state *,
+				struct option_state *, struct option_state *,
+				struct binding_scope **, struct expression *,
+				struct switch_table *);
+static void free_switch_table (struct switch_table **, const char *, int);
+
 int execute_statements (result, packet, lease, client_state,
 			in_options, out_options, scope, statements,
 			on_star)
@@ -134,11 +142,18 @@ int execute_statements (result, packet, lease, client_state,
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug ("exec: switch");
 #endif
-			status = (find_matching_case
-				  (&e, packet, lease, client_state,
-				   in_options, out_options, scope,
-				   r->data.s_switch.expr,
-				   r->data.s_switch.statements));
+			if (r->data.s_switch.table)
+				status = (switch_table_lookup
+					  (&e, packet, lease, client_state,
+					   in_options, out_options, scope,
+					   r->data.s_switch.expr,
+					   r->data.s_switch.table));
+			else
+				status = (find_matching_case
+					  (&e, packet, lease, client_state,
+					   in_options, out_options, scope,
+					   r->data.s_switch.expr,
+					   r->data.s_switch.statements));
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug ("exec: switch: case %lx", (unsigned long)e);
 #endif
@@ -567,6 +582,136 @@ int execute_statements (result, packet, lease, client_state,
    specific scopes, so we recursively traverse the scope list, executing
    the most outer scope first. */
 
+/* Bumped whenever the statements of a group may have changed, so that
+   option sets built from the old statements are no longer used. */
+unsigned statements_generation = 1;
+
+void group_option_set_forget (group)
+	struct group *group;
+{
+	int i;
+
+	if (group -> option_set) {
+		for (i = 0; i < group -> option_set -> count; i++)
+			option_cache_dereference
+				(&group -> option_set -> options [i], MDL);
+		dfree (group -> option_set, MDL);
+		group -> option_set = (struct option_set *)0;
+	}
+	group -> option_set_generation = 0;
+}
+
+/* Count the option statements in a list of statements, or return -1 if
+   there is any other kind of statement on the list. */
+static int count_option_statements (statements)
+	struct executable_statement *statements;
+{
+	struct executable_statement *r;
+	int count = 0, sub;
+
+	for (r = statements; r; r = r -> next) {
+		switch (r -> op) {
+		      case supersede_option_statement:
+		      case send_option_statement:
+			count++;
+			break;
+
+		      case statements_statement:
+			sub = count_option_statements (r -> data.statements);
+			if (sub < 0)
+				return -1;
+			count += sub;
+			break;
+
+		      default:
+			return -1;
+		}
+	}
+	return count;
+}
+
+/* Add the option caches set by a list of option statements to set.
+   Saving an option into a hashed, indexed or sorted space replaces any
+   earlier value, so an earlier entry for the same option is dropped. */
+static void add_option_statements (set, statements)
+	struct option_set *set;
+	struct executable_statement *statements;
+{
+	struct executable_statement *r;
+	struct option_cache *oc;
+	int i;
+
+	for (r = statements; r; r = r -> next) {
+		if (r -> op == statements_statement) {
+			add_option_statements (set, r -> data.statements);
+			continue;
+		}
+
+		oc = r -> data.option;
+		if (oc -> option -> universe -> save_func ==
+		    save_hashed_option ||
+		    oc -> option -> universe -> save_func ==
+		    save_indexed_option ||
+		    oc -> option -> universe -> save_func ==
+		    save_sorted_option) {
+			for (i = 0; i < set -> count; i++) {
+				if (set -> options [i] -> option -> universe ==
+				    oc -> option -> universe &&
+				    set -> options [i] -> option -> code ==
+				    oc -> option -> code)
+					break;
+			}
+			if (i < set -> count) {
+				option_cache_dereference (&set -> options [i],
+							  MDL);
+				memmove (&set -> options [i],
+					 &set -> options [i + 1],
+					 ((set -> count - i - 1) *
+					  sizeof set -> options [0]));
+				set -> options [--set -> count] =
+					(struct option_cache *)0;
+			}
+		}
+		option_cache_reference (&set -> options [set -> count++],
+					oc, MDL);
+	}
+}
+
+static void add_group_options (set, group)
+	struct option_set *set;
+	struct group *group;
+{
+	if (group -> next)
+		add_group_options (set, group -> next);
+	add_option_statements (set, group -> statements);
+}
+
+/* Build the option set of a group if every group it is nested in holds
+   nothing but option statements. */
+static void build_option_set (group)
+	struct group *group;
+{
+	struct group *g;
+	int count = 0, sub;
+
+	group_option_set_forget (group);
+	group -> option_set_generation = statements_generation;
+
+	for (g = group; g; g = g -> next) {
+		sub = count_option_statements (g -> statements);
+		if (sub < 0)
+			return;
+		count += sub;
+	}
+
+	group -> option_set = dmalloc ((sizeof *group -> option_set) +
+				       count * sizeof (struct option_cache *),
+				       MDL);
+	if (!group -> option_set)
+		return;
+	add_group_options (group -> option_set, group);
+}
+
 void execute_statements_in_scope (result, packet,
 				  lease, client_state, in_options, out_options,
 				  scope, group, limiting_group, on_star)
@@ -615,6 +760,35 @@ void execute_statements_in_scope (result, packet,
 			return;
 	}
 
+	/* If this group and those it is nested in only set options, save
+	   the options they set directly, unless one of the outer groups
+	   is to be left out. */
+	if (group -> option_set_generation != statements_generation)
+		build_option_set (group);
+	if (out_options && group -> option_set) {
+		struct group *g;
+		struct option_cache *oc;
+		int i;
+
+		for (g = group -> next; g; g = g -> next) {
+			for (limit = limiting_group; limit;
+			     limit = limit -> next) {
+				if (g == limit)
+					break;
+			}
+			if (limit)
+				break;
+		}
+		if (!g) {
+			for (i = 0; i < group -> option_set -> count; i++) {
+				oc = group -> option_set -> options [i];
+				save_option (oc -> option -> universe,
+					     out_options, oc);
+			}
+			return;
+		}
+	}
+
 	if (group -> next)
 		execute_statements_in_scope (result, packet,
 					     lease, client_state,
@@ -683,6 +857,9 @@ int executable_statement_dereference (ptr, file, line)
 		if ((*ptr) -> data.s_switch.expr)
 			expression_dereference (&(*ptr) -> data.s_switch.expr,
 						file, line);
+		if ((*ptr) -> data.s_switch.table)
+			free_switch_table (&(*ptr) -> data.s_switch.table,
+					   file, line);
 		break;
 
 	      case case_statement:
@@ -1117,6 +1294,292 @@ int find_matching_case (struct executable_statement **ep,
 	return 0;
 }
 
+/* A switch statement whose case values are all constants gets a hash
+   table of them, so that the value switched on can be looked up rather
+   than compared with each case in turn.   The table points at the case
+   and default statements on the switch statement's own list, so holds
+   no references to them. */
+
+#define SWITCH_TABLE_MIN	4
+
+struct switch_case {
+	struct switch_case *next;	/* Next in hash bucket. */
+	struct executable_statement *stmt;
+	struct data_string value;	/* For data switches. */
+	unsigned long number;		/* For numeric switches. */
+};
+
+struct switch_table {
+	int numeric;
+	int count;
+	unsigned nbuckets;
+	struct switch_case *cases;
+	struct switch_case **buckets;
+	struct executable_statement *default_stmt;
+};
+
+static void free_switch_table (tp, file, line)
+	struct switch_table **tp;
+	const char *file;
+	int line;
+{
+	struct switch_table *table = *tp;
+	int i;
+
+	if (table -> cases) {
+		for (i = 0; i < table -> count; i++)
+			if (table -> cases [i].value.buffer)
+				data_string_forget (&table -> cases [i].value,
+						    file, line);
+		dfree (table -> cases, file, line);
+	}
+	if (table -> buckets)
+		dfree (table -> buckets, file, line);
+	dfree (table, file, line);
+	*tp = (struct switch_table *)0;
+}
+
+static struct switch_case *switch_table_find (table, data, len, number)
+	struct switch_table *table;
+	const unsigned char *data;
+	unsigned len;
+	unsigned long number;
+{
+	struct switch_case *c;
+
+	if (table -> numeric) {
+		c = table -> buckets [do_string_hash (&number, sizeof number,
+						      table -> nbuckets)];
+		while (c && c -> number != number)
+			c = c -> next;
+	} else {
+		c = table -> buckets [do_string_hash (data, len,
+						      table -> nbuckets)];
+		while (c && (c -> value.len != len ||
+			     memcmp (c -> value.data, data, len)))
+			c = c -> next;
+	}
+	return c;
+}
+
+/* Build the case table for a switch statement, if its cases are all
+   constants (as folded by optimize_statement()) and there are enough of
+   them to be worth it. */
+
+static void build_switch_table (r)
+	struct executable_statement *r;
+{
+	struct switch_table *table;
+	struct switch_case *c;
+	struct executable_statement *s;
+	struct expression *value;
+	unsigned bucket;
+	int count = 0;
+
+	for (s = r -> data.s_switch.statements; s; s = s -> next) {
+		if (s -> op != case_statement)
+			continue;
+		value = s -> data.c_case;
+		if (value -> op != expr_const_data &&
+		    value -> op != expr_const_int)
+			return;
+		count++;
+	}
+	if (count < SWITCH_TABLE_MIN)
+		return;
+
+	table = dmalloc (sizeof *table, MDL);
+	if (!table)
+		return;
+	table -> numeric = !is_data_expression (r -> data.s_switch.expr);
+	for (table -> nbuckets = 16; table -> nbuckets < count;
+	     table -> nbuckets <<= 1)
+		;
+	table -> cases = dmalloc (count * sizeof (struct switch_case), MDL);
+	table -> buckets = dmalloc (table -> nbuckets *
+				    sizeof (struct switch_case *), MDL);
+	if (!table -> cases || !table -> buckets) {
+		free_switch_table (&table, MDL);
+		return;
+	}
+
+	for (s = r -> data.s_switch.statements; s; s = s -> next) {
+		if (s -> op == default_statement) {
+			if (!table -> default_stmt)
+				table -> default_stmt = s;
+			continue;
+		}
+		if (s -> op != case_statement)
+			continue;
+
+		/* A case that doesn't match the type of the value switched
+		   on is left out, since it can never match. */
+		value = s -> data.c_case;
+		if (table -> numeric
+		    ? value -> op != expr_const_int
+		    : value -> op != expr_const_data)
+			continue;
+
+		/* The first of two cases with the same value wins. */
+		if (table -> numeric) {
+			if (switch_table_find (table, (const unsigned char *)0,
+					       0, value -> data.const_int))
+				continue;
+		} else {
+			if (switch_table_find (table,
+					       value -> data.const_data.data,
+					       value -> data.const_data.len, 0))
+				continue;
+		}
+
+		c = &table -> cases [table -> count++];
+		c -> stmt = s;
+		if (table -> numeric) {
+			c -> number = value -> data.const_int;
+			bucket = do_string_hash (&c -> number,
+						 sizeof c -> number,
+						 table -> nbuckets);
+		} else {
+			data_string_copy (&c -> value,
+					  &value -> data.const_data, MDL);
+			bucket = do_string_hash (c -> value.data,
+						 c -> value.len,
+						 table -> nbuckets);
+		}
+		c -> next = table -> buckets [bucket];
+		table -> buckets [bucket] = c;
+	}
+	r -> data.s_switch.table = table;
+}
+
+/* find_matching_case() for a switch statement with a case table. */
+
+static int switch_table_lookup (ep, packet, lease, client_state,
+				in_options, out_options, scope, expr, table)
+	struct executable_statement **ep;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *out_options;
+	struct binding_scope **scope;
+	struct expression *expr;
+	struct switch_table *table;
+{
+	struct switch_case *c = (struct switch_case *)0;
+	struct executable_statement *s;
+	struct data_string ds;
+	unsigned long n;
+
+	if (table -> numeric) {
+		if (evaluate_numeric_expression (&n, packet, lease,
+						 client_state, in_options,
+						 out_options, scope, expr))
+			c = switch_table_find (table,
+					       (const unsigned char *)0, 0, n);
+	} else {
+		memset (&ds, 0, sizeof ds);
+		if (evaluate_data_expression (&ds, packet, lease,
+					      client_state, in_options,
+					      out_options, scope, expr, MDL)) {
+			c = switch_table_find (table, ds.data, ds.len, 0);
+			data_string_forget (&ds, MDL);
+		}
+	}
+
+	s = c ? c -> stmt : table -> default_stmt;
+	if (!s || !s -> next)
+		return 0;
+	executable_statement_reference (ep, s -> next, MDL);
+	return 1;
+}
+
+/* Simplify a statement that has just been parsed: fold the constant
+   parts of its expressions, replace an if or switch statement whose
+   outcome is known with the statements it would run, and give a switch
+   statement with constant cases a case table. */
+
+void optimize_statement (ptr)
+	struct executable_statement **ptr;
+{
+	struct executable_statement *r = *ptr, *s;
+	struct executable_statement *run = (struct executable_statement *)0;
+	struct executable_statement *folded = (struct executable_statement *)0;
+	int constant, rc;
+
+	switch (r -> op) {
+	      case if_statement:
+		if (!fold_expression (&r -> data.ie.expr) ||
+		    !evaluate_boolean_expression (&rc, (struct packet *)0,
+						  (struct lease *)0,
+						  (struct client_state *)0,
+						  (struct option_state *)0,
+						  (struct option_state *)0,
+						  (struct binding_scope **)0,
+						  r -> data.ie.expr))
+			return;
+		s = rc ? r -> data.ie.tc : r -> data.ie.fc;
+		if (s)
+			executable_statement_reference (&run, s, MDL);
+		break;
+
+	      case switch_statement:
+		constant = fold_expression (&r -> data.s_switch.expr);
+		for (s = r -> data.s_switch.statements; s; s = s -> next) {
+			if (s -> op == case_statement &&
+			    !fold_expression (&s -> data.c_case))
+				constant = 0;
+			/* find_matching_case() can't return nothing. */
+			if ((s -> op == case_statement ||
+			     s -> op == default_statement) && !s -> next)
+				constant = 0;
+		}
+		if (!constant) {
+			build_switch_table (r);
+			return;
+		}
+
+		/* The value and every case are known, so the statements
+		   that will be run are too. */
+		find_matching_case (&run, (struct packet *)0,
+				    (struct lease *)0,
+				    (struct client_state *)0,
+				    (struct option_state *)0,
+				    (struct option_state *)0,
+				    (struct binding_scope **)0,
+				    r -> data.s_switch.expr,
+				    r -> data.s_switch.statements);
+		break;
+
+	      case eval_statement:
+		/* Evaluating a constant does nothing. */
+		if (!fold_expression (&r -> data.eval))
+			return;
+		break;
+
+	      default:
+		return;
+	}
+
+	if (!executable_statement_allocate (&folded, MDL)) {
+		if (run)
+			executable_statement_dereference (&run, MDL);
+		return;
+	}
+	folded -> op = statements_statement;
+	if (run) {
+		executable_statement_reference (&folded -> data.statements,
+						run, MDL);
+		executable_statement_dereference (&run, MDL);
+	}
+	if (r -> next)
+		executable_statement_reference (&folded -> next,
+						r -> next, MDL);
+	executable_statement_dereference (ptr, MDL);
+	executable_statement_reference (ptr, folded, MDL);
+	executable_statement_dereference (&folded, MDL);
+}
+
 int executable_statement_foreach (struct executable_statement *stmt,
 				  int (*callback) (struct
 						   executable_statement *,
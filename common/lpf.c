@@ -47,6 +47,12 @@
 #include <net/if.h>
 #endif
 
+/* recvmmsg() arrived together with MSG_WAITFORONE, so use the flag to
+   tell whether we can pull several frames off the socket per wakeup. */
+#if defined (USE_LPF_RECEIVE) && defined (MSG_WAITFORONE)
+#define USE_LPF_RECVMMSG
+#endif
+
 #if defined (USE_LPF_SEND) || defined (USE_LPF_RECEIVE)
 /* Reinitializes the specified interface after an address change.   This
    is not required for packet-filter APIs. */
@@ -190,12 +196,37 @@ static void lpf_tr_filter_setup (struct interface_info *);
 
 static void lpf_gen_filter_setup (struct interface_info *);
 
+#if defined (USE_LPF_RECVMMSG)
+/* When batching is enabled the interface's rbuf holds an array of
+   rbuf_max mmsghdrs followed by the same number of these slots.
+   rbuf_len is the number of frames the last recvmmsg() returned and
+   rbuf_offset the next one to hand back to the caller. */
+struct lpf_rx_slot {
+	struct iovec iov;
+	unsigned char frame [1536];
+#ifdef PACKET_AUXDATA
+	unsigned char cmsgbuf [CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+#endif
+};
+
+#define LPF_RX_MSGS(ip) ((struct mmsghdr *)((ip) -> rbuf))
+#define LPF_RX_SLOTS(ip) \
+	((struct lpf_rx_slot *)(LPF_RX_MSGS(ip) + (ip) -> rbuf_max))
+
+static void lpf_rx_batch_setup (struct interface_info *);
+#endif
+
 void if_register_receive (info)
 	struct interface_info *info;
 {
 	/* Open a LPF device and hang it on this interface... */
 	info -> rfdesc = if_register_lpf (info);
 
+#if defined (USE_LPF_RECVMMSG)
+	if (receive_batch_size > 1)
+		lpf_rx_batch_setup (info);
+#endif
+
 #ifdef PACKET_AUXDATA
 	{
 	int val = 1;
@@ -235,6 +266,14 @@ void if_deregister_receive (info)
 	   are closed */
 	close (info -> rfdesc);
 	info -> rfdesc = -1;
+#if defined (USE_LPF_RECVMMSG)
+	if (info -> rbuf) {
+		dfree (info -> rbuf, MDL);
+		info -> rbuf = NULL;
+	}
+	info -> rbuf_max = 0;
+	info -> rbuf_offset = info -> rbuf_len = 0;
+#endif
 	if (!quiet_interface_discovery)
 		log_info ("Disabling input on LPF/%s/%s%s%s",
 			  info -> name,
@@ -246,6 +285,42 @@ void if_deregister_receive (info)
 			   info -> shared_network -> name : ""));
 }
 
+#if defined (USE_LPF_RECVMMSG)
+static void lpf_rx_batch_setup (info)
+	struct interface_info *info;
+{
+	struct mmsghdr *msgs;
+	struct lpf_rx_slot *slots;
+	unsigned i;
+
+	info -> rbuf_max = receive_batch_size;
+	if (info -> rbuf_max > MAX_RECEIVE_BATCH_SIZE)
+		info -> rbuf_max = MAX_RECEIVE_BATCH_SIZE;
+	info -> rbuf = dmalloc (info -> rbuf_max * (sizeof (struct mmsghdr) +
+						   sizeof (struct lpf_rx_slot)),
+				MDL);
+	if (!info -> rbuf)
+		log_fatal ("Can't allocate %u frame receive batch for %s",
+			   info -> rbuf_max, info -> name);
+	info -> rbuf_offset = 0;
+	info -> rbuf_len = 0;
+
+	/* The iovecs never move, only the control lengths need
+	   resetting before each read. */
+	msgs = LPF_RX_MSGS (info);
+	slots = LPF_RX_SLOTS (info);
+	for (i = 0; i < info -> rbuf_max; i++) {
+		slots [i].iov.iov_base = slots [i].frame;
+		slots [i].iov.iov_len = sizeof slots [i].frame;
+		msgs [i].msg_hdr.msg_iov = &slots [i].iov;
+		msgs [i].msg_hdr.msg_iovlen = 1;
+#ifdef PACKET_AUXDATA
+		msgs [i].msg_hdr.msg_control = slots [i].cmsgbuf;
+#endif
+	}
+}
+#endif /* USE_LPF_RECVMMSG */
+
 static void lpf_gen_filter_setup (info)
 	struct interface_info *info;
 {
@@ -370,6 +445,14 @@ ssize_t send_packet (interface, packet, raw, len, from, to, hto)
 #endif /* USE_LPF_SEND */
 
 #ifdef USE_LPF_RECEIVE
+static ssize_t lpf_decode_frame (struct interface_info *, struct msghdr *,
+				 unsigned char *, int, unsigned char *,
+				 struct sockaddr_in *, struct hardware *);
+#if defined (USE_LPF_RECVMMSG)
+static ssize_t lpf_receive_batched (struct interface_info *, unsigned char *,
+				    struct sockaddr_in *, struct hardware *);
+#endif
+
 ssize_t receive_packet (interface, buf, len, from, hfrom)
 	struct interface_info *interface;
 	unsigned char *buf;
@@ -378,11 +461,7 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	struct hardware *hfrom;
 {
 	int length = 0;
-	int offset = 0;
-	int csum_ready = 1;
 	unsigned char ibuf [1536];
-	unsigned bufix = 0;
-	unsigned paylen;
 	struct iovec iov = {
 		.iov_base = ibuf,
 		.iov_len = sizeof ibuf,
@@ -408,10 +487,91 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	};
 #endif /* PACKET_AUXDATA */
 
+#if defined (USE_LPF_RECVMMSG)
+	if (interface -> rbuf)
+		return lpf_receive_batched (interface, buf, from, hfrom);
+#endif
+
 	length = recvmsg (interface->rfdesc, &msg, 0);
 	if (length <= 0)
 		return length;
 
+	return lpf_decode_frame (interface, &msg, ibuf, length,
+				 buf, from, hfrom);
+}
+
+#if defined (USE_LPF_RECVMMSG)
+/* Hand back the next usable frame from the batch, refilling it with a
+   single recvmmsg() once it has been drained.   The socket is known to
+   be readable when we're called with an empty batch, so don't wait for
+   more than what is already queued. */
+static ssize_t lpf_receive_batched (interface, buf, from, hfrom)
+	struct interface_info *interface;
+	unsigned char *buf;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	struct mmsghdr *msgs = LPF_RX_MSGS (interface);
+	struct lpf_rx_slot *slots = LPF_RX_SLOTS (interface);
+	ssize_t result;
+	unsigned i;
+	int count;
+
+	if (interface -> rbuf_offset >= interface -> rbuf_len) {
+		for (i = 0; i < interface -> rbuf_max; i++) {
+#ifdef PACKET_AUXDATA
+			msgs [i].msg_hdr.msg_controllen =
+				sizeof slots [i].cmsgbuf;
+#endif
+			msgs [i].msg_len = 0;
+		}
+
+		interface -> rbuf_offset = 0;
+		interface -> rbuf_len = 0;
+		count = recvmmsg (interface -> rfdesc, msgs,
+				  interface -> rbuf_max, MSG_DONTWAIT, NULL);
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (count <= 0)
+			return count;
+		interface -> rbuf_len = count;
+	}
+
+	/* Frames we can't use (wrong vlan, bad checksum...) are skipped
+	   here rather than costing the caller another round trip. */
+	while (interface -> rbuf_offset < interface -> rbuf_len) {
+		i = interface -> rbuf_offset++;
+		if (msgs [i].msg_len == 0)
+			continue;
+		result = lpf_decode_frame (interface, &msgs [i].msg_hdr,
+					   slots [i].frame,
+					   (int)msgs [i].msg_len,
+					   buf, from, hfrom);
+		if (result != 0)
+			return result;
+	}
+	return 0;
+}
+#endif /* USE_LPF_RECVMMSG */
+
+/* Strip the link, IP and UDP headers off a frame read from the packet
+   socket and copy the payload into buf.   Returns the payload length,
+   or zero if the frame should be dropped. */
+static ssize_t lpf_decode_frame (interface, msg, ibuf, length,
+				 buf, from, hfrom)
+	struct interface_info *interface;
+	struct msghdr *msg;
+	unsigned char *ibuf;
+	int length;
+	unsigned char *buf;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	int offset = 0;
+	int csum_ready = 1;
+	unsigned bufix = 0;
+	unsigned paylen;
+
 #ifdef PACKET_AUXDATA
 	{
 	/*  Use auxiliary packet data to:
@@ -433,7 +593,7 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	 *  checksum offloading is enabled on the interface.  */
 	struct cmsghdr *cmsg;
 
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 		if (cmsg->cmsg_level == SOL_PACKET &&
 		    cmsg->cmsg_type == PACKET_AUXDATA) {
 			struct tpacket_auxdata *aux = (void *)CMSG_DATA(cmsg);
@@ -42,7 +42,40 @@ static int pretty_domain(char **, char *, const unsigned char **,
 static int prepare_option_buffer(struct universe *universe, struct buffer *bp,
 				 unsigned char *buffer, unsigned length,
 				 unsigned code, int terminatep,
+				 struct packet_arena *arena,
 				 struct option_cache **opp);
+struct option_template;
+struct option_value;
+static int option_value(struct data_string *od, int *text, unsigned code,
+			struct packet *packet, struct lease *lease,
+			struct client_state *client_state,
+			struct option_state *in_options,
+			struct option_state *cfg_options,
+			struct binding_scope **scope, const char *vuname);
+static int store_options_layout(struct option_template *tpl,
+				struct option_value *values, int *where,
+				int *ocount,
+				unsigned char *buffer, unsigned index,
+				unsigned buflen, struct packet *packet,
+				struct lease *lease,
+				struct client_state *client_state,
+				struct option_state *in_options,
+				struct option_state *cfg_options,
+				struct binding_scope **scope,
+				unsigned *priority_list, int priority_len,
+				unsigned first_cutoff, int second_cutoff,
+				int terminate, const char *vuname);
+static int store_options_template(int *ocount,
+				  unsigned char *buffer, unsigned index,
+				  unsigned buflen, struct packet *packet,
+				  struct lease *lease,
+				  struct client_state *client_state,
+				  struct option_state *in_options,
+				  struct option_state *cfg_options,
+				  struct binding_scope **scope,
+				  unsigned *priority_list, int priority_len,
+				  unsigned first_cutoff, int second_cutoff,
+				  int terminate, const char *vuname);
 
 /* Parse all available options out of the specified packet. */
 /* Note, the caller is responsible for allocating packet->options. */
@@ -126,14 +159,29 @@ int parse_option_buffer (options, buffer, length, universe)
 	unsigned code;
 	struct option_cache *op = NULL, *nop = NULL;
 	struct buffer *bp = (struct buffer *)0;
+	struct packet_arena *arena = NULL;
+	unsigned char *data;
 	struct option *option = NULL;
 	char *reason = "general failure";
 
-	if (!buffer_allocate (&bp, length, MDL)) {
-		log_error ("no memory for option buffer.");
-		return 0;
+	/* Options straight out of a received packet point into the copy
+	   of it held by the packet's arena.   Anything else, including the
+	   contents of an encapsulation, which mustn't be overwritten when
+	   its suboptions are NUL terminated, gets a copy of its own. */
+	if (options->arena != NULL && options->arena->raw != NULL &&
+	    buffer >= options->arena->raw &&
+	    buffer + length <= options->arena->raw + options->arena->length) {
+		arena = options->arena;
+		buffer_reference(&bp, arena->buffer, MDL);
+		data = bp->data + (buffer - arena->raw);
+	} else {
+		if (!buffer_allocate (&bp, length, MDL)) {
+			log_error ("no memory for option buffer.");
+			return 0;
+		}
+		memcpy (bp -> data, buffer, length);
+		data = bp->data;
 	}
-	memcpy (bp -> data, buffer, length);
 
 	for (offset = 0;
 	     (offset + universe->tag_size) <= length &&
@@ -201,7 +249,7 @@ int parse_option_buffer (options, buffer, length, universe)
 		if (option &&
 		    (option->format[0] == 'e' || option->format[0] == 'E')) {
 			(void) parse_encapsulated_suboptions(options, option,
-							     bp->data + offset,
+							     data + offset,
 							     len,
 							     universe, NULL);
 		}
@@ -220,7 +268,7 @@ int parse_option_buffer (options, buffer, length, universe)
 		if (op == NULL) {
 			/* If we don't have an option create one */
 			if (save_option_buffer(universe, options, bp,
-					       bp->data + offset, len,
+					       data + offset, len,
 					       code, 1) == 0) {
 				log_error("parse_option_buffer: "
 					  "save_option_buffer failed");
@@ -245,7 +293,7 @@ int parse_option_buffer (options, buffer, length, universe)
 			       op->data.len);
 			/* Concat new option behind old. */
 			memcpy(new.buffer->data + op->data.len,
-			       bp->data + offset, len);
+			       data + offset, len);
 			new.len = op->data.len + len;
 			new.data = new.buffer->data;
 			/* Save new concat'd object. */
@@ -259,7 +307,7 @@ int parse_option_buffer (options, buffer, length, universe)
 			while (op->next != NULL)
 				op = op->next;
 
-			if (!option_cache_allocate(&nop, MDL)) {
+			if (!packet_arena_option_cache(&nop, arena, MDL)) {
 				log_error("parse_option_buffer: No memory.");
 				buffer_dereference(&bp, MDL);
 				option_dereference(&option, MDL);
@@ -270,7 +318,7 @@ int parse_option_buffer (options, buffer, length, universe)
 
 			nop->data.buffer = NULL;
 			buffer_reference(&nop->data.buffer, bp, MDL);
-			nop->data.data = bp->data + offset;
+			nop->data.data = data + offset;
 			nop->data.len = len;
 
 			option_cache_reference(&op->next, nop, MDL);
@@ -527,6 +575,36 @@ int fqdn_universe_decode (struct option_state *options,
 	return 1;
 }
 
+/* Options found in an option space that are added to a priority list. */
+struct priority_state {
+	unsigned *list;
+	int *len;
+	int max;
+	int site;
+	unsigned site_code_min;
+};
+
+/* Add the code of an option to a priority list: for the site option space,
+   if it is at or above the site code cutoff, and for the DHCP option
+   space, if it is below it. */
+static void
+add_priority_code(struct option_cache *oc, struct packet *packet,
+		  struct lease *lease, struct client_state *client_state,
+		  struct option_state *in_options,
+		  struct option_state *cfg_options,
+		  struct binding_scope **scope,
+		  struct universe *universe, void *stuff)
+{
+	struct priority_state *pri = stuff;
+	unsigned code = oc->option->code;
+
+	if ((pri->site ? (code >= pri->site_code_min)
+		       : (code < pri->site_code_min)) &&
+	    (*pri->len < pri->max) &&
+	    (code != DHO_DHCP_AGENT_OPTIONS))
+		pri->list[(*pri->len)++] = code;
+}
+
 /*
  * Load all options into a buffer, and then split them out into the three
  * separate fields in the dhcp packet (options, file, and sname) where
@@ -554,7 +632,7 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	int i;
 	struct option_cache *op;
 	struct data_string ds;
-	pair pp, *hash;
+	struct priority_state pri;
 	int overload_used = 0;
 	int of1 = 0, of2 = 0;
 
@@ -748,21 +826,15 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * it's slightly more general to do it this way,
 		 * taking the 1Q99 DHCP futures work into account.
 		 */
+		pri.list = priority_list;
+		pri.len = &priority_len;
+		pri.max = PRIORITY_COUNT;
 		if (cfg_options->site_code_min) {
-		    for (i = 0; i < OPTION_HASH_SIZE; i++) {
-			hash = cfg_options->universes[dhcp_universe.index];
-			if (hash) {
-			    for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code <
-				     cfg_options->site_code_min &&
-				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
-			    }
-			}
-		    }
+			pri.site = 0;
+			pri.site_code_min = cfg_options->site_code_min;
+			option_space_foreach(NULL, NULL, NULL, NULL,
+					     cfg_options, NULL, &dhcp_universe,
+					     &pri, add_priority_code);
 		}
 
 		/*
@@ -770,19 +842,11 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * is no site option space, we'll be cycling through the
 		 * dhcp option space.
 		 */
-		for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		    hash = cfg_options->universes[cfg_options->site_universe];
-		    if (hash != NULL)
-			for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code >=
-				     cfg_options->site_code_min &&
-				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
-			}
-		}
+		pri.site = 1;
+		pri.site_code_min = cfg_options->site_code_min;
+		option_space_foreach(NULL, NULL, NULL, NULL, cfg_options, NULL,
+				     universes[cfg_options->site_universe],
+				     &pri, add_priority_code);
 
 		/*
 		 * Put any spaces that are encapsulated on the list,
@@ -813,11 +877,12 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	index += 4;
 
 	/* Copy the options into the big buffer... */
-	option_size = store_options(&overload_used, buffer, index, mb_max,
-				    inpacket, lease, client_state,
-				    in_options, cfg_options, scope,
-				    priority_list, priority_len,
-				    of1, of2, terminate, vuname);
+	option_size = store_options_template(&overload_used, buffer, index,
+					     mb_max, inpacket, lease,
+					     client_state, in_options,
+					     cfg_options, scope,
+					     priority_list, priority_len,
+					     of1, of2, terminate, vuname);
 
 	/* If store_options() failed */
 	if (option_size == 0)
@@ -1224,6 +1289,349 @@ store_options6(char *buf, int buflen,
 	return bufpos;
 }
 
+/*
+ * Option templates.
+ *
+ * How store_options() lays the options out depends only on the priority
+ * list, the size of the buffer and the lengths of the option values.
+ * Most of those values come straight from the configuration, and are the
+ * same from one response to the next; it's mostly the per-lease values,
+ * such as the lease time, renewal and rebinding times and server
+ * identifier, that change.  So once a layout has been worked out, it is
+ * kept as a template: a copy of the buffer store_options() produced, with
+ * a note of where in it each per-lease value went.
+ *
+ * An option whose cache was parsed from the configuration with a constant
+ * value is identified by the cache itself, which the template holds a
+ * reference to, and isn't evaluated again while the template is in use.
+ * Any other option is evaluated, and identified by the length of its
+ * value.  A later response with the same priority list, buffer size,
+ * configured options and value lengths gets a copy of the template with
+ * its own per-lease values written over the old ones.  All templates are
+ * thrown away when the configuration changes.
+ */
+
+#define OPTION_TEMPLATE_HASH_SIZE	256
+#define OPTION_TEMPLATE_MAX_OPTIONS	128
+
+/* The value of an option to be stored, and whether a NUL may be added. */
+struct option_value {
+	struct data_string data;
+	int text;
+};
+
+/* Part of an option's value and where it goes in the buffer. */
+struct option_chunk {
+	unsigned code;
+	unsigned offset;
+	unsigned dst;
+	unsigned len;
+};
+
+struct option_template {
+	unsigned hash;
+	unsigned *key;
+	unsigned key_len;
+	struct option_cache **fixed;
+	int fixed_count;
+	unsigned char patch[256];
+	unsigned char *buffer;
+	unsigned first_start, first_end;
+	unsigned second_start, second_end;
+	int option_size;
+	int overload;
+	struct option_chunk *chunks;
+	int chunk_count;
+	int chunk_max;
+	int failed;
+};
+
+static struct option_template *option_templates[OPTION_TEMPLATE_HASH_SIZE];
+static unsigned option_templates_generation;
+
+static void
+option_template_free(struct option_template *tpl) {
+	int i;
+
+	if (tpl->key != NULL)
+		dfree(tpl->key, MDL);
+	if (tpl->fixed != NULL) {
+		for (i = 0; i < tpl->fixed_count; i++)
+			option_cache_dereference(&tpl->fixed[i], MDL);
+		dfree(tpl->fixed, MDL);
+	}
+	if (tpl->buffer != NULL)
+		dfree(tpl->buffer, MDL);
+	if (tpl->chunks != NULL)
+		dfree(tpl->chunks, MDL);
+	dfree(tpl, MDL);
+}
+
+/* Throw away all option templates. */
+void
+flush_option_templates(void) {
+	int i;
+
+	for (i = 0; i < OPTION_TEMPLATE_HASH_SIZE; i++) {
+		if (option_templates[i] != NULL) {
+			option_template_free(option_templates[i]);
+			option_templates[i] = NULL;
+		}
+	}
+}
+
+/* Record that len bytes of the value of option code, starting at offset,
+   were stored at dst.  Only the values that are patched in are noted. */
+static void
+option_template_chunk(struct option_template *tpl, unsigned code,
+		      unsigned offset, unsigned dst, unsigned len) {
+	struct option_chunk *chunks;
+
+	if (tpl->failed || (len == 0) || !tpl->patch[code])
+		return;
+
+	if (tpl->chunk_count == tpl->chunk_max) {
+		chunks = dmalloc((tpl->chunk_max + 16) * sizeof(*chunks), MDL);
+		if (chunks == NULL) {
+			tpl->failed = 1;
+			return;
+		}
+		if (tpl->chunks != NULL) {
+			memcpy(chunks, tpl->chunks,
+			       tpl->chunk_count * sizeof(*chunks));
+			dfree(tpl->chunks, MDL);
+		}
+		tpl->chunks = chunks;
+		tpl->chunk_max += 16;
+	}
+
+	tpl->chunks[tpl->chunk_count].code = code;
+	tpl->chunks[tpl->chunk_count].offset = offset;
+	tpl->chunks[tpl->chunk_count].dst = dst;
+	tpl->chunks[tpl->chunk_count].len = len;
+	tpl->chunk_count++;
+}
+
+/* Return the cache for option code if it has a constant value from the
+   configuration that option_value() would use as it is. */
+static struct option_cache *
+option_template_fixed(unsigned code, struct option_state *cfg_options) {
+	struct option_cache *oc;
+	struct universe *u;
+
+	if (code >= cfg_options->site_code_min)
+		u = universes[cfg_options->site_universe];
+	else
+		u = &dhcp_universe;
+
+	oc = lookup_option(u, cfg_options, code);
+	if ((oc == NULL) || !(oc->flags & OPTION_CONSTANT) ||
+	    (oc->option == NULL) || (oc->option->format[0] == 'e'))
+		return NULL;
+	return oc;
+}
+
+/*
+ * Store the options on the priority list into buffer like store_options(),
+ * using or making a template.  Options that aren't constant are evaluated
+ * up front; where[code] is the index of the entry in values for each
+ * option that has a value, or -1.  The constant options are only
+ * evaluated if a new template has to be made.
+ */
+static int
+store_options_template(int *ocount,
+		       unsigned char *buffer, unsigned index, unsigned buflen,
+		       struct packet *packet, struct lease *lease,
+		       struct client_state *client_state,
+		       struct option_state *in_options,
+		       struct option_state *cfg_options,
+		       struct binding_scope **scope,
+		       unsigned *priority_list, int priority_len,
+		       unsigned first_cutoff, int second_cutoff,
+		       int terminate, const char *vuname) {
+	unsigned key[7 + 2 * OPTION_TEMPLATE_MAX_OPTIONS];
+	struct option_cache *fixed[OPTION_TEMPLATE_MAX_OPTIONS];
+	unsigned fixed_code[OPTION_TEMPLATE_MAX_OPTIONS];
+	struct option_value values[OPTION_TEMPLATE_MAX_OPTIONS];
+	unsigned char seen[256];
+	int where[256];
+	struct option_template *tpl, **slot;
+	struct option_chunk *chunk;
+	unsigned key_len, hash, code, first, second;
+	int i, count, fixed_count, option_size, overload = 0;
+
+	for (i = 0; i < priority_len; i++) {
+		if (priority_list[i] > 255)
+			break;
+	}
+	if ((i < priority_len) || (priority_len > OPTION_TEMPLATE_MAX_OPTIONS))
+		return store_options(ocount, buffer, index, buflen, packet,
+				     lease, client_state, in_options,
+				     cfg_options, scope, priority_list,
+				     priority_len, first_cutoff,
+				     second_cutoff, terminate, vuname);
+
+	/* The templates hold on to option caches from the configuration,
+	   so let go of them once it has changed. */
+	if (option_templates_generation != statements_generation) {
+		flush_option_templates();
+		option_templates_generation = statements_generation;
+	}
+
+	/* The key is everything the layout depends on. */
+	key_len = 0;
+	key[key_len++] = cfg_options->site_universe;
+	key[key_len++] = cfg_options->site_code_min;
+	key[key_len++] = index;
+	key[key_len++] = buflen;
+	key[key_len++] = first_cutoff;
+	key[key_len++] = second_cutoff;
+	key[key_len++] = terminate;
+
+	hash = 2166136261U;
+	memset(seen, 0, sizeof(seen));
+	count = fixed_count = 0;
+	for (i = 0; i < priority_len; i++) {
+		code = priority_list[i];
+		key[key_len++] = code;
+		if (seen[code])
+			continue;
+		seen[code] = 1;
+		where[code] = -1;
+
+		fixed[fixed_count] = option_template_fixed(code, cfg_options);
+		if (fixed[fixed_count] != NULL) {
+			key[key_len++] = 2;
+			fixed_code[fixed_count] = code;
+			hash ^= (unsigned)(unsigned long)fixed[fixed_count++];
+			hash *= 16777619U;
+			continue;
+		}
+
+		memset(&values[count], 0, sizeof(values[count]));
+		if (!option_value(&values[count].data, &values[count].text,
+				  code, packet, lease, client_state,
+				  in_options, cfg_options, scope, vuname)) {
+			key[key_len++] = 0;
+			continue;
+		}
+		key[key_len++] = ((values[count].data.len << 2) |
+				  (values[count].text ? 2 : 0) | 1);
+		where[code] = count++;
+	}
+
+	for (i = 0; i < key_len; i++) {
+		hash ^= key[i];
+		hash *= 16777619U;
+	}
+
+	slot = &option_templates[hash % OPTION_TEMPLATE_HASH_SIZE];
+	tpl = *slot;
+	if ((tpl != NULL) && (tpl->hash == hash) &&
+	    (tpl->key_len == key_len) &&
+	    (tpl->fixed_count == fixed_count) &&
+	    !memcmp(tpl->key, key, key_len * sizeof(key[0])) &&
+	    !memcmp(tpl->fixed, fixed, fixed_count * sizeof(fixed[0]))) {
+		/* Copy only the parts of the buffer that were used. */
+		memcpy(&buffer[index], tpl->buffer, tpl->option_size);
+		if (tpl->overload & 1)
+			memcpy(&buffer[index + tpl->first_start],
+			       &tpl->buffer[tpl->first_start],
+			       tpl->first_end - tpl->first_start);
+		if (tpl->overload & 2)
+			memcpy(&buffer[index + tpl->second_start],
+			       &tpl->buffer[tpl->second_start],
+			       tpl->second_end - tpl->second_start);
+		for (i = 0; i < tpl->chunk_count; i++) {
+			chunk = &tpl->chunks[i];
+			memcpy(&buffer[index + chunk->dst],
+			       values[where[chunk->code]].data.data +
+			       chunk->offset, chunk->len);
+		}
+		overload = tpl->overload;
+		option_size = tpl->option_size;
+		goto out;
+	}
+
+	/* The layout needs the values of the constant options too. */
+	tpl = dmalloc(sizeof(*tpl), MDL);
+	if (tpl != NULL) {
+		memset(tpl, 0, sizeof(*tpl));
+		tpl->key = dmalloc(key_len * sizeof(key[0]), MDL);
+		tpl->buffer = dmalloc(buflen - index, MDL);
+		if (fixed_count != 0)
+			tpl->fixed = dmalloc(fixed_count * sizeof(fixed[0]),
+					     MDL);
+		if ((tpl->key == NULL) || (tpl->buffer == NULL) ||
+		    ((fixed_count != 0) && (tpl->fixed == NULL)))
+			tpl->failed = 1;
+		for (i = 0; i < 256; i++)
+			tpl->patch[i] = (seen[i] && (where[i] >= 0));
+	}
+	for (i = 0; i < fixed_count; i++) {
+		code = fixed_code[i];
+		memset(&values[count], 0, sizeof(values[count]));
+		if (option_value(&values[count].data, &values[count].text,
+				 code, packet, lease, client_state,
+				 in_options, cfg_options, scope, vuname))
+			where[code] = count++;
+	}
+
+	/* Lay the options out the usual way, noting where they went. */
+	option_size = store_options_layout(tpl, values, where, &overload,
+					   buffer, index, buflen, packet,
+					   lease, client_state, in_options,
+					   cfg_options, scope,
+					   priority_list, priority_len,
+					   first_cutoff, second_cutoff,
+					   terminate, vuname);
+
+	if (tpl != NULL) {
+		if (tpl->failed || (option_size == 0)) {
+			option_template_free(tpl);
+		} else {
+			tpl->hash = hash;
+			memcpy(tpl->key, key, key_len * sizeof(key[0]));
+			tpl->key_len = key_len;
+			for (i = 0; i < fixed_count; i++)
+				option_cache_reference(&tpl->fixed[i],
+						       fixed[i], MDL);
+			tpl->fixed_count = fixed_count;
+
+			/* The overloaded fields are padded out to their
+			   ends, as store_options_layout() does. */
+			first = first_cutoff ? first_cutoff - index : 0;
+			second = second_cutoff ? second_cutoff - index : 0;
+			tpl->first_start = first;
+			tpl->first_end = second ? second : buflen - index;
+			tpl->second_start = second;
+			tpl->second_end = buflen - index;
+
+			memcpy(tpl->buffer, &buffer[index], option_size);
+			if (overload & 1)
+				memcpy(&tpl->buffer[tpl->first_start],
+				       &buffer[index + tpl->first_start],
+				       tpl->first_end - tpl->first_start);
+			if (overload & 2)
+				memcpy(&tpl->buffer[tpl->second_start],
+				       &buffer[index + tpl->second_start],
+				       tpl->second_end - tpl->second_start);
+			tpl->option_size = option_size;
+			tpl->overload = overload;
+			if (*slot != NULL)
+				option_template_free(*slot);
+			*slot = tpl;
+		}
+	}
+
+      out:
+	if (ocount != NULL)
+		*ocount |= overload;
+	for (i = 0; i < count; i++)
+		data_string_forget(&values[i].data, MDL);
+	return option_size;
+}
+
 /*
  * Store all the requested options into the requested buffer.
  * XXX: ought to be static
@@ -1239,6 +1647,202 @@ store_options(int *ocount,
 	      unsigned *priority_list, int priority_len,
 	      unsigned first_cutoff, int second_cutoff, int terminate,
 	      const char *vuname)
+{
+	return store_options_layout(NULL, NULL, NULL, ocount, buffer, index,
+				    buflen, packet, lease, client_state,
+				    in_options, cfg_options, scope,
+				    priority_list, priority_len,
+				    first_cutoff, second_cutoff,
+				    terminate, vuname);
+}
+
+/*
+ * Work out the value store_options() sends for an option code, leaving it
+ * in od, and set text if a NUL may be added to it.  Returns zero if there
+ * is no value to send.
+ */
+static int
+option_value(struct data_string *od, int *text, unsigned code,
+	     struct packet *packet, struct lease *lease,
+	     struct client_state *client_state,
+	     struct option_state *in_options,
+	     struct option_state *cfg_options,
+	     struct binding_scope **scope, const char *vuname)
+{
+	struct option_cache *oc;
+	struct option *option = NULL;
+	struct universe *u;
+	int have_encapsulation = 0;
+	struct data_string encapsulation;
+	unsigned length;
+
+	memset (&encapsulation, 0, sizeof encapsulation);
+
+	/* Look up the option in the site option space if the code
+	   is above the cutoff, otherwise in the DHCP option space. */
+	if (code >= cfg_options -> site_code_min)
+		u = universes [cfg_options -> site_universe];
+	else
+		u = &dhcp_universe;
+
+	oc = lookup_option (u, cfg_options, code);
+
+	if (oc && oc->option)
+	    option_reference(&option, oc->option, MDL);
+	else
+	    option_code_hash_lookup(&option, u->code_hash, &code, 0, MDL);
+
+	/* If it's a straight encapsulation, and the user supplied a
+	 * value for the entire option, use that.  Otherwise, search
+	 * the encapsulated space.
+	 *
+	 * If it's a limited encapsulation with preceding data, and the
+	 * user supplied values for the preceding bytes, search the
+	 * encapsulated space.
+	 */
+	if ((option != NULL) &&
+	    (((oc == NULL) && (option->format[0] == 'E')) ||
+	     ((oc != NULL) && (option->format[0] == 'e')))) {
+	    static char *s, *t;
+	    struct option_cache *tmp;
+	    struct data_string name;
+
+	    s = strchr (option->format, 'E');
+	    if (s)
+		t = strchr (++s, '.');
+	    if (s && t) {
+		memset (&name, 0, sizeof name);
+
+		/* A zero-length universe name means the vendor
+		   option space, if one is defined. */
+		if (t == s) {
+		    if (vendor_cfg_option) {
+			tmp = lookup_option (vendor_cfg_option -> universe,
+					     cfg_options,
+					     vendor_cfg_option -> code);
+			if (tmp)
+			    /* No need to check the return as we check name.len below */
+			    (void) evaluate_option_cache (&name, packet, lease,
+							  client_state,
+							  in_options,
+							  cfg_options,
+							  scope, tmp, MDL);
+		    } else if (vuname) {
+			name.data = (unsigned char *)s;
+			name.len = strlen (s);
+		    }
+		} else {
+		    name.data = (unsigned char *)s;
+		    name.len = t - s;
+		}
+
+		/* If we found a universe, and there are options configured
+		   for that universe, try to encapsulate it. */
+		if (name.len) {
+		    have_encapsulation =
+			    (option_space_encapsulate
+			     (&encapsulation, packet, lease, client_state,
+			      in_options, cfg_options, scope, &name));
+		}
+
+		data_string_forget (&name, MDL);
+	    }
+	}
+
+	/* In order to avoid memory leaks, we have to get to here
+	   with any option cache that we allocated in tmp not being
+	   referenced by tmp, and whatever option cache is referenced
+	   by oc being an actual reference.   lookup_option doesn't
+	   generate a reference (this needs to be fixed), so the
+	   preceding goop ensures that if we *didn't* generate a new
+	   option cache, oc still winds up holding an actual reference. */
+
+	/* If no data is available for this option, skip it. */
+	if (!oc && !have_encapsulation)
+		goto skip;
+
+	/* Find the value of the option... */
+	od->len = 0;
+	if (oc) {
+	    /* No need to check the return as we check od->len below */
+	    (void) evaluate_option_cache (od, packet,
+					  lease, client_state, in_options,
+					  cfg_options, scope, oc, MDL);
+
+	    /* If we have encapsulation for this option, and an oc
+	     * lookup succeeded, but the evaluation failed, it is
+	     * either because this is a complex atom (atoms before
+	     * E on format list) and the top half of the option is
+	     * not configured, or this is a simple encapsulated
+	     * space and the evaluator is giving us a NULL.  Prefer
+	     * the evaluator's opinion over the subspace.
+	     */
+	    if (!od->len) {
+		data_string_forget (&encapsulation, MDL);
+		data_string_forget (od, MDL);
+		goto skip;
+	    }
+	}
+
+	/* We should now have a constant length for the option. */
+	length = od->len;
+	if (have_encapsulation) {
+		length += encapsulation.len;
+
+		/* od->len can be nonzero if we got here without an
+		 * oc (cache lookup failed), but did have an encapsulated
+		 * simple encapsulation space.
+		 */
+		if (!od->len) {
+			data_string_copy (od, &encapsulation, MDL);
+			data_string_forget (&encapsulation, MDL);
+		} else {
+			struct buffer *bp = (struct buffer *)0;
+			if (!buffer_allocate (&bp, length, MDL)) {
+				option_cache_dereference (&oc, MDL);
+				data_string_forget (od, MDL);
+				data_string_forget (&encapsulation, MDL);
+				goto skip;
+			}
+			memcpy (&bp -> data [0], od->data, od->len);
+			memcpy (&bp -> data [od->len], encapsulation.data,
+				encapsulation.len);
+			data_string_forget (od, MDL);
+			data_string_forget (&encapsulation, MDL);
+			od->data = &bp -> data [0];
+			buffer_reference (&od->buffer, bp, MDL);
+			buffer_dereference (&bp, MDL);
+			od->len = length;
+			od->terminated = 0;
+		}
+	}
+
+	*text = (option && format_has_text(option->format));
+	if (option != NULL)
+		option_dereference(&option, MDL);
+	return 1;
+
+      skip:
+	if (option != NULL)
+		option_dereference(&option, MDL);
+	return 0;
+}
+
+/* If values isn't NULL, the value of each option is taken from the entry
+   of values that where gives for its code, rather than worked out here,
+   and if tpl isn't NULL, where each value is stored is recorded in it. */
+static int
+store_options_layout(struct option_template *tpl,
+		     struct option_value *values, int *where, int *ocount,
+		     unsigned char *buffer, unsigned index, unsigned buflen,
+		     struct packet *packet, struct lease *lease,
+		     struct client_state *client_state,
+		     struct option_state *in_options,
+		     struct option_state *cfg_options,
+		     struct binding_scope **scope,
+		     unsigned *priority_list, int priority_len,
+		     unsigned first_cutoff, int second_cutoff, int terminate,
+		     const char *vuname)
 {
 	int bufix = 0, six = 0, tix = 0;
 	int i;
@@ -1246,8 +1850,6 @@ store_options(int *ocount,
 	int tto;
 	int bufend, sbufend;
 	struct data_string od;
-	struct option_cache *oc;
-	struct option *option = NULL;
 	unsigned code;
 
 	/*
@@ -1329,162 +1931,28 @@ store_options(int *ocount,
 	       have been stored by a previous pass). */
 	    unsigned length;
 	    int optstart, soptstart, toptstart;
-	    struct universe *u;
-	    int have_encapsulation = 0;
-	    struct data_string encapsulation;
 	    int splitup;
-
-	    memset (&encapsulation, 0, sizeof encapsulation);
-	    have_encapsulation = 0;
-
-	    if (option != NULL)
-		option_dereference(&option, MDL);
+	    int text;
 
 	    /* Code for next option to try to store. */
 	    code = priority_list [i];
 
-	    /* Look up the option in the site option space if the code
-	       is above the cutoff, otherwise in the DHCP option space. */
-	    if (code >= cfg_options -> site_code_min)
-		    u = universes [cfg_options -> site_universe];
-	    else
-		    u = &dhcp_universe;
-
-	    oc = lookup_option (u, cfg_options, code);
-
-	    if (oc && oc->option)
-		option_reference(&option, oc->option, MDL);
-	    else
-		option_code_hash_lookup(&option, u->code_hash, &code, 0, MDL);
-
-	    /* If it's a straight encapsulation, and the user supplied a
-	     * value for the entire option, use that.  Otherwise, search
-	     * the encapsulated space.
-	     *
-	     * If it's a limited encapsulation with preceding data, and the
-	     * user supplied values for the preceding bytes, search the
-	     * encapsulated space.
-	     */
-	    if ((option != NULL) &&
-		(((oc == NULL) && (option->format[0] == 'E')) ||
-		 ((oc != NULL) && (option->format[0] == 'e')))) {
-		static char *s, *t;
-		struct option_cache *tmp;
-		struct data_string name;
-
-		s = strchr (option->format, 'E');
-		if (s)
-		    t = strchr (++s, '.');
-		if (s && t) {
-		    memset (&name, 0, sizeof name);
-
-		    /* A zero-length universe name means the vendor
-		       option space, if one is defined. */
-		    if (t == s) {
-			if (vendor_cfg_option) {
-			    tmp = lookup_option (vendor_cfg_option -> universe,
-						 cfg_options,
-						 vendor_cfg_option -> code);
-			    if (tmp)
-				/* No need to check the return as we check name.len below */
-				(void) evaluate_option_cache (&name, packet, lease,
-							      client_state,
-							      in_options,
-							      cfg_options,
-							      scope, tmp, MDL);
-			} else if (vuname) {
-			    name.data = (unsigned char *)s;
-			    name.len = strlen (s);
-			}
-		    } else {
-			name.data = (unsigned char *)s;
-			name.len = t - s;
-		    }
-
-		    /* If we found a universe, and there are options configured
-		       for that universe, try to encapsulate it. */
-		    if (name.len) {
-			have_encapsulation =
-				(option_space_encapsulate
-				 (&encapsulation, packet, lease, client_state,
-				  in_options, cfg_options, scope, &name));
-		    }
-
-		    data_string_forget (&name, MDL);
-		}
-	    }
-
-	    /* In order to avoid memory leaks, we have to get to here
-	       with any option cache that we allocated in tmp not being
-	       referenced by tmp, and whatever option cache is referenced
-	       by oc being an actual reference.   lookup_option doesn't
-	       generate a reference (this needs to be fixed), so the
-	       preceding goop ensures that if we *didn't* generate a new
-	       option cache, oc still winds up holding an actual reference. */
-
-	    /* If no data is available for this option, skip it. */
-	    if (!oc && !have_encapsulation) {
-		    continue;
-	    }
-
 	    /* Find the value of the option... */
-	    od.len = 0;
-	    if (oc) {
-		/* No need to check the return as we check od.len below */
-		(void) evaluate_option_cache (&od, packet,
-					      lease, client_state, in_options,
-					      cfg_options, scope, oc, MDL);
-
-		/* If we have encapsulation for this option, and an oc
-		 * lookup succeeded, but the evaluation failed, it is
-		 * either because this is a complex atom (atoms before
-		 * E on format list) and the top half of the option is
-		 * not configured, or this is a simple encapsulated
-		 * space and the evaluator is giving us a NULL.  Prefer
-		 * the evaluator's opinion over the subspace.
-		 */
-		if (!od.len) {
-		    data_string_forget (&encapsulation, MDL);
-		    data_string_forget (&od, MDL);
+	    if (values != NULL) {
+		    if (where [code] < 0)
+			    continue;
+		    data_string_copy (&od, &values [where [code]].data, MDL);
+		    text = values [where [code]].text;
+	    } else if (!option_value (&od, &text, code, packet, lease,
+				      client_state, in_options, cfg_options,
+				      scope, vuname))
 		    continue;
-		}
-	    }
 
 	    /* We should now have a constant length for the option. */
 	    length = od.len;
-	    if (have_encapsulation) {
-		    length += encapsulation.len;
-
-		    /* od.len can be nonzero if we got here without an
-		     * oc (cache lookup failed), but did have an encapsulated
-		     * simple encapsulation space.
-		     */
-		    if (!od.len) {
-			    data_string_copy (&od, &encapsulation, MDL);
-			    data_string_forget (&encapsulation, MDL);
-		    } else {
-			    struct buffer *bp = (struct buffer *)0;
-			    if (!buffer_allocate (&bp, length, MDL)) {
-				    option_cache_dereference (&oc, MDL);
-				    data_string_forget (&od, MDL);
-				    data_string_forget (&encapsulation, MDL);
-				    continue;
-			    }
-			    memcpy (&bp -> data [0], od.data, od.len);
-			    memcpy (&bp -> data [od.len], encapsulation.data,
-				    encapsulation.len);
-			    data_string_forget (&od, MDL);
-			    data_string_forget (&encapsulation, MDL);
-			    od.data = &bp -> data [0];
-			    buffer_reference (&od.buffer, bp, MDL);
-			    buffer_dereference (&bp, MDL);
-			    od.len = length;
-			    od.terminated = 0;
-		    }
-	    }
 
 	    /* Do we add a NUL? */
-	    if (terminate && option && format_has_text(option->format)) {
+	    if (terminate && text) {
 		    length++;
 		    tto = 1;
 	    } else {
@@ -1572,9 +2040,17 @@ store_options(int *ocount,
 				memcpy (base + *pix + 2,
 					od.data + ix, (unsigned)(incr - 1));
 			    base [*pix + 2 + incr - 1] = 0;
+			    if (tpl)
+				option_template_chunk (tpl, code, ix,
+						       (base - buffer) +
+						       *pix + 2, incr - 1);
 		    } else {
 			    memcpy (base + *pix + 2,
 				    od.data + ix, (unsigned)incr);
+			    if (tpl)
+				option_template_chunk (tpl, code, ix,
+						       (base - buffer) +
+						       *pix + 2, incr);
 		    }
 		    length -= incr;
 		    ix += incr;
@@ -1583,9 +2059,6 @@ store_options(int *ocount,
 	    data_string_forget (&od, MDL);
 	}
 
-	if (option != NULL)
-	    option_dereference(&option, MDL);
-
 	/* If we can overload, and we have, then PAD and END those spaces. */
 	if (first_cutoff && six) {
 	    if ((first_cutoff + six + 1) < sbufend)
@@ -2493,6 +2966,17 @@ struct option_cache *lookup_hashed_option (universe, options, code)
 	return (struct option_cache *)0;
 }
 
+/* Option caches for data held in the copy of a received packet are
+   carved from that packet's arena. */
+static struct packet_arena *
+option_buffer_arena(struct option_state *options, struct buffer *bp)
+{
+	if (options->arena != NULL && bp != NULL &&
+	    bp == options->arena->buffer)
+		return options->arena;
+	return NULL;
+}
+
 /* Save a specified buffer into an option cache. */
 int
 save_option_buffer(struct universe *universe, struct option_state *options,
@@ -2503,7 +2987,9 @@ save_option_buffer(struct universe *universe, struct option_state *options,
 	int status = 1;
 
 	status = prepare_option_buffer(universe, bp, buffer, length, code,
-				       terminatep, &op);
+				       terminatep, option_buffer_arena(options,
+								       bp),
+				       &op);
 
 	if (status == 0)
 		goto cleanup;
@@ -2527,7 +3013,9 @@ append_option_buffer(struct universe *universe, struct option_state *options,
 	int status = 1;
 
 	status = prepare_option_buffer(universe, bp, buffer, length, code,
-				       terminatep, &op);
+				       terminatep, option_buffer_arena(options,
+								       bp),
+				       &op);
 
 	if (status == 0)
 		goto cleanup;
@@ -2545,7 +3033,8 @@ append_option_buffer(struct universe *universe, struct option_state *options,
 static int
 prepare_option_buffer(struct universe *universe, struct buffer *bp,
 		      unsigned char *buffer, unsigned length, unsigned code,
-		      int terminatep, struct option_cache **opp)
+		      int terminatep, struct packet_arena *arena,
+		      struct option_cache **opp)
 {
 	struct buffer *lbp = NULL;
 	struct option *option = NULL;
@@ -2598,7 +3087,7 @@ prepare_option_buffer(struct universe *universe, struct buffer *bp,
 		option->refcnt = 1;
 	}
 
-	if (!option_cache_allocate (opp, MDL)) {
+	if (!packet_arena_option_cache (opp, arena, MDL)) {
 		log_error("No memory for option code %s.%s.",
 			  universe->name, option->name);
 		status = 0;
@@ -2931,6 +3420,13 @@ int option_cache_dereference (ptr, file, line)
 		if ((*ptr) -> next)
 			option_cache_dereference (&((*ptr) -> next),
 						  file, line);
+		/* Caches carved from a packet arena go back with it. */
+		if ((*ptr) -> arena) {
+			packet_arena_dereference (&(*ptr) -> arena,
+						  file, line);
+			*ptr = (struct option_cache *)0;
+			return 1;
+		}
 		/* Put it back on the free list... */
 		(*ptr) -> expression = (struct expression *)free_option_caches;
 		free_option_caches = *ptr;
@@ -3818,6 +4314,392 @@ void hashed_option_space_foreach (struct packet *packet, struct lease *lease,
 	}
 }
 
+/*
+ * Indexed option storage.
+ *
+ * Option spaces with 8-bit codes, such as the DHCP space, keep their
+ * options in an array indexed by option code, so a lookup is one
+ * memory access rather than a walk down a hash chain.
+ */
+
+#define INDEXED_OPTION_COUNT 256
+
+struct option_cache *
+lookup_indexed_option(struct universe *universe, struct option_state *options,
+		      unsigned code)
+{
+	struct option_cache **array;
+
+	if (universe->index >= options->universe_count)
+		return NULL;
+	array = options->universes[universe->index];
+	if ((array == NULL) || (code >= INDEXED_OPTION_COUNT))
+		return NULL;
+	return array[code];
+}
+
+void
+save_indexed_option(struct universe *universe, struct option_state *options,
+		    struct option_cache *oc, isc_boolean_t appendp)
+{
+	struct option_cache **array, **ocloc;
+	unsigned code = oc->option->code;
+
+	if (oc->refcnt == 0)
+		abort();
+
+	if (code >= INDEXED_OPTION_COUNT) {
+		log_error("option %s.%s code %u out of range.",
+			  universe->name, oc->option->name, code);
+		return;
+	}
+
+	array = options->universes[universe->index];
+	if (array == NULL) {
+		array = dmalloc(INDEXED_OPTION_COUNT * sizeof(*array), MDL);
+		if (array == NULL) {
+			log_error("no memory to store %s.%s",
+				  universe->name, oc->option->name);
+			return;
+		}
+		options->universes[universe->index] = array;
+	}
+
+	/* If appendp is set, append the option onto the tail of the ->next
+	   list, otherwise replace what was there. */
+	ocloc = &array[code];
+	if (*ocloc != NULL) {
+		if (appendp) {
+			do {
+				ocloc = &(*ocloc)->next;
+			} while (*ocloc != NULL);
+		} else {
+			option_cache_dereference(ocloc, MDL);
+		}
+	}
+	option_cache_reference(ocloc, oc, MDL);
+}
+
+void
+delete_indexed_option(struct universe *universe, struct option_state *options,
+		      int code)
+{
+	struct option_cache **array = options->universes[universe->index];
+
+	if ((array == NULL) || (code < 0) || (code >= INDEXED_OPTION_COUNT))
+		return;
+	if (array[code] != NULL)
+		option_cache_dereference(&array[code], MDL);
+}
+
+int
+indexed_option_state_dereference(struct universe *universe,
+				 struct option_state *state,
+				 const char *file, int line)
+{
+	struct option_cache **array = state->universes[universe->index];
+	int i;
+
+	if (array == NULL)
+		return 0;
+
+	for (i = 0; i < INDEXED_OPTION_COUNT; i++) {
+		if (array[i] != NULL)
+			option_cache_dereference(&array[i], file, line);
+	}
+
+	dfree(array, file, line);
+	state->universes[universe->index] = NULL;
+	return 1;
+}
+
+int
+indexed_option_space_encapsulate(struct data_string *result,
+				 struct packet *packet, struct lease *lease,
+				 struct client_state *client_state,
+				 struct option_state *in_options,
+				 struct option_state *cfg_options,
+				 struct binding_scope **scope,
+				 struct universe *universe)
+{
+	struct option_cache **array;
+	int status = 0;
+	int i;
+
+	if (universe->index >= cfg_options->universe_count)
+		return 0;
+	array = cfg_options->universes[universe->index];
+	if (array == NULL)
+		return 0;
+
+	for (i = 0; i < INDEXED_OPTION_COUNT; i++) {
+		if ((array[i] != NULL) &&
+		    store_option(result, universe, packet, lease,
+				 client_state, in_options, cfg_options,
+				 scope, array[i]))
+			status = 1;
+	}
+
+	if (search_subencapsulation(result, packet, lease, client_state,
+				    in_options, cfg_options, scope, universe))
+		status = 1;
+
+	return status;
+}
+
+void
+indexed_option_space_foreach(struct packet *packet, struct lease *lease,
+			     struct client_state *client_state,
+			     struct option_state *in_options,
+			     struct option_state *cfg_options,
+			     struct binding_scope **scope,
+			     struct universe *u, void *stuff,
+			     void (*func) (struct option_cache *,
+					   struct packet *,
+					   struct lease *,
+					   struct client_state *,
+					   struct option_state *,
+					   struct option_state *,
+					   struct binding_scope **,
+					   struct universe *, void *))
+{
+	struct option_cache **array;
+	int i;
+
+	if (cfg_options->universe_count <= u->index)
+		return;
+	array = cfg_options->universes[u->index];
+	if (array == NULL)
+		return;
+
+	for (i = 0; i < INDEXED_OPTION_COUNT; i++) {
+		if (array[i] != NULL)
+			(*func)(array[i], packet, lease, client_state,
+				in_options, cfg_options, scope, u, stuff);
+	}
+}
+
+/*
+ * Sorted option storage.
+ *
+ * Option spaces with wider codes, such as the DHCPv6 space, keep their
+ * options in a vector sorted by option code and found by binary search.
+ * An option state rarely holds more than a few dozen options from one
+ * space, so this is smaller than a hash table and quicker to search.
+ */
+
+struct option_vector {
+	int count;
+	int max;
+	struct option_cache **options;
+};
+
+/* Return the index of code in vec, or of where it would be inserted. */
+static int
+option_vector_find(struct option_vector *vec, unsigned code, int *found)
+{
+	int lo = 0, hi = vec->count, mid;
+	unsigned mcode;
+
+	*found = 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		mcode = vec->options[mid]->option->code;
+		if (mcode == code) {
+			*found = 1;
+			return mid;
+		}
+		if (mcode < code)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+struct option_cache *
+lookup_sorted_option(struct universe *universe, struct option_state *options,
+		     unsigned code)
+{
+	struct option_vector *vec;
+	int i, found;
+
+	if (universe->index >= options->universe_count)
+		return NULL;
+	vec = options->universes[universe->index];
+	if (vec == NULL)
+		return NULL;
+
+	i = option_vector_find(vec, code, &found);
+	return (found ? vec->options[i] : NULL);
+}
+
+void
+save_sorted_option(struct universe *universe, struct option_state *options,
+		   struct option_cache *oc, isc_boolean_t appendp)
+{
+	struct option_vector *vec;
+	struct option_cache **ocloc, **grown;
+	int i, found;
+
+	if (oc->refcnt == 0)
+		abort();
+
+	vec = options->universes[universe->index];
+	if (vec == NULL) {
+		vec = dmalloc(sizeof(*vec), MDL);
+		if (vec == NULL) {
+			log_error("no memory to store %s.%s",
+				  universe->name, oc->option->name);
+			return;
+		}
+		options->universes[universe->index] = vec;
+	}
+
+	i = option_vector_find(vec, oc->option->code, &found);
+	if (found) {
+		/* If appendp is set, append the option onto the tail of
+		   the ->next list, otherwise replace what was there. */
+		ocloc = &vec->options[i];
+		if (appendp) {
+			do {
+				ocloc = &(*ocloc)->next;
+			} while (*ocloc != NULL);
+		} else {
+			option_cache_dereference(ocloc, MDL);
+		}
+		option_cache_reference(ocloc, oc, MDL);
+		return;
+	}
+
+	if (vec->count == vec->max) {
+		grown = dmalloc((vec->max ? vec->max * 2 : 8) *
+				sizeof(*grown), MDL);
+		if (grown == NULL) {
+			log_error("no memory to store %s.%s",
+				  universe->name, oc->option->name);
+			return;
+		}
+		if (vec->options != NULL) {
+			memcpy(grown, vec->options,
+			       vec->count * sizeof(*grown));
+			dfree(vec->options, MDL);
+		}
+		vec->options = grown;
+		vec->max = vec->max ? vec->max * 2 : 8;
+	}
+
+	memmove(&vec->options[i + 1], &vec->options[i],
+		(vec->count - i) * sizeof(vec->options[0]));
+	vec->options[i] = NULL;
+	vec->count++;
+	option_cache_reference(&vec->options[i], oc, MDL);
+}
+
+void
+delete_sorted_option(struct universe *universe, struct option_state *options,
+		     int code)
+{
+	struct option_vector *vec = options->universes[universe->index];
+	int i, found;
+
+	if (vec == NULL)
+		return;
+
+	i = option_vector_find(vec, code, &found);
+	if (!found)
+		return;
+
+	option_cache_dereference(&vec->options[i], MDL);
+	memmove(&vec->options[i], &vec->options[i + 1],
+		(vec->count - i - 1) * sizeof(vec->options[0]));
+	vec->count--;
+	vec->options[vec->count] = NULL;
+}
+
+int
+sorted_option_state_dereference(struct universe *universe,
+				struct option_state *state,
+				const char *file, int line)
+{
+	struct option_vector *vec = state->universes[universe->index];
+	int i;
+
+	if (vec == NULL)
+		return 0;
+
+	for (i = 0; i < vec->count; i++)
+		option_cache_dereference(&vec->options[i], file, line);
+	if (vec->options != NULL)
+		dfree(vec->options, file, line);
+	dfree(vec, file, line);
+	state->universes[universe->index] = NULL;
+	return 1;
+}
+
+int
+sorted_option_space_encapsulate(struct data_string *result,
+				struct packet *packet, struct lease *lease,
+				struct client_state *client_state,
+				struct option_state *in_options,
+				struct option_state *cfg_options,
+				struct binding_scope **scope,
+				struct universe *universe)
+{
+	struct option_vector *vec;
+	int status = 0;
+	int i;
+
+	if (universe->index >= cfg_options->universe_count)
+		return 0;
+	vec = cfg_options->universes[universe->index];
+	if (vec == NULL)
+		return 0;
+
+	for (i = 0; i < vec->count; i++) {
+		if (store_option(result, universe, packet, lease,
+				 client_state, in_options, cfg_options,
+				 scope, vec->options[i]))
+			status = 1;
+	}
+
+	if (search_subencapsulation(result, packet, lease, client_state,
+				    in_options, cfg_options, scope, universe))
+		status = 1;
+
+	return status;
+}
+
+void
+sorted_option_space_foreach(struct packet *packet, struct lease *lease,
+			    struct client_state *client_state,
+			    struct option_state *in_options,
+			    struct option_state *cfg_options,
+			    struct binding_scope **scope,
+			    struct universe *u, void *stuff,
+			    void (*func) (struct option_cache *,
+					  struct packet *,
+					  struct lease *,
+					  struct client_state *,
+					  struct option_state *,
+					  struct option_state *,
+					  struct binding_scope **,
+					  struct universe *, void *))
+{
+	struct option_vector *vec;
+	int i;
+
+	if (cfg_options->universe_count <= u->index)
+		return;
+	vec = cfg_options->universes[u->index];
+	if (vec == NULL)
+		return;
+
+	for (i = 0; i < vec->count; i++)
+		(*func)(vec->options[i], packet, lease, client_state,
+			in_options, cfg_options, scope, u, stuff);
+}
+
 void
 save_linked_option(struct universe *universe, struct option_state *options,
 		   struct option_cache *oc, isc_boolean_t appendp)
@@ -4038,6 +4920,16 @@ void do_packet (interface, packet, len, from_port, from, hfrom)
 		return;
 	}
 
+	/* Parse the options into the packet's arena. */
+	if (!packet_arena_allocate(&decoded_packet->arena,
+				   (unsigned char *)packet, len, MDL)) {
+		log_error("do_packet: no memory for packet arena.");
+		packet_dereference(&decoded_packet, MDL);
+		return;
+	}
+	packet_arena_reference(&decoded_packet->options->arena,
+			       decoded_packet->arena, MDL);
+
 	/* If there's an option buffer, try to parse it. */
 	if (decoded_packet->packet_length >= DHCP_FIXED_NON_UDP + 4) {
 		if (!parse_options(decoded_packet)) {
@@ -4069,6 +4961,10 @@ void do_packet (interface, packet, len, from_port, from, hfrom)
 			bootp(decoded_packet);
 	}
 
+	/* The receive buffer is about to be reused; nothing more can be
+	   parsed out of it into the arena. */
+	decoded_packet->arena->raw = NULL;
+
 	/* If the caller kept the packet, they'll have upped the refcnt. */
 	packet_dereference(&decoded_packet, MDL);
 
@@ -4140,6 +5036,16 @@ do_packet6(struct interface_info *interface, const char *packet,
 		return;
 	}
 
+	if (!packet_arena_allocate(&decoded_packet->arena,
+				   (const unsigned char *)packet,
+				   (unsigned)len, MDL)) {
+		log_error("do_packet6: no memory for packet arena.");
+		packet_dereference(&decoded_packet, MDL);
+		return;
+	}
+	packet_arena_reference(&decoded_packet->options->arena,
+			       decoded_packet->arena, MDL);
+
 	/* IPv4 information, already set to 0 */
 	/* decoded_packet->packet_type = 0; */
 	/* memset(&decoded_packet->haddr, 0, sizeof(decoded_packet->haddr)); */
@@ -4221,6 +5127,7 @@ do_packet6(struct interface_info *interface, const char *packet,
 
 	dhcpv6(decoded_packet);
 
+	decoded_packet->arena->raw = NULL;
 	packet_dereference(&decoded_packet, MDL);
 
 #if defined (DEBUG_MEMORY_LEAKAGE)
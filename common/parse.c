@@ -2480,7 +2480,8 @@ int parse_executable_statement (result, cfile, lose, case_context)
 		if (!parse_semi (cfile)) {
 			*lose = 1;
 			executable_statement_dereference (result, MDL);
-		}
+		} else
+			optimize_statement (result);
 		break;
 
 	      case EXECUTE:
@@ -3243,6 +3244,7 @@ int parse_switch_statement (result, cfile, lose)
 		parse_warn (cfile, "right brace expected.");
 		goto pfui;
 	}
+	optimize_statement (result);
 	return 1;
 }
 
@@ -3331,6 +3333,8 @@ int parse_if_statement (result, cfile, lose)
 #if defined (DEBUG_EXPRESSION_PARSE)
 	print_expression ("if condition", (*result) -> data.ie.expr);
 #endif
+	fold_expression (&(*result) -> data.ie.expr);
+	compile_expression ((*result) -> data.ie.expr, context_boolean);
 	if (parenp) {
 		token = next_token (&val, (unsigned *)0, cfile);
 		if (token != RPAREN) {
@@ -3419,7 +3423,8 @@ int parse_if_statement (result, cfile, lose)
 		}
 	} else
 		(*result) -> data.ie.fc = (struct executable_statement *)0;
-	
+
+	optimize_statement (result);
 	return 1;
 }
 
@@ -4916,6 +4921,7 @@ int parse_option_statement (result, cfile, lookups, option, op)
 			}
 			return 0;
 		}
+		compile_expression (expr, context_data);
 	} else {
 		if (! parse_option_data(&expr, cfile, lookups, option))
 			return 0;
@@ -4930,6 +4936,8 @@ int parse_option_statement (result, cfile, lookups, option, op)
 	if (expr && !option_cache (&(*result)->data.option,
 				   NULL, expr, option, MDL))
 		log_fatal ("no memory for option cache");
+	if (expr && is_constant_expression (expr))
+		(*result)->data.option->flags |= OPTION_CONSTANT;
 
 	if (expr)
 		expression_dereference (&expr, MDL);
@@ -350,6 +350,7 @@ void hash_dump (table)
 	if (!table)
 		return;
 
+	finish_hash_resize (table);
 	for (i = 0; i < table -> hash_count; i++) {
 		if (!table -> buckets [i])
 			continue;
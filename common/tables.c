@@ -1092,13 +1092,13 @@ void initialize_common_option_spaces()
 	/* Set up the DHCP option universe... */
 	dhcp_universe.name = "dhcp";
 	dhcp_universe.concat_duplicates = 1;
-	dhcp_universe.lookup_func = lookup_hashed_option;
+	dhcp_universe.lookup_func = lookup_indexed_option;
 	dhcp_universe.option_state_dereference =
-		hashed_option_state_dereference;
-	dhcp_universe.save_func = save_hashed_option;
-	dhcp_universe.delete_func = delete_hashed_option;
-	dhcp_universe.encapsulate = hashed_option_space_encapsulate;
-	dhcp_universe.foreach = hashed_option_space_foreach;
+		indexed_option_state_dereference;
+	dhcp_universe.save_func = save_indexed_option;
+	dhcp_universe.delete_func = delete_indexed_option;
+	dhcp_universe.encapsulate = indexed_option_space_encapsulate;
+	dhcp_universe.foreach = indexed_option_space_foreach;
 	dhcp_universe.decode = parse_option_buffer;
 	dhcp_universe.length_size = 1;
 	dhcp_universe.tag_size = 1;
@@ -1367,13 +1367,13 @@ void initialize_common_option_spaces()
 	/* Set up the DHCPv6 root universe. */
 	dhcpv6_universe.name = "dhcp6";
 	dhcpv6_universe.concat_duplicates = 0;
-	dhcpv6_universe.lookup_func = lookup_hashed_option;
+	dhcpv6_universe.lookup_func = lookup_sorted_option;
 	dhcpv6_universe.option_state_dereference =
-		hashed_option_state_dereference;
-	dhcpv6_universe.save_func = save_hashed_option;
-	dhcpv6_universe.delete_func = delete_hashed_option;
-	dhcpv6_universe.encapsulate = hashed_option_space_encapsulate;
-	dhcpv6_universe.foreach = hashed_option_space_foreach;
+		sorted_option_state_dereference;
+	dhcpv6_universe.save_func = save_sorted_option;
+	dhcpv6_universe.delete_func = delete_sorted_option;
+	dhcpv6_universe.encapsulate = sorted_option_space_encapsulate;
+	dhcpv6_universe.foreach = sorted_option_space_foreach;
 	dhcpv6_universe.decode = parse_option_buffer;
 	dhcpv6_universe.length_size = 2;
 	dhcpv6_universe.tag_size = 2;
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2020 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.	 IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+#include <atf-c.h>
+#include "dhcpd.h"
+
+/* Expressions covering the operators the stack machine implements, some
+ * it hands back to the tree walker, and ways for each to fail. */
+static const struct {
+    const char *text;
+    enum expression_context context;
+} expressions[] = {
+    { "substring(option dhcp-client-identifier, 1, 3)", context_data },
+    { "substring(option host-name, 20, 2)", context_data },
+    { "substring(option domain-name, 0, 2)", context_data },
+    { "suffix(option host-name, 4)", context_data },
+    { "suffix(option host-name, 40)", context_data },
+    { "lcase(substring(option host-name, 0, 6))", context_data },
+    { "ucase(concat(option host-name, \"-x\"))", context_data },
+    { "concat(\"a\", option host-name, \"b\")", context_data },
+    { "concat(option host-name, option domain-name)", context_data },
+    { "binary-to-ascii(16, 8, \":\", substring(hardware, 1, 6))",
+      context_data },
+    { "binary-to-ascii(10, 8, \".\", leased-address)", context_data },
+    { "binary-to-ascii(10, 16, \"-\", option dhcp-client-identifier)",
+      context_data },
+    { "binary-to-ascii(10, 12, \"-\", hardware)", context_data },
+    { "reverse(1, substring(hardware, 1, 6))", context_data },
+    { "reverse(2, hardware)", context_data },
+    { "pick-first-value(option domain-name, option host-name)",
+      context_data },
+    { "pick-first-value(option domain-name, "
+      "config-option domain-name-servers)", context_data },
+    { "pick-first-value(option domain-name, option nis-domain)",
+      context_data },
+    { "encode-int(extract-int(option dhcp-client-identifier, 16), 32)",
+      context_data },
+    { "encode-int(extract-int(option host-name, 8), 8)", context_data },
+    { "concat(packet(0, 4), packet(1000, 4))", context_data },
+    { "concat(packet(0, 4), packet(236, 8))", context_data },
+    { "concat(packet(0, 4), \"x\")", context_data },
+    { "concat(leased-address, host-decl-name)", context_data },
+    { "concat(option vendor-class-identifier, \"/\", filename)",
+      context_data },
+    { "concat(option vendor-class-identifier, \"/\", "
+      "pick-first-value(filename, option host-name))", context_data },
+    { "option host-name = \"Client-Host\"", context_boolean },
+    { "substring(option host-name, 0, 6) = \"Client\" and not known",
+      context_boolean },
+    { "exists host-name and exists domain-name", context_boolean },
+    { "exists domain-name or static", context_boolean },
+    { "option domain-name = option nis-domain", context_boolean },
+    { "option host-name = option domain-name", context_boolean },
+    { "extract-int(option dhcp-client-identifier, 8) = 1",
+      context_boolean },
+    { "not (option host-name = \"x\")", context_boolean },
+    { "known or option host-name = \"Client-Host\"", context_boolean },
+    { "not (known and static)", context_boolean },
+    { "option vendor-class-identifier = \"eth0\" or option host-name = \"x\"",
+      context_boolean },
+    { "extract-int(substring(option dhcp-client-identifier, 1, 4), 32)",
+      context_numeric }
+};
+
+static struct packet *packet;
+static struct option_state *cfg_options;
+static struct lease lease;
+
+/* A packet with a few options, configuration options and a lease to
+ * evaluate the expressions against. */
+static void
+setup(void)
+{
+    static struct dhcp_packet raw;
+    unsigned char host_name[] = "Client-Host";
+    unsigned char client_id[] = { 1, 0, 1, 2, 3, 4, 5 };
+    unsigned char vendor_class[] = "eth0";
+    unsigned char servers[] = { 10, 0, 0, 1 };
+
+    initialize_common_option_spaces();
+
+    memset(&raw, 0, sizeof(raw));
+    raw.op = BOOTREQUEST;
+    raw.htype = HTYPE_ETHER;
+    raw.hlen = 6;
+    memcpy(raw.chaddr, client_id + 1, 6);
+
+    if (!packet_allocate(&packet, MDL) ||
+	!option_state_allocate(&packet->options, MDL) ||
+	!option_state_allocate(&cfg_options, MDL)) {
+	atf_tc_fail("can't allocate packet");
+    }
+    packet->raw = &raw;
+    packet->packet_length = DHCP_FIXED_NON_UDP;
+
+    if (!save_option_buffer(&dhcp_universe, packet->options, NULL,
+			    host_name, sizeof(host_name) - 1,
+			    DHO_HOST_NAME, 0) ||
+	!save_option_buffer(&dhcp_universe, packet->options, NULL,
+			    client_id, sizeof(client_id),
+			    DHO_DHCP_CLIENT_IDENTIFIER, 0) ||
+	!save_option_buffer(&dhcp_universe, packet->options, NULL,
+			    vendor_class, sizeof(vendor_class) - 1,
+			    DHO_VENDOR_CLASS_IDENTIFIER, 0) ||
+	!save_option_buffer(&dhcp_universe, cfg_options, NULL,
+			    servers, sizeof(servers),
+			    DHO_DOMAIN_NAME_SERVERS, 0)) {
+	atf_tc_fail("can't save options");
+    }
+
+    memset(&lease, 0, sizeof(lease));
+    lease.ip_addr.len = 4;
+    memcpy(lease.ip_addr.iabuf, servers, 4);
+}
+
+static struct expression *
+parse(const char *text, enum expression_context context)
+{
+    struct parse *cfile = NULL;
+    struct expression *expr = NULL;
+    char buf[200];
+    int lose = 0, status;
+
+    strcpy(buf, text);
+    if (new_parse(&cfile, -1, buf, strlen(buf), "test", 0) !=
+	ISC_R_SUCCESS) {
+	atf_tc_fail("can't start parse");
+    }
+    if (context == context_boolean)
+	status = parse_boolean_expression(&expr, cfile, &lose);
+    else if (context == context_numeric)
+	status = parse_numeric_expression(&expr, cfile, &lose);
+    else
+	status = parse_data_expression(&expr, cfile, &lose);
+    end_parse(&cfile);
+
+    if (!status) {
+	atf_tc_fail("can't parse %s", text);
+    }
+    return expr;
+}
+
+/* Evaluate an expression into a printable form: "NULL" if evaluation
+ * fails, otherwise the type and value. */
+static void
+evaluate(struct expression *expr, enum expression_context context,
+	 char *out, size_t outlen)
+{
+    struct data_string data;
+    unsigned long num = 0;
+    int result = 0;
+
+    memset(&data, 0, sizeof(data));
+    if (context == context_boolean) {
+	if (evaluate_boolean_expression(&result, packet, &lease, NULL,
+					packet->options, cfg_options,
+					NULL, expr))
+	    snprintf(out, outlen, "bool %d", result);
+	else
+	    snprintf(out, outlen, "NULL");
+    } else if (context == context_numeric) {
+	if (evaluate_numeric_expression(&num, packet, &lease, NULL,
+					packet->options, cfg_options,
+					NULL, expr))
+	    snprintf(out, outlen, "num %lu", num);
+	else
+	    snprintf(out, outlen, "NULL");
+    } else {
+	if (evaluate_data_expression(&data, packet, &lease, NULL,
+				     packet->options, cfg_options,
+				     NULL, expr, MDL)) {
+	    snprintf(out, outlen, "data %d %s", data.terminated,
+		     print_hex_1(data.len, data.data, 60));
+	    if (data.terminated && data.data[data.len] != 0)
+		snprintf(out, outlen, "unterminated");
+	    data_string_forget(&data, MDL);
+	} else
+	    snprintf(out, outlen, "NULL");
+    }
+}
+
+ATF_TC(compiled_expressions);
+
+ATF_TC_HEAD(compiled_expressions, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify compiled expressions give the same results "
+		      "as the tree walker.");
+}
+
+ATF_TC_BODY(compiled_expressions, tc)
+{
+    struct expression *expr;
+    char tree[400], compiled[400];
+    int i;
+
+    setup();
+
+    for (i = 0; i < sizeof(expressions) / sizeof(expressions[0]); i++) {
+	expr = parse(expressions[i].text, expressions[i].context);
+
+	evaluate(expr, expressions[i].context, tree, sizeof(tree));
+	compile_expression(expr, expressions[i].context);
+	if (expr->program == NULL) {
+	    atf_tc_fail("%s wasn't compiled", expressions[i].text);
+	}
+	evaluate(expr, expressions[i].context, compiled, sizeof(compiled));
+
+	if (strcmp(tree, compiled) != 0) {
+	    atf_tc_fail("%s: tree walker gives %s, compiled %s",
+			expressions[i].text, tree, compiled);
+	}
+	expression_dereference(&expr, MDL);
+    }
+
+    option_state_dereference(&cfg_options, MDL);
+    packet_dereference(&packet, MDL);
+}
+
+static struct executable_statement *
+parse_statements(const char *text)
+{
+    struct parse *cfile = NULL;
+    struct executable_statement *stmt = NULL;
+    char buf[600];
+    int lose = 0;
+
+    strcpy(buf, text);
+    if (new_parse(&cfile, -1, buf, strlen(buf), "test", 0) !=
+	ISC_R_SUCCESS) {
+	atf_tc_fail("can't start parse");
+    }
+    if (!parse_executable_statements(&stmt, cfile, &lose, context_any) ||
+	stmt == NULL) {
+	atf_tc_fail("can't parse %s", text);
+    }
+    end_parse(&cfile);
+    return stmt;
+}
+
+/* Run statements and return the domain-name they set, or "-". */
+static void
+run_statements(struct executable_statement *stmt, const char *host_name,
+	       char *out, size_t outlen)
+{
+    struct option_state *options = NULL;
+    struct option_cache *oc;
+    struct data_string data;
+
+    delete_option(&dhcp_universe, packet->options, DHO_HOST_NAME);
+    if (!save_option_buffer(&dhcp_universe, packet->options, NULL,
+			    (unsigned char *)host_name, strlen(host_name),
+			    DHO_HOST_NAME, 0) ||
+	!option_state_allocate(&options, MDL)) {
+	atf_tc_fail("can't set up options");
+    }
+
+    execute_statements(NULL, packet, &lease, NULL, packet->options,
+		       options, NULL, stmt, NULL);
+
+    memset(&data, 0, sizeof(data));
+    oc = lookup_option(&dhcp_universe, options, DHO_DOMAIN_NAME);
+    if (oc != NULL &&
+	evaluate_option_cache(&data, packet, &lease, NULL, packet->options,
+			      options, NULL, oc, MDL)) {
+	snprintf(out, outlen, "%.*s", (int)data.len, data.data);
+	data_string_forget(&data, MDL);
+    } else
+	snprintf(out, outlen, "-");
+    option_state_dereference(&options, MDL);
+}
+
+/* Statements whose outcome is known when they are read, which must
+ * always set the domain-name given, and switches with enough constant
+ * cases to get a case table. */
+static const struct {
+    const char *text;
+    enum statement_op op;
+    int table;
+    const char *result;
+} statements[] = {
+    { "if concat(\"a\", \"b\") = substring(\"xab\", 1, 2) "
+      "{ supersede domain-name \"yes\"; } "
+      "else { supersede domain-name \"no\"; }",
+      statements_statement, 0, "yes" },
+    { "if \"a\" = \"b\" { supersede domain-name \"yes\"; }",
+      statements_statement, 0, "-" },
+    { "if option host-name = concat(\"h\", \"2\") "
+      "{ supersede domain-name \"yes\"; }",
+      if_statement, 0, NULL },
+    { "switch (ucase(\"b\")) { case \"A\": supersede domain-name \"a\"; "
+      "case \"B\": supersede domain-name \"b\"; break; "
+      "default: supersede domain-name \"d\"; }",
+      statements_statement, 0, "b" },
+    { "switch (option host-name) { "
+      "case \"h1\": supersede domain-name \"one\"; break; "
+      "case concat(\"h\", \"2\"): supersede domain-name \"two\"; "
+      "case \"h3\": supersede domain-name \"three\"; break; "
+      "default: supersede domain-name \"other\"; break; "
+      "case \"h1\": supersede domain-name \"again\"; break; "
+      "case \"\": supersede domain-name \"empty\"; break; "
+      "case lcase(\"H5\"): supersede domain-name \"five\"; }",
+      switch_statement, 1, NULL },
+    { "switch (option host-name) { "
+      "case \"h1\": supersede domain-name \"one\"; break; "
+      "case \"h2\": supersede domain-name \"two\"; break; "
+      "case \"h3\": supersede domain-name \"three\"; break; "
+      "case \"h4\": supersede domain-name \"four\"; }",
+      switch_statement, 1, NULL },
+    { "switch (extract-int(suffix(option host-name, 1), 8)) { "
+      "case 49: supersede domain-name \"one\"; break; "
+      "case 48 + 2: supersede domain-name \"two\"; break; "
+      "case 51: supersede domain-name \"three\"; break; "
+      "case 104: supersede domain-name \"h\"; break; "
+      "default: supersede domain-name \"other\"; }",
+      switch_statement, 1, NULL },
+    { "switch (option host-name) { "
+      "case \"h1\": supersede domain-name \"one\"; break; "
+      "case \"h2\": supersede domain-name \"two\"; break; "
+      "case option domain-name: supersede domain-name \"dn\"; break; "
+      "case \"h4\": supersede domain-name \"four\"; break; "
+      "case \"h5\": supersede domain-name \"five\"; }",
+      switch_statement, 0, NULL }
+};
+
+static const char *host_names[] = {
+    "h1", "h2", "h3", "h4", "h5", "h", "", "x1", "example.com"
+};
+
+ATF_TC(optimized_statements);
+
+ATF_TC_HEAD(optimized_statements, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify statements folded or given a case table when "
+		      "read run as they would have.");
+}
+
+ATF_TC_BODY(optimized_statements, tc)
+{
+    struct executable_statement *stmt;
+    struct switch_table *table;
+    char expect[100], result[100];
+    const char *text;
+    int i, j;
+
+    setup();
+
+    for (i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+	text = statements[i].text;
+	stmt = parse_statements(text);
+	if (stmt->op != statements[i].op) {
+	    atf_tc_fail("%s: statement type %d, expected %d", text,
+			stmt->op, statements[i].op);
+	}
+	table = NULL;
+	if (stmt->op == switch_statement) {
+	    table = stmt->data.s_switch.table;
+	    if ((table != NULL) != statements[i].table) {
+		atf_tc_fail("%s: %s case table", text,
+			    table ? "unexpected" : "no");
+	    }
+	}
+
+	for (j = 0; j < sizeof(host_names) / sizeof(host_names[0]); j++) {
+	    /* Without its table, a switch checks each case in turn. */
+	    if (table != NULL) {
+		stmt->data.s_switch.table = NULL;
+		run_statements(stmt, host_names[j], expect, sizeof(expect));
+		stmt->data.s_switch.table = table;
+	    } else if (statements[i].result != NULL) {
+		strcpy(expect, statements[i].result);
+	    } else {
+		continue;
+	    }
+	    run_statements(stmt, host_names[j], result, sizeof(result));
+	    if (strcmp(expect, result) != 0) {
+		atf_tc_fail("%s: with %s, gives %s, expected %s", text,
+			    host_names[j], result, expect);
+	    }
+	}
+	executable_statement_dereference(&stmt, MDL);
+    }
+
+    option_state_dereference(&cfg_options, MDL);
+    packet_dereference(&packet, MDL);
+}
+
+/* This macro defines main() method that will call specified
+   test cases. tp and simple_test_case names can be whatever you want
+   as long as it is a valid variable identifier. */
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, compiled_expressions);
+    ATF_TP_ADD_TC(tp, optimized_statements);
+
+    return (atf_no_error());
+}
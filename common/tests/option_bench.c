@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.	 IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Option storage microbenchmark.
+ *
+ * Times saving options into an option state, looking them up and freeing
+ * the state for the DHCP and DHCPv6 option spaces, both with the storage
+ * those spaces use and with the hashed storage other spaces use.  Not run
+ * as part of the unit tests; build it with "make option_bench" and run it
+ * with an optional iteration count.
+ */
+
+#include <config.h>
+#include <sys/time.h>
+#include "dhcpd.h"
+
+/* Options a typical DHCPv4 request and response carry. */
+static unsigned v4_codes[] = {
+	DHO_SUBNET_MASK, DHO_ROUTERS, DHO_DOMAIN_NAME_SERVERS, DHO_HOST_NAME,
+	DHO_DOMAIN_NAME, DHO_DHCP_REQUESTED_ADDRESS, DHO_DHCP_LEASE_TIME,
+	DHO_DHCP_MESSAGE_TYPE, DHO_DHCP_SERVER_IDENTIFIER,
+	DHO_DHCP_PARAMETER_REQUEST_LIST, DHO_DHCP_MAX_MESSAGE_SIZE,
+	DHO_DHCP_RENEWAL_TIME, DHO_DHCP_REBINDING_TIME,
+	DHO_VENDOR_CLASS_IDENTIFIER, DHO_DHCP_CLIENT_IDENTIFIER, DHO_FQDN
+};
+
+/* Options a typical DHCPv6 request and response carry. */
+static unsigned v6_codes[] = {
+	D6O_CLIENTID, D6O_SERVERID, D6O_IA_NA, D6O_ORO, D6O_ELAPSED_TIME,
+	D6O_RAPID_COMMIT, D6O_USER_CLASS, D6O_VENDOR_CLASS, D6O_VENDOR_OPTS,
+	D6O_RECONF_ACCEPT, D6O_NAME_SERVERS, D6O_DOMAIN_SEARCH, D6O_IA_PD,
+	D6O_CLIENT_FQDN
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static double
+now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* The option state is freed through the universe first, since a copy
+   given hashed storage uses the index of the universe it copies. */
+static void
+release(struct universe *u, struct option_state **options) {
+	(*u->option_state_dereference)(u, *options, MDL);
+	option_state_dereference(options, MDL);
+}
+
+static struct option_state *
+build(struct universe *u, unsigned *codes, int count) {
+	struct option_state *options = NULL;
+	unsigned char data[4] = { 1, 2, 3, 4 };
+	int i;
+
+	if (!option_state_allocate(&options, MDL))
+		log_fatal("can't allocate option state");
+	for (i = 0; i < count; i++) {
+		if (!save_option_buffer(u, options, NULL, data, sizeof(data),
+					codes[i], 0))
+			log_fatal("can't save option %u", codes[i]);
+	}
+	return options;
+}
+
+static void
+bench(const char *name, struct universe *u, unsigned *codes, int count,
+      unsigned max_code, long iterations) {
+	struct option_state *options;
+	double start, lookup, save;
+	unsigned code;
+	long i, found = 0;
+
+	options = build(u, codes, count);
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		/* Half the lookups are for options that are there. */
+		if (i & 1)
+			code = codes[(i >> 1) % count];
+		else
+			code = (i >> 1) % max_code;
+		if (lookup_option(u, options, code) != NULL)
+			found++;
+	}
+	lookup = now() - start;
+	release(u, &options);
+
+	start = now();
+	for (i = 0; i < iterations / count; i++) {
+		options = build(u, codes, count);
+		release(u, &options);
+	}
+	save = now() - start;
+
+	printf("%-16s %8.1f ns/lookup %8.1f ns/save+free (%ld found)\n",
+	       name, lookup * 1e9 / iterations,
+	       save * 1e9 / ((iterations / count) * count), found);
+}
+
+/* Give a copy of a universe the hashed storage functions. */
+static void
+make_hashed(struct universe *hashed, struct universe *u) {
+	*hashed = *u;
+	hashed->lookup_func = lookup_hashed_option;
+	hashed->save_func = save_hashed_option;
+	hashed->delete_func = delete_hashed_option;
+	hashed->option_state_dereference = hashed_option_state_dereference;
+	hashed->encapsulate = hashed_option_space_encapsulate;
+	hashed->foreach = hashed_option_space_foreach;
+}
+
+int
+main(int argc, char **argv) {
+	struct universe hashed;
+	long iterations = 10000000;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+	if (iterations < 100)
+		iterations = 100;
+
+	initialize_common_option_spaces();
+
+	bench("dhcp", &dhcp_universe, v4_codes, COUNT(v4_codes), 256,
+	      iterations);
+	make_hashed(&hashed, &dhcp_universe);
+	bench("dhcp (hashed)", &hashed, v4_codes, COUNT(v4_codes), 256,
+	      iterations);
+
+	bench("dhcp6", &dhcpv6_universe, v6_codes, COUNT(v6_codes), 128,
+	      iterations);
+	make_hashed(&hashed, &dhcpv6_universe);
+	bench("dhcp6 (hashed)", &hashed, v6_codes, COUNT(v6_codes), 128,
+	      iterations);
+
+	return 0;
+}
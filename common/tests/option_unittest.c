@@ -130,6 +130,205 @@ ATF_TC_BODY(pretty_print_option, tc)
 }
 
 
+ATF_TC(cons_options_template);
+
+ATF_TC_HEAD(cons_options_template, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify cons_options gives the same result from a "
+		      "template as without one.");
+}
+
+/* Build an option state holding a subnet mask, a domain name of
+ * name_len characters, the given lease time and the constant option
+ * cache fixed. */
+static struct option_state *
+template_options(int name_len, u_int32_t lease_time,
+		 struct option_cache *fixed)
+{
+    struct option_state *options = NULL;
+    unsigned char mask[4] = { 255, 255, 255, 0 };
+    unsigned char name[400];
+    unsigned char lt[4];
+
+    if (!option_state_allocate(&options, MDL)) {
+	atf_tc_fail("can't allocate option state");
+    }
+
+    memset(name, 'a', sizeof(name));
+    putULong(lt, lease_time);
+
+    if (!save_option_buffer(&dhcp_universe, options, NULL, mask,
+			    sizeof(mask), DHO_SUBNET_MASK, 0) ||
+	!save_option_buffer(&dhcp_universe, options, NULL, name,
+			    name_len, DHO_DOMAIN_NAME, 0) ||
+	!save_option_buffer(&dhcp_universe, options, NULL, lt,
+			    sizeof(lt), DHO_DHCP_LEASE_TIME, 0)) {
+	atf_tc_fail("can't save options");
+    }
+    save_option(&dhcp_universe, options, fixed);
+
+    return options;
+}
+
+/* Make an option cache for the name servers as the config parser does,
+ * with a constant value. */
+static struct option_cache *
+template_fixed(void)
+{
+    struct option_cache *oc = NULL;
+    struct expression *expr = NULL;
+    struct option *option = NULL;
+    unsigned code = DHO_DOMAIN_NAME_SERVERS;
+    unsigned char servers[8] = { 10, 0, 0, 1, 10, 0, 0, 2 };
+
+    if (!option_code_hash_lookup(&option, dhcp_universe.code_hash,
+				 &code, 0, MDL) ||
+	!make_const_data(&expr, servers, sizeof(servers), 0, 1, MDL) ||
+	!option_cache(&oc, NULL, expr, option, MDL)) {
+	atf_tc_fail("can't make option cache");
+    }
+    oc->flags |= OPTION_CONSTANT;
+    expression_dereference(&expr, MDL);
+    option_dereference(&option, MDL);
+
+    return oc;
+}
+
+/* Build the options with a template in place, then again after throwing
+ * the templates away, and compare. */
+static void
+template_compare(int name_len, int overload)
+{
+    struct option_state *options;
+    struct option_cache *fixed;
+    struct dhcp_packet first, cached, uncached;
+    int first_len, cached_len, uncached_len, refcnt;
+
+    flush_option_templates();
+
+    fixed = template_fixed();
+    refcnt = fixed->refcnt;
+    options = template_options(name_len, 3600, fixed);
+    memset(&first, 0, sizeof(first));
+    first_len = cons_options(NULL, &first, NULL, NULL, 0, NULL, options,
+			     NULL, overload, 0, 0, NULL, NULL);
+    option_state_dereference(&options, MDL);
+
+    options = template_options(name_len, 7200, fixed);
+    memset(&cached, 0, sizeof(cached));
+    cached_len = cons_options(NULL, &cached, NULL, NULL, 0, NULL, options,
+			      NULL, overload, 0, 0, NULL, NULL);
+
+    /* The template keeps the constant option, rather than its value. */
+    if (fixed->refcnt != refcnt + 2) {
+	atf_tc_fail("template doesn't hold the constant option");
+    }
+
+    flush_option_templates();
+    memset(&uncached, 0, sizeof(uncached));
+    uncached_len = cons_options(NULL, &uncached, NULL, NULL, 0, NULL,
+				options, NULL, overload, 0, 0, NULL, NULL);
+    option_state_dereference(&options, MDL);
+
+    if (first_len == 0 || cached_len != first_len ||
+	cached_len != uncached_len) {
+	atf_tc_fail("lengths differ: %d %d %d",
+		    first_len, cached_len, uncached_len);
+    }
+    if (memcmp(&cached, &uncached, sizeof(cached)) != 0) {
+	atf_tc_fail("options from the template differ");
+    }
+    if (memcmp(&first, &cached, sizeof(cached)) == 0) {
+	atf_tc_fail("lease time wasn't filled in");
+    }
+    flush_option_templates();
+    if (fixed->refcnt != refcnt) {
+	atf_tc_fail("constant option still referenced");
+    }
+    option_cache_dereference(&fixed, MDL);
+}
+
+ATF_TC_BODY(cons_options_template, tc)
+{
+    initialize_common_option_spaces();
+
+    /* Everything fits in the options field. */
+    template_compare(20, 0);
+
+    /* The domain name has to be split, and spills over into the
+     * file and sname fields. */
+    template_compare(300, 3);
+}
+
+ATF_TC(packet_arena);
+
+ATF_TC_HEAD(packet_arena, tc)
+{
+    atf_tc_set_md_var(tc, "descr",
+		      "Verify options parsed out of a received packet point "
+		      "into its arena.");
+}
+
+ATF_TC_BODY(packet_arena, tc)
+{
+    struct option_state *options = NULL;
+    struct packet_arena *arena = NULL;
+    struct option_cache *oc;
+    unsigned char packet[] = {
+	DHO_DHCP_MESSAGE_TYPE, 1, DHCPDISCOVER,
+	DHO_DOMAIN_NAME, 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+	DHO_DHCP_AGENT_OPTIONS, 4, RAI_CIRCUIT_ID, 2, 'a', 'b',
+	DHO_END
+    };
+    unsigned char agent[] = { RAI_CIRCUIT_ID, 2, 'a', 'b' };
+
+    initialize_common_option_spaces();
+
+    if (!option_state_allocate(&options, MDL) ||
+	!packet_arena_allocate(&arena, packet, sizeof(packet), MDL)) {
+	atf_tc_fail("can't allocate option state or arena");
+    }
+    packet_arena_reference(&options->arena, arena, MDL);
+
+    if (!parse_option_buffer(options, packet, sizeof(packet),
+			     &dhcp_universe)) {
+	atf_tc_fail("parse_option_buffer failed");
+    }
+
+    /* Top level options are carved from the arena and point into its
+     * copy of the packet, NUL terminated in place. */
+    oc = lookup_option(&dhcp_universe, options, DHO_DOMAIN_NAME);
+    if (oc == NULL || oc->arena != arena ||
+	oc->data.buffer != arena->buffer ||
+	oc->data.data != arena->buffer->data + 5 ||
+	oc->data.len != 7 || !oc->data.terminated ||
+	strcmp((const char *)oc->data.data, "example") != 0) {
+	atf_tc_fail("domain-name isn't in the arena");
+    }
+
+    /* The encapsulation keeps its raw data intact, and its suboptions
+     * get a copy of their own. */
+    oc = lookup_option(&dhcp_universe, options, DHO_DHCP_AGENT_OPTIONS);
+    if (oc == NULL || oc->data.len != sizeof(agent) ||
+	memcmp(oc->data.data, agent, sizeof(agent)) != 0) {
+	atf_tc_fail("relay agent information was overwritten");
+    }
+    oc = lookup_option(&agent_universe, options, RAI_CIRCUIT_ID);
+    if (oc == NULL || oc->arena != NULL ||
+	oc->data.buffer == arena->buffer ||
+	oc->data.len != 2 || memcmp(oc->data.data, "ab", 2) != 0) {
+	atf_tc_fail("circuit-id wasn't copied");
+    }
+
+    /* Once the options are gone, only our reference is left. */
+    option_state_dereference(&options, MDL);
+    if (arena->refcnt != 1) {
+	atf_tc_fail("arena refcnt is %d", arena->refcnt);
+    }
+    packet_arena_dereference(&arena, MDL);
+}
+
 /* This macro defines main() method that will call specified
    test cases. tp and simple_test_case names can be whatever you want
    as long as it is a valid variable identifier. */
@@ -137,6 +336,8 @@ ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, option_refcnt);
     ATF_TP_ADD_TC(tp, pretty_print_option);
+    ATF_TP_ADD_TC(tp, cons_options_template);
+    ATF_TP_ADD_TC(tp, packet_arena);
 
     return (atf_no_error());
 }
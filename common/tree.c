@@ -712,6 +712,14 @@ int evaluate_boolean_expression (result, packet, lease, client_state,
 	regex_t re;
 #endif
 
+#if !defined (DEBUG_EXPRESSIONS)
+	if (expr -> program && expr -> program -> context == context_boolean)
+		return evaluate_boolean_program (result, packet, lease,
+						 client_state, in_options,
+						 cfg_options, scope,
+						 expr -> program);
+#endif
+
 	switch (expr -> op) {
 	      case expr_check:
 		*result = check_collection (packet, lease,
@@ -1146,6 +1154,14 @@ int evaluate_data_expression (result, packet, lease, client_state,
 	struct packet *relay_packet;
 	struct option_state *relay_options;
 
+#if !defined (DEBUG_EXPRESSIONS)
+	if (expr -> program && expr -> program -> context == context_data)
+		return evaluate_data_program (result, packet, lease,
+					      client_state, in_options,
+					      cfg_options, scope,
+					      expr -> program, file, line);
+#endif
+
 	switch (expr -> op) {
 		/* Extract N bytes starting at byte M of a data string. */
 	      case expr_substring:
@@ -2245,6 +2261,14 @@ int evaluate_numeric_expression (result, packet, lease, client_state,
 	unsigned long ileft, iright;
 	int rc = 0;
 
+#if !defined (DEBUG_EXPRESSIONS)
+	if (expr -> program && expr -> program -> context == context_numeric)
+		return evaluate_numeric_program (result, packet, lease,
+						 client_state, in_options,
+						 cfg_options, scope,
+						 expr -> program);
+#endif
+
 	switch (expr -> op) {
 	      case expr_check:
 	      case expr_equal:
@@ -3025,6 +3049,8 @@ void expression_dereference (eptr, file, line)
 	      default:
 		break;
 	}
+	if (expr -> program)
+		free_expression_program (&expr -> program, file, line);
 	free_expression (expr, MDL);
 }
 
@@ -3114,6 +3140,153 @@ int is_compound_expression (expr)
 		expr -> op == expr_v6relay);
 }
 
+/* Return true if expr always evaluates to the same data. */
+int is_constant_expression (expr)
+	struct expression *expr;
+{
+	if (expr -> op == expr_const_data)
+		return 1;
+	if (expr -> op == expr_concat)
+		return (is_constant_expression (expr -> data.concat [0]) &&
+			is_constant_expression (expr -> data.concat [1]));
+	return 0;
+}
+
+/* Replace the constant parts of an expression with their values, so
+   that they are worked out once when the configuration is read rather
+   than for every packet.   Returns nonzero if the whole expression is
+   constant; a constant boolean expression is left for the caller to
+   evaluate, since there is no node for a boolean constant. */
+
+int fold_expression (expr)
+	struct expression **expr;
+{
+	struct expression *e = *expr;
+	struct expression *folded = (struct expression *)0;
+	struct data_string data;
+	unsigned long num;
+	int constant;
+
+	/* Fold every operand, even once one is known not to be constant. */
+#define FOLD(x) ((x) ? fold_expression (&(x)) : 1)
+	switch (e -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+		return 1;
+
+	      case expr_substring:
+		constant = FOLD (e -> data.substring.expr);
+		constant &= FOLD (e -> data.substring.offset);
+		constant &= FOLD (e -> data.substring.len);
+		break;
+
+	      case expr_suffix:
+		constant = FOLD (e -> data.suffix.expr);
+		constant &= FOLD (e -> data.suffix.len);
+		break;
+
+	      case expr_lcase:
+		constant = FOLD (e -> data.lcase);
+		break;
+
+	      case expr_ucase:
+		constant = FOLD (e -> data.ucase);
+		break;
+
+	      case expr_concat:
+		constant = FOLD (e -> data.concat [0]);
+		constant &= FOLD (e -> data.concat [1]);
+		break;
+
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		constant = FOLD (e -> data.encode_int);
+		break;
+
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+		constant = FOLD (e -> data.extract_int);
+		break;
+
+	      case expr_binary_to_ascii:
+		constant = FOLD (e -> data.b2a.base);
+		constant &= FOLD (e -> data.b2a.width);
+		constant &= FOLD (e -> data.b2a.separator);
+		constant &= FOLD (e -> data.b2a.buffer);
+		break;
+
+	      case expr_reverse:
+		constant = FOLD (e -> data.reverse.width);
+		constant &= FOLD (e -> data.reverse.buffer);
+		break;
+
+	      case expr_not:
+		constant = FOLD (e -> data.not);
+		break;
+
+	      case expr_equal:
+	      case expr_not_equal:
+	      case expr_and:
+	      case expr_or:
+	      case expr_add:
+	      case expr_subtract:
+	      case expr_multiply:
+	      case expr_divide:
+	      case expr_remainder:
+	      case expr_binary_and:
+	      case expr_binary_or:
+	      case expr_binary_xor:
+		constant = FOLD (e -> data.and [0]);
+		constant &= FOLD (e -> data.and [1]);
+		break;
+
+	      default:
+		return 0;
+	}
+#undef FOLD
+
+	if (!constant)
+		return 0;
+
+	/* An expression that fails on constants fails every time; leave
+	   it to do so when it is evaluated. */
+	if (is_data_expression (e)) {
+		memset (&data, 0, sizeof data);
+		if (!evaluate_data_expression (&data, (struct packet *)0,
+					       (struct lease *)0,
+					       (struct client_state *)0,
+					       (struct option_state *)0,
+					       (struct option_state *)0,
+					       (struct binding_scope **)0,
+					       e, MDL))
+			return 0;
+		if (!make_const_data (&folded, data.data, data.len,
+				      data.terminated, 1, MDL)) {
+			data_string_forget (&data, MDL);
+			return 0;
+		}
+		data_string_forget (&data, MDL);
+	} else if (is_numeric_expression (e)) {
+		if (!evaluate_numeric_expression (&num, (struct packet *)0,
+						  (struct lease *)0,
+						  (struct client_state *)0,
+						  (struct option_state *)0,
+						  (struct option_state *)0,
+						  (struct binding_scope **)0,
+						  e) ||
+		    !make_const_int (&folded, num))
+			return 0;
+	} else
+		return 1;
+
+	expression_dereference (expr, MDL);
+	expression_reference (expr, folded, MDL);
+	expression_dereference (&folded, MDL);
+	return 1;
+}
+
 static int op_val (enum expr_op);
 
 static int op_val (op)
@@ -196,11 +196,11 @@ typedef time_t TIME;
 # define LEASE_HASH_SIZE	100003
 #endif
 
-/* It is not known what the worst case subclass hash size is.  We estimate
- * high, I think.
+/* Subclass hash tables grow as subclasses are added, so there is no
+ * need to size them for the worst case.
  */
 #if !defined (SCLASS_HASH_SIZE)
-# define SCLASS_HASH_SIZE	12007
+# define SCLASS_HASH_SIZE	127
 #endif
 
 #if !defined (AGENT_HASH_SIZE)
@@ -390,7 +390,12 @@ struct option_cache {
 	struct data_string data;
 
 	#define OPTION_HAD_NULLS	0x00000001
+	/* Set on caches parsed from the config with a constant value. */
+	#define OPTION_CONSTANT		0x00000002
 	u_int32_t flags;
+
+	/* Packet arena this cache was carved from, if any. */
+	struct packet_arena *arena;
 };
 
 struct option_state {
@@ -398,9 +403,30 @@ struct option_state {
 	int universe_count;
 	int site_universe;
 	int site_code_min;
+	struct packet_arena *arena;	/* Arena of the packet the options
+					   were parsed from, if any. */
 	void *universes [1];
 };
 
+/* Storage shared by the options parsed out of one received packet: a
+   copy of the packet, which the option data point into, and the option
+   caches describing them.   The arena is referenced by the packet, its
+   option state and each cache carved from it, and goes back on the free
+   list in one piece once the last of those is gone. */
+#if !defined (PACKET_ARENA_CACHES)
+# define PACKET_ARENA_CACHES 64
+#endif
+struct packet_arena {
+	int refcnt;
+	struct packet_arena *next;	/* Free list. */
+	const unsigned char *raw;	/* Packet as received, while valid. */
+	unsigned length;
+	struct buffer *buffer;		/* Copy of the received packet. */
+	unsigned buffer_size;
+	int used;			/* Caches carved so far. */
+	struct option_cache caches [PACKET_ARENA_CACHES];
+};
+
 /* A dhcp packet and the pointers to its option values. */
 struct packet {
 	struct dhcp_packet *raw;
@@ -447,16 +473,40 @@ struct packet {
 
 	struct shared_network *shared_network;
 	struct option_state *options;
-
+	struct packet_arena *arena;
+
+	/* The classes the packet is in, in the order it was put in them.
+	   The first PACKET_MAX_CLASSES are kept in class_store, and the
+	   vector moves to the heap if there are more.   class_set has two
+	   bits for each class named in a permit list: one set if the
+	   packet is in the class, the other if it is in one of the class's
+	   subclasses.   It is kept in class_set_store unless there are
+	   more such classes than fit there. */
 #if !defined (PACKET_MAX_CLASSES)
 # define PACKET_MAX_CLASSES 5
+#endif
+#if !defined (PACKET_CLASS_SET_SIZE)
+# define PACKET_CLASS_SET_SIZE 8
 #endif
 	int class_count;
-	struct class *classes [PACKET_MAX_CLASSES];
+	int class_max;
+	struct class **classes;
+	struct class *class_store [PACKET_MAX_CLASSES];
+	unsigned char *class_set;
+	int class_set_size;
+	unsigned char class_set_store [PACKET_CLASS_SET_SIZE];
 
 	int known;
 	int authenticated;
 
+	/* Results of permitted() for this packet, two bits per permit list
+	   (evaluated, permitted) indexed by the index of its first permit.
+	   The cache is cleared if known, authenticated or the classes of
+	   the packet change. */
+	unsigned char *permit_cache;
+	unsigned permit_cache_size;
+	int permit_cache_key;
+
 	/* If we stash agent options onto the packet option state, to pretend
 	 * options we got in a previous exchange were still there, we need
 	 * to signal this in a reliable way.
@@ -817,6 +867,14 @@ struct lease_state {
 #define SV_BIND_LOCAL_ADDRESS6		98
 #define SV_PING_CLTT_SECS		99
 #define SV_PING_TIMEOUT_MS		100
+#define SV_RECEIVE_BATCH_SIZE		101
+#define SV_SHARD_COUNT			102
+#define SV_SHARD_INDEX			103
+#define SV_LEASE_FILE_FORMAT		104
+#define SV_LEASE_REWRITE_INTERVAL	105
+#define SV_LEASE_REWRITE_SIZE		106
+#define SV_DENSE_POOL_SIZE		107
+#define SV_LEASE_EXPIRY_BATCH_SIZE	108
 
 #if !defined (DEFAULT_PING_TIMEOUT)
 # define DEFAULT_PING_TIMEOUT 1
@@ -877,12 +935,27 @@ struct lease_state {
 # define DEFAULT_ABANDON_LEASE_TIME 86400
 #endif
 
+#if !defined (LEASE_REWRITE_PERIOD)
+# define LEASE_REWRITE_PERIOD 3600
+#endif
+
+#if !defined (DEFAULT_RECEIVE_BATCH_SIZE)
+# define DEFAULT_RECEIVE_BATCH_SIZE 1	/* default 1 disables batching */
+#endif
+
+#if !defined (MAX_RECEIVE_BATCH_SIZE)
+# define MAX_RECEIVE_BATCH_SIZE 1024
+#endif
+
 #define PLM_IGNORE 0
 #define PLM_PREFER 1
 #define PLM_EXACT 2
 #define PLM_MINIMUM 3
 #define PLM_MAXIMUM 4
 
+#define LEASE_FILE_TEXT 0
+#define LEASE_FILE_BINARY 1
+
 /* Client option names */
 
 #define	CL_TIMEOUT		1
@@ -960,6 +1033,19 @@ struct group {
 	struct shared_network *shared_network;
 	int authoritative;
 	struct executable_statement *statements;
+
+	/* The options set by this group and the groups it is nested in,
+	   when they contain nothing but option statements, as built for
+	   statements_generation option_set_generation. */
+	struct option_set *option_set;
+	unsigned option_set_generation;
+};
+
+/* Option caches to be saved in order into an option state, standing in
+   for executing a chain of groups that only set options. */
+struct option_set {
+	int count;
+	struct option_cache *options[1];
 };
 
 /* A dhcp host declaration structure. */
@@ -1004,6 +1090,7 @@ struct permit {
 	} type;
 	struct class *class;
 	TIME after;	/* date after which this clause applies */
+	unsigned index;	/* identifies the list in packet permit caches */
 };
 
 #if defined (BINARY_LEASES)
@@ -1018,6 +1105,27 @@ struct leasechain {
 };
 #endif
 
+/* Pools of a shared network with the same permit and prohibit lists,
+   kept in heaps by the lease each pool would give out next.  See
+   allocate_lease(). */
+struct pool_group {
+	struct pool_group *next;
+	struct permit *permit_list;
+	struct permit *prohibit_list;
+	isc_heap_t *heaps[3];
+	int by_class;		/* found through the shared network's
+				   class table */
+	int flags_only;		/* permits only depend on packet flags */
+	unsigned memo;		/* permitted() results by packet flags */
+	unsigned memo_valid;
+	unsigned long seen;
+};
+
+struct pool_class {
+	struct class *class;
+	struct pool_group *group;
+};
+
 struct pool {
 	OMAPI_OBJECT_PREAMBLE;
 	struct pool *next;
@@ -1044,6 +1152,13 @@ struct pool {
 #endif
 	int logged;		/* already logged a message */
 	int low_threshold;	/* low threshold to restart logging */
+
+	struct pool_group *pool_group;
+	struct lease *candidate;	/* lease to give out next */
+	TIME candidate_ends;		/* its expiry when last sifted */
+	unsigned pool_heap;		/* heap of pool_group it is in */
+	unsigned heap_index;		/* place in that heap, 0 if none */
+	unsigned seq;			/* place in the shared network */
 };
 
 struct shared_network {
@@ -1053,6 +1168,7 @@ struct shared_network {
 
 #define SHARED_IMPLICIT	  1 /* This network was synthesized. */
 	int flags;
+	int shard;		/* Which of shard-count servers answers. */
 
 	struct subnet *subnets;
 	struct interface_info *interface;
@@ -1062,6 +1178,11 @@ struct shared_network {
 #if defined (FAILOVER_PROTOCOL)
 	dhcp_failover_state_t *failover_peer;
 #endif
+
+	int pools_indexed;	/* 1 if indexed, -1 if it can't be */
+	struct pool_group *pool_groups;
+	struct pool_class *pool_classes;	/* sorted by class */
+	int pool_class_count;
 };
 
 struct subnet {
@@ -1082,6 +1203,7 @@ struct collection {
 
 	const char *name;
 	struct class *classes;
+	struct class_index *index;	/* Built by check_collection(). */
 };
 
 /* Used as an argument to parse_clasS_decl() */
@@ -1118,6 +1240,18 @@ struct class {
 	struct expression *submatch;
 	int spawning;
 
+	/* Subclasses a spawning class has spawned, most recently matched
+	   first, and the neighbours of a spawned subclass on that list.
+	   With a spawn limit, the least recently matched subclasses
+	   holding no leases are dropped to stay within it. */
+	int spawn_limit;
+	int spawned_count;
+	u_int32_t spawned_total;	/* Spawned since startup. */
+	u_int32_t spawned_evicted;	/* Dropped for the limit. */
+	struct class *spawned_head, *spawned_tail;
+	struct class *spawned_prev, *spawned_next;
+	int spawned;			/* On its superclass's list. */
+
 	struct group *group;
 
 	/* Statements to execute if class matches. */
@@ -1129,6 +1263,9 @@ struct class {
 #define CLASS_DECL_SUBCLASS	8
 
 	int flags;
+
+	int id;			/* Position in packet class sets if the class
+			   is named in a permit list, or 0. */
 };
 
 /* DHCP client lease structure... */
@@ -1402,6 +1539,8 @@ struct interface_info {
 	unsigned int rbuf_max;		/* Size of read buffer. */
 	size_t rbuf_offset;		/* Current offset into buffer. */
 	size_t rbuf_len;		/* Length of data in buffer. */
+	u_int32_t rx_wakeups;		/* Reads that returned frames. */
+	u_int32_t rx_frames;		/* Frames returned by those reads. */
 
 	struct ifreq *ifp;		/* Pointer to ifreq struct. */
 	int configured;			/* If set to 1, interface has at least
@@ -1435,12 +1574,15 @@ struct leasequeue {
 	struct leasequeue *prev;
 	struct leasequeue *next;
 	struct lease *lease;
+	u_int32_t commit;
 };
 
 typedef void (*tvref_t)(void *, void *, const char *, int);
 typedef void (*tvunref_t)(void *, const char *, int);
 struct timeout {
 	struct timeout *next;
+	struct timeout *prev;
+	struct timeout *hnext;		/* Next in the same index bucket. */
 	struct timeval when;
 	void (*func) (void *);
 	void *what;
@@ -1449,6 +1591,14 @@ struct timeout {
 	isc_timer_t *isc_timeout;
 };
 
+/* Counters kept by the timeout code in dispatch.c. */
+struct timeout_stats {
+	u_int32_t count;		/* Timeouts currently scheduled. */
+	u_int32_t peak;			/* Most ever scheduled at once. */
+	u_int32_t ops;			/* Index lookups done. */
+	u_int32_t probes;		/* Index entries examined. */
+};
+
 struct eventqueue {
 	struct eventqueue *next;
 	void (*handler)(void *);
@@ -1663,6 +1813,11 @@ struct iasubopt {
 	/* space for the on * executable statements */
 	struct on_star on_star;
 	int static_lease;
+
+	/* the binary lease journal record this was last written in, and
+	 * a checksum of what it held besides timers (internal use only) */
+	u_int32_t journal_gen;
+	u_int32_t journal_sum;
 };
 
 struct ia_xx {
@@ -1673,12 +1828,23 @@ struct ia_xx {
 	int max_iasubopt;		/* space available for IAADDR/PREFIX */
 	time_t cltt;			/* client last transaction time */
 	struct iasubopt **iasubopt;	/* pointers to the IAADDR/IAPREFIXs */
+
+	/* the reply to the last renewal that changed nothing but timers,
+	 * the request it answered, and the configuration and cache
+	 * threshold it was built with (internal use only) */
+	struct data_string renew_key;
+	struct data_string renew_reply;
+	unsigned renew_generation;
+	int renew_threshold;
 };
 
 extern ia_hash_t *ia_na_active;
 extern ia_hash_t *ia_ta_active;
 extern ia_hash_t *ia_pd_active;
 
+/* Enough levels of used_map to summarize 2^31 bits a word at a time. */
+#define USED_MAP_LEVELS 7
+
 /*!
  *
  * \brief ipv6_pool structure
@@ -1716,6 +1882,19 @@ struct ipv6_pool {
 						   this pool */
 	struct subnet *subnet;			/* subnet for this pool */
 	struct ipv6_pond *ipv6_pond;		/* pond for this pool */
+	u_int32_t *used_map;			/* occupancy bitmap of a dense
+						   IA_NA or IA_PD pool, or
+						   NULL */
+	u_int32_t map_size;			/* addresses or prefixes in
+						   used_map */
+	u_int32_t map_free;			/* free ones in used_map */
+	int map_levels;				/* levels in used_map */
+	u_int32_t map_level[USED_MAP_LEVELS + 1]; /* word offset of each
+						   level in used_map */
+	time_t expiry_time;			/* when leases next expire or
+						   are cleaned up */
+	int expiry_index;			/* index into the heap of pools
+						   to expire, or 0 */
 };
 
 /*!
@@ -1839,6 +2018,8 @@ typedef struct dhcp_ddns_cb {
 } dhcp_ddns_cb_t;
 
 extern struct ipv6_pool **pools;
+extern u_int32_t dense_pool_size;
+extern u_int32_t lease_expiry_batch_size;
 
 
 /* External definitions... */
@@ -1872,6 +2053,7 @@ int cons_options (struct packet *, struct dhcp_packet *, struct lease *,
 		  int, struct option_state *, struct option_state *,
 		  struct binding_scope **,
 		  int, int, int, struct data_string *, const char *);
+void flush_option_templates (void);
 int fqdn_universe_decode (struct option_state *,
 			  const unsigned char *, unsigned, struct universe *);
 struct option_cache *
@@ -2042,6 +2224,64 @@ void hashed_option_space_foreach (struct packet *, struct lease *,
 					    struct option_state *,
 					    struct binding_scope **,
 					    struct universe *, void *));
+struct option_cache *lookup_indexed_option(struct universe *,
+					    struct option_state *, unsigned);
+void save_indexed_option(struct universe *, struct option_state *,
+			 struct option_cache *, isc_boolean_t appendp);
+void delete_indexed_option(struct universe *, struct option_state *, int);
+int indexed_option_state_dereference(struct universe *,
+				     struct option_state *,
+				     const char *, int);
+int indexed_option_space_encapsulate(struct data_string *,
+				     struct packet *, struct lease *,
+				     struct client_state *,
+				     struct option_state *,
+				     struct option_state *,
+				     struct binding_scope **,
+				     struct universe *);
+void indexed_option_space_foreach(struct packet *, struct lease *,
+				  struct client_state *,
+				  struct option_state *,
+				  struct option_state *,
+				  struct binding_scope **,
+				  struct universe *, void *,
+				  void (*) (struct option_cache *,
+					    struct packet *,
+					    struct lease *,
+					    struct client_state *,
+					    struct option_state *,
+					    struct option_state *,
+					    struct binding_scope **,
+					    struct universe *, void *));
+struct option_cache *lookup_sorted_option(struct universe *,
+					   struct option_state *, unsigned);
+void save_sorted_option(struct universe *, struct option_state *,
+			struct option_cache *, isc_boolean_t appendp);
+void delete_sorted_option(struct universe *, struct option_state *, int);
+int sorted_option_state_dereference(struct universe *,
+				    struct option_state *,
+				    const char *, int);
+int sorted_option_space_encapsulate(struct data_string *,
+				    struct packet *, struct lease *,
+				    struct client_state *,
+				    struct option_state *,
+				    struct option_state *,
+				    struct binding_scope **,
+				    struct universe *);
+void sorted_option_space_foreach(struct packet *, struct lease *,
+				 struct client_state *,
+				 struct option_state *,
+				 struct option_state *,
+				 struct binding_scope **,
+				 struct universe *, void *,
+				 void (*) (struct option_cache *,
+					   struct packet *,
+					   struct lease *,
+					   struct client_state *,
+					   struct option_state *,
+					   struct option_state *,
+					   struct binding_scope **,
+					   struct universe *, void *));
 int linked_option_get (struct data_string *, struct universe *,
 		       struct packet *, struct lease *,
 		       struct client_state *,
@@ -2118,6 +2358,9 @@ extern u_int16_t ddns_conflict_mask;
 #endif
 extern int dont_use_fsync;
 extern int server_id_check;
+extern int shard_count;
+extern int shard_index;
+extern int lease_file_format;
 
 #ifdef EUI_64
 extern int persist_eui64;
@@ -2131,6 +2374,8 @@ extern int do_release_on_roam;
 extern int authoring_byte_order;
 extern int lease_id_format;
 extern u_int32_t abandon_lease_time;
+extern u_int32_t lease_rewrite_period;
+extern u_int32_t lease_rewrite_size;
 
 extern const char *path_dhcpd_conf;
 extern const char *path_dhcpd_db;
@@ -2389,6 +2634,8 @@ int is_boolean_expression (struct expression *);
 int is_data_expression (struct expression *);
 int is_numeric_expression (struct expression *);
 int is_compound_expression (struct expression *);
+int is_constant_expression (struct expression *);
+int fold_expression (struct expression **);
 int op_precedence (enum expr_op, enum expr_op);
 enum expression_context expression_context (struct expression *);
 enum expression_context op_context (enum expr_op);
@@ -2410,6 +2657,23 @@ int data_string_sprintfa(struct data_string *ds, const char *fmt, ...);
 int concat_dclists (struct data_string *, struct data_string *,
                     struct data_string *);
 
+/* bytecode.c */
+void compile_expression (struct expression *, enum expression_context);
+void free_expression_program (struct expr_program **, const char *, int);
+int evaluate_boolean_program (int *, struct packet *, struct lease *,
+			      struct client_state *, struct option_state *,
+			      struct option_state *, struct binding_scope **,
+			      struct expr_program *);
+int evaluate_numeric_program (unsigned long *, struct packet *,
+			      struct lease *, struct client_state *,
+			      struct option_state *, struct option_state *,
+			      struct binding_scope **, struct expr_program *);
+int evaluate_data_program (struct data_string *, struct packet *,
+			   struct lease *, struct client_state *,
+			   struct option_state *, struct option_state *,
+			   struct binding_scope **, struct expr_program *,
+			   const char *, int);
+
 /* dhcp.c */
 extern int outstanding_pings;
 extern int max_outstanding_acks;
@@ -2440,7 +2704,9 @@ void static_lease_dereference (struct lease *, const char *, int);
 int allocate_lease (struct lease **, struct packet *,
 		    struct pool *, int *);
 int permitted (struct packet *, struct permit *);
+void pool_index_update (struct pool *);
 int locate_network (struct packet *);
+int shard_owns_network (struct shared_network *);
 int parse_agent_information_option (struct packet *, int, u_int8_t *);
 unsigned cons_agent_information_options (struct option_state *,
 					 struct dhcp_packet *,
@@ -2511,6 +2777,7 @@ void relinquish_free_expressions (void);
 void relinquish_free_binding_values (void);
 void relinquish_free_option_caches (void);
 void relinquish_free_packets (void);
+void relinquish_free_packet_arenas (void);
 #endif
 
 int option_chain_head_allocate (struct option_chain_head **,
@@ -2542,6 +2809,7 @@ void free_protocol (struct protocol *, const char *, int);
 void free_dhcp_packet (struct dhcp_packet *, const char *, int);
 struct client_lease *new_client_lease (const char *, int);
 void free_client_lease (struct client_lease *, const char *, int);
+extern unsigned permit_count;
 struct permit *new_permit (const char *, int);
 void free_permit (struct permit *, const char *, int);
 pair new_pair (const char *, int);
@@ -2594,6 +2862,13 @@ int packet_allocate (struct packet **, const char *, int);
 int packet_reference (struct packet **,
 		      struct packet *, const char *, int);
 int packet_dereference (struct packet **, const char *, int);
+int packet_arena_allocate (struct packet_arena **, const unsigned char *,
+			   unsigned, const char *, int);
+int packet_arena_reference (struct packet_arena **,
+			    struct packet_arena *, const char *, int);
+int packet_arena_dereference (struct packet_arena **, const char *, int);
+int packet_arena_option_cache (struct option_cache **, struct packet_arena *,
+			       const char *, int);
 int binding_scope_allocate (struct binding_scope **,
 			    const char *, int);
 int binding_scope_reference (struct binding_scope **,
@@ -2851,6 +3126,7 @@ extern int bind_local_address6;
 extern u_int16_t local_port;
 extern u_int16_t remote_port;
 extern u_int16_t relay_port;
+extern int receive_batch_size;
 extern int dhcpv4_over_dhcpv6;
 extern int (*dhcp_interface_setup_hook) (struct interface_info *,
 					 struct iaddr *);
@@ -2865,6 +3141,7 @@ extern void (*dhcpv6_packet_handler)(struct interface_info *,
 				     const char *, int,
 				     int, const struct iaddr *, isc_boolean_t);
 extern struct timeout *timeouts;
+extern struct timeout_stats timeout_stats;
 extern omapi_object_type_t *dhcp_type_interface;
 #if defined (TRACING)
 extern trace_type_t *interface_trace;
@@ -2941,6 +3218,7 @@ extern struct enumeration syslog_enum;
 void initialize_server_option_spaces (void);
 
 extern struct enumeration prefix_length_modes;
+extern struct enumeration lease_file_formats;
 
 /* inet.c */
 struct iaddr subnet_number (struct iaddr, struct iaddr);
@@ -3086,8 +3364,12 @@ int write_billing_class (struct class *);
 void commit_leases_timeout (void *);
 int commit_leases (void);
 int commit_leases_timed (void);
+#if defined (ASYNC_COMMIT)
+u_int32_t commit_leases_async (void (*)(u_int32_t));
+#endif
 void db_startup (int);
 int new_lease_file (int test_mode);
+isc_result_t read_lease_journal (const char *, const char *, unsigned);
 int group_writer (struct group_object *);
 int write_ia(const struct ia_xx *);
 
@@ -3243,7 +3525,13 @@ extern struct executable_statement *default_classification_rules;
 void classification_setup (void);
 void classify_client (struct packet *);
 int check_collection (struct packet *, struct lease *, struct collection *);
+void invalidate_class_indexes (void);
+void forget_class_index (struct collection *);
 void classify (struct packet *, struct class *);
+int packet_class_member (struct packet *, struct class *, int);
+void forget_spawned_class (struct class *);
+void permit_class_id (struct class *);
+void release_class_id (struct class *);
 isc_result_t unlink_class (struct class **class);
 isc_result_t find_class (struct class **, const char *,
 			 const char *, int);
@@ -3268,12 +3556,15 @@ void execute_statements_in_scope (struct binding_value **result,
 				  struct on_star *);
 int executable_statement_dereference (struct executable_statement **,
 				      const char *, int);
+extern unsigned statements_generation;
+void group_option_set_forget (struct group *);
 void write_statements (FILE *, struct executable_statement *, int);
 int find_matching_case (struct executable_statement **,
 			struct packet *, struct lease *, struct client_state *,
 			struct option_state *, struct option_state *,
 			struct binding_scope **,
 			struct expression *, struct executable_statement *);
+void optimize_statement (struct executable_statement **);
 int executable_statement_foreach (struct executable_statement *,
 				  int (*) (struct executable_statement *,
 					   void *, int), void *, int);
@@ -3549,6 +3840,9 @@ isc_result_t dhcp_lease_get (omapi_object_t **, const char *, int);
 int find_grouped_subnet (struct subnet **, struct shared_network *,
 			 struct iaddr, const char *, int);
 int find_subnet(struct subnet **, struct iaddr, const char *, int);
+int subnet_trie_key_bit(const unsigned char *, unsigned);
+unsigned subnet_trie_key_common(const unsigned char *,
+				const unsigned char *, unsigned);
 void enter_shared_network (struct shared_network *);
 void new_shared_network_interface (struct parse *,
 				   struct shared_network *,
@@ -3848,11 +4142,15 @@ isc_result_t create_prefix6(struct ipv6_pool *pool,
 isc_boolean_t prefix6_exists(const struct ipv6_pool *pool,
 			     const struct in6_addr *pref, u_int8_t plen);
 
+isc_result_t ipv6_pool_use_map(struct ipv6_pool *pool);
+void map_dense_ipv6_pools(u_int32_t max_size);
 isc_result_t add_ipv6_pool(struct ipv6_pool *pool);
 isc_result_t find_ipv6_pool(struct ipv6_pool **pool, u_int16_t type,
 			    const struct in6_addr *addr);
 isc_boolean_t ipv6_in_pool(const struct in6_addr *addr,
 			   const struct ipv6_pool *pool);
+isc_boolean_t shard_owns_lease6(const struct ipv6_pool *pool,
+				const struct in6_addr *addr);
 isc_result_t ipv6_pond_allocate(struct ipv6_pond **pond,
 				const char *file, int line);
 isc_result_t ipv6_pond_reference(struct ipv6_pond **pond,
@@ -3865,6 +4163,7 @@ isc_result_t renew_leases(struct ia_xx *ia);
 isc_result_t release_leases(struct ia_xx *ia);
 isc_result_t decline_leases(struct ia_xx *ia);
 void schedule_lease_timeout(struct ipv6_pool *pool);
+void lease_timeout_support(void *);
 void schedule_all_ipv6_lease_timeouts();
 
 void mark_hosts_unavailable(void);
@@ -63,8 +63,17 @@ struct hash_table {
 	hash_comparator_t cmp;
 	unsigned (*do_hash)(const void *, unsigned, unsigned);
 
-	/* This must remain the last entry in this table. */
-	struct hash_bucket *buckets [1];
+	unsigned entries;		/* Entries in the table. */
+	unsigned resizes;		/* Times the table has been resized. */
+	int iterating;			/* Set within hash_foreach(). */
+
+	/* While the table is being resized, entries that have not yet
+	   been moved to the new buckets are in old_buckets [moved] on. */
+	struct hash_bucket **old_buckets;
+	unsigned old_count;
+	unsigned moved;
+
+	struct hash_bucket **buckets;
 };
 
 struct named_hash {
@@ -83,6 +92,7 @@ int name##_hash_lookup (type **, hashtype *, bufarg, unsigned,		      \
 unsigned char * name##_hash_report(hashtype *);				      \
 int name##_hash_foreach (hashtype *, hash_foreach_func);		      \
 int name##_new_hash (hashtype **, unsigned, const char *, int);		      \
+int name##_hash_resize (hashtype **, unsigned, const char *, int);	      \
 void name##_free_hash_table (hashtype **, const char *, int);
 
 
@@ -128,6 +138,12 @@ int name##_new_hash (hashtype **tp, unsigned c, const char *file, int line)   \
 			 hasher, file, line);				      \
 }									      \
 									      \
+int name##_hash_resize (hashtype **tp, unsigned c,			      \
+			const char *file, int line)			      \
+{									      \
+	return resize_hash ((struct hash_table **)tp, c, file, line);	      \
+}									      \
+									      \
 void name##_free_hash_table (hashtype **table, const char *file, int line)    \
 {									      \
 	free_hash_table ((struct hash_table **)table, file, line);	      \
@@ -142,12 +158,16 @@ int new_hash(struct hash_table **,
 	     hash_reference, hash_dereference, unsigned,
 	     unsigned (*do_hash)(const void *, unsigned, unsigned),
 	     const char *, int);
+int resize_hash(struct hash_table **, unsigned, const char *, int);
+void finish_hash_resize(struct hash_table *);
 unsigned do_string_hash(const void *, unsigned, unsigned);
 unsigned do_case_hash(const void *, unsigned, unsigned);
 unsigned do_id_hash(const void *, unsigned, unsigned);
 unsigned do_number_hash(const void *, unsigned, unsigned);
 unsigned do_ip4_hash(const void *, unsigned, unsigned);
 unsigned char *hash_report(struct hash_table *);
+void register_hash_report(const char *, struct hash_table **);
+const char *hash_reports(void);
 void add_hash (struct hash_table *,
 		      const void *, unsigned, hashed_object_t *,
 		      const char *, int);
@@ -26,6 +26,8 @@
  *
  */
 
+struct switch_table;
+
 struct executable_statement {
 	int refcnt;
 	struct executable_statement *next;
@@ -78,6 +80,8 @@ struct executable_statement {
 		struct {
 			struct expression *expr;
 			struct executable_statement *statements;
+			struct switch_table *table;	/* If cases are
+							   constant. */
 		} s_switch;
 		struct expression *c_case;
 		struct {
@@ -281,8 +281,19 @@ struct expression {
 	} data;
 	int flags;
 #	define EXPR_EPHEMERAL	1
+	struct expr_program *program;	/* Compiled form, if any. */
 };		
 
+/* An expression compiled for the stack machine in common/bytecode.c. */
+struct expr_insn;
+struct expr_program {
+	enum expression_context context;	/* What it evaluates to. */
+	int count;				/* Instructions. */
+	int depth;				/* Stack slots used. */
+	int held;				/* Strings held while running. */
+	struct expr_insn *code;
+};
+
 /* DNS host entry structure... */
 struct dns_host_entry {
 	int refcnt;
@@ -1826,6 +1826,26 @@ parse_class_declaration(struct parse *cfile, int type)
 			if (pc)
 				parse_error(cfile,
 					    "invalid spawn in subclass.");
+			token = peek_token(&val, NULL, cfile);
+			if (token == LIMIT) {
+				struct comment *comment;
+
+				skip_token(&val, NULL, cfile);
+				token = next_token(&val, NULL, cfile);
+				if (token != NUMBER)
+					parse_error(cfile,
+						    "expecting a number");
+				tmp = createInt(atoll(val));
+				tmp->skip = ISC_TRUE;
+				cfile->issue_counter++;
+				comment = createComment("/// Spawned subclass "
+							"limit is not "
+							"supported by Kea");
+				TAILQ_INSERT_TAIL(&tmp->comments, comment);
+				mapSet(class, tmp, "spawn-limit");
+				parse_semi(cfile);
+				continue;
+			}
 			expr = createBool(ISC_TRUE);
 			expr->skip = ISC_TRUE;
 			cfile->issue_counter++;
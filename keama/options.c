@@ -392,6 +392,15 @@ struct option_def configs[] = {
         { "bind-local-address6", "f",           "server",  98, 0},
 	{ "ping-cltt-secs", "T",		"server",  99, 0},
 	{ "ping-timeout-ms", "T",		"server", 100, 0},
+	{ "receive-batch-size", "S",		"server", 101, 0},
+	{ "shard-count", "S",			"server", 102, 0},
+	{ "shard-index", "S",			"server", 103, 0},
+	{ "lease-file-format", "Nlease_file_formats.",
+						"server", 104, 0},
+	{ "lease-file-rewrite-interval", "T",	"server", 105, 0},
+	{ "lease-file-rewrite-size", "L",	"server", 106, 0},
+	{ "dense-pool-size", "L",		"server", 107, 0},
+	{ "lease-expiry-batch-size", "L",	"server", 108, 0},
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -59,7 +59,6 @@ int new_hash_table (tp, count, file, line)
 	int line;
 {
 	struct hash_table *rval;
-	unsigned extra;
 
 	if (!tp) {
 		log_error ("%s(%d): new_hash_table called with null pointer.",
@@ -77,19 +76,22 @@ int new_hash_table (tp, count, file, line)
 #endif
 	}
 
-	/* There is one hash bucket in the structure.  Allocate extra
-	 * memory beyond the end of the structure to fulfill the requested
-	 * count ("count - 1").  Do not let there be less than one.
+	/* The buckets are allocated separately, so that they can be
+	 * replaced when the table is resized.  Do not let there be less
+	 * than one.
 	 */
-	if (count <= 1)
-		extra = 0;
-	else
-		extra = count - 1;
+	if (count < 1)
+		count = 1;
 
-	rval = dmalloc(sizeof(struct hash_table) +
-		       (extra * sizeof(struct hash_bucket *)), file, line);
+	rval = dmalloc(sizeof(struct hash_table), file, line);
 	if (!rval)
 		return 0;
+	rval -> buckets = dmalloc(count * sizeof(struct hash_bucket *),
+				  file, line);
+	if (!rval -> buckets) {
+		dfree(rval, file, line);
+		return 0;
+	}
 	rval -> hash_count = count;
 	*tp = rval;
 	return 1;
@@ -107,6 +109,8 @@ void free_hash_table (tp, file, line)
 	int i;
 	struct hash_bucket *hbc, *hbn = (struct hash_bucket *)0;
 
+	if (ptr != NULL)
+		finish_hash_resize(ptr);
 	for (i = 0; ptr != NULL && i < ptr -> hash_count; i++) {
 	    for (hbc = ptr -> buckets [i]; hbc; hbc = hbn) {
 		hbn = hbc -> next;
@@ -121,6 +125,11 @@ void free_hash_table (tp, file, line)
 	}
 #endif
 
+	if (ptr != NULL) {
+		if (ptr -> old_buckets)
+			dfree(ptr -> old_buckets, MDL);
+		dfree(ptr -> buckets, MDL);
+	}
 	dfree((void *)ptr, MDL);
 	*tp = (struct hash_table *)0;
 }
@@ -236,6 +245,138 @@ int new_hash(struct hash_table **rp,
 	return 1;
 }
 
+/* A table is grown once it holds more than HASH_MAX_LOAD entries per
+ * bucket.  Rather than moving every entry at once, each add, delete and
+ * lookup moves the entries of HASH_RESIZE_STEP of the old buckets, so
+ * that no one call pays for the whole resize.  Until the old buckets
+ * are empty, entries are looked for in both.
+ */
+#define HASH_MAX_LOAD		2
+#define HASH_RESIZE_STEP	4
+
+static void
+move_hash_buckets(struct hash_table *table, unsigned count)
+{
+	struct hash_bucket *bp, *next, **tail;
+	unsigned hashno;
+
+	while (table->old_buckets && count--) {
+		/* Each entry goes on the end of its new chain, so that
+		   entries with the same key stay in the order they were
+		   added. */
+		for (bp = table->old_buckets[table->moved]; bp; bp = next) {
+			next = bp->next;
+			hashno = (*table->do_hash)(bp->name, bp->len,
+						   table->hash_count);
+			for (tail = &table->buckets[hashno]; *tail;
+			     tail = &(*tail)->next)
+				;
+			bp->next = NULL;
+			*tail = bp;
+		}
+		table->old_buckets[table->moved] = NULL;
+
+		if (++table->moved == table->old_count) {
+			dfree(table->old_buckets, MDL);
+			table->old_buckets = NULL;
+			table->old_count = 0;
+			table->moved = 0;
+		}
+	}
+}
+
+/* Move a few more entries of a table being resized, unless it is being
+ * walked by hash_foreach(). */
+static void
+hash_resize_step(struct hash_table *table)
+{
+	if (table->old_buckets && !table->iterating)
+		move_hash_buckets(table, HASH_RESIZE_STEP);
+}
+
+/* Move any entries left in the old buckets of a table being resized.
+ * Code that walks the buckets itself must call this first. */
+void
+finish_hash_resize(struct hash_table *table)
+{
+	if (table->old_buckets)
+		move_hash_buckets(table, table->old_count);
+}
+
+static int
+start_hash_resize(struct hash_table *table, unsigned hsize,
+		  const char *file, int line)
+{
+	struct hash_bucket **buckets;
+
+	if (hsize < 1)
+		hsize = 1;
+	buckets = dmalloc(hsize * sizeof(struct hash_bucket *), file, line);
+	if (!buckets)
+		return 0;
+
+	finish_hash_resize(table);
+	table->old_buckets = table->buckets;
+	table->old_count = table->hash_count;
+	table->moved = 0;
+	table->buckets = buckets;
+	table->hash_count = hsize;
+	table->resizes++;
+	return 1;
+}
+
+/* Give a hash table a different number of buckets.  The entries are
+ * moved across as the table is used. */
+int resize_hash(struct hash_table **tp, unsigned hsize,
+		const char *file, int line)
+{
+	if (!tp || !*tp)
+		return 0;
+	return start_hash_resize(*tp, hsize, file, line);
+}
+
+/* Find the link to the first entry in a chain matching a key.  With
+ * anylen, an entry that was added with no length matches if its name
+ * is the same string as the key. */
+static struct hash_bucket **
+find_hash_entry(struct hash_table *table, struct hash_bucket **bpp,
+		const void *key, unsigned len, int anylen)
+{
+	struct hash_bucket *bp;
+
+	for (; (bp = *bpp) != NULL; bpp = &bp->next) {
+		if (anylen && !bp->len &&
+		    !strcmp((const char *)bp->name, key))
+			return bpp;
+		if (bp->len == len && !(*table->cmp)(bp->name, key, len))
+			return bpp;
+	}
+	return NULL;
+}
+
+/* Look for an entry in the new buckets and then, if the table is being
+ * resized, in the old bucket the key hashed to if it has not been
+ * moved yet. */
+static struct hash_bucket **
+hash_entry(struct hash_table *table, const void *key, unsigned len,
+	   int anylen)
+{
+	struct hash_bucket **bpp;
+	unsigned hashno;
+
+	hashno = (*table->do_hash)(key, len, table->hash_count);
+	bpp = find_hash_entry(table, &table->buckets[hashno], key, len,
+			      anylen);
+	if (bpp || !table->old_buckets)
+		return bpp;
+
+	hashno = (*table->do_hash)(key, len, table->old_count);
+	if (hashno < table->moved)
+		return NULL;
+	return find_hash_entry(table, &table->old_buckets[hashno], key, len,
+			       anylen);
+}
+
 unsigned
 do_case_hash(const void *name, unsigned len, unsigned size)
 {
@@ -346,10 +487,13 @@ hash_report(struct hash_table *table)
 	static unsigned char retbuf[sizeof("Contents/Size (%): "
 					   "2147483647/2147483647 "
 					   "(2147483647%). "
-					   "Min/max: 2147483647/2147483647")];
+					   "Min/max: 2147483647/2147483647. "
+					   "Resized: 4294967295 "
+					   "(4294967295/4294967295 moved)")];
 	unsigned curlen, pct, contents=0, minlen=UINT_MAX, maxlen=0;
-	unsigned i;
+	unsigned i, old = 0;
 	struct hash_bucket *bp;
+	char *cp;
 
 	if (table == NULL)
 		return (unsigned char *) "No table.";
@@ -374,6 +518,14 @@ hash_report(struct hash_table *table)
 		contents += curlen;
 	}
 
+	/* Count the entries still to be moved by a resize, but not in the
+	   chain lengths, which are for the new buckets. */
+	for (i = table->moved; table->old_buckets && i < table->old_count;
+	     i++)
+		for (bp = table->old_buckets[i]; bp != NULL; bp = bp->next)
+			old++;
+	contents += old;
+
 	if (contents >= (UINT_MAX / 100))
 		pct = contents / ((table->hash_count / 100) + 1);
 	else
@@ -386,13 +538,66 @@ hash_report(struct hash_table *table)
 	    maxlen > 2147483647)
 		return (unsigned char *) "Report out of range for display.";
 
-	sprintf((char *)retbuf, 
-		"Contents/Size (%%): %u/%u (%u%%). Min/max: %u/%u",
-		contents, table->hash_count, pct, minlen, maxlen);
+	cp = (char *)retbuf;
+	cp += sprintf(cp,
+		      "Contents/Size (%%): %u/%u (%u%%). Min/max: %u/%u",
+		      contents, table->hash_count, pct, minlen, maxlen);
+	if (table->resizes)
+		cp += sprintf(cp, ". Resized: %u", table->resizes);
+	if (table->old_buckets)
+		sprintf(cp, " (%u/%u moved)", table->moved, table->old_count);
 
 	return retbuf;
 }
 
+/* Tables included in hash_reports(), by the address of the variable
+   pointing to each, so that they can be registered before they are
+   created. */
+struct reported_hash {
+	struct reported_hash *next;
+	const char *name;
+	struct hash_table **table;
+};
+
+static struct reported_hash *reported_hashes;
+
+void
+register_hash_report(const char *name, struct hash_table **tp)
+{
+	struct reported_hash *rh, **rp;
+
+	for (rp = &reported_hashes; *rp; rp = &(*rp)->next)
+		if ((*rp)->table == tp)
+			return;
+	rh = dmalloc(sizeof *rh, MDL);
+	if (!rh)
+		return;
+	rh->name = name;
+	rh->table = tp;
+	*rp = rh;
+}
+
+/* Return hash_report() for each registered table, one to a line. */
+const char *
+hash_reports()
+{
+	static char buf[2048];
+	struct reported_hash *rh;
+	size_t used = 0;
+	int len;
+
+	buf[0] = '\0';
+	for (rh = reported_hashes; rh && used < sizeof buf; rh = rh->next) {
+		len = snprintf(buf + used, sizeof buf - used, "%s%s: %s",
+			       used ? "\n" : "", rh->name,
+			       (char *)hash_report(*rh->table));
+		if (len < 0)
+			break;
+		used += len;
+	}
+	return buf;
+}
+
 void add_hash (table, key, len, pointer, file, line)
 	struct hash_table *table;
 	unsigned len;
@@ -427,6 +632,15 @@ void add_hash (table, key, len, pointer, file, line)
 	bp -> next = table -> buckets [hashno];
 	bp -> len = len;
 	table -> buckets [hashno] = bp;
+	table -> entries++;
+
+	/* Grow the table once its chains get long. */
+	if (!table -> old_buckets && !table -> iterating &&
+	    table -> entries > HASH_MAX_LOAD * table -> hash_count)
+		start_hash_resize (table, table -> hash_count * 2 + 1,
+				   file, line);
+	else
+		hash_resize_step (table);
 }
 
 void delete_hash_entry (table, key, len, file, line)
@@ -436,8 +650,7 @@ void delete_hash_entry (table, key, len, file, line)
 	const char *file;
 	int line;
 {
-	int hashno;
-	struct hash_bucket *bp, *pbp = (struct hash_bucket *)0;
+	struct hash_bucket **bpp, *bp;
 	void *foo;
 
 	if (!table)
@@ -446,29 +659,20 @@ void delete_hash_entry (table, key, len, file, line)
 	if (!len)
 		len = find_length(key, table->do_hash);
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
+	hash_resize_step (table);
 
-	/* Go through the list looking for an entry that matches;
-	   if we find it, delete it. */
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if ((!bp -> len &&
-		     !strcmp ((const char *)bp->name, key)) ||
-		    (bp -> len == len &&
-		     !(table -> cmp)(bp->name, key, len))) {
-			if (pbp) {
-				pbp -> next = bp -> next;
-			} else {
-				table -> buckets [hashno] = bp -> next;
-			}
-			if (bp -> value && table -> dereferencer) {
-				foo = &bp -> value;
-				(*(table -> dereferencer)) (foo, file, line);
-			}
-			free_hash_bucket (bp, file, line);
-			break;
-		}
-		pbp = bp;	/* jwg, 9/6/96 - nice catch! */
+	/* Look for an entry that matches; if we find it, delete it. */
+	bpp = hash_entry (table, key, len, 1);
+	if (!bpp)
+		return;
+	bp = *bpp;
+	*bpp = bp -> next;
+	if (bp -> value && table -> dereferencer) {
+		foo = &bp -> value;
+		(*(table -> dereferencer)) (foo, file, line);
 	}
+	free_hash_bucket (bp, file, line);
+	table -> entries--;
 }
 
 int hash_lookup (vp, table, key, len, file, line)
@@ -479,8 +683,7 @@ int hash_lookup (vp, table, key, len, file, line)
 	const char *file;
 	int line;
 {
-	int hashno;
-	struct hash_bucket *bp;
+	struct hash_bucket **bpp, *bp;
 
 	if (!table)
 		return 0;
@@ -492,42 +695,57 @@ int hash_lookup (vp, table, key, len, file, line)
 			  "initialized to zero (from %s:%d).", file, line);
 	}
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
+	hash_resize_step (table);
 
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if (len == bp -> len
-		    && !(*table->cmp)(bp->name, key, len)) {
-			if (table -> referencer)
-				(*table -> referencer) (vp, bp -> value,
-							file, line);
-			else
-				*vp = bp -> value;
-			return 1;
-		}
+	bpp = hash_entry (table, key, len, 0);
+	if (!bpp)
+		return 0;
+	bp = *bpp;
+	if (table -> referencer)
+		(*table -> referencer) (vp, bp -> value, file, line);
+	else
+		*vp = bp -> value;
+	return 1;
+}
+
+/* Call func for each entry in a chain.  Returns zero if func fails. */
+static int
+hash_foreach_chain (struct hash_bucket *bp, hash_foreach_func func,
+		    int *count)
+{
+	struct hash_bucket *next;
+
+	while (bp) {
+		next = bp -> next;
+		if ((*func)(bp->name, bp->len, bp->value) != ISC_R_SUCCESS)
+			return 0;
+		bp = next;
+		(*count)++;
 	}
-	return 0;
+	return 1;
 }
 
 int hash_foreach (struct hash_table *table, hash_foreach_func func)
 {
-	int i;
-	struct hash_bucket *bp, *next;
+	unsigned i;
 	int count = 0;
 
 	if (!table)
 		return 0;
 
-	for (i = 0; i < table -> hash_count; i++) {
-		bp = table -> buckets [i];
-		while (bp) {
-			next = bp -> next;
-			if ((*func)(bp->name, bp->len, bp->value)
-							!= ISC_R_SUCCESS)
-				return count;
-			bp = next;
-			count++;
-		}
-	}
+	/* Entries aren't moved between the old and new buckets while the
+	   table is being walked. */
+	table -> iterating++;
+	for (i = 0; i < table -> hash_count; i++)
+		if (!hash_foreach_chain (table -> buckets [i], func, &count))
+			goto out;
+	for (i = table -> moved; table -> old_buckets &&
+		     i < table -> old_count; i++)
+		if (!hash_foreach_chain (table -> old_buckets [i], func,
+					 &count))
+			goto out;
+      out:
+	table -> iterating--;
 	return count;
 }
 
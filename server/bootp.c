@@ -68,10 +68,14 @@ void bootp (packet)
 		 : packet -> interface -> name);
 
 	if (!locate_network (packet)) {
-		log_info ("%s: network unknown", msgbuf);
+		if (shard_owns_network (NULL))
+			log_info ("%s: network unknown", msgbuf);
 		return;
 	}
 
+	if (!shard_owns_network (packet -> shared_network))
+		return;
+
 	find_lease (&lease, packet, packet -> shared_network,
 		    0, 0, (struct lease *)0, MDL);
 
@@ -59,151 +59,855 @@ void classify_client (packet)
 			    &global_scope, default_classification_rules, NULL);
 }
 
-int check_collection (packet, lease, collection)
+/* Spawned subclasses are kept on a list on their spawning class, most
+   recently matched first, so that when the class has a spawn limit the
+   least recently matched ones can be dropped.   Subclasses holding
+   leases are never dropped; only the SPAWN_EVICT_SCAN least recently
+   matched are looked at, so if those all hold leases the class is
+   allowed to go over its limit for the time being. */
+
+#define SPAWN_EVICT_SCAN	16
+
+static void spawned_push (class, nc)
+	struct class *class;
+	struct class *nc;
+{
+	nc -> spawned_prev = (struct class *)0;
+	nc -> spawned_next = class -> spawned_head;
+	if (class -> spawned_head)
+		class -> spawned_head -> spawned_prev = nc;
+	else
+		class -> spawned_tail = nc;
+	class -> spawned_head = nc;
+}
+
+static void spawned_unlink (class, nc)
+	struct class *class;
+	struct class *nc;
+{
+	if (nc -> spawned_prev)
+		nc -> spawned_prev -> spawned_next = nc -> spawned_next;
+	else
+		class -> spawned_head = nc -> spawned_next;
+	if (nc -> spawned_next)
+		nc -> spawned_next -> spawned_prev = nc -> spawned_prev;
+	else
+		class -> spawned_tail = nc -> spawned_prev;
+	nc -> spawned_prev = nc -> spawned_next = (struct class *)0;
+}
+
+/* Take a spawned subclass off its superclass's list.   This must be
+   done before it is deleted from the superclass's hash table. */
+
+void forget_spawned_class (nc)
+	struct class *nc;
+{
+	if (!nc -> spawned || !nc -> superclass)
+		return;
+	spawned_unlink (nc -> superclass, nc);
+	nc -> superclass -> spawned_count--;
+	nc -> spawned = 0;
+}
+
+static void evict_spawned_classes (class)
+	struct class *class;
+{
+	struct class *nc, *prev, *hold;
+	int scanned;
+
+	/* The subclass just spawned is at the head and is kept. */
+	for (nc = class -> spawned_tail, scanned = 0;
+	     nc && nc != class -> spawned_head &&
+		     scanned < SPAWN_EVICT_SCAN &&
+		     class -> spawned_count > class -> spawn_limit;
+	     nc = prev, scanned++) {
+		prev = nc -> spawned_prev;
+		if (nc -> leases_consumed)
+			continue;
+
+#if defined (DEBUG_CLASS_MATCHING)
+		log_info ("dropping subclass %s.",
+			  print_hex_1 (nc -> hash_string.len,
+				       nc -> hash_string.data, 60));
+#endif
+		/* The hash table may hold the last reference to the
+		   subclass, whose name is the key being deleted. */
+		hold = (struct class *)0;
+		class_reference (&hold, nc, MDL);
+		forget_spawned_class (hold);
+		class_hash_delete (class -> hash,
+				   (const char *)hold -> hash_string.data,
+				   hold -> hash_string.len, MDL);
+		class_dereference (&hold, MDL);
+		class -> spawned_evicted++;
+	}
+}
+
+/* Check whether a packet belongs to a class or, if the class has a
+   submatch expression, one of its subclasses, spawning a new subclass
+   if need be.   If evaluate_expr is zero, the class's match expression
+   is already known to be true. */
+
+static int check_class (packet, lease, class, evaluate_expr)
 	struct packet *packet;
 	struct lease *lease;
-	struct collection *collection;
+	struct class *class;
+	int evaluate_expr;
 {
-	struct class *class, *nc;
+	struct class *nc;
 	struct data_string data;
-	int matched = 0;
 	int status;
 	int ignorep;
 	int classfound;
 
-	for (class = collection -> classes; class; class = class -> nic) {
 #if defined (DEBUG_CLASS_MATCHING)
-		log_info ("checking against class %s...", class -> name);
+	log_info ("checking against class %s...", class -> name);
 #endif
-		memset (&data, 0, sizeof data);
+	memset (&data, 0, sizeof data);
 
-		/* If there is a "match if" expression, check it.   If
-		   we get a match, and there's no subclass expression,
-		   it's a match.   If we get a match and there is a subclass
-		   expression, then we check the submatch.   If it's not a
-		   match, that's final - we don't check the submatch. */
+	/* If there is a "match if" expression, check it.   If
+	   we get a match, and there's no subclass expression,
+	   it's a match.   If we get a match and there is a subclass
+	   expression, then we check the submatch.   If it's not a
+	   match, that's final - we don't check the submatch. */
 
-		if (class -> expr) {
+	if (class -> expr) {
+		if (evaluate_expr)
 			status = (evaluate_boolean_expression_result
 				  (&ignorep, packet, lease,
 				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
+				   packet -> options,
+				   (struct option_state *)0,
 				   lease ? &lease -> scope : &global_scope,
 				   class -> expr));
-			if (status) {
-				if (!class -> submatch) {
-					matched = 1;
+		else
+			status = 1;
+		if (status) {
+			if (!class -> submatch) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches class.");
+				log_info ("matches class.");
 #endif
-					classify (packet, class);
-					continue;
-				}
-			} else
-				continue;
-		}
+				classify (packet, class);
+				return 1;
+			}
+		} else
+			return 0;
+	}
 
-		/* Check to see if the client matches an existing subclass.
-		   If it doesn't, and this is a spawning class, spawn a new
-		   subclass and put the client in it. */
-		if (class -> submatch) {
-			status = (evaluate_data_expression
-				  (&data, packet, lease,
-				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
-				   class -> submatch, MDL));
-			if (status && data.len) {
-				nc = (struct class *)0;
-				classfound = class_hash_lookup (&nc, class -> hash,
-					(const char *)data.data, data.len, MDL);
+	/* Check to see if the client matches an existing subclass.
+	   If it doesn't, and this is a spawning class, spawn a new
+	   subclass and put the client in it. */
+	if (class -> submatch) {
+		status = (evaluate_data_expression
+			  (&data, packet, lease,
+			   (struct client_state *)0,
+			   packet -> options, (struct option_state *)0,
+			   lease ? &lease -> scope : &global_scope,
+			   class -> submatch, MDL));
+		if (status && data.len) {
+			nc = (struct class *)0;
+			classfound = class_hash_lookup (&nc, class -> hash,
+				(const char *)data.data, data.len, MDL);
 
 #ifdef LDAP_CONFIGURATION
-				if (!classfound && find_subclass_in_ldap (class, &nc, &data))
-					classfound = 1;
+			if (!classfound && find_subclass_in_ldap (class, &nc, &data))
+				classfound = 1;
 #endif
 
-				if (classfound) {
+			if (classfound) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches subclass %s.",
-					      print_hex_1 (data.len,
-							   data.data, 60));
+				log_info ("matches subclass %s.",
+				      print_hex_1 (data.len,
+						   data.data, 60));
 #endif
-					data_string_forget (&data, MDL);
-					classify (packet, nc);
-					matched = 1;
-					class_dereference (&nc, MDL);
-					continue;
-				}
-				if (!class -> spawning) {
-					data_string_forget (&data, MDL);
-					continue;
+				data_string_forget (&data, MDL);
+				if (nc -> spawned &&
+				    class -> spawned_head != nc) {
+					spawned_unlink (class, nc);
+					spawned_push (class, nc);
 				}
-				/* XXX Write out the spawned class? */
+				classify (packet, nc);
+				class_dereference (&nc, MDL);
+				return 1;
+			}
+			if (!class -> spawning) {
+				data_string_forget (&data, MDL);
+				return 0;
+			}
+			/* XXX Write out the spawned class? */
 #if defined (DEBUG_CLASS_MATCHING)
-				log_info ("spawning subclass %s.",
-				      print_hex_1 (data.len, data.data, 60));
+			log_info ("spawning subclass %s.",
+			      print_hex_1 (data.len, data.data, 60));
 #endif
-				status = class_allocate (&nc, MDL);
-				group_reference (&nc -> group,
-						 class -> group, MDL);
-				class_reference (&nc -> superclass,
-						 class, MDL);
-				nc -> lease_limit = class -> lease_limit;
-				nc -> dirty = 1;
-				if (nc -> lease_limit) {
-					nc -> billed_leases =
-						(dmalloc
-						 (nc -> lease_limit *
-						  sizeof (struct lease *),
-						  MDL));
-					if (!nc -> billed_leases) {
+			status = class_allocate (&nc, MDL);
+			group_reference (&nc -> group,
+					 class -> group, MDL);
+			class_reference (&nc -> superclass,
+					 class, MDL);
+			nc -> lease_limit = class -> lease_limit;
+			nc -> dirty = 1;
+			if (nc -> lease_limit) {
+				nc -> billed_leases =
+					(dmalloc
+					 (nc -> lease_limit *
+					  sizeof (struct lease *),
+					  MDL));
+				if (!nc -> billed_leases) {
+					log_error ("no memory for%s",
+						   " billing");
+					data_string_forget
+						(&nc -> hash_string,
+						 MDL);
+					class_dereference (&nc, MDL);
+					data_string_forget (&data,
+							    MDL);
+					return 0;
+				}
+				memset (nc -> billed_leases, 0,
+					(nc -> lease_limit *
+					 sizeof (struct lease *)));
+			}
+			data_string_copy (&nc -> hash_string, &data,
+					  MDL);
+			if (!class -> hash)
+			    class_new_hash(&class->hash,
+					   SCLASS_HASH_SIZE, MDL);
+			class_hash_add (class -> hash,
+					(const char *)
+					nc -> hash_string.data,
+					nc -> hash_string.len,
+					nc, MDL);
+			spawned_push (class, nc);
+			nc -> spawned = 1;
+			class -> spawned_count++;
+			class -> spawned_total++;
+			if (class -> spawn_limit &&
+			    class -> spawned_count > class -> spawn_limit)
+				evict_spawned_classes (class);
+			classify (packet, nc);
+			class_dereference (&nc, MDL);
+		}
+
+		data_string_forget (&data, MDL);
+	}
+	return 0;
+}
+
+/* Classes in a collection whose match expression compares some data
+   expression with a constant, either as a whole or on a prefix taken
+   with substring (..., 0, N), are indexed by that constant.  Each
+   distinct data expression (the key) is then evaluated once per packet
+   and looked up, and only the classes it finds, plus those whose match
+   expressions have some other form, are checked.  The index is built
+   the first time the collection is checked and rebuilt whenever the
+   set of classes changes. */
+
+#define CLASS_INDEX_MIN	8	/* Don't index fewer classes than this. */
+
+struct class_index_key {
+	struct class_index_key *next;
+	struct expression *expr;	/* Evaluated once per packet. */
+	int *lengths;			/* Prefix lengths; -1 for all. */
+	int nlengths;
+};
+
+struct class_index_entry {
+	struct class_index_entry *next;	/* Next in hash bucket. */
+	struct class_index_key *key;
+	int length;			/* Prefix length, or -1. */
+	const unsigned char *data;	/* The constant compared with. */
+	unsigned len;
+	int ordinal;			/* Position in the collection. */
+};
+
+struct class_index {
+	int generation;			/* Generation it was built for. */
+	int count;			/* Classes in the collection. */
+	struct class **classes;		/* By position. */
+	int *remainder;			/* Positions of unindexed classes. */
+	int nremainder;
+	int nindexed;
+	struct class_index_key *keys;
+	struct class_index_entry *entries;
+	struct class_index_entry **buckets;
+	int nbuckets;
+};
+
+static int class_index_generation;
+
+/* Called whenever a class is added to or removed from a collection, or
+   its match expression changes. */
+
+void invalidate_class_indexes ()
+{
+	class_index_generation++;
+}
+
+void forget_class_index (collection)
+	struct collection *collection;
+{
+	struct class_index *index = collection -> index;
+	struct class_index_key *key;
+	int i;
+
+	if (!index)
+		return;
+	collection -> index = (struct class_index *)0;
+
+	for (i = 0; i < index -> count; i++)
+		class_dereference (&index -> classes [i], MDL);
+	while ((key = index -> keys) != NULL) {
+		index -> keys = key -> next;
+		expression_dereference (&key -> expr, MDL);
+		if (key -> lengths)
+			dfree (key -> lengths, MDL);
+		dfree (key, MDL);
+	}
+	if (index -> classes)
+		dfree (index -> classes, MDL);
+	if (index -> remainder)
+		dfree (index -> remainder, MDL);
+	if (index -> entries)
+		dfree (index -> entries, MDL);
+	if (index -> buckets)
+		dfree (index -> buckets, MDL);
+	dfree (index, MDL);
+}
+
+/* Data expressions that can serve as index keys: those that depend only
+   on the packet and lease, and that same_index_key() can compare. */
+
+static int index_key_expression (expr)
+	struct expression *expr;
+{
+	switch (expr -> op) {
+	      case expr_option:
+	      case expr_config_option:
+	      case expr_hardware:
+	      case expr_leased_address:
+	      case expr_const_data:
+	      case expr_const_int:
+		return 1;
+
+	      case expr_packet:
+		return (index_key_expression (expr -> data.packet.offset) &&
+			index_key_expression (expr -> data.packet.len));
+
+	      case expr_substring:
+		return (index_key_expression
+			(expr -> data.substring.expr) &&
+			index_key_expression
+			(expr -> data.substring.offset) &&
+			index_key_expression (expr -> data.substring.len));
+
+	      case expr_suffix:
+		return (index_key_expression (expr -> data.suffix.expr) &&
+			index_key_expression (expr -> data.suffix.len));
+
+	      case expr_lcase:
+		return index_key_expression (expr -> data.lcase);
+
+	      case expr_ucase:
+		return index_key_expression (expr -> data.ucase);
+
+	      default:
+		return 0;
+	}
+}
+
+static int same_index_key (a, b)
+	struct expression *a, *b;
+{
+	if (a == b)
+		return 1;
+	if (a -> op != b -> op)
+		return 0;
+
+	switch (a -> op) {
+	      case expr_option:
+		return (a -> data.option -> universe ==
+			b -> data.option -> universe &&
+			a -> data.option -> code == b -> data.option -> code);
+
+	      case expr_config_option:
+		return (a -> data.config_option -> universe ==
+			b -> data.config_option -> universe &&
+			a -> data.config_option -> code ==
+			b -> data.config_option -> code);
+
+	      case expr_hardware:
+	      case expr_leased_address:
+		return 1;
+
+	      case expr_const_data:
+		return (a -> data.const_data.len ==
+			b -> data.const_data.len &&
+			!memcmp (a -> data.const_data.data,
+				 b -> data.const_data.data,
+				 a -> data.const_data.len));
+
+	      case expr_const_int:
+		return a -> data.const_int == b -> data.const_int;
+
+	      case expr_packet:
+		return (same_index_key (a -> data.packet.offset,
+					b -> data.packet.offset) &&
+			same_index_key (a -> data.packet.len,
+					b -> data.packet.len));
+
+	      case expr_substring:
+		return (same_index_key (a -> data.substring.expr,
+					b -> data.substring.expr) &&
+			same_index_key (a -> data.substring.offset,
+					b -> data.substring.offset) &&
+			same_index_key (a -> data.substring.len,
+					b -> data.substring.len));
+
+	      case expr_suffix:
+		return (same_index_key (a -> data.suffix.expr,
+					b -> data.suffix.expr) &&
+			same_index_key (a -> data.suffix.len,
+					b -> data.suffix.len));
+
+	      case expr_lcase:
+		return same_index_key (a -> data.lcase, b -> data.lcase);
+
+	      case expr_ucase:
+		return same_index_key (a -> data.ucase, b -> data.ucase);
+
+	      default:
+		return 0;
+	}
+}
+
+/* If a match expression has the form KEY = "constant", or
+   substring (KEY, 0, N) = "constant" with a constant N bytes long,
+   return the key, the prefix length (-1 when the whole key is
+   compared) and the constant.  The comparison fails when KEY can't be
+   evaluated, and when KEY is shorter than N, so looking up the first N
+   bytes of the key's value finds exactly the classes that match. */
+
+static int index_match (expr, key, length, value)
+	struct expression *expr;
+	struct expression **key;
+	int *length;
+	struct data_string **value;
+{
+	struct expression *k, *c;
+
+	if (expr -> op != expr_equal)
+		return 0;
+	if (expr -> data.equal [1] -> op == expr_const_data) {
+		k = expr -> data.equal [0];
+		c = expr -> data.equal [1];
+	} else if (expr -> data.equal [0] -> op == expr_const_data) {
+		k = expr -> data.equal [1];
+		c = expr -> data.equal [0];
+	} else
+		return 0;
+	if (k -> op == expr_const_data || !index_key_expression (k))
+		return 0;
+
+	*length = -1;
+	if (k -> op == expr_substring &&
+	    k -> data.substring.offset -> op == expr_const_int &&
+	    k -> data.substring.offset -> data.const_int == 0 &&
+	    k -> data.substring.len -> op == expr_const_int &&
+	    k -> data.substring.len -> data.const_int ==
+	    c -> data.const_data.len && c -> data.const_data.len > 0) {
+		*length = c -> data.const_data.len;
+		k = k -> data.substring.expr;
+	}
+
+	*key = k;
+	*value = &c -> data.const_data;
+	return 1;
+}
+
+static struct class_index *collection_index (collection)
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class_index_key *key, **kp;
+	struct class_index_entry *entry;
+	struct class *class;
+	struct expression *expr;
+	struct data_string *value;
+	int length, nindexed, count, i, *lengths;
+	unsigned bucket;
+
+	index = collection -> index;
+	if (index) {
+		if (index -> generation == class_index_generation)
+			return index;
+		forget_class_index (collection);
+	}
+
+	count = nindexed = 0;
+	for (class = collection -> classes; class; class = class -> nic) {
+		count++;
+		if (class -> expr &&
+		    index_match (class -> expr, &expr, &length, &value))
+			nindexed++;
+	}
+
+	index = dmalloc (sizeof *index, MDL);
+	if (!index)
+		return (struct class_index *)0;
+	index -> generation = class_index_generation;
+	collection -> index = index;
+
+	/* With only a few indexable classes, checking each in turn is as
+	   quick, so leave the index empty. */
+	if (nindexed < CLASS_INDEX_MIN)
+		return index;
+
+	for (index -> nbuckets = 16; index -> nbuckets < nindexed;
+	     index -> nbuckets <<= 1)
+		;
+	index -> classes = dmalloc (count * sizeof (struct class *), MDL);
+	index -> remainder = dmalloc (count * sizeof (int), MDL);
+	index -> entries = dmalloc (nindexed *
+				    sizeof (struct class_index_entry), MDL);
+	index -> buckets = dmalloc (index -> nbuckets *
+				    sizeof (struct class_index_entry *), MDL);
+	if (!index -> classes || !index -> remainder ||
+	    !index -> entries || !index -> buckets)
+		goto fail;
+
+	for (class = collection -> classes; class; class = class -> nic) {
+		i = index -> count++;
+		class_reference (&index -> classes [i], class, MDL);
+		if (!class -> expr ||
+		    !index_match (class -> expr, &expr, &length, &value)) {
+			index -> remainder [index -> nremainder++] = i;
+			continue;
+		}
+
+		/* Find or add the key, and the prefix length under it. */
+		for (kp = &index -> keys; *kp; kp = &(*kp) -> next)
+			if (same_index_key ((*kp) -> expr, expr))
+				break;
+		key = *kp;
+		if (!key) {
+			key = dmalloc (sizeof *key, MDL);
+			if (!key)
+				goto fail;
+			expression_reference (&key -> expr, expr, MDL);
+			*kp = key;
+		}
+		for (i = 0; i < key -> nlengths; i++)
+			if (key -> lengths [i] == length)
+				break;
+		if (i == key -> nlengths) {
+			lengths = dmalloc ((i + 1) * sizeof (int), MDL);
+			if (!lengths)
+				goto fail;
+			if (key -> lengths) {
+				memcpy (lengths, key -> lengths,
+					i * sizeof (int));
+				dfree (key -> lengths, MDL);
+			}
+			lengths [i] = length;
+			key -> lengths = lengths;
+			key -> nlengths++;
+		}
+
+		entry = &index -> entries [index -> nindexed++];
+		entry -> key = key;
+		entry -> length = length;
+		entry -> data = value -> data;
+		entry -> len = value -> len;
+		entry -> ordinal = index -> count - 1;
+		bucket = do_string_hash (entry -> data, entry -> len,
+					 index -> nbuckets);
+		entry -> next = index -> buckets [bucket];
+		index -> buckets [bucket] = entry;
+	}
+	return index;
+
+      fail:
+	log_error ("no memory to index classes in collection %s",
+		   collection -> name);
+	forget_class_index (collection);
+	index = dmalloc (sizeof *index, MDL);
+	if (index) {
+		index -> generation = class_index_generation;
+		collection -> index = index;
+	}
+	return index;
+}
+
+static int compare_ordinals (a, b)
+	const void *a, *b;
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Collect the positions of the indexed classes whose match expressions
+   are true for this packet, in collection order.   Positions go in the
+   array *hitp holds maxhits of, which is replaced with one big enough
+   for every indexed class if it fills up. */
+
+static int index_lookup (index, packet, lease, hitp, maxhits)
+	struct class_index *index;
+	struct packet *packet;
+	struct lease *lease;
+	int **hitp;
+	int maxhits;
+{
+	struct class_index_key *key;
+	struct class_index_entry *entry;
+	struct data_string data;
+	int *hits = *hitp, nhits = 0, *nh;
+	unsigned bucket, len;
+	int i;
+
+	for (key = index -> keys; key; key = key -> next) {
+		memset (&data, 0, sizeof data);
+		if (!evaluate_data_expression (&data, packet, lease,
+					       (struct client_state *)0,
+					       packet -> options,
+					       (struct option_state *)0,
+					       lease ? &lease -> scope
+						     : &global_scope,
+					       key -> expr, MDL))
+			continue;
+
+		for (i = 0; i < key -> nlengths; i++) {
+			if (key -> lengths [i] < 0)
+				len = data.len;
+			else if ((unsigned)key -> lengths [i] <= data.len)
+				len = key -> lengths [i];
+			else
+				continue;
+
+			bucket = do_string_hash (data.data, len,
+						 index -> nbuckets);
+			for (entry = index -> buckets [bucket];
+			     entry; entry = entry -> next) {
+				if (entry -> key != key ||
+				    entry -> length != key -> lengths [i] ||
+				    entry -> len != len ||
+				    (len && memcmp (entry -> data,
+						    data.data, len)))
+					continue;
+				if (nhits == maxhits) {
+					maxhits = index -> nindexed;
+					nh = dmalloc (maxhits * sizeof (int),
+						      MDL);
+					if (!nh) {
 						log_error ("no memory for%s",
-							   " billing");
-						data_string_forget
-							(&nc -> hash_string,
-							 MDL);
-						class_dereference (&nc, MDL);
+							   " class matches");
 						data_string_forget (&data,
 								    MDL);
-						continue;
+						goto out;
 					}
-					memset (nc -> billed_leases, 0,
-						(nc -> lease_limit *
-						 sizeof (struct lease *)));
+					memcpy (nh, hits, nhits * sizeof (int));
+					*hitp = hits = nh;
 				}
-				data_string_copy (&nc -> hash_string, &data,
-						  MDL);
-				if (!class -> hash)
-				    class_new_hash(&class->hash,
-						   SCLASS_HASH_SIZE, MDL);
-				class_hash_add (class -> hash,
-						(const char *)
-						nc -> hash_string.data,
-						nc -> hash_string.len,
-						nc, MDL);
-				classify (packet, nc);
-				class_dereference (&nc, MDL);
+				hits [nhits++] = entry -> ordinal;
 			}
+		}
+		data_string_forget (&data, MDL);
+	}
+
+      out:
+	if (nhits > 1)
+		qsort (hits, nhits, sizeof (int), compare_ordinals);
+	return nhits;
+}
 
-			data_string_forget (&data, MDL);
+int check_collection (packet, lease, collection)
+	struct packet *packet;
+	struct lease *lease;
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class *class;
+	int matched = 0;
+	int hitbuf [32], *hits = hitbuf, nhits, i, j, ordinal;
+
+	index = collection_index (collection);
+	if (!index || !index -> keys) {
+		for (class = collection -> classes; class;
+		     class = class -> nic)
+			if (check_class (packet, lease, class, 1))
+				matched = 1;
+		return matched;
+	}
+
+	/* Walk the classes the index found and the unindexed classes
+	   together, so that the packet is put in its classes in the order
+	   they were declared. */
+	nhits = index_lookup (index, packet, lease, &hits,
+			      sizeof hitbuf / sizeof hitbuf [0]);
+	for (i = j = 0; i < nhits || j < index -> nremainder; ) {
+		if (j == index -> nremainder ||
+		    (i < nhits && hits [i] < index -> remainder [j])) {
+			ordinal = hits [i++];
+			if (check_class (packet, lease,
+					 index -> classes [ordinal], 0))
+				matched = 1;
+		} else {
+			ordinal = index -> remainder [j++];
+			if (check_class (packet, lease,
+					 index -> classes [ordinal], 1))
+				matched = 1;
 		}
 	}
+	if (hits != hitbuf)
+		dfree (hits, MDL);
 	return matched;
 }
 
+/* Classes named in permit lists are given small integer ids, so that
+   packets can record whether they are in them as a bit set and a permit
+   list check is a single bit test.   Other classes, including the
+   subclasses spawned for clients, are never given one: there may be any
+   number of them, and the packet's own list of its classes is short
+   enough to search.   The ids of classes that have been freed are
+   reused. */
+
+static int class_id_count;
+static int *free_class_ids;
+static int free_class_id_count, free_class_id_max;
+
+void permit_class_id (class)
+	struct class *class;
+{
+	if (class -> id)
+		return;
+	if (free_class_id_count)
+		class -> id = free_class_ids [--free_class_id_count];
+	else
+		class -> id = ++class_id_count;
+}
+
+void release_class_id (class)
+	struct class *class;
+{
+	int *ids;
+
+	if (!class -> id)
+		return;
+	if (free_class_id_count == free_class_id_max) {
+		ids = dmalloc ((free_class_id_max + 64) * sizeof (int), MDL);
+		if (!ids)
+			return;
+		if (free_class_ids) {
+			memcpy (ids, free_class_ids,
+				free_class_id_count * sizeof (int));
+			dfree (free_class_ids, MDL);
+		}
+		free_class_ids = ids;
+		free_class_id_max += 64;
+	}
+	free_class_ids [free_class_id_count++] = class -> id;
+	class -> id = 0;
+}
+
+/* Set one of the two bits for a class id in a packet's class set.
+   The set starts out in the packet, and only moves to the heap if
+   more classes are named in permit lists than fit there. */
+
+static int set_class_bit (packet, id, bit)
+	struct packet *packet;
+	int id;
+	int bit;
+{
+	unsigned char *set;
+	int size;
+
+	if (!packet -> class_set) {
+		packet -> class_set = packet -> class_set_store;
+		packet -> class_set_size = sizeof packet -> class_set_store;
+	}
+	if (id / 4 >= packet -> class_set_size) {
+		size = class_id_count / 4 + 1;
+		set = dmalloc (size, MDL);
+		if (!set)
+			return 0;
+		memcpy (set, packet -> class_set, packet -> class_set_size);
+		if (packet -> class_set != packet -> class_set_store)
+			dfree (packet -> class_set, MDL);
+		packet -> class_set = set;
+		packet -> class_set_size = size;
+	}
+	packet -> class_set [id / 4] |= 1 << ((id % 4) * 2 + bit);
+	return 1;
+}
+
+/* Return nonzero if the packet is in a class or, if subclasses is
+   nonzero, in one of its subclasses. */
+
+int packet_class_member (packet, class, subclasses)
+	struct packet *packet;
+	struct class *class;
+	int subclasses;
+{
+	int id = class -> id;
+	unsigned char bits;
+	int i;
+
+	if (id) {
+		if (id / 4 >= packet -> class_set_size)
+			return 0;
+		bits = packet -> class_set [id / 4] >> ((id % 4) * 2);
+		return bits & (subclasses ? 3 : 1);
+	}
+
+	for (i = 0; i < packet -> class_count; i++) {
+		if (packet -> classes [i] == class ||
+		    (subclasses &&
+		     packet -> classes [i] -> superclass == class))
+			return 1;
+	}
+	return 0;
+}
+
 void classify (packet, class)
 	struct packet *packet;
 	struct class *class;
 {
-	if (packet -> class_count < PACKET_MAX_CLASSES)
-		class_reference (&packet -> classes [packet -> class_count++],
-				 class, MDL);
-	else
-		log_error ("too many classes match %s",
+	struct class **classes;
+	int max;
+
+	if (packet -> class_count == packet -> class_max) {
+		if (!packet -> classes) {
+			packet -> classes = packet -> class_store;
+			packet -> class_max = PACKET_MAX_CLASSES;
+		} else {
+			max = packet -> class_max * 2;
+			classes = dmalloc (max * sizeof (struct class *), MDL);
+			if (!classes) {
+				log_error ("no memory to classify %s",
+				      print_hw_addr (packet -> raw -> htype,
+						     packet -> raw -> hlen,
+						     packet -> raw -> chaddr));
+				return;
+			}
+			memcpy (classes, packet -> classes,
+				packet -> class_count *
+				sizeof (struct class *));
+			if (packet -> classes != packet -> class_store)
+				dfree (packet -> classes, MDL);
+			packet -> classes = classes;
+			packet -> class_max = max;
+		}
+	}
+
+	if ((class -> id && !set_class_bit (packet, class -> id, 0)) ||
+	    (class -> superclass && class -> superclass -> id &&
+	     !set_class_bit (packet, class -> superclass -> id, 1))) {
+		log_error ("no memory to classify %s",
 		      print_hw_addr (packet -> raw -> htype,
 				     packet -> raw -> hlen,
 				     packet -> raw -> chaddr));
+		return;
+	}
+	class_reference (&packet -> classes [packet -> class_count++],
+			 class, MDL);
 }
 
 
@@ -221,6 +925,7 @@ isc_result_t unlink_class(struct class **class) {
 				}
 				cp->nic = 0;
 				class_dereference(class, MDL);
+				invalidate_class_indexes();
 
 				return ISC_R_SUCCESS;
 			}
@@ -177,7 +177,11 @@ isc_result_t read_conf_file (const char *filename, struct group *group,
 	if (status != ISC_R_SUCCESS || cfile == NULL)
 		return status;
 
-	if (leasep)
+	/* A lease file that starts with a NUL is a binary journal. */
+	if (leasep && cfile->buflen > 0 && cfile->inbuf[0] == '\0')
+		status = read_lease_journal (filename, cfile->inbuf,
+					     cfile->buflen);
+	else if (leasep)
 		status = lease_file_subparse (cfile);
 	else
 		status = conf_file_subparse (cfile, group, group_type);
@@ -840,6 +844,7 @@ int parse_statement (cfile, group, type, host_decl, declaration)
 		if (!et)
 			return declaration;
 	      insert_statement:
+		statements_generation++;
 		if (group -> statements) {
 			int multi = 0;
 
@@ -1625,6 +1630,8 @@ void get_permit(cfile, permit_head, is_allow, valid_from, valid_until)
 		find_class(&permit->class, val, MDL);
 		if (!permit->class)
 			parse_warn(cfile, "no such class: %s", val);
+		else
+			permit_class_id(permit->class);
 		break;
 
 	      case AFTER:
@@ -2479,6 +2486,8 @@ int parse_class_declaration (cp, cfile, group, type)
 				print_expression ("class match",
 						  class -> expr);
 #endif
+				compile_expression (class -> expr,
+						    context_boolean);
 				parse_semi (cfile);
 			}
 		} else if (token == SPAWN) {
@@ -2489,8 +2498,22 @@ int parse_class_declaration (cp, cfile, group, type)
 				skip_to_semi (cfile);
 				break;
 			}
-			class -> spawning = 1;
 			token = next_token (&val, NULL, cfile);
+			if (token == LIMIT) {
+				token = next_token (&val, NULL, cfile);
+				if (token != NUMBER) {
+					parse_warn (cfile,
+						    "expecting a number");
+					if (token != SEMI)
+						skip_to_semi (cfile);
+					break;
+				}
+				class -> spawn_limit = atoi (val);
+				if (!parse_semi (cfile))
+					break;
+				continue;
+			}
+			class -> spawning = 1;
 			if (token != WITH) {
 				parse_warn (cfile,
 					    "expecting with after spawn");
@@ -2520,6 +2543,8 @@ int parse_class_declaration (cp, cfile, group, type)
 				print_expression ("class submatch",
 						  class -> submatch);
 #endif
+				compile_expression (class -> submatch,
+						    context_data);
 				parse_semi (cfile);
 			}
 		} else if (token == LEASE) {
@@ -2568,6 +2593,14 @@ int parse_class_declaration (cp, cfile, group, type)
 				class_dereference(&theclass, MDL);
 			}
 		} else {
+			struct class *thesubclass = NULL;
+
+			if (class_hash_lookup(&thesubclass, pc->hash,
+					      (char *)class->hash_string.data,
+					      class->hash_string.len, MDL)) {
+				forget_spawned_class(thesubclass);
+				class_dereference(&thesubclass, MDL);
+			}
 			class_hash_delete(pc->hash,
 					  (char *)class->hash_string.data,
 					  class->hash_string.len, MDL);
@@ -2584,6 +2617,9 @@ int parse_class_declaration (cp, cfile, group, type)
 		}
 	}
 
+	/* The class may be new or have a new match expression. */
+	invalidate_class_indexes ();
+
 	if (cp)				/* should always be 0??? */
 		status = class_reference (cp, class, MDL);
 	class_dereference (&class, MDL);
@@ -29,17 +29,29 @@
 #include "dhcpd.h"
 #include <ctype.h>
 #include <errno.h>
-
-#define LEASE_REWRITE_PERIOD 3600
+#include <signal.h>
+#include <sys/wait.h>
+#if defined (ASYNC_COMMIT)
+#include <pthread.h>
+#endif
 
 static isc_result_t write_binding_scope(FILE *db_file, struct binding *bnd,
 					char *prepend);
+static void rewrite_lease_file(void);
+static void abandon_lease_file_rewrite(void);
 
 FILE *db_file;
 
 static int counting = 0;
 static int count = 0;
 TIME write_time;
+static off_t write_size;
+
+/* The lease file rewrite in progress, if any. */
+static pid_t rewrite_pid = -1;
+static char rewrite_fname[512];
+static off_t rewrite_offset;
+static ino_t rewrite_ino;
 int lease_file_is_corrupt = 0;
 
 /* Write a single binding scope value in parsable format.
@@ -93,6 +105,370 @@ write_binding_scope(FILE *db_file, struct binding *bnd, char *prepend) {
 	return ISC_R_SUCCESS;
 }
 
+/* Binary lease journal.
+
+   When lease-file-format is binary, leases and IAs are appended to the
+   lease file as checksummed binary records instead of text declarations,
+   so that they can be loaded again at startup without going through the
+   lexer and the declaration parsers.  Everything else (hosts, groups,
+   classes, failover state and so on) is still written as text, as are
+   leases carrying state the records don't hold.
+
+   A record is a NUL, which never appears in a text lease file, a one
+   octet record type, a four octet payload length, the payload and a four
+   octet checksum of everything after the NUL.  Integers are in network
+   byte order.  The text between records is parsed as it always has been.
+   The file begins with a header record, which is how the reader tells
+   the two formats apart.
+
+   Once an IA has been written out in full, a renewal that changes
+   nothing but its lifetimes is written as an IA timers record, which
+   holds only the timers and is applied to the IA the reader already
+   has.  Version 1 files simply never contain them. */
+
+#define JOURNAL_MAGIC		"ISC-DHCP-LEASES"
+#define JOURNAL_VERSION		2
+
+#define JOURNAL_HEADER		1
+#define JOURNAL_LEASE		2
+#define JOURNAL_IA		3
+#define JOURNAL_IA_TIMERS	4
+
+#define JOURNAL_BINDING_END	0
+#define JOURNAL_BINDING_DATA	1
+#define JOURNAL_BINDING_NUMERIC	2
+#define JOURNAL_BINDING_BOOLEAN	3
+
+/* Octets around the payload: NUL, type and length before, checksum
+   after. */
+#define JOURNAL_OVERHEAD	10
+
+static unsigned char *journal_buf;
+static unsigned journal_len, journal_max;
+
+/* Full IA records are numbered.  Each iasubopt remembers the record it
+   was last written in (journal_gen) and a checksum of everything that
+   record held for it other than timers (journal_sum).  Records numbered
+   journal_gen_base or lower belong to an earlier lease file. */
+static u_int32_t journal_gen, journal_gen_base;
+
+/* 32 bit FNV-1a, continuing from sum. */
+static u_int32_t
+journal_sum(u_int32_t sum, const unsigned char *data, unsigned len) {
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		sum ^= data[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+static u_int32_t
+journal_checksum(const unsigned char *data, unsigned len) {
+	return journal_sum(2166136261U, data, len);
+}
+
+static void
+journal_put(const void *data, unsigned len) {
+	unsigned char *buf;
+	unsigned max;
+
+	if (journal_len + len > journal_max) {
+		max = journal_max ? journal_max : 1024;
+		while (max < journal_len + len)
+			max *= 2;
+		buf = dmalloc(max, MDL);
+		if (buf == NULL)
+			log_fatal("No memory for lease journal record.");
+		if (journal_buf != NULL) {
+			memcpy(buf, journal_buf, journal_len);
+			dfree(journal_buf, MDL);
+		}
+		journal_buf = buf;
+		journal_max = max;
+	}
+	memcpy(journal_buf + journal_len, data, len);
+	journal_len += len;
+}
+
+static void
+journal_put8(unsigned val) {
+	unsigned char buf[1];
+
+	buf[0] = val;
+	journal_put(buf, 1);
+}
+
+static void
+journal_put16(unsigned val) {
+	unsigned char buf[2];
+
+	putUShort(buf, val);
+	journal_put(buf, 2);
+}
+
+static void
+journal_put32(u_int32_t val) {
+	unsigned char buf[4];
+
+	putULong(buf, val);
+	journal_put(buf, 4);
+}
+
+static void
+journal_put64(isc_uint64_t val) {
+	journal_put32((u_int32_t)(val >> 32));
+	journal_put32((u_int32_t)val);
+}
+
+static void
+journal_start(unsigned type) {
+	journal_len = 0;
+	journal_put8(0);
+	journal_put8(type);
+	journal_put32(0);
+}
+
+static int
+journal_finish(void) {
+	putULong(journal_buf + 2, journal_len - (JOURNAL_OVERHEAD - 4));
+	journal_put32(journal_checksum(journal_buf + 1, journal_len - 1));
+
+	if (fwrite(journal_buf, journal_len, 1, db_file) != 1)
+		return 0;
+	return 1;
+}
+
+/* The binding scope counterpart of write_binding_scope(); values that
+   can't be written there are complained about and skipped here too. */
+static void
+journal_put_scope(struct binding_scope *scope) {
+	struct binding *bnd;
+	unsigned len;
+
+	for (bnd = scope ? scope->bindings : NULL; bnd; bnd = bnd->next) {
+		if (bnd->value == NULL)
+			continue;
+
+		if (bnd->value->type == binding_data) {
+			if (bnd->value->value.data.data == NULL)
+				continue;
+			journal_put8(JOURNAL_BINDING_DATA);
+		} else if (bnd->value->type == binding_numeric) {
+			journal_put8(JOURNAL_BINDING_NUMERIC);
+		} else if (bnd->value->type == binding_boolean) {
+			journal_put8(JOURNAL_BINDING_BOOLEAN);
+		} else if (bnd->value->type == binding_dns) {
+			log_error("%s: persistent dns values not supported.",
+				  bnd->name);
+			continue;
+		} else if (bnd->value->type == binding_function) {
+			log_error("%s: persistent functions not supported.",
+				  bnd->name);
+			continue;
+		} else {
+			log_fatal("%s: unknown binding type %d", bnd->name,
+				  bnd->value->type);
+		}
+
+		len = strlen(bnd->name);
+		journal_put16(len);
+		journal_put(bnd->name, len);
+
+		if (bnd->value->type == binding_data) {
+			journal_put32(bnd->value->value.data.len);
+			journal_put(bnd->value->value.data.data,
+				    bnd->value->value.data.len);
+		} else if (bnd->value->type == binding_numeric) {
+			journal_put64((isc_uint64_t)bnd->value->value.intval);
+		} else {
+			journal_put8(bnd->value->value.intval ? 1 : 0);
+		}
+	}
+	journal_put8(JOURNAL_BINDING_END);
+}
+
+static int
+journal_write_header(void) {
+	/* Nothing in the new file can be written as timers alone. */
+	journal_gen_base = journal_gen;
+
+	journal_start(JOURNAL_HEADER);
+	journal_put(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) - 1);
+	journal_put32(JOURNAL_VERSION);
+	return journal_finish();
+}
+
+/* Agent options, billing classes and on statements only have a text
+   form, so leases that carry them are written out as text. */
+static int
+journal_lease_ok(const struct lease *lease) {
+	return ((lease_file_format == LEASE_FILE_BINARY) &&
+		((lease->billing_class == NULL) ||
+		 (lease->ends <= cur_time)) &&
+		(lease->agent_options == NULL) &&
+		(lease->on_star.on_expiry == NULL) &&
+		(lease->on_star.on_release == NULL));
+}
+
+static int
+journal_write_lease(const struct lease *lease) {
+	binding_state_t state, next, rewind;
+	unsigned len;
+
+	/* Out of range states are written the way write_lease() would
+	   have had them read back. */
+	state = lease->binding_state;
+	if ((state <= 0) || (state > FTS_LAST))
+		state = FTS_ABANDONED;
+	next = lease->next_binding_state;
+	if ((next <= 0) || (next > FTS_LAST))
+		next = FTS_ABANDONED;
+	rewind = lease->rewind_binding_state;
+	if ((rewind <= 0) || (rewind > FTS_LAST))
+		rewind = state;
+
+	journal_start(JOURNAL_LEASE);
+	journal_put8(lease->ip_addr.len);
+	journal_put(lease->ip_addr.iabuf, lease->ip_addr.len);
+	journal_put64((isc_uint64_t)lease->starts);
+	journal_put64((isc_uint64_t)lease->ends);
+	journal_put64((isc_uint64_t)lease->tstp);
+	journal_put64((isc_uint64_t)lease->tsfp);
+	journal_put64((isc_uint64_t)lease->atsfp);
+	journal_put64((isc_uint64_t)lease->cltt);
+	journal_put8(state);
+	journal_put8(next);
+	journal_put8(rewind);
+	journal_put8(lease->flags & (RESERVED_LEASE | BOOTP_LEASE));
+	journal_put8(lease->hardware_addr.hlen);
+	journal_put(lease->hardware_addr.hbuf, lease->hardware_addr.hlen);
+	journal_put32(lease->uid_len);
+	journal_put(lease->uid, lease->uid_len);
+	if (lease->client_hostname &&
+	    db_printable((unsigned char *)lease->client_hostname)) {
+		len = strlen(lease->client_hostname);
+		journal_put16(len);
+		journal_put(lease->client_hostname, len);
+	} else {
+		journal_put16(0);
+	}
+	journal_put_scope(lease->scope);
+
+	return journal_finish();
+}
+
+static int
+journal_ia_ok(const struct ia_xx *ia) {
+	int i;
+
+	if (lease_file_format != LEASE_FILE_BINARY)
+		return 0;
+	if ((ia->ia_type != D6O_IA_NA) && (ia->ia_type != D6O_IA_TA) &&
+	    (ia->ia_type != D6O_IA_PD))
+		return 0;
+	for (i = 0; i < ia->num_iasubopt; i++) {
+		if (ia->iasubopt[i]->on_star.on_expiry ||
+		    ia->iasubopt[i]->on_star.on_release)
+			return 0;
+	}
+	return 1;
+}
+
+static TIME
+journal_end_time(const struct iasubopt *iasubopt) {
+	if ((iasubopt->state == FTS_ACTIVE) ||
+	    (iasubopt->state == FTS_ABANDONED) ||
+	    (iasubopt->hard_lifetime_end_time != 0))
+		return iasubopt->hard_lifetime_end_time;
+	return iasubopt->soft_lifetime_end_time;
+}
+
+/* The full record is always built, since that is how its checksums are
+   found.  If every iasubopt was last written in the same full record of
+   this file, is still active and hasn't changed since but for timers,
+   the reader already has this IA and only the timers are written. */
+static int
+journal_write_ia(const struct ia_xx *ia) {
+	struct iasubopt *iasubopt;
+	u_int32_t gen, ia_sum, sum;
+	unsigned head, mark;
+	int i, timers_only;
+
+	gen = (ia->num_iasubopt > 0) ? ia->iasubopt[0]->journal_gen : 0;
+	timers_only = (gen > journal_gen_base);
+
+	journal_start(JOURNAL_IA);
+	journal_put16(ia->ia_type);
+	journal_put16(ia->iaid_duid.len);
+	journal_put(ia->iaid_duid.data, ia->iaid_duid.len);
+	head = journal_len;
+	journal_put64((isc_uint64_t)ia->cltt);
+	journal_put32(ia->num_iasubopt);
+
+	/* The IA's type, IAID, DUID and number of iasubopts go into the
+	   checksum of each of them. */
+	ia_sum = journal_checksum(journal_buf + 6, head - 6);
+	ia_sum = journal_sum(ia_sum, journal_buf + head + 8, 4);
+
+	for (i = 0; i < ia->num_iasubopt; i++) {
+		iasubopt = ia->iasubopt[i];
+
+		if ((iasubopt->state <= 0) || (iasubopt->state > FTS_LAST)) {
+			log_fatal("Unknown iasubopt state %d at %s:%d",
+				  iasubopt->state, MDL);
+		}
+
+		mark = journal_len;
+		journal_put(&iasubopt->addr, sizeof(iasubopt->addr));
+		journal_put8(iasubopt->plen);
+		journal_put8(iasubopt->state);
+		journal_put32(iasubopt->prefer);
+		journal_put32(iasubopt->valid);
+		journal_put64((isc_uint64_t)journal_end_time(iasubopt));
+		journal_put_scope(iasubopt->scope);
+
+		/* Everything but the lifetimes and end time. */
+		sum = journal_sum(ia_sum, journal_buf + mark,
+				  sizeof(iasubopt->addr) + 2);
+		mark += sizeof(iasubopt->addr) + 18;
+		sum = journal_sum(sum, journal_buf + mark, journal_len - mark);
+
+		if ((iasubopt->journal_gen != gen) ||
+		    (iasubopt->journal_sum != sum) ||
+		    (iasubopt->state != FTS_ACTIVE))
+			timers_only = 0;
+		iasubopt->journal_sum = sum;
+	}
+
+	if (timers_only) {
+		journal_start(JOURNAL_IA_TIMERS);
+		journal_put16(ia->ia_type);
+		journal_put16(ia->iaid_duid.len);
+		journal_put(ia->iaid_duid.data, ia->iaid_duid.len);
+		journal_put64((isc_uint64_t)ia->cltt);
+		journal_put32(ia->num_iasubopt);
+		for (i = 0; i < ia->num_iasubopt; i++) {
+			iasubopt = ia->iasubopt[i];
+			journal_put(&iasubopt->addr, sizeof(iasubopt->addr));
+			journal_put32(iasubopt->prefer);
+			journal_put32(iasubopt->valid);
+			journal_put64((isc_uint64_t)
+				      journal_end_time(iasubopt));
+		}
+		return journal_finish();
+	}
+
+	if (!journal_finish())
+		return 0;
+
+	gen = ++journal_gen;
+	for (i = 0; i < ia->num_iasubopt; i++)
+		ia->iasubopt[i]->journal_gen = gen;
+	return 1;
+}
+
 /* Write the specified lease to the current lease database file. */
 
 int write_lease (lease)
@@ -111,6 +487,17 @@ int write_lease (lease)
 
 	if (counting)
 		++count;
+
+	if (journal_lease_ok(lease)) {
+		if (!journal_write_lease(lease)) {
+			log_info("write_lease: unable to write lease %s",
+				 piaddr(lease->ip_addr));
+			lease_file_is_corrupt = 1;
+			return 0;
+		}
+		return 1;
+	}
+
 	errno = 0;
 	fprintf (db_file, "lease %s {", piaddr (lease -> ip_addr));
 	if (errno) {
@@ -560,6 +947,20 @@ write_ia(const struct ia_xx *ia) {
 		++count;
 	}
 
+	if (journal_ia_ok(ia)) {
+		if (!journal_write_ia(ia)) {
+			goto error_exit;
+		}
+		fflush(db_file);
+		return 1;
+	}
+
+	/* A text declaration replaces whatever the journal last said
+	 * about this IA. */
+	for (i = 0; i < ia->num_iasubopt; i++) {
+		ia->iasubopt[i]->journal_gen = 0;
+	}
+
 	s = format_lease_id(ia->iaid_duid.data, ia->iaid_duid.len,
 			    lease_id_format, MDL);
 	if (s == NULL) {
@@ -910,6 +1311,12 @@ write_named_billing_class(const void *key, unsigned len, void *object)
 				return ISC_R_IOERROR;
 		}
 
+		if (class->spawn_limit > 0) {
+			if (fprintf(db_file, "  spawn limit %d;\n",
+				    class->spawn_limit) <= 0)
+				return ISC_R_IOERROR;
+		}
+
 		if (class->expr != 0) {
 			if (fprintf(db_file, "  match if ") <= 0)
 				return ISC_R_IOERROR;
@@ -1020,6 +1427,26 @@ int write_billing_class (class)
 	return !errors;
 }
 
+/* Whether anything has been written to the lease file since it was
+   last rewritten and it has either been lease-file-rewrite-interval
+   seconds or the file has grown by lease-file-rewrite-size octets. */
+static int
+lease_file_rewrite_due(void)
+{
+	struct stat st;
+
+	if ((count == 0) || (rewrite_pid > 0))
+		return 0;
+	if ((lease_rewrite_period != 0) &&
+	    (cur_time - write_time > lease_rewrite_period))
+		return 1;
+	if ((lease_rewrite_size != 0) &&
+	    (fstat(fileno(db_file), &st) == 0) &&
+	    (st.st_size - write_size > lease_rewrite_size))
+		return 1;
+	return 0;
+}
+
 /* Commit leases after a timeout. */
 void commit_leases_timeout (void *foo)
 {
@@ -1043,19 +1470,18 @@ int commit_leases ()
 		return (0);
 	}
 
-	/* If we haven't rewritten the lease database in over an
-	   hour, rewrite it now.  (The length of time should probably
-	   be configurable. */
-	if (count && cur_time - write_time > LEASE_REWRITE_PERIOD) {
+	/* If the lease database is due to be rewritten, start doing
+	   that now. */
+	if (lease_file_rewrite_due()) {
 		count = 0;
 		write_time = cur_time;
-		new_lease_file(0);
+		rewrite_lease_file();
 	}
 	return (1);
 }
 
 /*
- * rewrite the lease file about once an hour
+ * rewrite the lease file about once every lease-file-rewrite-interval
  * This is meant as a quick patch for ticket 24887.  It allows
  * us to rotate the v6 lease file without adding too many fsync()
  * calls.  In the future wes should revisit this area and add
@@ -1063,12 +1489,777 @@ int commit_leases ()
  */
 int commit_leases_timed()
 {
-	if ((count != 0) && (cur_time - write_time > LEASE_REWRITE_PERIOD)) {
+	if (lease_file_rewrite_due()) {
 		return (commit_leases());
 	}
 	return (1);
 }
 
+#if defined (ASYNC_COMMIT)
+/*
+ * Group commit of the lease file.  Writing leases only fills the stdio
+ * buffer and the kernel page cache; the fsync() that makes them durable
+ * is what stalls the server, so commit_leases_async() flushes the buffer
+ * and leaves the fsync() to a writer thread.  Each request is numbered
+ * and the thread reports the newest number its fsync() covered through
+ * a pipe that the dispatch loop watches.  Requests made while an fsync()
+ * is in progress are all covered by the next one, so the batch grows
+ * with the load.  The thread uses nothing but the variables below.
+ */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static int commit_fd = -1;
+static u_int32_t commit_requested;
+static u_int32_t commit_synced;
+static int commit_errno;
+
+static int commit_started;
+static int commit_pipe[2] = { -1, -1 };
+static void (*commit_callback)(u_int32_t);
+static omapi_object_type_t *commit_type;
+static omapi_object_t *commit_object;
+
+static void *
+commit_thread(void *arg) {
+	u_int32_t target;
+	int fd, err;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&commit_lock);
+		while (commit_synced == commit_requested)
+			pthread_cond_wait(&commit_cond, &commit_lock);
+		target = commit_requested;
+		fd = commit_fd;
+		pthread_mutex_unlock(&commit_lock);
+
+		err = 0;
+		if ((dont_use_fsync == 0) && (fsync(fd) < 0))
+			err = errno;
+
+		pthread_mutex_lock(&commit_lock);
+		commit_synced = target;
+		if (err != 0)
+			commit_errno = err;
+		pthread_cond_broadcast(&commit_cond);
+		pthread_mutex_unlock(&commit_lock);
+
+		/* If the pipe is full the dispatch loop is already due. */
+		if (write(commit_pipe[1], &c, 1) < 0)
+			continue;
+	}
+	return NULL;
+}
+
+static int
+commit_readsocket(omapi_object_t *h) {
+	return commit_pipe[0];
+}
+
+/* The writer thread has finished an fsync(). */
+static isc_result_t
+commit_done(omapi_object_t *h) {
+	char buf[64];
+	u_int32_t synced;
+	int err;
+
+	while (read(commit_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&commit_lock);
+	synced = commit_synced;
+	err = commit_errno;
+	commit_errno = 0;
+	pthread_mutex_unlock(&commit_lock);
+
+	if (err != 0) {
+		errno = err;
+		log_info("commit_leases: unable to commit, fsync(): %m");
+	}
+	if (commit_callback != NULL)
+		(*commit_callback)(synced);
+	return ISC_R_SUCCESS;
+}
+
+/* Wait for the writer thread to sync everything it has been given. */
+static void
+commit_wait(void) {
+	if (commit_started <= 0)
+		return;
+
+	pthread_mutex_lock(&commit_lock);
+	while (commit_synced != commit_requested)
+		pthread_cond_wait(&commit_cond, &commit_lock);
+	pthread_mutex_unlock(&commit_lock);
+}
+
+/*
+ * Start the writer thread the first time it's needed, which is after
+ * the server has gone into the background.  Returns 0 if commits have
+ * to be done synchronously.
+ */
+static int
+commit_thread_start(void) {
+	pthread_t thread;
+	sigset_t all, old;
+	isc_result_t status;
+	int i, rv;
+
+	if (commit_started != 0)
+		return (commit_started > 0);
+	commit_started = -1;
+
+	if (pipe(commit_pipe) < 0) {
+		log_error("Can't create lease commit pipe: %m");
+		return 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if ((fcntl(commit_pipe[i], F_SETFL, O_NONBLOCK) < 0) ||
+		    (fcntl(commit_pipe[i], F_SETFD, FD_CLOEXEC) < 0)) {
+			log_error("Can't set up lease commit pipe: %m");
+			goto fail;
+		}
+	}
+
+	status = omapi_object_type_register(&commit_type, "lease-commit",
+					    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+					    sizeof(*commit_object), 0, RC_MISC);
+	if (status == ISC_R_SUCCESS)
+		status = omapi_object_allocate(&commit_object, commit_type,
+					       0, MDL);
+	if (status == ISC_R_SUCCESS)
+		status = omapi_register_io_object(commit_object,
+						  commit_readsocket, 0,
+						  commit_done, 0, 0);
+	if (status != ISC_R_SUCCESS) {
+		log_error("Can't register lease commit pipe: %s",
+			  isc_result_totext(status));
+		goto fail;
+	}
+
+	/* Signals are for the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rv = pthread_create(&thread, NULL, commit_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rv != 0) {
+		errno = rv;
+		log_error("Can't start lease commit thread: %m");
+		omapi_unregister_io_object(commit_object);
+		goto fail;
+	}
+	pthread_detach(thread);
+
+	commit_started = 1;
+	return 1;
+
+      fail:
+	close(commit_pipe[0]);
+	close(commit_pipe[1]);
+	return 0;
+}
+
+/*
+ * Commit any leases that have been written out, without waiting for
+ * them to reach the disk.  Returns a commit number, and done is called
+ * with a number at least as large once the leases are on stable storage.
+ * Returns 0 if the commit has already been made, or has failed.
+ */
+u_int32_t
+commit_leases_async(void (*done)(u_int32_t)) {
+	u_int32_t ticket;
+
+#if defined (TRACING)
+	if (trace_playback()) {
+		commit_leases();
+		return 0;
+	}
+#endif
+	if (!commit_thread_start()) {
+		commit_leases();
+		return 0;
+	}
+
+	if (fflush(db_file) == EOF) {
+		log_info("commit_leases: unable to commit, fflush(): %m");
+		return 0;
+	}
+
+	commit_callback = done;
+	pthread_mutex_lock(&commit_lock);
+	commit_fd = fileno(db_file);
+	if (++commit_requested == 0)
+		++commit_requested;
+	ticket = commit_requested;
+	pthread_cond_signal(&commit_cond);
+	pthread_mutex_unlock(&commit_lock);
+
+	if (lease_file_rewrite_due()) {
+		count = 0;
+		write_time = cur_time;
+		rewrite_lease_file();
+	}
+	return ticket;
+}
+#endif /* ASYNC_COMMIT */
+
+/* Reading the binary lease journal back in. */
+
+struct journal_cursor {
+	const unsigned char *data;
+	unsigned len;
+	unsigned pos;
+	int bad;
+};
+
+static const unsigned char *
+journal_get(struct journal_cursor *jc, unsigned len) {
+	const unsigned char *p;
+
+	if (jc->bad || (len > jc->len - jc->pos)) {
+		jc->bad = 1;
+		return NULL;
+	}
+	p = jc->data + jc->pos;
+	jc->pos += len;
+	return p;
+}
+
+static unsigned
+journal_get8(struct journal_cursor *jc) {
+	const unsigned char *p = journal_get(jc, 1);
+
+	return p ? p[0] : 0;
+}
+
+static unsigned
+journal_get16(struct journal_cursor *jc) {
+	const unsigned char *p = journal_get(jc, 2);
+
+	return p ? getUShort(p) : 0;
+}
+
+static u_int32_t
+journal_get32(struct journal_cursor *jc) {
+	const unsigned char *p = journal_get(jc, 4);
+
+	return p ? getULong(p) : 0;
+}
+
+static isc_uint64_t
+journal_get64(struct journal_cursor *jc) {
+	isc_uint64_t val;
+
+	val = journal_get32(jc);
+	return (val << 32) | journal_get32(jc);
+}
+
+/* Read the bindings written by journal_put_scope() into *scope, which
+   is allocated if there are any. */
+static void
+journal_get_scope(struct journal_cursor *jc, struct binding_scope **scope) {
+	struct binding *bnd;
+	struct binding_value *nv;
+	struct data_string *data;
+	const unsigned char *p;
+	char *name;
+	unsigned type, len;
+
+	for (;;) {
+		type = journal_get8(jc);
+		if (jc->bad || (type == JOURNAL_BINDING_END))
+			return;
+
+		len = journal_get16(jc);
+		p = journal_get(jc, len);
+		if ((p == NULL) || (len == 0)) {
+			jc->bad = 1;
+			return;
+		}
+		name = dmalloc(len + 1, MDL);
+		if (name == NULL)
+			log_fatal("No memory for binding name.");
+		memcpy(name, p, len);
+
+		nv = NULL;
+		if (!binding_value_allocate(&nv, MDL))
+			log_fatal("no memory for binding value.");
+
+		switch (type) {
+		      case JOURNAL_BINDING_DATA:
+			len = journal_get32(jc);
+			p = journal_get(jc, len);
+			if (p == NULL)
+				break;
+			nv->type = binding_data;
+			data = &nv->value.data;
+			if (!buffer_allocate(&data->buffer, len + 1, MDL))
+				log_fatal("No memory for binding.");
+			memcpy(data->buffer->data, p, len);
+			data->data = data->buffer->data;
+			data->len = len;
+			data->terminated = 1;
+			break;
+
+		      case JOURNAL_BINDING_NUMERIC:
+			nv->type = binding_numeric;
+			nv->value.intval = (long)journal_get64(jc);
+			break;
+
+		      case JOURNAL_BINDING_BOOLEAN:
+			nv->type = binding_boolean;
+			nv->value.boolean = journal_get8(jc);
+			break;
+
+		      default:
+			jc->bad = 1;
+			break;
+		}
+
+		if (jc->bad) {
+			binding_value_dereference(&nv, MDL);
+			dfree(name, MDL);
+			return;
+		}
+
+		if (*scope == NULL) {
+			if (!binding_scope_allocate(scope, MDL))
+				log_fatal("Out of memory for lease binding "
+					  "scope.");
+			bnd = NULL;
+		} else
+			bnd = find_binding(*scope, name);
+
+		if (bnd == NULL) {
+			bnd = dmalloc(sizeof(*bnd), MDL);
+			if (bnd == NULL)
+				log_fatal("No memory for lease binding.");
+			bnd->name = name;
+			binding_value_reference(&bnd->value, nv, MDL);
+			bnd->next = (*scope)->bindings;
+			(*scope)->bindings = bnd;
+		} else {
+			dfree(name, MDL);
+			binding_value_dereference(&bnd->value, MDL);
+			binding_value_reference(&bnd->value, nv, MDL);
+		}
+		binding_value_dereference(&nv, MDL);
+	}
+}
+
+/* The binary equivalent of parse_lease_declaration() followed by
+   enter_lease(). */
+static void
+journal_replay_lease(struct journal_cursor *jc) {
+	struct lease *lease;
+	const unsigned char *p;
+	unsigned len;
+
+	lease = NULL;
+	if (lease_allocate(&lease, MDL) != ISC_R_SUCCESS)
+		log_fatal("No memory for lease.");
+
+	len = journal_get8(jc);
+	if (len > sizeof(lease->ip_addr.iabuf))
+		jc->bad = 1;
+	if ((p = journal_get(jc, len)) != NULL) {
+		memcpy(lease->ip_addr.iabuf, p, len);
+		lease->ip_addr.len = len;
+	}
+
+	lease->starts = (TIME)journal_get64(jc);
+	lease->ends = (TIME)journal_get64(jc);
+	lease->tstp = (TIME)journal_get64(jc);
+	lease->tsfp = (TIME)journal_get64(jc);
+	lease->atsfp = (TIME)journal_get64(jc);
+	lease->cltt = (TIME)journal_get64(jc);
+
+	lease->binding_state = journal_get8(jc);
+	lease->next_binding_state = journal_get8(jc);
+	lease->rewind_binding_state = journal_get8(jc);
+	if ((lease->binding_state <= 0) ||
+	    (lease->binding_state > FTS_LAST) ||
+	    (lease->next_binding_state <= 0) ||
+	    (lease->next_binding_state > FTS_LAST) ||
+	    (lease->rewind_binding_state <= 0) ||
+	    (lease->rewind_binding_state > FTS_LAST))
+		jc->bad = 1;
+
+	lease->flags |= journal_get8(jc) & (RESERVED_LEASE | BOOTP_LEASE);
+
+	len = journal_get8(jc);
+	if (len > sizeof(lease->hardware_addr.hbuf))
+		jc->bad = 1;
+	if ((p = journal_get(jc, len)) != NULL) {
+		memcpy(lease->hardware_addr.hbuf, p, len);
+		lease->hardware_addr.hlen = len;
+	}
+
+	len = journal_get32(jc);
+	if (((p = journal_get(jc, len)) != NULL) && (len > 0)) {
+		if (len < sizeof(lease->uid_buf)) {
+			lease->uid = lease->uid_buf;
+			lease->uid_max = sizeof(lease->uid_buf);
+		} else {
+			lease->uid = dmalloc(len, MDL);
+			if (lease->uid == NULL)
+				log_fatal("no space for uid");
+			lease->uid_max = len;
+		}
+		memcpy(lease->uid, p, len);
+		lease->uid_len = len;
+	}
+
+	len = journal_get16(jc);
+	if (((p = journal_get(jc, len)) != NULL) && (len > 0)) {
+		lease->client_hostname = dmalloc(len + 1, MDL);
+		if (lease->client_hostname == NULL)
+			log_fatal("no memory for client hostname.");
+		memcpy(lease->client_hostname, p, len);
+	}
+
+	journal_get_scope(jc, &lease->scope);
+
+	if (!jc->bad) {
+		if (lease->tstp == 0)
+			lease->tstp = lease->ends;
+		enter_lease(lease);
+	}
+	lease_dereference(&lease, MDL);
+}
+
+/* The binary equivalent of parse_ia_na_declaration() and friends. */
+static void
+journal_replay_ia(struct journal_cursor *jc) {
+#if defined (DHCPv6)
+	struct ia_xx *ia, *old_ia;
+	struct iasubopt *iasubopt;
+	struct ipv6_pool *pool;
+	struct binding_scope *scope;
+	ia_hash_t *ia_active;
+	const unsigned char *p, *addr;
+	const char *kind;
+	char addr_buf[sizeof("ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255")];
+	binding_state_t state;
+	u_int32_t iaid, prefer, valid, count;
+	unsigned type, len, plen;
+	TIME end_time;
+
+	type = journal_get16(jc);
+	len = journal_get16(jc);
+	p = journal_get(jc, len);
+	if ((p == NULL) || (len <= 5)) {
+		jc->bad = 1;
+		return;
+	}
+
+	switch (type) {
+	      case D6O_IA_NA:
+		ia_active = ia_na_active;
+		kind = "IA_NA";
+		break;
+	      case D6O_IA_TA:
+		ia_active = ia_ta_active;
+		kind = "IA_TA";
+		break;
+	      case D6O_IA_PD:
+		ia_active = ia_pd_active;
+		kind = "IA_PD";
+		break;
+	      default:
+		jc->bad = 1;
+		return;
+	}
+
+	if (local_family != AF_INET6) {
+		log_error("%s is only supported in DHCPv6 mode.", kind);
+		return;
+	}
+
+	/* Extract the IAID from the front, as parse_iaid_duid() does. */
+	iaid = parse_byte_order_uint32(p);
+	ia = NULL;
+	if (ia_allocate(&ia, iaid, (const char *)p + 4, len - 4, MDL)
+	    != ISC_R_SUCCESS)
+		log_fatal("journal_replay_ia: Out of memory.");
+	ia->ia_type = type;
+	ia->cltt = (TIME)journal_get64(jc);
+
+	count = journal_get32(jc);
+	while (!jc->bad && (count-- > 0)) {
+		addr = journal_get(jc, sizeof(iasubopt->addr));
+		plen = journal_get8(jc);
+		state = journal_get8(jc);
+		prefer = journal_get32(jc);
+		valid = journal_get32(jc);
+		end_time = (TIME)journal_get64(jc);
+		scope = NULL;
+		journal_get_scope(jc, &scope);
+		if (jc->bad || (state <= 0) || (state > FTS_LAST)) {
+			if (scope != NULL)
+				binding_scope_dereference(&scope, MDL);
+			jc->bad = 1;
+			break;
+		}
+
+		iasubopt = NULL;
+		if (iasubopt_allocate(&iasubopt, MDL) != ISC_R_SUCCESS)
+			log_fatal("Out of memory.");
+		memcpy(&iasubopt->addr, addr, sizeof(iasubopt->addr));
+		iasubopt->plen = (type == D6O_IA_PD) ? plen : 0;
+		iasubopt->state = state;
+		iasubopt->prefer = prefer;
+		iasubopt->valid = valid;
+		if (iasubopt->state == FTS_RELEASED)
+			iasubopt->hard_lifetime_end_time = end_time;
+
+		if (scope != NULL) {
+			binding_scope_reference(&iasubopt->scope, scope, MDL);
+			binding_scope_dereference(&scope, MDL);
+		}
+
+		/* Find the pool this address is in, checking the prefix
+		 * length of prefixes in case the pool was reconfigured. */
+		pool = NULL;
+		if ((find_ipv6_pool(&pool, type,
+				    &iasubopt->addr) != ISC_R_SUCCESS) ||
+		    ((type == D6O_IA_PD) && (pool->units != plen))) {
+			inet_ntop(AF_INET6, &iasubopt->addr,
+				  addr_buf, sizeof(addr_buf));
+			if (type == D6O_IA_PD)
+				log_error("No pool found for prefix %s/%d",
+					  addr_buf, plen);
+			else
+				log_error("No pool found for %s address %s",
+					  kind, addr_buf);
+			if (pool != NULL)
+				ipv6_pool_dereference(&pool, MDL);
+			iasubopt_dereference(&iasubopt, MDL);
+			continue;
+		}
+#ifdef EUI_64
+		if ((type == D6O_IA_NA) &&
+		    (pool->ipv6_pond->use_eui_64) &&
+		    (!valid_for_eui_64_pool(pool, &ia->iaid_duid, IAID_LEN,
+					    &iasubopt->addr))) {
+			log_error("Non EUI-64 lease in EUI-64 pool: %s"
+				  " discarding it",
+				  pin6_addr(&iasubopt->addr));
+			ipv6_pool_dereference(&pool, MDL);
+			iasubopt_dereference(&iasubopt, MDL);
+			continue;
+		}
+#endif
+
+		/* remove old information */
+		if (cleanup_lease6(ia_active, pool,
+				   iasubopt, ia) != ISC_R_SUCCESS) {
+			inet_ntop(AF_INET6, &iasubopt->addr,
+				  addr_buf, sizeof(addr_buf));
+			log_error("duplicate %s lease for address %s",
+				  kind, addr_buf);
+		}
+
+		if ((state == FTS_ACTIVE) || (state == FTS_ABANDONED)) {
+			ia_add_iasubopt(ia, iasubopt, MDL);
+			ia_reference(&iasubopt->ia, ia, MDL);
+			add_lease6(pool, iasubopt, end_time);
+		}
+
+		ipv6_pool_dereference(&pool, MDL);
+		iasubopt_dereference(&iasubopt, MDL);
+	}
+
+	/* If we have an existing record for this IA, remove it. */
+	old_ia = NULL;
+	if (ia_hash_lookup(&old_ia, ia_active,
+			   (unsigned char *)ia->iaid_duid.data,
+			   ia->iaid_duid.len, MDL)) {
+		ia_hash_delete(ia_active,
+			       (unsigned char *)ia->iaid_duid.data,
+			       ia->iaid_duid.len, MDL);
+		ia_dereference(&old_ia, MDL);
+	}
+
+	/* If we have addresses, add this, otherwise don't bother. */
+	if (ia->num_iasubopt > 0) {
+		ia_hash_add(ia_active,
+			    (unsigned char *)ia->iaid_duid.data,
+			    ia->iaid_duid.len, ia, MDL);
+	}
+	ia_dereference(&ia, MDL);
+#else /* !DHCPv6 */
+	log_error("No DHCPv6 support.");
+#endif /* DHCPv6 */
+}
+
+/* Apply the timers in a JOURNAL_IA_TIMERS record to the IA an earlier
+   record left in the hash, as renew_lease6() did when it was written.
+   If that IA isn't there, a pool has gone away since, which will have
+   been complained about when the full record was read. */
+static void
+journal_replay_ia_timers(struct journal_cursor *jc) {
+#if defined (DHCPv6)
+	struct ia_xx *ia;
+	struct iasubopt *iasubopt;
+	ia_hash_t *ia_active;
+	const unsigned char *p, *addr;
+	u_int32_t prefer, valid, count;
+	unsigned type, len;
+	TIME cltt, end_time;
+	int i;
+
+	type = journal_get16(jc);
+	len = journal_get16(jc);
+	p = journal_get(jc, len);
+	cltt = (TIME)journal_get64(jc);
+	count = journal_get32(jc);
+	if (jc->bad)
+		return;
+
+	switch (type) {
+	      case D6O_IA_NA:
+		ia_active = ia_na_active;
+		break;
+	      case D6O_IA_TA:
+		ia_active = ia_ta_active;
+		break;
+	      case D6O_IA_PD:
+		ia_active = ia_pd_active;
+		break;
+	      default:
+		jc->bad = 1;
+		return;
+	}
+
+	if (local_family != AF_INET6)
+		return;
+
+	ia = NULL;
+	if (!ia_hash_lookup(&ia, ia_active, (unsigned char *)p, len, MDL))
+		return;
+	if (ia->num_iasubopt != count) {
+		ia_dereference(&ia, MDL);
+		return;
+	}
+
+	ia->cltt = cltt;
+	while (count-- > 0) {
+		addr = journal_get(jc, sizeof(iasubopt->addr));
+		prefer = journal_get32(jc);
+		valid = journal_get32(jc);
+		end_time = (TIME)journal_get64(jc);
+		if (jc->bad)
+			break;
+
+		for (i = 0; i < ia->num_iasubopt; i++) {
+			iasubopt = ia->iasubopt[i];
+			if (memcmp(&iasubopt->addr, addr,
+				   sizeof(iasubopt->addr)) == 0)
+				break;
+		}
+		if ((i == ia->num_iasubopt) ||
+		    (iasubopt->state != FTS_ACTIVE))
+			continue;
+
+		iasubopt->prefer = prefer;
+		iasubopt->valid = valid;
+		iasubopt->soft_lifetime_end_time = end_time;
+		renew_lease6(iasubopt->ipv6_pool, iasubopt);
+	}
+	ia_dereference(&ia, MDL);
+#endif /* DHCPv6 */
+}
+
+/* Load a lease file that begins with a journal header.  Binary records
+   are replayed directly; the text between them is handed to the lease
+   file parser.  A damaged record can only be the result of a write that
+   didn't complete, so everything from there on is ignored. */
+isc_result_t
+read_lease_journal(const char *name, const char *data, unsigned len) {
+	struct journal_cursor jc;
+	struct parse *cfile;
+	const unsigned char *rec;
+	const char *end;
+	isc_result_t status;
+	unsigned pos, next, rlen, type;
+
+	pos = 0;
+	while (pos < len) {
+		if (data[pos] != '\0') {
+			end = memchr(data + pos, '\0', len - pos);
+			next = end ? end - data : len;
+
+			cfile = NULL;
+			status = new_parse(&cfile, -1, (char *)data + pos,
+					   next - pos, name, 0);
+			if (status != ISC_R_SUCCESS || cfile == NULL)
+				return status;
+			status = lease_file_subparse(cfile);
+			end_parse(&cfile);
+			if (status != ISC_R_SUCCESS)
+				return status;
+
+			pos = next;
+			continue;
+		}
+
+		if (len - pos < JOURNAL_OVERHEAD)
+			break;
+		rec = (const unsigned char *)data + pos;
+		type = rec[1];
+		rlen = getULong(rec + 2);
+		if ((rlen > len - pos - JOURNAL_OVERHEAD) ||
+		    (getULong(rec + JOURNAL_OVERHEAD - 4 + rlen) !=
+		     journal_checksum(rec + 1, rlen + JOURNAL_OVERHEAD - 5)))
+			break;
+
+		jc.data = rec + JOURNAL_OVERHEAD - 4;
+		jc.len = rlen;
+		jc.pos = 0;
+		jc.bad = 0;
+
+		switch (type) {
+		      case JOURNAL_HEADER:
+			if ((rlen != sizeof(JOURNAL_MAGIC) - 1 + 4) ||
+			    memcmp(jc.data, JOURNAL_MAGIC,
+				   sizeof(JOURNAL_MAGIC) - 1) ||
+			    (getULong(jc.data + rlen - 4) < 1) ||
+			    (getULong(jc.data + rlen - 4) > JOURNAL_VERSION))
+				log_fatal("%s: unsupported lease journal "
+					  "version.", name);
+			break;
+
+		      case JOURNAL_LEASE:
+			journal_replay_lease(&jc);
+			break;
+
+		      case JOURNAL_IA:
+			journal_replay_ia(&jc);
+			break;
+
+		      case JOURNAL_IA_TIMERS:
+			journal_replay_ia_timers(&jc);
+			break;
+
+		      default:
+			log_error("%s: unknown lease journal record type %u "
+				  "at offset %u skipped.", name, type, pos);
+			break;
+		}
+		if (jc.bad)
+			log_error("%s: malformed lease journal record at "
+				  "offset %u skipped.", name, pos);
+
+		pos += rlen + JOURNAL_OVERHEAD;
+	}
+
+	if (pos < len)
+		log_error("%s: damaged lease journal record at offset %u, "
+			  "ignoring the last %u bytes.", name, pos, len - pos);
+	return ISC_R_SUCCESS;
+}
+
 void db_startup (int test_mode)
 {
 	const char *current_db_path;
@@ -1130,34 +2321,32 @@ void db_startup (int test_mode)
 #endif
 }
 
-int new_lease_file (int test_mode)
+/* Create a temporary lease file to be moved into place by
+   install_lease_file(), returning its descriptor.  The suffix keeps a
+   background rewrite from sharing its file with new_lease_file() when
+   both start in the same second. */
+static int
+create_lease_file(char *newfname, size_t len, const char *suffix)
 {
-	char newfname [512];
-	char backfname [512];
 	TIME t;
 	int db_fd;
-	int db_validity;
-	FILE *new_db_file;
 
-	/* Make a temporary lease file... */
 	time(&t);
 
-	db_validity = lease_file_is_corrupt;
-
 	/* %Audit% Truncated filename causes panic. %2004.06.17,Safe%
 	 * This should never happen since the path is a configuration
 	 * variable from build-time or command-line.  But if it should,
 	 * either by malice or ignorance, we panic, since the potential
 	 * for havoc is high.
 	 */
-	if (snprintf (newfname, sizeof newfname, "%s.%d",
-		     path_dhcpd_db, (int)t) >= sizeof newfname)
+	if (snprintf (newfname, len, "%s.%d%s",
+		     path_dhcpd_db, (int)t, suffix) >= len)
 		log_fatal("new_lease_file: lease file path too long");
 
 	db_fd = open (newfname, O_WRONLY | O_TRUNC | O_CREAT, 0664);
 	if (db_fd < 0) {
 		log_error ("Can't create new lease file: %m");
-		return 0;
+		return -1;
 	}
 
 #if defined (PARANOIA)
@@ -1175,39 +2364,41 @@ int new_lease_file (int test_mode)
 	}
 #endif /* PARANOIA */
 
-	if ((new_db_file = fdopen(db_fd, "w")) == NULL) {
-		log_error("Can't fdopen new lease file: %m");
-		close(db_fd);
-		goto fdfail;
-	}
+	return db_fd;
+}
 
-	/* Close previous database, if any. */
-	if (db_file)
-		fclose(db_file);
-	db_file = new_db_file;
+/* Write the header and everything we know of to db_file. */
+static int
+write_lease_file(void)
+{
+	struct stat st;
+
+	if ((lease_file_format == LEASE_FILE_BINARY) &&
+	    !journal_write_header())
+		return 0;
 
 	errno = 0;
 	fprintf (db_file, "# The format of this file is documented in the %s",
 		 "dhcpd.leases(5) manual page.\n");
 
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "# This lease file was written by isc-dhcp-%s\n\n",
 		 PACKAGE_VERSION);
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "# authoring-byte-order entry is generated,"
                           " DO NOT DELETE\n");
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "authoring-byte-order %s;\n\n",
 		 (DHCP_BYTE_ORDER == LITTLE_ENDIAN ?
 		  "little-endian" : "big-endian"));
 	if (errno)
-		goto fail;
+		return 0;
 
 	/* At this point we have a new lease file that, so far, could not
 	 * be described as either corrupt nor valid.
@@ -1216,16 +2407,20 @@ int new_lease_file (int test_mode)
 
 	/* Write out all the leases that we know of... */
 	counting = 0;
+	count = 0;
 	if (!write_leases ())
-		goto fail;
+		return 0;
 
-	if (test_mode) {
-		log_debug("Lease file test successful,"
-			  " removing temp lease file: %s",
-			  newfname);
-		(void)unlink (newfname);
-		return (1);
-	}
+	if (fstat(fileno(db_file), &st) == 0)
+		write_size = st.st_size;
+	return 1;
+}
+
+/* Back up the current lease file and move the new one into its place. */
+static int
+install_lease_file(const char *newfname)
+{
+	char backfname [512];
 
 #if defined (TRACING)
 	if (!trace_playback ()) {
@@ -1244,7 +2439,7 @@ int new_lease_file (int test_mode)
 	    if (unlink (backfname) < 0 && errno != ENOENT) {
 		log_error ("Can't remove old lease database backup %s: %m",
 			   backfname);
-		goto fail;
+		return 0;
 	    }
 	    if (link(path_dhcpd_db, backfname) < 0) {
 		if (errno == ENOENT) {
@@ -1253,7 +2448,7 @@ int new_lease_file (int test_mode)
 		} else {
 			log_error("Can't backup lease database %s to %s: %m",
 				  path_dhcpd_db, backfname);
-			goto fail;
+			return 0;
 		}
 	    }
 #if defined (TRACING)
@@ -1264,9 +2459,64 @@ int new_lease_file (int test_mode)
 	if (rename (newfname, path_dhcpd_db) < 0) {
 		log_error ("Can't install new lease database %s to %s: %m",
 			   newfname, path_dhcpd_db);
+		return 0;
+	}
+	return 1;
+}
+
+/* Replace db_file, which is being written to, by new_db_file. */
+static void
+switch_lease_file(FILE *new_db_file)
+{
+	/* Close previous database, if any. */
+#if defined (ASYNC_COMMIT)
+	commit_wait();
+#endif
+	if (db_file)
+		fclose(db_file);
+	db_file = new_db_file;
+}
+
+int new_lease_file (int test_mode)
+{
+	char newfname [512];
+	int db_fd;
+	int db_validity;
+	FILE *new_db_file;
+
+	db_validity = lease_file_is_corrupt;
+
+	/* Make a temporary lease file... */
+	db_fd = create_lease_file(newfname, sizeof newfname, "");
+	if (db_fd < 0)
+		return 0;
+
+	if ((new_db_file = fdopen(db_fd, "w")) == NULL) {
+		log_error("Can't fdopen new lease file: %m");
+		close(db_fd);
+		goto fdfail;
+	}
+
+	/* A rewrite in the background would now be missing whatever
+	   goes to the new file, so it is thrown away. */
+	abandon_lease_file_rewrite();
+
+	switch_lease_file(new_db_file);
+
+	if (!write_lease_file())
 		goto fail;
+
+	if (test_mode) {
+		log_debug("Lease file test successful,"
+			  " removing temp lease file: %s",
+			  newfname);
+		(void)unlink (newfname);
+		return (1);
 	}
 
+	if (!install_lease_file(newfname))
+		goto fail;
+
 	counting = 1;
 	return 1;
 
@@ -1277,6 +2527,196 @@ int new_lease_file (int test_mode)
 	return 0;
 }
 
+/* Rewrite the lease file without stopping the server.  A child process
+   writes the new file from its copy-on-write snapshot of the lease
+   database, while the server goes on appending to the current file.
+   When the child is done, whatever was appended after the snapshot is
+   copied onto the end of the new file, which is then moved into place;
+   since the last declaration of a lease wins, the result is the same as
+   if new_lease_file() had been called at that point. */
+
+static void rewrite_lease_file_wait(void *);
+
+static void
+rewrite_lease_file(void)
+{
+	struct stat st;
+	struct timeval tv;
+	FILE *new_db_file;
+	int db_fd;
+
+	if (rewrite_pid > 0)
+		return;
+
+#if defined (TRACING)
+	/* The child would share the trace file with us. */
+	if (trace_record() || trace_playback()) {
+		new_lease_file(0);
+		return;
+	}
+#endif
+
+	if ((fflush(db_file) == EOF) || (fstat(fileno(db_file), &st) < 0)) {
+		log_error("Can't find the end of the lease file: %m");
+		new_lease_file(0);
+		return;
+	}
+
+	db_fd = create_lease_file(rewrite_fname, sizeof rewrite_fname,
+				  ".rewrite");
+	if (db_fd < 0)
+		return;
+
+	rewrite_pid = fork();
+	if (rewrite_pid < 0) {
+		log_error("Can't fork to rewrite the lease file: %m");
+		close(db_fd);
+		(void)unlink(rewrite_fname);
+		new_lease_file(0);
+		return;
+	}
+
+	if (rewrite_pid == 0) {
+		/* Only this thread exists in the child, and all it does is
+		   write the file and leave without running any exit
+		   handlers or flushing anything it inherited. */
+		if ((new_db_file = fdopen(db_fd, "w")) == NULL)
+			_exit(1);
+		db_file = new_db_file;
+		if (!write_lease_file() || lease_file_is_corrupt ||
+		    (fclose(db_file) == EOF))
+			_exit(1);
+		_exit(0);
+	}
+
+	/* Records appended from here on are copied after the child's,
+	   which needn't match anything we wrote before. */
+	journal_gen_base = journal_gen;
+
+	close(db_fd);
+	rewrite_offset = st.st_size;
+	rewrite_ino = st.st_ino;
+	log_info("Rewriting lease file in process %ld.", (long)rewrite_pid);
+
+	tv.tv_sec = cur_tv.tv_sec + 1;
+	tv.tv_usec = cur_tv.tv_usec;
+	add_timeout(&tv, rewrite_lease_file_wait, NULL, 0, 0);
+}
+
+/* Copy the lease file from the snapshot onwards to the end of the new
+   file. */
+static int
+rewrite_lease_file_tail(int new_fd)
+{
+	char buf[65536];
+	ssize_t len;
+	int fd;
+
+	fd = open(path_dhcpd_db, O_RDONLY);
+	if (fd < 0) {
+		log_error("Can't open %s: %m", path_dhcpd_db);
+		return 0;
+	}
+	if (lseek(fd, rewrite_offset, SEEK_SET) < 0) {
+		log_error("Can't seek in %s: %m", path_dhcpd_db);
+		close(fd);
+		return 0;
+	}
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		if (write(new_fd, buf, len) != len) {
+			log_error("Can't write %s: %m", rewrite_fname);
+			close(fd);
+			return 0;
+		}
+	}
+	close(fd);
+	if (len < 0) {
+		log_error("Can't read %s: %m", path_dhcpd_db);
+		return 0;
+	}
+	if ((dont_use_fsync == 0) && (fsync(new_fd) < 0)) {
+		log_error("Can't fsync %s: %m", rewrite_fname);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+rewrite_lease_file_wait(void *foo)
+{
+	struct stat st;
+	struct timeval tv;
+	FILE *new_db_file;
+	int status;
+	int new_fd;
+	pid_t pid;
+
+	pid = waitpid(rewrite_pid, &status, WNOHANG);
+	if (pid == 0) {
+		tv.tv_sec = cur_tv.tv_sec + 1;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout(&tv, rewrite_lease_file_wait, NULL, 0, 0);
+		return;
+	}
+	rewrite_pid = -1;
+
+	if ((pid < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		log_error("Lease file rewrite failed.");
+		(void)unlink(rewrite_fname);
+		return;
+	}
+
+	/* Bring the new file up to date and switch to it.  Nothing else
+	   writes to the lease file until we return. */
+	if ((fflush(db_file) == EOF) || (fstat(fileno(db_file), &st) < 0) ||
+	    (st.st_ino != rewrite_ino)) {
+		log_error("Lease file changed during rewrite, "
+			  "discarding it.");
+		(void)unlink(rewrite_fname);
+		return;
+	}
+
+	new_fd = open(rewrite_fname, O_WRONLY | O_APPEND);
+	if (new_fd < 0) {
+		log_error("Can't open %s: %m", rewrite_fname);
+		(void)unlink(rewrite_fname);
+		return;
+	}
+	if (!rewrite_lease_file_tail(new_fd) ||
+	    ((new_db_file = fdopen(new_fd, "a")) == NULL)) {
+		close(new_fd);
+		(void)unlink(rewrite_fname);
+		return;
+	}
+	if (!install_lease_file(rewrite_fname)) {
+		fclose(new_db_file);
+		(void)unlink(rewrite_fname);
+		return;
+	}
+
+	log_info("Lease file rewritten, %lu bytes appended during the "
+		 "rewrite.", (unsigned long)(st.st_size - rewrite_offset));
+	switch_lease_file(new_db_file);
+	if (fstat(fileno(db_file), &st) == 0)
+		write_size = st.st_size;
+}
+
+/* Throw away a rewrite in progress. */
+static void
+abandon_lease_file_rewrite(void)
+{
+	int status;
+
+	if (rewrite_pid <= 0)
+		return;
+
+	cancel_timeout(rewrite_lease_file_wait, NULL);
+	kill(rewrite_pid, SIGKILL);
+	(void)waitpid(rewrite_pid, &status, 0);
+	(void)unlink(rewrite_fname);
+	rewrite_pid = -1;
+}
+
 int group_writer (struct group_object *group)
 {
 	if (!write_group (group))
@@ -51,10 +51,18 @@ int outstanding_pings;
 #if defined(DELAYED_ACK)
 static void delayed_ack_enqueue(struct lease *);
 static void delayed_acks_timer(void *);
+static void delayed_ack_reply(struct leasequeue *);
+#if defined(ASYNC_COMMIT)
+static void delayed_acks_committed(u_int32_t);
+#endif
 
 
 struct leasequeue *ackqueue_head, *ackqueue_tail;
 static struct leasequeue *free_ackqueue;
+#if defined(ASYNC_COMMIT)
+/* ACKs waiting for the lease commit thread, oldest first */
+static struct leasequeue *commitqueue_head, *commitqueue_tail;
+#endif
 static struct timeval max_fsync;
 
 int outstanding_acks;
@@ -100,8 +108,15 @@ dhcp (struct packet *packet) {
 	struct lease *lease = NULL;
 	const char *errmsg;
 	struct data_string data;
+	int located;
 
-	if (!locate_network(packet) &&
+	located = locate_network(packet);
+
+	/* Another server in the shard group answers this one. */
+	if (!shard_owns_network(packet->shared_network))
+		return;
+
+	if (!located &&
 	    packet->packet_type != DHCPREQUEST &&
 	    packet->packet_type != DHCPINFORM &&
 	    packet->packet_type != DHCPLEASEQUERY) {
@@ -2544,11 +2559,8 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 		   class, and if so, whether or not it can continue to
 		   be billed to that class. */
 		if (lease -> billing_class) {
-			for (i = 0; i < packet -> class_count; i++)
-				if (packet -> classes [i] ==
-				    lease -> billing_class)
-					break;
-			if (i == packet -> class_count) {
+			if (!packet_class_member (packet,
+						  lease -> billing_class, 0)) {
 				unbill_class(lease);
 				/* Active lease billing change negates reuse */
 				if (lease->binding_state == FTS_ACTIVE) {
@@ -3807,11 +3819,16 @@ delayed_ack_enqueue(struct lease *lease)
  * Commits the leases and then for each delayed ack:
  *  - Update the failover peer if we're in failover
  *  - Send the REPLY to the client
+ * When the commit is left to the lease commit thread the acks wait on
+ * the commit queue until it reports that the leases are on disk.
  */
 static void
 delayed_acks_timer(void *foo)
 {
 	struct leasequeue *ack, *p;
+#if defined(ASYNC_COMMIT)
+	u_int32_t commit;
+#endif
 
 	/* Reset max fsync */
 	memset(&max_fsync, 0, sizeof(max_fsync));
@@ -3822,42 +3839,29 @@ delayed_acks_timer(void *foo)
 	}
 
 	/* Commit the leases first */
+#if defined(ASYNC_COMMIT)
+	commit = commit_leases_async(delayed_acks_committed);
+#else
 	commit_leases();
-
-	/* Now process the delayed ACKs
-	 - update failover peer
-	 - send out the ACK packets
-	 - move the queue slots to the free list
-	*/
+#endif
 
 	/*  process from bottom to retain packet order */
 	for (ack = ackqueue_tail ; ack ; ack = p) {
 		p = ack->prev;
 
-#if defined(FAILOVER_PROTOCOL)
-		/* If we're in failover we need to send any deferred
-		* bind updates as well as the replies */
-		if (ack->lease->pool) {
-			dhcp_failover_state_t *fpeer;
-
-			fpeer = ack->lease->pool->failover_peer;
-			if (fpeer && fpeer->link_to_peer) {
-				dhcp_failover_send_updates(fpeer);
-			}
+#if defined(ASYNC_COMMIT)
+		if (commit != 0) {
+			ack->commit = commit;
+			ack->next = NULL;
+			if (commitqueue_tail)
+				commitqueue_tail->next = ack;
+			else
+				commitqueue_head = ack;
+			commitqueue_tail = ack;
+			continue;
 		}
 #endif
-
-		/* dhcp_reply() requires that the reply state still be valid */
-		if (ack->lease->state == NULL)
-			log_error("delayed ack for %s has gone stale",
-				  piaddr(ack->lease->ip_addr));
-		else {
-			dhcp_reply(ack->lease);
-		}
-
-		lease_dereference(&ack->lease, MDL);
-		ack->next = free_ackqueue;
-		free_ackqueue = ack;
+		delayed_ack_reply(ack);
 	}
 
 	ackqueue_head = NULL;
@@ -3865,6 +3869,58 @@ delayed_acks_timer(void *foo)
 	outstanding_acks = 0;
 }
 
+#if defined(ASYNC_COMMIT)
+/* The lease commit thread has synced everything up to commit, so
+ * send the acks that were waiting for it. */
+static void
+delayed_acks_committed(u_int32_t commit)
+{
+	struct leasequeue *ack;
+
+	while ((ack = commitqueue_head) != NULL &&
+	       (commit - ack->commit) < 0x80000000U) {
+		commitqueue_head = ack->next;
+		if (!commitqueue_head)
+			commitqueue_tail = NULL;
+		delayed_ack_reply(ack);
+	}
+}
+#endif
+
+/* Now process a delayed ACK whose lease has been committed
+ - update failover peer
+ - send out the ACK packet
+ - move the queue slot to the free list
+*/
+static void
+delayed_ack_reply(struct leasequeue *ack)
+{
+#if defined(FAILOVER_PROTOCOL)
+	/* If we're in failover we need to send any deferred
+	* bind updates as well as the replies */
+	if (ack->lease->pool) {
+		dhcp_failover_state_t *fpeer;
+
+		fpeer = ack->lease->pool->failover_peer;
+		if (fpeer && fpeer->link_to_peer) {
+			dhcp_failover_send_updates(fpeer);
+		}
+	}
+#endif
+
+	/* dhcp_reply() requires that the reply state still be valid */
+	if (ack->lease->state == NULL)
+		log_error("delayed ack for %s has gone stale",
+			  piaddr(ack->lease->ip_addr));
+	else {
+		dhcp_reply(ack->lease);
+	}
+
+	lease_dereference(&ack->lease, MDL);
+	ack->next = free_ackqueue;
+	free_ackqueue = ack;
+}
+
 #if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 void
 relinquish_ackqueue(void)
@@ -3875,6 +3931,12 @@ relinquish_ackqueue(void)
 		n = q->next;
 		dfree(q, MDL);
 	}
+#if defined(ASYNC_COMMIT)
+	for (q = commitqueue_head ; q ; q = n) {
+		n = q->next;
+		dfree(q, MDL);
+	}
+#endif
 	for (q = free_ackqueue ; q ; q = n) {
 		n = q->next;
 		dfree(q, MDL);
@@ -4981,11 +5043,375 @@ int mockup_lease (struct lease **lp, struct packet *packet,
    lease.   If all of these possibilities fail to pan out, we don't return
    a lease at all. */
 
+/*
+ * Pool index.
+ *
+ * Shared networks may hold hundreds of pools, often one for each class
+ * of client, and allocate_lease() used to check the permit lists and
+ * the next lease of every one of them.  Instead, the pools of a shared
+ * network are put into groups with the same permit and prohibit lists.
+ * Each group keeps its pools in three heaps, one for each tier of
+ * preference allocate_lease() applies to the lease a pool would give out
+ * next.  A group that only admits members of certain classes is found
+ * through a table of those classes, sorted so the packet's classes can
+ * be looked up in it.  The lists of the other groups are evaluated once
+ * per packet, and are remembered when they only depend on whether the
+ * client is known, authenticated or using BOOTP.
+ *
+ * Pools with a failover peer choose between their free and backup
+ * leases according to the state of the peer, so shared networks with
+ * such pools are still searched one pool at a time.
+ */
+
+#define POOL_HEAP_UNUSED	0	/* leases never given to a client */
+#define POOL_HEAP_USED		1	/* free leases used before */
+#define POOL_HEAP_ABANDONED	2
+#define POOL_HEAPS		3
+
+static unsigned long pool_index_generation;
+
+static isc_boolean_t
+pool_candidate_older(void *a, void *b) {
+	struct pool *pa = (struct pool *)a;
+	struct pool *pb = (struct pool *)b;
+
+	if (pa->candidate_ends != pb->candidate_ends)
+		return (pa->candidate_ends < pb->candidate_ends);
+	return (pa->seq < pb->seq);
+}
+
+static void
+pool_heap_changed(void *pool, unsigned int new_heap_index) {
+	((struct pool *)pool)->heap_index = new_heap_index;
+}
+
+static struct lease *
+pool_next_lease(struct pool *pool) {
+	if (LEASE_NOT_EMPTY(pool->free))
+		return (LEASE_GET_FIRST(pool->free));
+	return (LEASE_GET_FIRST(pool->abandoned));
+}
+
+static unsigned
+pool_lease_heap(struct lease *candl) {
+	if (candl->binding_state == FTS_ABANDONED)
+		return (POOL_HEAP_ABANDONED);
+	if (candl->uid_len || candl->hardware_addr.hlen)
+		return (POOL_HEAP_USED);
+	return (POOL_HEAP_UNUSED);
+}
+
+/* Put the pool in the heap for the lease it would give out next.  This
+   is called whenever a lease goes onto or off its free or abandoned
+   queue.  The heaps are ordered by the expiry saved here rather than by
+   the lease itself, so a lease that is changed before it comes off its
+   queue can't disorder them. */
+void
+pool_index_update(struct pool *pool) {
+	struct pool_group *group = pool->pool_group;
+	struct lease *candl;
+
+	if (group == NULL)
+		return;
+
+	if (pool->heap_index != 0) {
+		isc_heap_delete(group->heaps[pool->pool_heap],
+				pool->heap_index);
+		pool->heap_index = 0;
+	}
+
+	candl = pool_next_lease(pool);
+	pool->candidate = candl;
+	if (candl == NULL)
+		return;
+
+	pool->candidate_ends = candl->ends;
+	pool->pool_heap = pool_lease_heap(candl);
+
+	if (isc_heap_insert(group->heaps[pool->pool_heap],
+			    pool) != ISC_R_SUCCESS)
+		log_fatal("No memory for pool index.");
+}
+
+/* Whether the pool's place in the index no longer matches the lease it
+   would give out next.  Anything that changes the expiry or state of a
+   free or abandoned lease has to requeue it with supersede_lease() or
+   lease_enqueue(); this catches code that doesn't. */
+static int
+pool_index_stale(struct pool *pool) {
+	struct lease *candl = pool_next_lease(pool);
+
+	return ((candl != pool->candidate) ||
+		(candl->ends != pool->candidate_ends) ||
+		(pool_lease_heap(candl) != pool->pool_heap));
+}
+
+static int
+permit_lists_equal(struct permit *a, struct permit *b) {
+	for (; a && b; a = a->next, b = b->next) {
+		if ((a->type != b->type) || (a->class != b->class) ||
+		    (a->after != b->after))
+			return 0;
+	}
+	return ((a == NULL) && (b == NULL));
+}
+
+/* Whether permitted() only looks at packet->known, packet->authenticated
+   and whether the packet is BOOTP for this list. */
+static int
+permit_list_flags_only(struct permit *p) {
+	for (; p; p = p->next) {
+		if ((p->type == permit_class) || (p->type == permit_after))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+permit_list_classes_only(struct permit *p) {
+	if (p == NULL)
+		return 0;
+	for (; p; p = p->next) {
+		if ((p->type != permit_class) || (p->class == NULL))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+pool_class_cmp(const void *a, const void *b) {
+	const struct pool_class *ca = (const struct pool_class *)a;
+	const struct pool_class *cb = (const struct pool_class *)b;
+
+	if (ca->class < cb->class)
+		return -1;
+	return (ca->class > cb->class);
+}
+
+static void
+build_pool_index(struct shared_network *share) {
+	struct pool_group *group;
+	struct pool *pool;
+	struct permit *p;
+	unsigned seq;
+	int i;
+
+	share->pools_indexed = -1;
+#if defined (FAILOVER_PROTOCOL)
+	for (pool = share->pools; pool; pool = pool->next) {
+		if (pool->failover_peer != NULL)
+			return;
+	}
+#endif
+
+	seq = 0;
+	share->pool_class_count = 0;
+	for (pool = share->pools; pool; pool = pool->next) {
+		pool->seq = seq++;
+
+		for (group = share->pool_groups; group; group = group->next) {
+			if (permit_lists_equal(group->permit_list,
+					       pool->permit_list) &&
+			    permit_lists_equal(group->prohibit_list,
+					       pool->prohibit_list))
+				break;
+		}
+
+		if (group == NULL) {
+			group = dmalloc(sizeof(*group), MDL);
+			if (group == NULL)
+				log_fatal("No memory for pool index.");
+			group->permit_list = pool->permit_list;
+			group->prohibit_list = pool->prohibit_list;
+			for (i = 0; i < POOL_HEAPS; i++) {
+				if (isc_heap_create(dhcp_gbl_ctx.mctx,
+						    pool_candidate_older,
+						    pool_heap_changed, 0,
+						    &group->heaps[i])
+				    != ISC_R_SUCCESS)
+					log_fatal("No memory for pool index.");
+			}
+			group->by_class =
+				((pool->prohibit_list == NULL) &&
+				 permit_list_classes_only(pool->permit_list));
+			group->flags_only =
+				(permit_list_flags_only(pool->permit_list) &&
+				 permit_list_flags_only(pool->prohibit_list));
+			if (group->by_class) {
+				for (p = pool->permit_list; p; p = p->next)
+					share->pool_class_count++;
+			}
+			group->next = share->pool_groups;
+			share->pool_groups = group;
+		}
+
+		pool->pool_group = group;
+		pool_index_update(pool);
+	}
+
+	if (share->pool_class_count > 0) {
+		share->pool_classes =
+			dmalloc(share->pool_class_count *
+				sizeof(*share->pool_classes), MDL);
+		if (share->pool_classes == NULL)
+			log_fatal("No memory for pool index.");
+
+		i = 0;
+		for (group = share->pool_groups; group; group = group->next) {
+			if (!group->by_class)
+				continue;
+			for (p = group->permit_list; p; p = p->next) {
+				share->pool_classes[i].class = p->class;
+				share->pool_classes[i].group = group;
+				i++;
+			}
+		}
+		qsort(share->pool_classes, share->pool_class_count,
+		      sizeof(*share->pool_classes), pool_class_cmp);
+	}
+
+	share->pools_indexed = 1;
+}
+
+/* Replace *best with the pool of this group that allocate_lease() would
+   prefer, if there is one it would prefer to *best. */
+static void
+pool_group_best(struct pool_group *group, struct pool **best) {
+	struct pool *pool;
+	int i;
+
+	for (i = 0; i < POOL_HEAPS; i++) {
+		while (((pool = isc_heap_element(group->heaps[i], 1)) != NULL)
+		       && pool_index_stale(pool)) {
+			log_error("Pool index for %s is out of date.",
+				  piaddr(pool->candidate->ip_addr));
+#if defined (BINDING_STATE_DEBUG)
+			abort();
+#endif
+			pool_index_update(pool);
+		}
+		if (pool == NULL)
+			continue;
+
+		/* The top of the heap has the oldest lease, so if that
+		   one isn't free yet, none of them are. */
+		if ((i != POOL_HEAP_ABANDONED) &&
+		    (pool->candidate_ends > cur_time))
+			continue;
+
+		if ((*best == NULL) ||
+		    (pool->pool_heap < (*best)->pool_heap) ||
+		    ((pool->pool_heap == (*best)->pool_heap) &&
+		     ((pool->candidate_ends < (*best)->candidate_ends) ||
+		      ((pool->candidate_ends == (*best)->candidate_ends) &&
+		       (pool->seq < (*best)->seq)))))
+			*best = pool;
+		return;
+	}
+}
+
+static int
+pool_group_permitted(struct pool_group *group, struct packet *packet) {
+	unsigned bit = 0;
+	int result;
+
+	if (group->flags_only) {
+		bit = 1 << ((packet->known ? 1 : 0) |
+			    (packet->authenticated ? 2 : 0) |
+			    ((!packet->options_valid ||
+			      !packet->packet_type) ? 4 : 0));
+		if (group->memo_valid & bit)
+			return ((group->memo & bit) != 0);
+	}
+
+	result = !((group->prohibit_list &&
+		    permitted(packet, group->prohibit_list)) ||
+		   (group->permit_list &&
+		    !permitted(packet, group->permit_list)));
+
+	if (group->flags_only) {
+		group->memo_valid |= bit;
+		if (result)
+			group->memo |= bit;
+	}
+	return result;
+}
+
+/* Consider the groups that admit members of class. */
+static void
+pool_index_class(struct shared_network *share, struct class *class,
+		 struct pool **best) {
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = share->pool_class_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (share->pool_classes[mid].class < class)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; (lo < share->pool_class_count) &&
+	       (share->pool_classes[lo].class == class); lo++) {
+		if (share->pool_classes[lo].group->seen !=
+		    pool_index_generation) {
+			share->pool_classes[lo].group->seen =
+				pool_index_generation;
+			pool_group_best(share->pool_classes[lo].group, best);
+		}
+	}
+}
+
+/* Find the lease allocate_lease() would pick from the shared network's
+   pools. */
+static struct lease *
+pool_index_lease(struct shared_network *share, struct packet *packet) {
+	struct pool_group *group;
+	struct pool *best = NULL;
+	struct class *class;
+	int i;
+
+	++pool_index_generation;
+	if (share->pool_class_count > 0) {
+		for (i = 0; i < packet->class_count; i++) {
+			class = packet->classes[i];
+			if (class == NULL)
+				continue;
+			pool_index_class(share, class, &best);
+			if (class->superclass != NULL)
+				pool_index_class(share, class->superclass,
+						 &best);
+		}
+	}
+
+	for (group = share->pool_groups; group; group = group->next) {
+		if (!group->by_class && pool_group_permitted(group, packet))
+			pool_group_best(group, &best);
+	}
+
+	return (best ? best->candidate : NULL);
+}
+
 int allocate_lease (struct lease **lp, struct packet *packet,
 		    struct pool *pool, int *peer_has_leases)
 {
 	struct lease *lease = NULL;
 	struct lease *candl = NULL;
+	struct shared_network *share;
+
+	/* Use the pool index when we've been asked about all the pools of
+	   a shared network, and they can be indexed. */
+	share = pool ? pool->shared_network : NULL;
+	if ((share != NULL) && (pool == share->pools)) {
+		if (share->pools_indexed == 0)
+			build_pool_index(share);
+		if (share->pools_indexed > 0) {
+			lease = pool_index_lease(share, packet);
+			pool = NULL;
+		}
+	}
 
 	for (; pool ; pool = pool -> next) {
 		if ((pool -> prohibit_list &&
@@ -5136,16 +5562,10 @@ int allocate_lease (struct lease **lp, struct packet *packet,
 	return 0;
 }
 
-/* Determine whether or not a permit exists on a particular permit list
-   that matches the specified packet, returning nonzero if so, zero if
-   not. */
-
-int permitted (packet, permit_list)
-	struct packet *packet;
-	struct permit *permit_list;
+static int check_permit_list (struct packet *packet,
+			      struct permit *permit_list)
 {
 	struct permit *p;
-	int i;
 
 	for (p = permit_list; p; p = p -> next) {
 		switch (p -> type) {
@@ -5179,15 +5599,8 @@ int permitted (packet, permit_list)
 			break;
 
 		      case permit_class:
-			for (i = 0; i < packet -> class_count; i++) {
-				if (p -> class == packet -> classes [i])
-					return 1;
-				if (packet -> classes [i] &&
-				    packet -> classes [i] -> superclass &&
-				    (packet -> classes [i] -> superclass ==
-				     p -> class))
-					return 1;
-			}
+			if (packet_class_member (packet, p -> class, 1))
+				return 1;
 			break;
 
 		      case permit_after:
@@ -5199,6 +5612,56 @@ int permitted (packet, permit_list)
 	return 0;
 }
 
+/* Determine whether or not a permit exists on a particular permit list
+   that matches the specified packet, returning nonzero if so, zero if
+   not.   The same lists are checked again and again while choosing a
+   pool for a packet, so the answers are kept in a cache on the packet,
+   indexed by the first permit of the list. */
+
+int permitted (packet, permit_list)
+	struct packet *packet;
+	struct permit *permit_list;
+{
+	unsigned index, len;
+	unsigned char evaluated, result;
+	int key;
+
+	if (permit_list == NULL)
+		return 0;
+
+	key = ((packet -> known ? 1 : 0) |
+	       (packet -> authenticated ? 2 : 0) |
+	       (packet -> class_count << 2));
+
+	if (packet -> permit_cache == NULL && permit_count > 0) {
+		len = (permit_count + 3) / 4;
+		packet -> permit_cache = dmalloc (len, MDL);
+		if (packet -> permit_cache != NULL) {
+			packet -> permit_cache_size = len * 4;
+			packet -> permit_cache_key = key;
+		}
+	}
+
+	index = permit_list -> index;
+	if (index >= packet -> permit_cache_size)
+		return check_permit_list (packet, permit_list);
+
+	if (packet -> permit_cache_key != key) {
+		memset (packet -> permit_cache, 0,
+			packet -> permit_cache_size / 4);
+		packet -> permit_cache_key = key;
+	}
+
+	evaluated = 1 << ((index % 4) * 2);
+	result = evaluated << 1;
+	if (!(packet -> permit_cache [index / 4] & evaluated)) {
+		packet -> permit_cache [index / 4] |= evaluated;
+		if (check_permit_list (packet, permit_list))
+			packet -> permit_cache [index / 4] |= result;
+	}
+	return ((packet -> permit_cache [index / 4] & result) != 0);
+}
+
 #if defined(DHCPv6) && defined(DHCP4o6)
 static int locate_network6 (packet)
 	struct packet *packet;
@@ -5399,6 +5862,22 @@ int locate_network (packet)
 	return 0;
 }
 
+/*
+ * When shard-count splits the shared networks between several servers
+ * listening on the same interfaces, each server answers only for the
+ * networks that hash to its shard-index.  Packets we couldn't place on
+ * any network are left to shard zero so that they're answered once.
+ */
+int
+shard_owns_network(struct shared_network *share)
+{
+	if (shard_count <= 1)
+		return (1);
+	if (share == NULL)
+		return (shard_index == 0);
+	return (share->shard == shard_index);
+}
+
 /*
  * Try to figure out the source address to send packets from.
  *
@@ -80,6 +80,9 @@ u_int16_t ddns_conflict_mask;
 int ddns_update_style;
 int dont_use_fsync = 0; /* 0 = default, use fsync, 1 = don't use fsync */
 int server_id_check = 0; /* 0 = default, don't check server id, 1 = do check */
+int shard_count = 1; /* servers splitting the shared networks, 1 = no split */
+int shard_index = 0; /* which of those servers this one is */
+int lease_file_format = LEASE_FILE_TEXT;
 
 #ifdef DHCPv6
 int prefix_length_mode = PLM_PREFER;
@@ -93,6 +96,8 @@ int persist_eui64 = 1; /* 1 = write EUI64 leases to disk, 0 = don't */
 int authoring_byte_order = 0; /* 0 = not set */
 int lease_id_format = TOKEN_OCTAL; /* octal by default */
 u_int32_t abandon_lease_time = DEFAULT_ABANDON_LEASE_TIME;
+u_int32_t lease_rewrite_period = LEASE_REWRITE_PERIOD;
+u_int32_t lease_rewrite_size = 0; /* 0 = don't rewrite on size */
 
 const char *path_dhcpd_conf = _PATH_DHCPD_CONF;
 const char *path_dhcpd_db = _PATH_DHCPD_DB;
@@ -766,6 +771,7 @@ main(int argc, char **argv) {
 	add_enumeration (&prefix_length_modes);
 	dhcpv6_packet_handler = do_packet6;
 #endif /* DHCPv6 */
+	add_enumeration (&lease_file_formats);
 
 #if defined (NSUPDATE)
 	/* Set up the standard name service updater routine. */
@@ -777,6 +783,7 @@ main(int argc, char **argv) {
 
 	if (parse != NULL) {
 		lose = 0;
+		statements_generation++;
 		if (!(parse_executable_statements(&root_group->statements,
 						  parse, &lose, context_any))) {
 			end_parse(&parse);
@@ -1413,6 +1420,33 @@ void postconf_initialization (int quiet)
 
 		data_string_forget(&db, MDL);
 	}
+
+	oc = lookup_option(&server_universe, options, SV_DENSE_POOL_SIZE);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			dense_pool_size = getULong(db.data);
+		} else {
+			log_fatal("invalid dense-pool-size");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options,
+			   SV_LEASE_EXPIRY_BATCH_SIZE);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			lease_expiry_batch_size = getULong(db.data);
+		} else {
+			log_fatal("invalid lease-expiry-batch-size");
+		}
+
+		data_string_forget(&db, MDL);
+	}
 #endif
 
 	// Set global abandon-lease-time option.
@@ -1463,6 +1497,118 @@ void postconf_initialization (int quiet)
 	}
 #endif
 
+	oc = lookup_option(&server_universe, options, SV_RECEIVE_BATCH_SIZE);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 2) {
+			receive_batch_size = getUShort(db.data);
+		} else {
+			log_fatal("invalid receive-batch-size");
+		}
+
+		if (receive_batch_size < 1) {
+			receive_batch_size = 1;
+		} else if (receive_batch_size > MAX_RECEIVE_BATCH_SIZE) {
+			log_error("receive-batch-size %d is too large, "
+				  "using %d", receive_batch_size,
+				  MAX_RECEIVE_BATCH_SIZE);
+			receive_batch_size = MAX_RECEIVE_BATCH_SIZE;
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_SHARD_COUNT);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 2 && getUShort(db.data) > 0) {
+			shard_count = getUShort(db.data);
+		} else {
+			log_fatal("invalid shard-count");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_SHARD_INDEX);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 2) {
+			shard_index = getUShort(db.data);
+		} else {
+			log_fatal("invalid shard-index");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	if (shard_count > 1) {
+		struct shared_network *share;
+
+		if (shard_index >= shard_count)
+			log_fatal("shard-index %d must be less than "
+				  "shard-count %d", shard_index, shard_count);
+
+		/* Hash on the name so every server agrees on the split
+		   without having to see the same declaration order. */
+		for (share = shared_networks; share; share = share->next)
+			share->shard = do_string_hash(share->name,
+						      strlen(share->name),
+						      shard_count);
+
+		log_info("Answering for shard %d of %d.",
+			 shard_index, shard_count);
+	}
+
+#ifdef DHCPv6
+	/* The pools are all declared by now, and which of their addresses
+	   are ours is known, so map the dense ones. */
+	map_dense_ipv6_pools(dense_pool_size);
+#endif
+
+	oc = lookup_option(&server_universe, options, SV_LEASE_FILE_FORMAT);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 1) {
+			lease_file_format = db.data[0];
+		} else {
+			log_fatal("invalid lease-file-format");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options,
+			   SV_LEASE_REWRITE_INTERVAL);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			lease_rewrite_period = getULong(db.data);
+		} else {
+			log_fatal("invalid lease-file-rewrite-interval");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
+	oc = lookup_option(&server_universe, options, SV_LEASE_REWRITE_SIZE);
+	if ((oc != NULL) &&
+	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
+				  &global_scope, oc, MDL)) {
+		if (db.len == 4) {
+			lease_rewrite_size = getULong(db.data);
+		} else {
+			log_fatal("invalid lease-file-rewrite-size");
+		}
+
+		data_string_forget(&db, MDL);
+	}
+
 #if defined (BINARY_LEASES)
 	if (local_family == AF_INET) {
 		log_info("Source compiled to use binary-leases");
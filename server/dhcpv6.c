@@ -104,6 +104,11 @@ struct reply_state {
 	/* Space for the on commit statements for a fixed host */
 	struct on_star on_star;
 
+	/* IA_NA whose renewal changed nothing but its timers, and its
+	 * cache threshold, for the cached renewal reply. */
+	struct ia_xx *renew_ia;
+	int renew_threshold;
+
 	union reply_buffer {
 		unsigned char data[65536];
 		struct dhcpv6_packet reply;
@@ -188,6 +193,17 @@ static const char *iasubopt_plen_str(struct iasubopt *lease);
 static int release_on_roam(struct reply_state *reply);
 
 static int reuse_lease6(struct reply_state *reply, struct iasubopt *lease);
+static int cache_threshold6(struct reply_state *reply,
+			    struct iasubopt *lease);
+static int lease6_is_young(struct iasubopt *lease, int threshold,
+			   time_t *age);
+static int renew_unchanged(struct reply_state *reply);
+static int renew_from_cache(struct data_string *reply_ret,
+			    struct packet *packet,
+			    const struct data_string *client_id,
+			    struct shared_network *shared,
+			    struct host_decl *host);
+static void renew_save_reply(struct reply_state *reply);
 static void shorten_lifetimes(struct reply_state *reply, struct iasubopt *lease,
 			      time_t age, int threshold);
 static void write_to_packet(struct reply_state *reply, unsigned ia_cursor);
@@ -1252,6 +1268,14 @@ try_client_v6_address(struct iasubopt **addr,
 		return ISC_R_ADDRNOTAVAIL;
 	}
 
+	/*
+	 * Another shard server hands out this address, and may have
+	 * already, so it isn't ours to give.
+	 */
+	if (!shard_owns_lease6(pool, &tmp_addr)) {
+		return ISC_R_ADDRNOTAVAIL;
+	}
+
 	if (lease6_exists(pool, &tmp_addr)) {
 		return ISC_R_ADDRINUSE;
 	}
@@ -1481,7 +1505,8 @@ try_client_v6_prefix(struct iasubopt **pref,
 	}
 
 	if (!ipv6_in_pool(&tmp_pref, pool) ||
-	    ((int)tmp_plen != pool->units)) {
+	    ((int)tmp_plen != pool->units) ||
+	    !shard_owns_lease6(pool, &tmp_pref)) {
 		return ISC_R_ADDRNOTAVAIL;
 	}
 
@@ -1632,6 +1657,47 @@ pick_v6_prefix(struct reply_state *reply) {
 	return ISC_R_NORESOURCES;
 }
 
+/*
+ * Find the usable prefix length closest to the one the client asked for,
+ * among the PD pools it may use that are not known to be full and whose
+ * prefixes are longer (PLM_MINIMUM) or shorter (PLM_MAXIMUM) than bound.
+ * Returns -1 if there are none.
+ */
+static int
+closest_prefix_len(struct reply_state *reply, int prefix_mode, int bound) {
+	struct ipv6_pool *p;
+	struct ipv6_pond *pond;
+	int i, best = -1;
+
+	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
+		if (((pond->prohibit_list != NULL) &&
+		     (permitted(reply->packet, pond->prohibit_list))) ||
+		    ((pond->permit_list != NULL) &&
+		     (!permitted(reply->packet, pond->permit_list))))
+			continue;
+
+		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+			if ((p->pool_type != D6O_IA_PD) ||
+			    ((p->used_map != NULL) && (p->map_free == 0)) ||
+			    (eval_prefix_mode(p->units, reply->preflen,
+					      prefix_mode) != 1))
+				continue;
+
+			if (prefix_mode == PLM_MINIMUM) {
+				if ((p->units > bound) &&
+				    ((best < 0) || (p->units < best)))
+					best = p->units;
+			} else {
+				if ((p->units < bound) &&
+				    ((best < 0) || (p->units > best)))
+					best = p->units;
+			}
+		}
+	}
+
+	return best;
+}
+
 /*!
  *
  * \brief  Get an IPv6 prefix for the client based upon selection mode.
@@ -1639,7 +1705,11 @@ pick_v6_prefix(struct reply_state *reply) {
  * We walk through the ponds checking for permit and deny. If a pond is
  * permissable to use, loop through its PD pools checking prefix lengths
  * against the client plen based on the prefix length mode, looking for
- * available prefixes.
+ * available prefixes.  For PLM_MINIMUM and PLM_MAXIMUM we first try the
+ * pools with the usable length closest to the client's, then the next
+ * closest and so on, so a client does not get a shorter (larger) prefix
+ * than it needs while one closer to its request is free.  Dense pools
+ * that are full are skipped without trying them.
  *
  * \param reply = the state structure for the current work on this request
  *                if we create a lease we return it using reply->lease
@@ -1662,25 +1732,44 @@ pick_v6_prefix_helper(struct reply_state *reply, int prefix_mode) {
 	int i;
 	unsigned int attempts;
 	struct iasubopt **pref = &reply->lease;
+	int len, bound;
+
+	len = -1;
+	bound = (prefix_mode == PLM_MINIMUM) ? reply->preflen - 1
+					     : reply->preflen + 1;
+	do {
+		if ((prefix_mode == PLM_MINIMUM) ||
+		    (prefix_mode == PLM_MAXIMUM)) {
+			len = closest_prefix_len(reply, prefix_mode, bound);
+			if (len < 0)
+				break;
+			bound = len;
+		}
 
-	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
-		if (((pond->prohibit_list != NULL) &&
-		     (permitted(reply->packet, pond->prohibit_list))) ||
-		    ((pond->permit_list != NULL) &&
-		     (!permitted(reply->packet, pond->permit_list))))
-			continue;
+		for (pond = reply->shared->ipv6_pond; pond != NULL;
+		     pond = pond->next) {
+			if (((pond->prohibit_list != NULL) &&
+			     (permitted(reply->packet, pond->prohibit_list))) ||
+			    ((pond->permit_list != NULL) &&
+			     (!permitted(reply->packet, pond->permit_list))))
+				continue;
 
-		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
-			if ((p->pool_type == D6O_IA_PD) &&
-			    (eval_prefix_mode(p->units, reply->preflen,
-					      prefix_mode) == 1) &&
-			    (create_prefix6(p, pref, &attempts,
-					    &reply->ia->iaid_duid,
-					    cur_time + 120) == ISC_R_SUCCESS)) {
-				return (ISC_R_SUCCESS);
+			for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+				if ((p->pool_type == D6O_IA_PD) &&
+				    ((len < 0) || (p->units == len)) &&
+				    ((p->used_map == NULL) ||
+				     (p->map_free != 0)) &&
+				    (eval_prefix_mode(p->units, reply->preflen,
+						      prefix_mode) == 1) &&
+				    (create_prefix6(p, pref, &attempts,
+						    &reply->ia->iaid_duid,
+						    cur_time + 120)
+				     == ISC_R_SUCCESS)) {
+					return (ISC_R_SUCCESS);
+				}
 			}
 		}
-	}
+	} while (len >= 0);
 
 	return ISC_R_NORESOURCES;
 }
@@ -1722,6 +1811,286 @@ eval_prefix_mode(int len, int preflen, int prefix_mode) {
 	return (use_it);
 }
 
+/*
+ * Cached renewal replies.
+ *
+ * Most Renews are for a single IA_NA whose addresses are kept, and change
+ * nothing but the lease timers.  The reply to such a renewal is kept on
+ * the IA along with a key describing the request it answered.  When the
+ * next Renew for that IA has the same key, was made under the same
+ * configuration (statements_generation) and the IA hasn't changed, the
+ * leases are renewed in place and the kept reply is sent again with the
+ * new transaction ID, without evaluating the configuration or building
+ * the reply.
+ *
+ * The key holds everything about the request that the reply can depend
+ * on: the shared network, host and classes it was matched to, and each
+ * message it came in, from the client's out through any relays, options
+ * and all, except the elapsed time and the relayed message itself.
+ */
+
+static unsigned char *renew_key_buf;
+static unsigned renew_key_len, renew_key_max;
+
+static void
+renew_key_put(const void *data, unsigned len) {
+	unsigned char *buf;
+	unsigned max;
+
+	if (renew_key_len + len > renew_key_max) {
+		max = renew_key_max ? renew_key_max : 1024;
+		while (renew_key_len + len > max)
+			max *= 2;
+		buf = dmalloc(max, MDL);
+		if (buf == NULL)
+			log_fatal("No memory for renewal key.");
+		if (renew_key_buf != NULL) {
+			memcpy(buf, renew_key_buf, renew_key_len);
+			dfree(renew_key_buf, MDL);
+		}
+		renew_key_buf = buf;
+		renew_key_max = max;
+	}
+
+	memcpy(renew_key_buf + renew_key_len, data, len);
+	renew_key_len += len;
+}
+
+static void
+renew_key_option(struct option_cache *oc, struct packet *packet,
+		 struct lease *lease, struct client_state *client_state,
+		 struct option_state *in_options,
+		 struct option_state *cfg_options,
+		 struct binding_scope **scope,
+		 struct universe *u, void *stuff) {
+	unsigned char head[6];
+
+	for (; oc != NULL; oc = oc->next) {
+		if ((oc->option->code == D6O_ELAPSED_TIME) ||
+		    (oc->option->code == D6O_RELAY_MSG))
+			continue;
+
+		putUShort(head, oc->option->code);
+		putULong(head + 2, oc->data.len);
+		renew_key_put(head, sizeof(head));
+		renew_key_put(oc->data.data, oc->data.len);
+	}
+}
+
+/* Build the key for a request in renew_key_buf. */
+static void
+renew_key_build(struct packet *packet, struct shared_network *shared,
+		struct host_decl *host) {
+	struct packet *p;
+
+	renew_key_len = 0;
+	renew_key_put(&shared, sizeof(shared));
+	renew_key_put(&host, sizeof(host));
+	renew_key_put(&packet->class_count, sizeof(packet->class_count));
+	renew_key_put(packet->classes,
+		      packet->class_count * sizeof(packet->classes[0]));
+	renew_key_put(&packet->client_addr, sizeof(packet->client_addr));
+
+	for (p = packet; p != NULL; p = p->dhcpv6_container_packet) {
+		renew_key_put(&p->dhcpv6_msg_type,
+			      sizeof(p->dhcpv6_msg_type));
+		renew_key_put(&p->dhcpv6_hop_count,
+			      sizeof(p->dhcpv6_hop_count));
+		renew_key_put(&p->dhcpv6_link_address,
+			      sizeof(p->dhcpv6_link_address));
+		renew_key_put(&p->dhcpv6_peer_address,
+			      sizeof(p->dhcpv6_peer_address));
+		option_space_foreach(p, NULL, NULL, NULL, p->options, NULL,
+				     &dhcpv6_universe, NULL,
+				     renew_key_option);
+	}
+}
+
+/* Return 1 if the IA_NA in a Renew is being renewed with the same
+ * addresses it had, and nothing else about them can change. */
+static int
+renew_unchanged(struct reply_state *reply) {
+	struct iasubopt *tmp;
+	int i;
+
+	if ((reply->packet->dhcpv6_msg_type != DHCPV6_RENEW) ||
+	    (reply->old_ia == NULL) ||
+	    (reply->old_ia->num_iasubopt != reply->ia->num_iasubopt))
+		return (0);
+
+#if defined (NSUPDATE)
+	/* DNS updates are retried and checked on every renewal. */
+	if ((ddns_update_style == DDNS_UPDATE_STYLE_STANDARD) ||
+	    (ddns_update_style == DDNS_UPDATE_STYLE_INTERIM))
+		return (0);
+#endif
+
+	for (i = 0; i < reply->ia->num_iasubopt; i++) {
+		tmp = reply->ia->iasubopt[i];
+		if ((tmp != reply->old_ia->iasubopt[i]) ||
+		    (tmp->state != FTS_ACTIVE) ||
+		    (tmp->ddns_cb != NULL) ||
+		    ((tmp->scope != NULL) && (tmp->scope->bindings != NULL)))
+			return (0);
+	}
+
+	return (1);
+}
+
+/* Keep the reply just built for a renewal that changed nothing but
+ * timers on the IA it renewed. */
+static void
+renew_save_reply(struct reply_state *reply) {
+	struct option_cache *oc;
+	struct ia_xx *ia = reply->renew_ia;
+
+	oc = lookup_option(&dhcpv6_universe, reply->packet->options,
+			   D6O_IA_NA);
+	if ((reply->ia_count != 1) || (reply->pd_count != 0) ||
+	    (oc == NULL) || (oc->next != NULL) ||
+	    (lookup_option(&dhcpv6_universe, reply->packet->options,
+			   D6O_IA_TA) != NULL))
+		return;
+
+	if (ia->renew_key.data != NULL)
+		data_string_forget(&ia->renew_key, MDL);
+	if (ia->renew_reply.data != NULL)
+		data_string_forget(&ia->renew_reply, MDL);
+
+	renew_key_build(reply->packet, reply->shared, reply->host);
+	if (!buffer_allocate(&ia->renew_key.buffer, renew_key_len, MDL) ||
+	    !buffer_allocate(&ia->renew_reply.buffer, reply->cursor, MDL))
+		log_fatal("No memory to keep renewal reply.");
+
+	memcpy(ia->renew_key.buffer->data, renew_key_buf, renew_key_len);
+	ia->renew_key.data = ia->renew_key.buffer->data;
+	ia->renew_key.len = renew_key_len;
+	memcpy(ia->renew_reply.buffer->data, reply->buf.data, reply->cursor);
+	ia->renew_reply.data = ia->renew_reply.buffer->data;
+	ia->renew_reply.len = reply->cursor;
+	ia->renew_generation = statements_generation;
+	ia->renew_threshold = reply->renew_threshold;
+}
+
+/*
+ * If the packet is a Renew of a single IA_NA that has a kept reply for
+ * the same request, renew its leases, write it out and return the kept
+ * reply in reply_ret.  Returns 1 if it did, 0 if the reply has to be
+ * built the usual way.
+ *
+ * The leases must all still be active and unexpired, and old enough that
+ * dhcp-cache-threshold wouldn't have them reused as they are, which
+ * would send the client shorter lifetimes.
+ */
+static int
+renew_from_cache(struct data_string *reply_ret, struct packet *packet,
+		 const struct data_string *client_id,
+		 struct shared_network *shared, struct host_decl *host) {
+	struct option_cache *oc;
+	struct data_string ia_data, key;
+	struct ia_xx *ia = NULL;
+	struct iasubopt *tmp;
+	char tmp_addr[INET6_ADDRSTRLEN];
+	u_int32_t iaid;
+	time_t age;
+	int i, ok = 0;
+
+	if (packet->dhcpv6_msg_type != DHCPV6_RENEW)
+		return (0);
+
+	oc = lookup_option(&dhcpv6_universe, packet->options, D6O_IA_NA);
+	if ((oc == NULL) || (oc->next != NULL) ||
+	    (lookup_option(&dhcpv6_universe, packet->options,
+			   D6O_IA_TA) != NULL) ||
+	    (lookup_option(&dhcpv6_universe, packet->options,
+			   D6O_IA_PD) != NULL))
+		return (0);
+
+	memset(&ia_data, 0, sizeof(ia_data));
+	memset(&key, 0, sizeof(key));
+	if (!evaluate_option_cache(&ia_data, packet, NULL, NULL,
+				   packet->options, NULL, &global_scope,
+				   oc, MDL))
+		return (0);
+	if (ia_data.len < IA_NA_OFFSET) {
+		data_string_forget(&ia_data, MDL);
+		return (0);
+	}
+	iaid = getULong(ia_data.data);
+	data_string_forget(&ia_data, MDL);
+
+	if (ia_make_key(&key, iaid, (const char *)client_id->data,
+			client_id->len, MDL) != ISC_R_SUCCESS)
+		return (0);
+	ia_hash_lookup(&ia, ia_na_active, (unsigned char *)key.data,
+		       key.len, MDL);
+	data_string_forget(&key, MDL);
+	if (ia == NULL)
+		return (0);
+
+	if ((ia->renew_reply.data == NULL) ||
+	    (ia->renew_generation != statements_generation) ||
+	    (ia->num_iasubopt == 0))
+		goto out;
+
+	renew_key_build(packet, shared, host);
+	if ((ia->renew_key.len != renew_key_len) ||
+	    memcmp(ia->renew_key.data, renew_key_buf, renew_key_len))
+		goto out;
+
+	for (i = 0; i < ia->num_iasubopt; i++) {
+		tmp = ia->iasubopt[i];
+		if ((tmp->state != FTS_ACTIVE) ||
+		    (tmp->hard_lifetime_end_time <= cur_time) ||
+		    (tmp->ddns_cb != NULL) ||
+		    ((tmp->scope != NULL) && (tmp->scope->bindings != NULL)))
+			goto out;
+		if ((ia->renew_threshold > 0) &&
+		    ((tmp->valid >= MAX_TIME) ||
+		     lease6_is_young(tmp, ia->renew_threshold, &age)))
+			goto out;
+	}
+
+	/* Renew the leases as reply_process_is_addressed() and
+	 * reply_process_ia_na() would. */
+	for (i = 0; i < ia->num_iasubopt; i++) {
+		tmp = ia->iasubopt[i];
+
+		log_info("%s NA: address %s to client with duid %s "
+			 "iaid = %d valid for %u seconds",
+			 dhcpv6_type_names[DHCPV6_REPLY],
+			 inet_ntop(AF_INET6, &tmp->addr,
+				   tmp_addr, sizeof(tmp_addr)),
+			 print_hex_1(client_id->len, client_id->data, 60),
+			 iaid, tmp->valid);
+
+		if (tmp->valid == INFINITE_TIME)
+			tmp->soft_lifetime_end_time = MAX_TIME;
+		else
+			tmp->soft_lifetime_end_time = cur_time + tmp->valid;
+		renew_lease6(tmp->ipv6_pool, tmp);
+		schedule_lease_timeout(tmp->ipv6_pool);
+	}
+	ia->cltt = cur_time;
+	write_ia(ia);
+
+	/* Send the kept reply with this request's transaction ID. */
+	reply_ret->len = ia->renew_reply.len;
+	reply_ret->buffer = NULL;
+	if (!buffer_allocate(&reply_ret->buffer, reply_ret->len, MDL)) {
+		log_fatal("No memory to store Reply.");
+	}
+	memcpy(reply_ret->buffer->data, ia->renew_reply.data, reply_ret->len);
+	memcpy(reply_ret->buffer->data + 1, packet->dhcpv6_transaction_id,
+	       sizeof(packet->dhcpv6_transaction_id));
+	reply_ret->data = reply_ret->buffer->data;
+	ok = 1;
+
+      out:
+	ia_dereference(&ia, MDL);
+	return (ok);
+}
+
 /*
  *! \file server/dhcpv6.c
  *
@@ -1766,7 +2135,7 @@ lease_to_client(struct data_string *reply_ret,
 	static struct reply_state reply;
 	struct option_cache *oc;
 	struct data_string packet_oro;
-	int i;
+	int i, known;
 
 	memset(&packet_oro, 0, sizeof(packet_oro));
 
@@ -1775,6 +2144,22 @@ lease_to_client(struct data_string *reply_ret,
 					packet) != ISC_R_SUCCESS)
 		goto exit;
 
+	/*
+	 * Find a host record that matches the packet, if any, and is
+	 * valid for the shared network the client is on.  The packet
+	 * isn't marked known until the reply has been started, as before.
+	 */
+	known = find_hosts6(&reply.host, packet, client_id, MDL);
+	if (known)
+		seek_shared_host(&reply.host, reply.shared);
+
+	/* A Renew that changes nothing may be answered as the last was. */
+	if (renew_from_cache(reply_ret, packet, client_id, reply.shared,
+			     reply.host)) {
+		(void) commit_leases_timed();
+		goto exit;
+	}
+
 	/*
 	 * Initialize the reply.
 	 */
@@ -1802,14 +2187,8 @@ lease_to_client(struct data_string *reply_ret,
 		}
 	}
 
-	/*
-	 * Find a host record that matches the packet, if any, and is
-	 * valid for the shared network the client is on.
-	 */
-	if (find_hosts6(&reply.host, packet, client_id, MDL)) {
+	if (known)
 		packet->known = 1;
-		seek_shared_host(&reply.host, reply.shared);
-	}
 
 	/* Process the client supplied IA's onto the reply buffer. */
 	reply.ia_count = 0;
@@ -1961,6 +2340,9 @@ lease_to_client(struct data_string *reply_ret,
 	memcpy(reply_ret->buffer->data, reply.buf.data, reply.cursor);
 	reply_ret->data = reply_ret->buffer->data;
 
+	if (reply.renew_ia != NULL)
+		renew_save_reply(&reply);
+
 	/* If appropriate commit and rotate the lease file */
 	(void) commit_leases_timed();
 
@@ -1978,6 +2360,8 @@ lease_to_client(struct data_string *reply_ret,
 		data_string_forget(&reply.client_id, MDL);
 	if (packet_oro.buffer != NULL)
 		data_string_forget(&packet_oro, MDL);
+	if (reply.renew_ia != NULL)
+		ia_dereference(&reply.renew_ia, MDL);
 	reply.renew = reply.rebind = reply.min_prefer = reply.min_valid = 0;
 	reply.cursor = 0;
 }
@@ -2300,6 +2684,7 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 	if ((reply->ia->num_iasubopt != 0) &&
 	    (reply->buf.reply.msg_type == DHCPV6_REPLY)) {
 		int must_commit = 0;
+		int unchanged = renew_unchanged(reply);
 		struct iasubopt *tmp;
 		struct data_string *ia_id;
 		int i;
@@ -2314,6 +2699,7 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 
 			/* If we have anything to do on commit do it now */
 			if (tmp->on_star.on_commit != NULL) {
+				unchanged = 0;
 				execute_statements(NULL, reply->packet,
 						   NULL, NULL,
 						   reply->packet->options,
@@ -2349,6 +2735,8 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 
 				/* Do our threshold check. */
 				check_pool6_threshold(reply, tmp);
+			} else {
+				unchanged = 0;
 			}
 		}
 
@@ -2378,6 +2766,14 @@ reply_process_ia_na(struct reply_state *reply, struct option_cache *ia) {
 		if (must_commit) {
 			write_ia(reply->ia);
 		}
+
+		/* The reply to a renewal that changed nothing else may be
+		 * sent again for the next one. */
+		if (unchanged && (reply->renew_ia == NULL)) {
+			reply->renew_threshold =
+				cache_threshold6(reply, reply->ia->iasubopt[0]);
+			ia_reference(&reply->renew_ia, reply->ia, MDL);
+		}
 	} else {
 		/* write the IA_NA in wire-format to the outbound buffer */
 		write_to_packet(reply, ia_cursor);
@@ -3206,11 +3602,8 @@ reply_process_ia_ta(struct reply_state *reply, struct option_cache *ia) {
  */
 int
 reuse_lease6(struct reply_state *reply, struct iasubopt *lease) {
-	int threshold = DEFAULT_CACHE_THRESHOLD;
-	struct option_cache* oc = NULL;
-	struct data_string d1;
+	int threshold;
 	time_t age;
-	time_t limit;
 	int reuse_it = 0;
 
 	/* In order to even qualify for reuse consideration:
@@ -3223,7 +3616,36 @@ reuse_lease6(struct reply_state *reply, struct iasubopt *lease) {
 		return (0);
 	}
 
-	/* Look up threshold value */
+	threshold = cache_threshold6(reply, lease);
+	if (threshold <= 0) {
+		return (0);
+	}
+
+	if (lease->valid >= MAX_TIME) {
+		/* Infinite leases are always reused.  We have to make
+		* a choice because we cannot determine when they actually
+		* began, so we either always reuse them or we never do. */
+		log_debug ("reusing infinite lease for: %s%s",
+			    pin6_addr(&lease->addr), iasubopt_plen_str(lease));
+		return (1);
+	}
+
+	if (lease6_is_young(lease, threshold, &age)) {
+		/* Reduce valid/preferred going to the client by age */
+		shorten_lifetimes(reply, lease, age, threshold);
+		reuse_it = 1;
+	}
+
+	return (reuse_it);
+}
+
+/* Look up the dhcp-cache-threshold that applies to lease. */
+static int
+cache_threshold6(struct reply_state *reply, struct iasubopt *lease) {
+	int threshold = DEFAULT_CACHE_THRESHOLD;
+	struct option_cache* oc = NULL;
+	struct data_string d1;
+
 	memset(&d1, 0, sizeof(struct data_string));
 	oc = lookup_option(&server_universe, reply->opt_state,
 			   SV_CACHE_THRESHOLD);
@@ -3238,32 +3660,22 @@ reuse_lease6(struct reply_state *reply, struct iasubopt *lease) {
 		data_string_forget(&d1, MDL);
 	}
 
-	if (threshold <= 0) {
-		return (0);
-	}
+	return (threshold);
+}
 
-	if (lease->valid >= MAX_TIME) {
-		/* Infinite leases are always reused.  We have to make
-		* a choice because we cannot determine when they actually
-		* began, so we either always reuse them or we never do. */
-		log_debug ("reusing infinite lease for: %s%s",
-			    pin6_addr(&lease->addr), iasubopt_plen_str(lease));
-		return (1);
-	}
+/* Return 1 if the lease is younger than threshold percent of its valid
+ * lifetime, which must be finite, and its age in age. */
+static int
+lease6_is_young(struct iasubopt *lease, int threshold, time_t *age) {
+	time_t limit;
 
-	age = cur_tv.tv_sec - (lease->hard_lifetime_end_time - lease->valid);
+	*age = cur_tv.tv_sec - (lease->hard_lifetime_end_time - lease->valid);
 	if (lease->valid <= (INT_MAX / threshold))
 		limit = lease->valid * threshold / 100;
 	else
 		limit = lease->valid / 100 * threshold;
 
-	if (age < limit) {
-		/* Reduce valid/preferred going to the client by age */
-		shorten_lifetimes(reply, lease, age, threshold);
-		reuse_it = 1;
-	}
-
-	return (reuse_it);
+	return (*age < limit);
 }
 
 /*
@@ -7569,10 +7981,38 @@ dhcpv6_discard(struct packet *packet) {
 		  piaddr(packet->client_addr));
 }
 
+/*
+ * When shard-count splits the DHCPv6 clients between several servers,
+ * each answers only the clients whose DUID hashes to its shard-index.
+ * Messages without a client identifier are left to shard zero.
+ */
+static int
+shard_owns_client(struct packet *packet) {
+	struct data_string client_id;
+	int shard;
+
+	if (shard_count <= 1)
+		return (1);
+
+	memset(&client_id, 0, sizeof(client_id));
+	if (get_client_id(packet, &client_id) != ISC_R_SUCCESS)
+		return (shard_index == 0);
+
+	shard = do_string_hash(client_id.data, client_id.len, shard_count);
+	data_string_forget(&client_id, MDL);
+	return (shard == shard_index);
+}
+
 static void
 build_dhcpv6_reply(struct data_string *reply, struct packet *packet) {
 	memset(reply, 0, sizeof(*reply));
 
+	/* Another server in the shard group answers this client. */
+	if ((packet->dhcpv6_msg_type != DHCPV6_RELAY_FORW) &&
+	    (packet->dhcpv6_msg_type != DHCPV6_DHCPV4_QUERY) &&
+	    !shard_owns_client(packet))
+		return;
+
 	/* I would like to classify the client once here, but
 	 * as I don't want to classify all of the incoming packets
 	 * I need to do it before handling specific types.
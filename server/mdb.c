@@ -94,6 +94,7 @@ isc_result_t enter_class(cd, dynamicp, commit)
 			/* nothing */ ;
 		class_reference (&c -> nic, cd, MDL);
 	}
+	invalidate_class_indexes ();
 
 	if (dynamicp && commit) {
 		const char *name = cd->name;
@@ -473,6 +474,7 @@ isc_result_t delete_class (cp, commit)
 	 * If this is a subclass remove it from the class's hash table
 	 */
 	if (cp->superclass) {
+		forget_spawned_class(cp);
 		class_hash_delete(cp->superclass->hash,
 				  (const char *)cp->hash_string.data,
 				  cp->hash_string.len,
@@ -929,11 +931,250 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 	}
 }
 
+/*
+ * Longest prefix match index over the subnets list, one trie for each
+ * address length.  It's a path compressed binary trie: a node covers
+ * the first plen bits of its key and its children differ at bit plen.
+ * Nodes without a subnet only exist to join two branches.  Should a
+ * subnet with a non-contiguous netmask turn up we give up on the index
+ * and go back to walking the list.  A node holds only the newest of
+ * several identical subnets, so once there are duplicates lookups
+ * within a shared network walk its list as well.
+ */
+struct subnet_trie_node {
+	struct subnet_trie_node *child [2];
+	unsigned char key [16];
+	unsigned plen;
+	struct subnet *subnet;
+};
+
+static struct subnet_trie_node *subnet_trie4;
+static struct subnet_trie_node *subnet_trie6;
+static int subnet_trie_unusable;
+static int subnet_trie_dups;
+
+/* Bit number bit of a key, counting from the most significant bit of
+   its first octet.  These are shared with the IPv6 pool index in
+   mdb6.c. */
+int
+subnet_trie_key_bit(const unsigned char *key, unsigned bit)
+{
+	return ((key[bit >> 3] >> (7 - (bit & 7))) & 1);
+}
+
+/* Number of leading bits, up to max, that a and b have in common. */
+unsigned
+subnet_trie_key_common(const unsigned char *a, const unsigned char *b,
+		       unsigned max)
+{
+	unsigned n = 0, i;
+	unsigned char x;
+
+	for (i = 0; n < max; i++) {
+		x = a[i] ^ b[i];
+		if (x == 0) {
+			n += 8;
+			continue;
+		}
+		while ((x & 0x80) == 0) {
+			x <<= 1;
+			n++;
+		}
+		break;
+	}
+	return (n < max ? n : max);
+}
+
+/* Fill in the masked key for a subnet and return its prefix length,
+   or -1 if the netmask isn't contiguous. */
+static int
+subnet_trie_key(const struct subnet *subnet, unsigned char *key)
+{
+	unsigned i;
+	int plen = 0, ended = 0;
+	unsigned char m;
+
+	memset(key, 0, 16);
+	for (i = 0; i < subnet->netmask.len && i < 16; i++) {
+		key[i] = subnet->net.iabuf[i] & subnet->netmask.iabuf[i];
+		for (m = 0x80; m != 0; m >>= 1) {
+			if (subnet->netmask.iabuf[i] & m) {
+				if (ended)
+					return (-1);
+				plen++;
+			} else {
+				ended = 1;
+			}
+		}
+	}
+	return (plen);
+}
+
+static struct subnet_trie_node **
+subnet_trie_root(unsigned len)
+{
+	if (len == 4)
+		return (&subnet_trie4);
+	if (len == 16)
+		return (&subnet_trie6);
+	return (NULL);
+}
+
+static struct subnet_trie_node *
+subnet_trie_node_new(const unsigned char *key, unsigned plen,
+		     struct subnet *subnet)
+{
+	struct subnet_trie_node *n;
+
+	n = dmalloc(sizeof(*n), MDL);
+	if (n == NULL)
+		log_fatal("No memory for subnet index.");
+	memcpy(n->key, key, sizeof(n->key));
+	n->plen = plen;
+	if (subnet != NULL)
+		subnet_reference(&n->subnet, subnet, MDL);
+	return (n);
+}
+
+/* Does any subnet already in the index contain, or lie within, the
+   given one?  Only then can enter_subnet() have ordering to do. */
+static int
+subnet_trie_overlaps(const struct subnet *subnet)
+{
+	struct subnet_trie_node **root, *n;
+	unsigned char key [16];
+	unsigned common;
+	int plen;
+
+	plen = subnet_trie_key(subnet, key);
+	root = subnet_trie_root(subnet->net.len);
+	if (plen < 0 || root == NULL)
+		return (1);
+
+	for (n = *root; n != NULL;
+	     n = n->child[subnet_trie_key_bit(key, n->plen)]) {
+		common = subnet_trie_key_common(n->key, key,
+						n->plen < plen ?
+						n->plen : plen);
+		if (common < n->plen && common < plen)
+			return (0);
+		/* Everything under n is within the new subnet. */
+		if (n->plen >= plen)
+			return (1);
+		if (n->subnet != NULL)
+			return (1);
+	}
+	return (0);
+}
+
+static void
+subnet_trie_insert(struct subnet *subnet)
+{
+	struct subnet_trie_node **np, *n, *leaf, *glue;
+	unsigned char key [16];
+	unsigned common = 0;
+	int plen;
+
+	plen = subnet_trie_key(subnet, key);
+	np = subnet_trie_root(subnet->net.len);
+	if (plen < 0 || np == NULL) {
+		subnet_trie_unusable = 1;
+		return;
+	}
+
+	while ((n = *np) != NULL) {
+		common = subnet_trie_key_common(n->key, key,
+						n->plen < plen ?
+						n->plen : plen);
+		if (common < n->plen)
+			break;
+		if (n->plen == plen) {
+			/* The list walk found the newest duplicate first. */
+			if (n->subnet != NULL) {
+				subnet_dereference(&n->subnet, MDL);
+				subnet_trie_dups = 1;
+			}
+			subnet_reference(&n->subnet, subnet, MDL);
+			return;
+		}
+		np = &n->child[subnet_trie_key_bit(key, n->plen)];
+	}
+
+	leaf = subnet_trie_node_new(key, plen, subnet);
+	if (n == NULL) {
+		*np = leaf;
+	} else if (common == plen) {
+		/* The new subnet contains the existing branch. */
+		leaf->child[subnet_trie_key_bit(n->key, plen)] = n;
+		*np = leaf;
+	} else {
+		glue = subnet_trie_node_new(key, common, NULL);
+		glue->child[subnet_trie_key_bit(n->key, common)] = n;
+		glue->child[subnet_trie_key_bit(key, common)] = leaf;
+		*np = glue;
+	}
+}
+
+/* Return the most specific subnet containing addr, restricted to the
+   given shared network if there is one. */
+static struct subnet *
+subnet_trie_lookup(struct iaddr addr, struct shared_network *share)
+{
+	struct subnet_trie_node **root, *n;
+	struct subnet *best = NULL;
+	unsigned bits = addr.len * 8;
+
+	root = subnet_trie_root(addr.len);
+	if (root == NULL)
+		return (NULL);
+
+	for (n = *root; n != NULL;
+	     n = n->child[subnet_trie_key_bit(addr.iabuf, n->plen)]) {
+		if (n->plen > bits ||
+		    subnet_trie_key_common(n->key, addr.iabuf,
+					   n->plen) < n->plen)
+			break;
+		if (n->subnet != NULL &&
+		    (share == NULL || n->subnet->shared_network == share))
+			best = n->subnet;
+		if (n->plen == bits)
+			break;
+	}
+	return (best);
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE) && \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+static void
+subnet_trie_free(struct subnet_trie_node **np)
+{
+	struct subnet_trie_node *n = *np;
+
+	if (n == NULL)
+		return;
+	subnet_trie_free(&n->child[0]);
+	subnet_trie_free(&n->child[1]);
+	if (n->subnet != NULL)
+		subnet_dereference(&n->subnet, MDL);
+	dfree(n, MDL);
+	*np = NULL;
+}
+#endif
+
 int find_subnet (struct subnet **sp,
 		 struct iaddr addr, const char *file, int line)
 {
 	struct subnet *rv;
 
+	if (!subnet_trie_unusable) {
+		rv = subnet_trie_lookup(addr, NULL);
+		if (rv == NULL)
+			return 0;
+		if (subnet_reference (sp, rv, file, line) != ISC_R_SUCCESS)
+			return 0;
+		return 1;
+	}
+
 	for (rv = subnets; rv; rv = rv -> next_subnet) {
 #if defined(DHCP4o6)
 		if (addr.len != rv->netmask.len)
@@ -955,6 +1196,15 @@ int find_grouped_subnet (struct subnet **sp,
 {
 	struct subnet *rv;
 
+	if (!subnet_trie_unusable && !subnet_trie_dups) {
+		rv = subnet_trie_lookup(addr, share);
+		if (rv == NULL)
+			return 0;
+		if (subnet_reference (sp, rv, file, line) != ISC_R_SUCCESS)
+			return 0;
+		return 1;
+	}
+
 	for (rv = share -> subnets; rv; rv = rv -> next_sibling) {
 #if defined(DHCP4o6)
 		if (addr.len != rv->netmask.len)
@@ -1010,9 +1260,15 @@ void enter_subnet (subnet)
 	struct subnet *scan = (struct subnet *)0;
 	struct subnet *next = (struct subnet *)0;
 	struct subnet *prev = (struct subnet *)0;
+	int overlaps;
+
+	/* Only a subnet that overlaps one we already have can need
+	   reordering or a warning, so don't scan the list otherwise. */
+	overlaps = subnet_trie_unusable || subnet_trie_overlaps (subnet);
+	subnet_trie_insert (subnet);
 
 	/* Check for duplicates... */
-	if (subnets)
+	if (subnets && overlaps)
 	    subnet_reference (&next, subnets, MDL);
 	while (next) {
 	    subnet_reference (&scan, next, MDL);
@@ -1041,7 +1297,6 @@ void enter_subnet (subnet)
 	if (prev)
 		subnet_dereference (&prev, MDL);
 
-	/* XXX use the BSD radix tree code instead of a linked list. */
 	if (subnets) {
 		subnet_reference (&subnet -> next_subnet, subnets, MDL);
 		subnet_dereference (&subnets, MDL);
@@ -1404,6 +1659,8 @@ int supersede_lease (comp, lease, commit, propogate, pimmediate, from_pool)
 	/* Remove the lease from its current place in its current
 	   timer sequence. */
 	LEASE_REMOVEP(lq, comp);
+	if ((lq == &comp->pool->free) || (lq == &comp->pool->abandoned))
+		pool_index_update(comp->pool);
 
 	/* Now that we've done the flag-affected queue removal
 	 * we can update the new lease's flags, if there's an
@@ -2460,6 +2717,7 @@ int write_leases ()
 	/* Write all the dynamically-created group declarations. */
 	if (group_name_hash) {
 	    num_written = 0;
+	    finish_hash_resize (group_name_hash);
 	    for (i = 0; i < group_name_hash -> hash_count; i++) {
 		for (hb = group_name_hash -> buckets [i];
 		     hb; hb = hb -> next) {
@@ -2479,6 +2737,7 @@ int write_leases ()
 	/* Write all the deleted host declarations. */
 	if (host_name_hash) {
 	    num_written = 0;
+	    finish_hash_resize (host_name_hash);
 	    for (i = 0; i < host_name_hash -> hash_count; i++) {
 		for (hb = host_name_hash -> buckets [i];
 		     hb; hb = hb -> next) {
@@ -2498,6 +2757,7 @@ int write_leases ()
 	/* Write all the new, dynamic host declarations. */
 	if (host_name_hash) {
 	    num_written = 0;
+	    finish_hash_resize (host_name_hash);
 	    for (i = 0; i < host_name_hash -> hash_count; i++) {
 		for (hb = host_name_hash -> buckets [i];
 		     hb; hb = hb -> next) {
@@ -2752,6 +3012,8 @@ int lease_enqueue (struct lease *comp)
 	}
 
 	LEASE_INSERTP(lq, comp);
+	if ((lq == &comp->pool->free) || (lq == &comp->pool->abandoned))
+		pool_index_update(comp->pool);
 
 	return 1;
 }
@@ -3047,6 +3309,7 @@ void free_everything(void)
 				  MDL);
 
 	for (lp = collections; lp; lp = lp -> next) {
+	    forget_class_index (lp);
 	    if (lp -> classes) {
 		class_reference (&cn, lp -> classes, MDL);
 		do {
@@ -3102,6 +3365,8 @@ void free_everything(void)
 	}
 
 	/* Subnets are complicated because of the extra links. */
+	subnet_trie_free (&subnet_trie4);
+	subnet_trie_free (&subnet_trie6);
 	if (subnets) {
 	    subnet_reference (&sn, subnets, MDL);
 	    do {
@@ -3270,6 +3535,7 @@ void free_everything(void)
 	relinquish_free_binding_values ();
 	relinquish_free_option_caches ();
 	relinquish_free_packets ();
+	relinquish_free_packet_arenas ();
 #if defined(COMPACT_LEASES)
 	relinquish_lease_hunks ();
 #endif
@@ -189,6 +189,25 @@ HASH_FUNCTIONS(iasubopt, struct in6_addr *, struct iasubopt, iasubopt_hash_t,
 
 struct ipv6_pool **pools;
 int num_pools;
+static int pools_max;
+
+/*
+ * Index over pools[] so that find_ipv6_pool() doesn't have to try every
+ * pool.  There is a path compressed binary trie for each pool type keyed
+ * on the pool prefix: a node covers the first bits of its prefix and its
+ * children differ at the next bit.  Each node refers to the first pool in
+ * pools[] with that prefix, or to none if it only joins two branches.
+ */
+struct ipv6_pool_node {
+	struct ipv6_pool_node *child[2];
+	struct in6_addr prefix;
+	int bits;
+	int index;
+};
+
+static struct ipv6_pool_node *pool_index_na;
+static struct ipv6_pool_node *pool_index_ta;
+static struct ipv6_pool_node *pool_index_pd;
 
 /*
  * Create a new IAADDR/PREFIX structure.
@@ -426,6 +445,10 @@ ia_dereference(struct ia_xx **ia, const char *file, int line) {
 			dfree(tmp->iasubopt, file, line);
 		}
 		data_string_forget(&(tmp->iaid_duid), file, line);
+		if (tmp->renew_key.data != NULL)
+			data_string_forget(&tmp->renew_key, file, line);
+		if (tmp->renew_reply.data != NULL)
+			data_string_forget(&tmp->renew_reply, file, line);
 		dfree(tmp, file, line);
 	}
 	return ISC_R_SUCCESS;
@@ -799,6 +822,8 @@ ipv6_pool_dereference(struct ipv6_pool **pool, const char *file, int line) {
 		isc_heap_foreach(tmp->inactive_timeouts, 
 				 dereference_heap_entry, NULL);
 		isc_heap_destroy(&(tmp->inactive_timeouts));
+		if (tmp->used_map != NULL)
+			dfree(tmp->used_map, file, line);
 		dfree(tmp, file, line);
 	}
 
@@ -1007,50 +1032,488 @@ static struct in6_addr rtany;
 /* Reserved Subnet Anycasts ::fdff:ffff:ffff:ff80-::fdff:ffff:ffff:ffff. */
 static struct in6_addr resany;
 
+static void
+init_reserved_iids(void) {
+	static isc_boolean_t init_resiid = ISC_FALSE;
+
+	if (!init_resiid) {
+		memset(&rtany, 0, 16);
+		memset(&resany, 0, 8);
+		resany.s6_addr[8] = 0xfd;
+		memset(&resany.s6_addr[9], 0xff, 6);
+		init_resiid = ISC_TRUE;
+	}
+}
+
 /*
- * Create a lease for the given address and client duid.
+ * Check for reserved interface IDs. (cf. RFC 5453)
+ */
+static isc_boolean_t
+reserved_iid6(const struct in6_addr *addr) {
+	if (memcmp(&addr->s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
+		return ISC_TRUE;
+	}
+	if ((memcmp(&addr->s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
+	    ((addr->s6_addr[15] & 0x80) == 0x80)) {
+		return ISC_TRUE;
+	}
+	return ISC_FALSE;
+}
+
+/*
+ * Dense pools.
+ *
+ * An IA_NA pool of at most dense_pool_size addresses, or an IA_PD pool
+ * of at most dense_pool_size prefixes, gets a bitmap with one bit per
+ * address or prefix.  A bit is set while its address or prefix is in
+ * the leases hash of the pool, and always for reserved interface IDs.
+ *
+ * Above the bitmap are summary levels, each with a bit per word of the
+ * level below that is set once that word is full, up to a single word.
+ * A search for a free address or prefix climbs until a level has room
+ * and comes back down, so it takes one step per level whatever the
+ * pool holds.
+ */
+u_int32_t dense_pool_size = 65536;
+
+#define USED_MAP_BIT(off)	((u_int32_t)1 << ((off) & 31))
+
+void build_prefix6(struct in6_addr *pref, const struct in6_addr *net_start_pref,
+		   int pool_bits, int pref_bits,
+		   const struct data_string *input);
+
+static int
+lowest_bit(u_int32_t bits) {
+	int i;
+
+	for (i = 0; (bits & 1) == 0; i++) {
+		bits >>= 1;
+	}
+	return i;
+}
+
+/*
+ * The index of an address or prefix is the part of it between the pool
+ * prefix and the allocation unit, or the low 32 bits of that part if it
+ * is wider.
+ */
+static u_int32_t
+pool_index6(const struct ipv6_pool *pool, const struct in6_addr *addr) {
+	u_int64_t v;
+	int width, first, last, i;
+
+	width = pool->units - pool->bits;
+	last = (pool->units - 1) / 8;
+	first = (last >= 4) ? last - 4 : 0;
+	v = 0;
+	for (i = first; i <= last; i++) {
+		v = (v << 8) | addr->s6_addr[i];
+	}
+	v >>= 8 * (last + 1) - pool->units;
+	if (width < 32) {
+		v &= ((u_int64_t)1 << width) - 1;
+	}
+	return (u_int32_t)v;
+}
+
+static void
+pool_set_index6(const struct ipv6_pool *pool, u_int32_t index,
+		struct in6_addr *addr) {
+	u_int64_t v, mask;
+	int width, first, last, shift, i;
+
+	width = pool->units - pool->bits;
+	last = (pool->units - 1) / 8;
+	first = (last >= 4) ? last - 4 : 0;
+	shift = 8 * (last + 1) - pool->units;
+	mask = (width < 32) ? ((u_int64_t)1 << width) - 1 : 0xffffffff;
+
+	v = 0;
+	for (i = first; i <= last; i++) {
+		v = (v << 8) | addr->s6_addr[i];
+	}
+	v = (v & ~(mask << shift)) | (((u_int64_t)index & mask) << shift);
+	for (i = last; i >= first; i--) {
+		addr->s6_addr[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static void
+used_map_address(const struct ipv6_pool *pool, u_int32_t index,
+		 struct in6_addr *addr) {
+	*addr = pool->start_addr;
+	pool_set_index6(pool, index, addr);
+}
+
+/*
+ * With shard-count set, the addresses and prefixes of each pool are
+ * split between the servers by their index, so servers that answer
+ * different clients from the same pools never hand out the same one.
+ */
+isc_boolean_t
+shard_owns_lease6(const struct ipv6_pool *pool, const struct in6_addr *addr) {
+	if (shard_count <= 1) {
+		return ISC_TRUE;
+	}
+	return ((pool_index6(pool, addr) % shard_count) == shard_index) ?
+		ISC_TRUE : ISC_FALSE;
+}
+
+/*
+ * Move a candidate address or prefix to one owned by our shard nearby,
+ * stepping back a round of shards if that would run off the end of the
+ * pool.
+ */
+static void
+shard_adjust6(const struct ipv6_pool *pool, struct in6_addr *addr) {
+	u_int64_t index, size;
+	int width;
+
+	if (shard_count <= 1) {
+		return;
+	}
+	width = pool->units - pool->bits;
+	size = (u_int64_t)1 << ((width < 32) ? width : 32);
+	index = pool_index6(pool, addr);
+	index = index - (index % shard_count) + shard_index;
+	if ((index >= size) && (index >= shard_count)) {
+		index -= shard_count;
+	}
+	pool_set_index6(pool, (u_int32_t)index, addr);
+}
+
+/*
+ * Set or clear a bit at the given level, carrying the change up through
+ * the levels whose words become full or stop being full.
+ */
+static void
+used_map_mark(struct ipv6_pool *pool, int level, u_int32_t index) {
+	u_int32_t *word;
+
+	for (; level < pool->map_levels; level++) {
+		word = &pool->used_map[pool->map_level[level] + index / 32];
+		*word |= USED_MAP_BIT(index);
+		if (*word != ~(u_int32_t)0) {
+			break;
+		}
+		index /= 32;
+	}
+}
+
+static void
+used_map_unmark(struct ipv6_pool *pool, u_int32_t index) {
+	u_int32_t *word;
+	int level, full;
+
+	for (level = 0; level < pool->map_levels; level++) {
+		word = &pool->used_map[pool->map_level[level] + index / 32];
+		full = (*word == ~(u_int32_t)0);
+		*word &= ~USED_MAP_BIT(index);
+		if (!full) {
+			break;
+		}
+		index /= 32;
+	}
+}
+
+/*
+ * Find the first free index at or after start, wrapping around to the
+ * start of the pool if need be.
+ */
+static isc_boolean_t
+used_map_find(const struct ipv6_pool *pool, u_int32_t start,
+	      u_int32_t *index) {
+	u_int32_t pos, words, free_bits;
+	int level;
+
+	pos = start;
+	for (level = 0; level < pool->map_levels; level++) {
+		words = pool->map_level[level + 1] - pool->map_level[level];
+		if (pos / 32 >= words) {
+			level = pool->map_levels;
+			break;
+		}
+		free_bits = ~pool->used_map[pool->map_level[level] + pos / 32] &
+			    (~(u_int32_t)0 << (pos & 31));
+		if (free_bits != 0) {
+			pos = (pos & ~31) + lowest_bit(free_bits);
+			break;
+		}
+		pos = pos / 32 + 1;
+	}
+
+	if (level == pool->map_levels) {
+		level = pool->map_levels - 1;
+		free_bits = ~pool->used_map[pool->map_level[level]];
+		if (free_bits == 0) {
+			return ISC_FALSE;
+		}
+		pos = lowest_bit(free_bits);
+	}
+
+	while (level > 0) {
+		level--;
+		free_bits = ~pool->used_map[pool->map_level[level] + pos];
+		pos = pos * 32 + lowest_bit(free_bits);
+	}
+
+	*index = pos;
+	return ISC_TRUE;
+}
+
+static void
+used_map_set(struct ipv6_pool *pool, const struct in6_addr *addr) {
+	u_int32_t index;
+
+	if ((pool->used_map == NULL) || !ipv6_in_pool(addr, pool)) {
+		return;
+	}
+	index = pool_index6(pool, addr);
+	if ((pool->used_map[index / 32] & USED_MAP_BIT(index)) == 0) {
+		used_map_mark(pool, 0, index);
+		pool->map_free--;
+	}
+}
+
+static void
+used_map_clear(struct ipv6_pool *pool, const struct in6_addr *addr) {
+	struct iasubopt *test_iasubopt;
+	u_int32_t index;
+
+	if ((pool->used_map == NULL) || !ipv6_in_pool(addr, pool)) {
+		return;
+	}
+	index = pool_index6(pool, addr);
+	if (((pool->used_map[index / 32] & USED_MAP_BIT(index)) == 0) ||
+	    ((pool->pool_type == D6O_IA_NA) && reserved_iid6(addr)) ||
+	    !shard_owns_lease6(pool, addr)) {
+		return;
+	}
+
+	/*
+	 * A host reservation may have put the address in the hash
+	 * as well, in which case it is still taken.
+	 */
+	test_iasubopt = NULL;
+	if (iasubopt_hash_lookup(&test_iasubopt, pool->leases,
+				 (void *)addr, sizeof(*addr), MDL)) {
+		iasubopt_dereference(&test_iasubopt, MDL);
+		return;
+	}
+
+	used_map_unmark(pool, index);
+	pool->map_free++;
+}
+
+/*
+ * Add to and remove from the leases hash of a pool, keeping the
+ * bitmap of a dense pool in step.
+ */
+static void
+pool_leases_add(struct ipv6_pool *pool, struct iasubopt *lease) {
+	iasubopt_hash_add(pool->leases, &lease->addr,
+			  sizeof(lease->addr), lease, MDL);
+	used_map_set(pool, &lease->addr);
+}
+
+static void
+pool_leases_delete(struct ipv6_pool *pool, const struct in6_addr *addr) {
+	iasubopt_hash_delete(pool->leases, (void *)addr, sizeof(*addr), MDL);
+	used_map_clear(pool, addr);
+}
+
+static struct ipv6_pool *mapping_pool;
+
+static isc_result_t
+map_hash_entry(const void *name, unsigned len, void *value) {
+	struct iasubopt *iasubopt = (struct iasubopt *)value;
+
+	used_map_set(mapping_pool, &iasubopt->addr);
+	return ISC_R_SUCCESS;
+}
+
+/*!
  *
- * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
- *   initialized to NULL
+ * \brief Give a pool an occupancy bitmap
+ *
+ * The bitmap starts out with the addresses or prefixes already in the
+ * leases hash of the pool and the reserved interface IDs marked as used.
+ *
+ * \param[in] pool = The pool, which must be an IA_NA or IA_PD pool of no
+ *		     more than 2^31 addresses or prefixes.
+ *
+ * \return
+ * ISC_R_SUCCESS     = The pool now has a bitmap.
+ * DHCP_R_INVALIDARG = The pool is of the wrong type or is too large.
+ * ISC_R_NOMEMORY    = The bitmap could not be allocated.
+ */
+isc_result_t
+ipv6_pool_use_map(struct ipv6_pool *pool) {
+	struct in6_addr addr;
+	u_int32_t size, count, words, total, off;
+	int level;
+
+	if (((pool->pool_type != D6O_IA_NA) &&
+	     (pool->pool_type != D6O_IA_PD)) ||
+	    (pool->units - pool->bits <= 0) ||
+	    (pool->units - pool->bits > 31)) {
+		return DHCP_R_INVALIDARG;
+	}
+	if (pool->used_map != NULL) {
+		return ISC_R_SUCCESS;
+	}
+
+	size = (u_int32_t)1 << (pool->units - pool->bits);
+	level = 0;
+	count = size;
+	total = 0;
+	for (;;) {
+		pool->map_level[level++] = total;
+		words = (count + 31) / 32;
+		total += words;
+		if (words == 1) {
+			break;
+		}
+		count = words;
+	}
+	pool->map_level[level] = total;
+
+	pool->used_map = dmalloc(total * sizeof(u_int32_t), MDL);
+	if (pool->used_map == NULL) {
+		return ISC_R_NOMEMORY;
+	}
+	pool->map_levels = level;
+	pool->map_size = size;
+	pool->map_free = size;
+
+	/* Bits past the end of each level are never free. */
+	count = size;
+	for (level = 0; level < pool->map_levels; level++) {
+		words = pool->map_level[level + 1] - pool->map_level[level];
+		for (off = count; off < words * 32; off++) {
+			used_map_mark(pool, level, off);
+		}
+		count = words;
+	}
+
+	/* Whatever belongs to other shards is never free either. */
+	if (shard_count > 1) {
+		for (off = 0; off < size; off++) {
+			if ((off % shard_count) != shard_index) {
+				used_map_mark(pool, 0, off);
+				pool->map_free--;
+			}
+		}
+	}
+
+	/*
+	 * Reserved interface IDs can only be the first address or in
+	 * the last 128 of an address pool.
+	 */
+	if (pool->pool_type == D6O_IA_NA) {
+		init_reserved_iids();
+		for (off = 0; off < size; off++) {
+			if ((off == 1) && (size > 129)) {
+				off = size - 128;
+			}
+			used_map_address(pool, off, &addr);
+			if (reserved_iid6(&addr)) {
+				used_map_set(pool, &addr);
+			}
+		}
+	}
+
+	mapping_pool = pool;
+	iasubopt_hash_foreach(pool->leases, map_hash_entry);
+	mapping_pool = NULL;
+
+	return ISC_R_SUCCESS;
+}
+
+/*
+ * Give every IA_NA and IA_PD pool of no more than max_size addresses or
+ * prefixes a bitmap.  A max_size of 0 leaves all pools hashed.
+ */
+void
+map_dense_ipv6_pools(u_int32_t max_size) {
+	struct ipv6_pool *p;
+	int i;
+
+	if (max_size == 0) {
+		return;
+	}
+
+	for (i = 0; i < num_pools; i++) {
+		p = pools[i];
+		if (((p->pool_type != D6O_IA_NA) &&
+		     (p->pool_type != D6O_IA_PD)) ||
+		    (p->units - p->bits <= 0) ||
+		    (p->units - p->bits > 31) ||
+		    (((u_int32_t)1 << (p->units - p->bits)) > max_size)) {
+			continue;
+		}
+		if (ipv6_pool_use_map(p) != ISC_R_SUCCESS) {
+			log_error("Unable to map pool %s/%d.",
+				  pin6_addr(&p->start_addr), p->bits);
+		}
+	}
+}
+
+/*
+ * Pick an address or prefix from a dense pool.  The client gets the one
+ * it would have hashed to in a sparse pool if that is free, and otherwise
+ * the first free one from there on.
+ */
+static isc_result_t
+pick_mapped6(struct ipv6_pool *pool, struct in6_addr *addr,
+	     unsigned int *attempts, const struct data_string *uid) {
+	u_int32_t index;
+
+	*attempts = 1;
+	if (pool->map_free == 0) {
+		return ISC_R_NORESOURCES;
+	}
+
+	if (pool->pool_type == D6O_IA_PD) {
+		build_prefix6(addr, &pool->start_addr,
+			      pool->bits, pool->units, uid);
+	} else {
+		build_address6(addr, &pool->start_addr, pool->bits, uid);
+	}
+	shard_adjust6(pool, addr);
+	index = pool_index6(pool, addr);
+	if ((pool->used_map[index / 32] & USED_MAP_BIT(index)) == 0) {
+		return ISC_R_SUCCESS;
+	}
+
+	*attempts = 2;
+	if (!used_map_find(pool, index, &index)) {
+		log_error("pick_mapped6: pool %s/%d has %u free "
+			  "but none in its bitmap.",
+			  pin6_addr(&pool->start_addr), pool->bits,
+			  pool->map_free);
+		return ISC_R_NORESOURCES;
+	}
+	used_map_address(pool, index, addr);
+	return ISC_R_SUCCESS;
+}
+
+/*
+ * Pick an address from a sparse pool.
  *
  * Right now we simply hash the DUID, and if we get a collision, we hash 
  * again until we find a free address. We try this a fixed number of times,
  * to avoid getting stuck in a loop (this is important on small pools
  * where we can run out of space).
- *
- * We return the number of attempts that it took to find an available
- * lease. This tells callers when a pool is are filling up, as
- * well as an indication of how full the pool is; statistically the 
- * more full a pool is the more attempts must be made before finding
- * a free lease. Realistically this will only happen in very full
- * pools.
- *
- * We probably want different algorithms depending on the network size, in
- * the long term.
  */
-isc_result_t
-create_lease6(struct ipv6_pool *pool, struct iasubopt **addr, 
-	      unsigned int *attempts,
-	      const struct data_string *uid, time_t soft_lifetime_end_time) {
+static isc_result_t
+pick_hashed_address6(struct ipv6_pool *pool, struct in6_addr *addr,
+		     unsigned int *attempts, const struct data_string *uid) {
 	struct data_string ds;
 	struct in6_addr tmp;
 	struct iasubopt *test_iaaddr;
 	struct data_string new_ds;
-	struct iasubopt *iaaddr;
-	isc_result_t result;
-	isc_boolean_t reserved_iid;
-	static isc_boolean_t init_resiid = ISC_FALSE;
-
-	/*
-	 * Fill the reserved IIDs.
-	 */
-	if (!init_resiid) {
-		memset(&rtany, 0, 16);
-		memset(&resany, 0, 8);
-		resany.s6_addr[8] = 0xfd;
-		memset(&resany.s6_addr[9], 0xff, 6);
-		init_resiid = ISC_TRUE;
-	}
 
 	/* 
 	 * Use the UID as our initial seed for the hash
@@ -1092,25 +1555,14 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 			data_string_forget(&ds, MDL);
 			return DHCP_R_INVALIDARG;
 		}
+		shard_adjust6(pool, &tmp);
 
 		/*
-		 * Avoid reserved interface IDs. (cf. RFC 5453)
-		 */
-		reserved_iid = ISC_FALSE;
-		if (memcmp(&tmp.s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
-			reserved_iid = ISC_TRUE;
-		}
-		if (!reserved_iid &&
-		    (memcmp(&tmp.s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
-		    ((tmp.s6_addr[15] & 0x80) == 0x80)) {
-			reserved_iid = ISC_TRUE;
-		}
-
-		/*
-		 * If this address is not in use, we're happy with it
+		 * If this address is ours, not in use and does not have
+		 * a reserved interface ID, we're happy with it
 		 */
 		test_iaaddr = NULL;
-		if (!reserved_iid &&
+		if (!reserved_iid6(&tmp) && shard_owns_lease6(pool, &tmp) &&
 		    (iasubopt_hash_lookup(&test_iaaddr, pool->leases,
 					  &tmp, sizeof(tmp), MDL) == 0)) {
 			break;
@@ -1136,22 +1588,61 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 	}
 
 	data_string_forget(&ds, MDL);
+	*addr = tmp;
+	return ISC_R_SUCCESS;
+}
 
-	/* 
-	 * We're happy with the address, create an IAADDR
-	 * to hold it.
-	 */
-	iaaddr = NULL;
-	result = iasubopt_allocate(&iaaddr, MDL);
-	if (result != ISC_R_SUCCESS) {
-		return result;
-	}
-	iaaddr->plen = 0;
-	memcpy(&iaaddr->addr, &tmp, sizeof(iaaddr->addr));
-
-	/*
-	 * Add the lease to the pool (note state is free, not active?!).
-	 */
+/*
+ * Create a lease for the given address and client duid.
+ *
+ * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
+ *   initialized to NULL
+ *
+ * Dense IA_NA pools pick from their bitmap (see ipv6_pool_use_map()),
+ * all others by hashing (see pick_hashed_address6()).
+ *
+ * We return the number of attempts that it took to find an available
+ * lease. This tells callers when a pool is are filling up, as
+ * well as an indication of how full the pool is; statistically the 
+ * more full a pool is the more attempts must be made before finding
+ * a free lease. Realistically this will only happen in very full
+ * pools.  A dense pool reports 1 attempt when the hashed address was
+ * free and 2 when it had to look further.
+ */
+isc_result_t
+create_lease6(struct ipv6_pool *pool, struct iasubopt **addr, 
+	      unsigned int *attempts,
+	      const struct data_string *uid, time_t soft_lifetime_end_time) {
+	struct in6_addr tmp;
+	struct iasubopt *iaaddr;
+	isc_result_t result;
+
+	init_reserved_iids();
+
+	if (pool->used_map != NULL) {
+		result = pick_mapped6(pool, &tmp, attempts, uid);
+	} else {
+		result = pick_hashed_address6(pool, &tmp, attempts, uid);
+	}
+	if (result != ISC_R_SUCCESS) {
+		return result;
+	}
+
+	/* 
+	 * We're happy with the address, create an IAADDR
+	 * to hold it.
+	 */
+	iaaddr = NULL;
+	result = iasubopt_allocate(&iaaddr, MDL);
+	if (result != ISC_R_SUCCESS) {
+		return result;
+	}
+	iaaddr->plen = 0;
+	memcpy(&iaaddr->addr, &tmp, sizeof(iaaddr->addr));
+
+	/*
+	 * Add the lease to the pool (note state is free, not active?!).
+	 */
 	result = add_lease6(pool, iaaddr, soft_lifetime_end_time);
 	if (result == ISC_R_SUCCESS) {
 		iasubopt_reference(addr, iaaddr, MDL);
@@ -1179,16 +1670,8 @@ create_lease6_eui_64(struct ipv6_pool *pool, struct iasubopt **addr,
 	struct iasubopt *test_iaaddr;
 	struct iasubopt *iaaddr;
 	isc_result_t result;
-	static isc_boolean_t init_resiid = ISC_FALSE;
 
-	/*  Fill the reserved IIDs.  */
-	if (!init_resiid) {
-		memset(&rtany, 0, 16);
-		memset(&resany, 0, 8);
-		resany.s6_addr[8] = 0xfd;
-		memset(&resany.s6_addr[9], 0xff, 6);
-		init_resiid = ISC_TRUE;
-	}
+	init_reserved_iids();
 
 	/* Pool must be IA_NA */
 	if (pool->pool_type != D6O_IA_NA) {
@@ -1204,9 +1687,7 @@ create_lease6_eui_64(struct ipv6_pool *pool, struct iasubopt **addr,
 	}
 
 	/* Avoid reserved interface IDs. (cf. RFC 5453) */
-	if ((memcmp(&tmp.s6_addr[8], &rtany.s6_addr[8], 8) == 0)  ||
-	    ((memcmp(&tmp.s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
-	    ((tmp.s6_addr[15] & 0x80) == 0x80))) {
+	if (reserved_iid6(&tmp)) {
 		log_error("create_lease6_eui_64: "
 			  "address conflicts with reserved IID");
 		return (ISC_R_FAILURE);
@@ -1379,8 +1860,7 @@ cleanup_lease6(ia_hash_t *ia_table,
 			pool->ipv6_pond->num_abandoned--;
 	}
 
-	iasubopt_hash_delete(pool->leases, &test_iasubopt->addr,
-			     sizeof(test_iasubopt->addr), MDL);
+	pool_leases_delete(pool, &test_iasubopt->addr);
 	ia_remove_iasubopt(old_ia, test_iasubopt, MDL);
 	if (old_ia->num_iasubopt <= 0) {
 		ia_hash_delete(ia_table,
@@ -1457,8 +1937,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 			pool->num_inactive--;
 		}
 
-		iasubopt_hash_delete(pool->leases, &test_iasubopt->addr, 
-				     sizeof(test_iasubopt->addr), MDL);
+		pool_leases_delete(pool, &test_iasubopt->addr);
 
 		/*
 		 * We're going to do a bit of evil trickery here.
@@ -1481,8 +1960,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 	if ((tmp_iasubopt->state == FTS_ACTIVE) ||
 	    (tmp_iasubopt->state == FTS_ABANDONED)) {
 		tmp_iasubopt->hard_lifetime_end_time = valid_lifetime_end_time;
-		iasubopt_hash_add(pool->leases, &tmp_iasubopt->addr, 
-				  sizeof(tmp_iasubopt->addr), lease, MDL);
+		pool_leases_add(pool, tmp_iasubopt);
 		insert_result = isc_heap_insert(pool->active_timeouts,
 						tmp_iasubopt);
 		if (insert_result == ISC_R_SUCCESS) {
@@ -1505,8 +1983,7 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 			pool->num_inactive++;
 	}
 	if (insert_result != ISC_R_SUCCESS) {
-		iasubopt_hash_delete(pool->leases, &lease->addr, 
-				     sizeof(lease->addr), MDL);
+		pool_leases_delete(pool, &lease->addr);
 		iasubopt_dereference(&tmp_iasubopt, MDL);
 		return insert_result;
 	}
@@ -1577,8 +2054,7 @@ move_lease_to_active(struct ipv6_pool *pool, struct iasubopt *lease) {
 
 	insert_result = isc_heap_insert(pool->active_timeouts, lease);
 	if (insert_result == ISC_R_SUCCESS) {
-       		iasubopt_hash_add(pool->leases, &lease->addr, 
-				  sizeof(lease->addr), lease, MDL);
+		pool_leases_add(pool, lease);
 		isc_heap_delete(pool->inactive_timeouts,
 				lease->inactive_index);
 		pool->num_active++;
@@ -1710,8 +2186,7 @@ move_lease_to_inactive(struct ipv6_pool *pool, struct iasubopt *lease,
 			binding_scope_dereference(&lease->scope, MDL);
 		}
 
-		iasubopt_hash_delete(pool->leases, 
-				     &lease->addr, sizeof(lease->addr), MDL);
+		pool_leases_delete(pool, &lease->addr);
 		isc_heap_delete(pool->active_timeouts, lease->active_index);
 		lease->state = state;
 		pool->num_active--;
@@ -1870,37 +2345,20 @@ build_prefix6(struct in6_addr *pref,
 }
 
 /*
- * Create a lease for the given prefix and client duid.
- *
- * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
- *   initialized to NULL
+ * Pick a prefix from a sparse pool.
  *
  * Right now we simply hash the DUID, and if we get a collision, we hash 
  * again until we find a free prefix. We try this a fixed number of times,
  * to avoid getting stuck in a loop (this is important on small pools
  * where we can run out of space).
- *
- * We return the number of attempts that it took to find an available
- * prefix. This tells callers when a pool is are filling up, as
- * well as an indication of how full the pool is; statistically the 
- * more full a pool is the more attempts must be made before finding
- * a free prefix. Realistically this will only happen in very full
- * pools.
- *
- * We probably want different algorithms depending on the network size, in
- * the long term.
  */
-isc_result_t
-create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref, 
-	       unsigned int *attempts,
-	       const struct data_string *uid,
-	       time_t soft_lifetime_end_time) {
+static isc_result_t
+pick_hashed_prefix6(struct ipv6_pool *pool, struct in6_addr *pref,
+		    unsigned int *attempts, const struct data_string *uid) {
 	struct data_string ds;
 	struct in6_addr tmp;
 	struct iasubopt *test_iapref;
 	struct data_string new_ds;
-	struct iasubopt *iapref;
-	isc_result_t result;
 
 	/* 
 	 * Use the UID as our initial seed for the hash
@@ -1923,16 +2381,19 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 		 */
 		build_prefix6(&tmp, &pool->start_addr,
 			      pool->bits, pool->units, &ds);
+		shard_adjust6(pool, &tmp);
 
 		/*
-		 * If this prefix is not in use, we're happy with it
+		 * If this prefix is ours and not in use, we're happy with it
 		 */
 		test_iapref = NULL;
-		if (iasubopt_hash_lookup(&test_iapref, pool->leases,
-					 &tmp, sizeof(tmp), MDL) == 0) {
+		if (shard_owns_lease6(pool, &tmp) &&
+		    (iasubopt_hash_lookup(&test_iapref, pool->leases,
+					  &tmp, sizeof(tmp), MDL) == 0)) {
 			break;
 		}
-		iasubopt_dereference(&test_iapref, MDL);
+		if (test_iapref != NULL)
+			iasubopt_dereference(&test_iapref, MDL);
 
 		/* 
 		 * Otherwise, we create a new input, adding the prefix
@@ -1952,6 +2413,43 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 	}
 
 	data_string_forget(&ds, MDL);
+	*pref = tmp;
+	return ISC_R_SUCCESS;
+}
+
+/*
+ * Create a lease for the given prefix and client duid.
+ *
+ * - pool must be a pointer to a (struct ipv6_pool *) pointer previously
+ *   initialized to NULL
+ *
+ * Dense pools pick from their bitmap (see ipv6_pool_use_map()), all
+ * others by hashing (see pick_hashed_prefix6()).
+ *
+ * We return the number of attempts that it took to find an available
+ * prefix. This tells callers when a pool is are filling up, as
+ * well as an indication of how full the pool is; statistically the 
+ * more full a pool is the more attempts must be made before finding
+ * a free prefix. Realistically this will only happen in very full
+ * pools.
+ */
+isc_result_t
+create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref, 
+	       unsigned int *attempts,
+	       const struct data_string *uid,
+	       time_t soft_lifetime_end_time) {
+	struct in6_addr tmp;
+	struct iasubopt *iapref;
+	isc_result_t result;
+
+	if (pool->used_map != NULL) {
+		result = pick_mapped6(pool, &tmp, attempts, uid);
+	} else {
+		result = pick_hashed_prefix6(pool, &tmp, attempts, uid);
+	}
+	if (result != ISC_R_SUCCESS) {
+		return result;
+	}
 
 	/* 
 	 * We're happy with the prefix, create an IAPREFIX
@@ -2011,46 +2509,289 @@ mark_lease_unavailable(struct ipv6_pool *pool, const struct in6_addr *addr) {
 	result = iasubopt_allocate(&dummy_iasubopt, MDL);
 	if (result == ISC_R_SUCCESS) {
 		dummy_iasubopt->addr = *addr;
-		iasubopt_hash_add(pool->leases, &dummy_iasubopt->addr,
-				  sizeof(*addr), dummy_iasubopt, MDL);
+		pool_leases_add(pool, dummy_iasubopt);
 	}
 	return result;
 }
 
+static void ipv6_network_portion(struct in6_addr *result,
+				 const struct in6_addr *addr, int bits);
+
+static struct ipv6_pool_node **
+pool_index_root(u_int16_t type) {
+	switch (type) {
+	case D6O_IA_NA:
+		return &pool_index_na;
+	case D6O_IA_TA:
+		return &pool_index_ta;
+	case D6O_IA_PD:
+		return &pool_index_pd;
+	default:
+		return NULL;
+	}
+}
+
+static struct ipv6_pool_node *
+pool_node_new(const struct in6_addr *prefix, int bits, int index) {
+	struct ipv6_pool_node *node;
+
+	node = dmalloc(sizeof(*node), MDL);
+	if (node != NULL) {
+		node->prefix = *prefix;
+		node->bits = bits;
+		node->index = index;
+	}
+	return node;
+}
+
+/*
+ * Enter pools[index] into the index for its type.
+ */
+static isc_result_t
+index_ipv6_pool(int index) {
+	struct ipv6_pool *pool = pools[index];
+	struct ipv6_pool_node **np, *n, *node, *glue;
+	struct in6_addr prefix;
+	int common;
+
+	np = pool_index_root(pool->pool_type);
+	if (np == NULL) {
+		/* find_ipv6_pool() will scan for this type. */
+		return ISC_R_SUCCESS;
+	}
+
+	/*
+	 * A pool with bits set past its prefix length can't contain any
+	 * address according to ipv6_in_pool(), so leave it out.
+	 */
+	ipv6_network_portion(&prefix, &pool->start_addr, pool->bits);
+	if (memcmp(&prefix, &pool->start_addr, sizeof(prefix)) != 0) {
+		return ISC_R_SUCCESS;
+	}
+
+	common = 0;
+	while ((n = *np) != NULL) {
+		common = subnet_trie_key_common(n->prefix.s6_addr,
+						prefix.s6_addr,
+						(n->bits < pool->bits) ?
+						n->bits : pool->bits);
+		if (common < n->bits) {
+			break;
+		}
+		if (n->bits == pool->bits) {
+			/* An earlier pool with this prefix wins. */
+			if (n->index < 0) {
+				n->index = index;
+			}
+			return ISC_R_SUCCESS;
+		}
+		np = &n->child[subnet_trie_key_bit(prefix.s6_addr, n->bits)];
+	}
+
+	node = pool_node_new(&prefix, pool->bits, index);
+	if (node == NULL) {
+		return ISC_R_NOMEMORY;
+	}
+	if (n == NULL) {
+		*np = node;
+	} else if (common == pool->bits) {
+		/* The new pool contains the existing branch. */
+		node->child[subnet_trie_key_bit(n->prefix.s6_addr,
+						common)] = n;
+		*np = node;
+	} else {
+		glue = pool_node_new(&prefix, common, -1);
+		if (glue == NULL) {
+			dfree(node, MDL);
+			return ISC_R_NOMEMORY;
+		}
+		glue->child[subnet_trie_key_bit(n->prefix.s6_addr,
+						common)] = n;
+		glue->child[subnet_trie_key_bit(prefix.s6_addr,
+						common)] = node;
+		*np = glue;
+	}
+	return ISC_R_SUCCESS;
+}
+
 /* 
  * Add a pool.
  */
 isc_result_t
 add_ipv6_pool(struct ipv6_pool *pool) {
 	struct ipv6_pool **new_pools;
+	isc_result_t result;
+	int new_max;
 
-	new_pools = dmalloc(sizeof(struct ipv6_pool *) * (num_pools+1), MDL);
-	if (new_pools == NULL) {
-		return ISC_R_NOMEMORY;
-	}
+	if (num_pools >= pools_max) {
+		new_max = (pools_max > 0) ? (pools_max * 2) : 16;
+		new_pools = dmalloc(sizeof(struct ipv6_pool *) * new_max, MDL);
+		if (new_pools == NULL) {
+			return ISC_R_NOMEMORY;
+		}
 
-	if (num_pools > 0) {
-		memcpy(new_pools, pools, 
-		       sizeof(struct ipv6_pool *) * num_pools);
-		dfree(pools, MDL);
+		if (num_pools > 0) {
+			memcpy(new_pools, pools, 
+			       sizeof(struct ipv6_pool *) * num_pools);
+			dfree(pools, MDL);
+		}
+		pools = new_pools;
+		pools_max = new_max;
 	}
-	pools = new_pools;
 
 	pools[num_pools] = NULL;
 	ipv6_pool_reference(&pools[num_pools], pool, MDL);
+	result = index_ipv6_pool(num_pools);
+	if (result != ISC_R_SUCCESS) {
+		ipv6_pool_dereference(&pools[num_pools], MDL);
+		return result;
+	}
 	num_pools++;
 	return ISC_R_SUCCESS;
 }
 
+/*
+ * Lease expiry.
+ *
+ * Pools with leases to expire or clean up are kept in a heap ordered by
+ * when the next of those is due, and a single timer is set for the
+ * first of them.  Each time it goes off, up to lease_expiry_batch_size
+ * leases are handled across the pools that are due, earliest first.  If
+ * that leaves any due, the timer is set again for right away, so that
+ * packets that arrived in the meantime are answered before the next
+ * batch.  An IA changed by a batch is written to the lease file once, at
+ * the end of it.
+ */
+u_int32_t lease_expiry_batch_size = 1000;
+
+static isc_heap_t *expiry_pools;
+static int expiry_pool_count;
+static time_t expiry_timer;
+
+static struct ia_xx **expiry_ias;
+static int expiry_ias_count, expiry_ias_max;
+
+static isc_boolean_t
+pool_expires_sooner(void *a, void *b) {
+	return ((struct ipv6_pool *)a)->expiry_time <
+	       ((struct ipv6_pool *)b)->expiry_time;
+}
+
+static void
+expiry_changed(void *pool, unsigned int new_heap_index) {
+	((struct ipv6_pool *)pool)->expiry_index = new_heap_index;
+}
+
+/*
+ * Remember an IA to be written out at the end of the batch.
+ */
 static void
-cleanup_old_expired(struct ipv6_pool *pool) {
+expiry_ia_add(struct ia_xx *ia) {
+	struct ia_xx **new_ias;
+	int new_max;
+
+	if (expiry_ias_count == expiry_ias_max) {
+		new_max = expiry_ias_max ? expiry_ias_max * 2 : 64;
+		new_ias = dmalloc(new_max * sizeof(*new_ias), MDL);
+		if (new_ias == NULL) {
+			log_fatal("Out of memory for expired IAs.");
+		}
+		if (expiry_ias != NULL) {
+			memcpy(new_ias, expiry_ias,
+			       expiry_ias_count * sizeof(*new_ias));
+			dfree(expiry_ias, MDL);
+		}
+		expiry_ias = new_ias;
+		expiry_ias_max = new_max;
+	}
+	expiry_ias[expiry_ias_count] = NULL;
+	ia_reference(&expiry_ias[expiry_ias_count], ia, MDL);
+	expiry_ias_count++;
+}
+
+static int
+ia_pointer_cmp(const void *a, const void *b) {
+	const struct ia_xx *ia_a = *(struct ia_xx * const *)a;
+	const struct ia_xx *ia_b = *(struct ia_xx * const *)b;
+
+	if (ia_a < ia_b)
+		return -1;
+	return (ia_a > ia_b);
+}
+
+/*
+ * Write each IA remembered by expiry_ia_add() once.
+ */
+static void
+expiry_ias_write(void) {
+	int i;
+
+	qsort(expiry_ias, expiry_ias_count, sizeof(*expiry_ias),
+	      ia_pointer_cmp);
+	for (i = 0; i < expiry_ias_count; i++) {
+		if ((i == 0) || (expiry_ias[i] != expiry_ias[i - 1])) {
+			write_ia(expiry_ias[i]);
+		}
+	}
+	for (i = 0; i < expiry_ias_count; i++) {
+		ia_dereference(&expiry_ias[i], MDL);
+	}
+	expiry_ias_count = 0;
+}
+
+/*
+ * Expire up to max leases from the pool, returning how many were.
+ */
+static unsigned
+expire_pool_leases(struct ipv6_pool *pool, unsigned max) {
+	struct iasubopt *lease;
+	unsigned count;
+
+	for (count = 0; count < max; count++) {
+		/*
+		 * Get the next lease scheduled to expire.
+		 *
+		 * Note that if there are no leases in the pool, 
+		 * expire_lease6() will return ISC_R_SUCCESS with 
+		 * a NULL lease.
+		 *
+		 * expire_lease6() will call move_lease_to_inactive() which
+		 * calls ddns_removals() do we want that on the standard
+		 * expiration timer or a special 'depref' timer?  Original
+		 * query from DH, moved here by SAR.
+		 */
+		lease = NULL;
+		if (expire_lease6(&lease, pool, cur_time) != ISC_R_SUCCESS) {
+			break;
+		}
+		if (lease == NULL) {
+			break;
+		}
+
+		if (lease->ia != NULL) {
+			expiry_ia_add(lease->ia);
+		}
+
+		iasubopt_dereference(&lease, MDL);
+	}
+	return count;
+}
+
+/*
+ * Clean up to max of the pool's old expired leases, returning how many
+ * were.
+ */
+static unsigned
+cleanup_old_expired(struct ipv6_pool *pool, unsigned max) {
 	struct iasubopt *tmp;
 	struct ia_xx *ia;
 	struct ia_xx *ia_active;
+	ia_hash_t *ia_table;
 	unsigned char *tmpd;
 	time_t timeout;
+	unsigned count;
 	
-	while (pool->num_inactive > 0) {
+	for (count = 0; (count < max) && (pool->num_inactive > 0); count++) {
 		tmp = (struct iasubopt *)
 				isc_heap_element(pool->inactive_timeouts, 1);
 		if (tmp->hard_lifetime_end_time != 0) {
@@ -2075,98 +2816,49 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 			ia = NULL;
 			ia_reference(&ia, tmp->ia, MDL);
 			ia_remove_iasubopt(ia, tmp, MDL);
+			switch (ia->ia_type) {
+			      case D6O_IA_NA:
+				ia_table = ia_na_active;
+				break;
+			      case D6O_IA_TA:
+				ia_table = ia_ta_active;
+				break;
+			      case D6O_IA_PD:
+				ia_table = ia_pd_active;
+				break;
+			      default:
+				ia_table = NULL;
+				break;
+			}
 			ia_active = NULL;
 			tmpd = (unsigned char *)ia->iaid_duid.data;
-			if ((ia->ia_type == D6O_IA_NA) &&
-			    (ia->num_iasubopt <= 0) &&
-			    (ia_hash_lookup(&ia_active, ia_na_active, tmpd,
-					    ia->iaid_duid.len, MDL) == 0) &&
-			    (ia_active == ia)) {
-				ia_hash_delete(ia_na_active, tmpd, 
-					       ia->iaid_duid.len, MDL);
-			}
-			if ((ia->ia_type == D6O_IA_TA) &&
-			    (ia->num_iasubopt <= 0) &&
-			    (ia_hash_lookup(&ia_active, ia_ta_active, tmpd,
-					    ia->iaid_duid.len, MDL) == 0) &&
-			    (ia_active == ia)) {
-				ia_hash_delete(ia_ta_active, tmpd, 
-					       ia->iaid_duid.len, MDL);
-			}
-			if ((ia->ia_type == D6O_IA_PD) &&
+			if ((ia_table != NULL) &&
 			    (ia->num_iasubopt <= 0) &&
-			    (ia_hash_lookup(&ia_active, ia_pd_active, tmpd,
-					    ia->iaid_duid.len, MDL) == 0) &&
-			    (ia_active == ia)) {
-				ia_hash_delete(ia_pd_active, tmpd, 
-					       ia->iaid_duid.len, MDL);
+			    ia_hash_lookup(&ia_active, ia_table, tmpd,
+					   ia->iaid_duid.len, MDL)) {
+				if (ia_active == ia) {
+					ia_hash_delete(ia_table, tmpd,
+						       ia->iaid_duid.len, MDL);
+				}
+				ia_dereference(&ia_active, MDL);
 			}
 			ia_dereference(&ia, MDL);
 		}
 		iasubopt_dereference(&tmp, MDL);
 	}
-}
-
-static void
-lease_timeout_support(void *vpool) {
-	struct ipv6_pool *pool;
-	struct iasubopt *lease;
-	
-	pool = (struct ipv6_pool *)vpool;
-	for (;;) {
-		/*
-		 * Get the next lease scheduled to expire.
-		 *
-		 * Note that if there are no leases in the pool, 
-		 * expire_lease6() will return ISC_R_SUCCESS with 
-		 * a NULL lease.
-		 *
-		 * expire_lease6() will call move_lease_to_inactive() which
-		 * calls ddns_removals() do we want that on the standard
-		 * expiration timer or a special 'depref' timer?  Original
-		 * query from DH, moved here by SAR.
-		 */
-		lease = NULL;
-		if (expire_lease6(&lease, pool, cur_time) != ISC_R_SUCCESS) {
-			break;
-		}
-		if (lease == NULL) {
-			break;
-		}
-
-		write_ia(lease->ia);
-
-		iasubopt_dereference(&lease, MDL);
-	}
-
-	/*
-	 * If appropriate commit and rotate the lease file
-	 * As commit_leases_timed() checks to see if we've done any writes
-	 * we don't bother tracking if this function called write _ia
-	 */
-	(void) commit_leases_timed();
-
-	/*
-	 * Do some cleanup of our expired leases.
-	 */
-	cleanup_old_expired(pool);
-
-	/*
-	 * Schedule next round of expirations.
-	 */
-	schedule_lease_timeout(pool);
+	return count;
 }
 
 /*
- * For a given pool, add a timer that will remove the next
- * lease to expire.
+ * Work out when the pool next has something to do, and put it in the
+ * right place in the heap of pools, or take it out if it has nothing.
  */
-void 
-schedule_lease_timeout(struct ipv6_pool *pool) {
+static void
+pool_expiry_update(struct ipv6_pool *pool) {
 	struct iasubopt *tmp;
+	struct ipv6_pool *ref;
 	time_t timeout;
 	time_t next_timeout;
-	struct timeval tv;
 
 	next_timeout = MAX_TIME;
 
@@ -2192,13 +2884,133 @@ schedule_lease_timeout(struct ipv6_pool *pool) {
 		}
 	}
 
-	if (next_timeout < MAX_TIME) {
-		tv.tv_sec = next_timeout;
+	if (next_timeout >= MAX_TIME) {
+		if (pool->expiry_index != 0) {
+			isc_heap_delete(expiry_pools, pool->expiry_index);
+			pool->expiry_index = 0;
+			expiry_pool_count--;
+			/* drop the reference the heap held */
+			ref = pool;
+			ipv6_pool_dereference(&ref, MDL);
+		}
+		return;
+	}
+
+	if (expiry_pools == NULL) {
+		if (isc_heap_create(dhcp_gbl_ctx.mctx, pool_expires_sooner,
+				    expiry_changed, 0,
+				    &expiry_pools) != ISC_R_SUCCESS) {
+			log_fatal("Out of memory for lease expiry.");
+		}
+	}
+
+	if (pool->expiry_index == 0) {
+		pool->expiry_time = next_timeout;
+		ref = NULL;
+		ipv6_pool_reference(&ref, pool, MDL);
+		if (isc_heap_insert(expiry_pools, ref) != ISC_R_SUCCESS) {
+			log_fatal("Out of memory for lease expiry.");
+		}
+		/* the heap keeps the reference */
+		expiry_pool_count++;
+	} else if (next_timeout < pool->expiry_time) {
+		pool->expiry_time = next_timeout;
+		isc_heap_increased(expiry_pools, pool->expiry_index);
+	} else if (next_timeout > pool->expiry_time) {
+		pool->expiry_time = next_timeout;
+		isc_heap_decreased(expiry_pools, pool->expiry_index);
+	}
+}
+
+/*
+ * Set the timer for the first pool with something to do, or for right
+ * away if a batch was cut short.
+ */
+static void
+schedule_lease_expiry(isc_boolean_t more) {
+	struct ipv6_pool *pool;
+	struct timeval tv;
+
+	if (expiry_pool_count == 0) {
+		if (expiry_timer != 0) {
+			cancel_timeout(lease_timeout_support, NULL);
+			expiry_timer = 0;
+		}
+		return;
+	}
+
+	pool = (struct ipv6_pool *)isc_heap_element(expiry_pools, 1);
+	if (more && (pool->expiry_time <= cur_time)) {
+		tv = cur_tv;
+		expiry_timer = cur_time;
+	} else {
+		if (pool->expiry_time == expiry_timer) {
+			return;
+		}
+		tv.tv_sec = pool->expiry_time;
 		tv.tv_usec = 0;
-		add_timeout(&tv, lease_timeout_support, pool,
-			    (tvref_t)ipv6_pool_reference, 
-			    (tvunref_t)ipv6_pool_dereference);
+		expiry_timer = pool->expiry_time;
+	}
+	add_timeout(&tv, lease_timeout_support, NULL, 0, 0);
+}
+
+void
+lease_timeout_support(void *unused) {
+	struct ipv6_pool *pool;
+	unsigned max, count, done;
+
+	/* the timer is spent */
+	expiry_timer = 0;
+
+	max = lease_expiry_batch_size ? lease_expiry_batch_size : UINT_MAX;
+	done = 0;
+	while ((done < max) && (expiry_pool_count > 0)) {
+		pool = (struct ipv6_pool *)isc_heap_element(expiry_pools, 1);
+		if (pool->expiry_time > cur_time) {
+			break;
+		}
+
+		count = expire_pool_leases(pool, max - done);
+		count += cleanup_old_expired(pool, max - done - count);
+		done += count;
+
+		pool_expiry_update(pool);
+
+		/*
+		 * A pool that is still due but got nothing done can't
+		 * do anything now; try it again in a second rather than
+		 * spinning on it.
+		 */
+		if ((count == 0) && (pool->expiry_index != 0) &&
+		    (pool->expiry_time <= cur_time)) {
+			pool->expiry_time = cur_time + 1;
+			isc_heap_decreased(expiry_pools, pool->expiry_index);
+		}
 	}
+
+	expiry_ias_write();
+
+	/*
+	 * If appropriate commit and rotate the lease file
+	 * As commit_leases_timed() checks to see if we've done any writes
+	 * we don't bother tracking if this function called write _ia
+	 */
+	(void) commit_leases_timed();
+
+	/*
+	 * Schedule next round of expirations.
+	 */
+	schedule_lease_expiry(done >= max ? ISC_TRUE : ISC_FALSE);
+}
+
+/*
+ * For a given pool, make sure the expiry timer will go off when the
+ * next lease to expire does.
+ */
+void 
+schedule_lease_timeout(struct ipv6_pool *pool) {
+	pool_expiry_update(pool);
+	schedule_lease_expiry(ISC_FALSE);
 }
 
 /*
@@ -2209,8 +3021,9 @@ schedule_all_ipv6_lease_timeouts(void) {
 	int i;
 
 	for (i=0; i<num_pools; i++) {
-		schedule_lease_timeout(pools[i]);
+		pool_expiry_update(pools[i]);
 	}
+	schedule_lease_expiry(ISC_FALSE);
 }
 
 /* 
@@ -2290,6 +3103,8 @@ ipv6_in_pool(const struct in6_addr *addr, const struct ipv6_pool *pool) {
 isc_result_t
 find_ipv6_pool(struct ipv6_pool **pool, u_int16_t type,
 	       const struct in6_addr *addr) {
+	struct ipv6_pool_node **root, *n;
+	int best;
 	int i;
 
 	if (pool == NULL) {
@@ -2301,15 +3116,42 @@ find_ipv6_pool(struct ipv6_pool **pool, u_int16_t type,
 		return DHCP_R_INVALIDARG;
 	}
 
-	for (i=0; i<num_pools; i++) {
-		if (pools[i]->pool_type != type)
-			continue;
-		if (ipv6_in_pool(addr, pools[i])) { 
-			ipv6_pool_reference(pool, pools[i], MDL);
-			return ISC_R_SUCCESS;
+	root = pool_index_root(type);
+	if (root == NULL) {
+		for (i=0; i<num_pools; i++) {
+			if (pools[i]->pool_type != type)
+				continue;
+			if (ipv6_in_pool(addr, pools[i])) { 
+				ipv6_pool_reference(pool, pools[i], MDL);
+				return ISC_R_SUCCESS;
+			}
 		}
+		return ISC_R_NOTFOUND;
 	}
-	return ISC_R_NOTFOUND;
+
+	/*
+	 * Pools may overlap.  Take the earliest one on the path to the
+	 * address, which is the one a scan of pools[] would find first.
+	 */
+	best = -1;
+	for (n = *root; n != NULL;
+	     n = n->child[subnet_trie_key_bit(addr->s6_addr, n->bits)]) {
+		if (subnet_trie_key_common(n->prefix.s6_addr, addr->s6_addr,
+					   n->bits) < n->bits) {
+			break;
+		}
+		if ((n->index >= 0) && ((best < 0) || (n->index < best))) {
+			best = n->index;
+		}
+		if (n->bits == 128) {
+			break;
+		}
+	}
+	if (best < 0) {
+		return ISC_R_NOTFOUND;
+	}
+	ipv6_pool_reference(pool, pools[best], MDL);
+	return ISC_R_SUCCESS;
 }
 
 /*
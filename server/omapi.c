@@ -195,6 +195,23 @@ void dhcp_db_objects_setup ()
 		log_fatal ("Can't register failover listener object type: %s",
 			   isc_result_totext (status));
 #endif /* FAILOVER_PROTOCOL */
+
+	/* The tables reported by the control object's hash-report. */
+	register_hash_report ("lease IP",
+			      (struct hash_table **)&lease_ip_addr_hash);
+	register_hash_report ("lease UID",
+			      (struct hash_table **)&lease_uid_hash);
+	register_hash_report ("lease HW",
+			      (struct hash_table **)&lease_hw_addr_hash);
+	register_hash_report ("host HW",
+			      (struct hash_table **)&host_hw_addr_hash);
+	register_hash_report ("host UID",
+			      (struct hash_table **)&host_uid_hash);
+	register_hash_report ("host name",
+			      (struct hash_table **)&host_name_hash);
+	register_hash_report ("IA_NA", (struct hash_table **)&ia_na_active);
+	register_hash_report ("IA_TA", (struct hash_table **)&ia_ta_active);
+	register_hash_report ("IA_PD", (struct hash_table **)&ia_pd_active);
 }
 
 isc_result_t dhcp_lease_set_value  (omapi_object_t *h,
@@ -1088,6 +1105,7 @@ isc_result_t dhcp_host_set_value  (omapi_object_t *h,
 			if (status != ISC_R_SUCCESS || parse == NULL)
 				return status;
 
+			statements_generation++;
 			if (!(parse_executable_statements
 			      (&host -> group -> statements, parse, &lose,
 			       context_any))) {
@@ -1970,6 +1988,18 @@ isc_result_t dhcp_class_get_value (omapi_object_t *h, omapi_object_t *id,
 	if (!omapi_ds_strcmp (name, "name"))
 		return omapi_make_string_value (value, name, class -> name,
 						MDL);
+	if (!omapi_ds_strcmp (name, "spawn-limit"))
+		return omapi_make_int_value (value, name,
+					     class -> spawn_limit, MDL);
+	if (!omapi_ds_strcmp (name, "spawned-subclasses"))
+		return omapi_make_int_value (value, name,
+					     class -> spawned_count, MDL);
+	if (!omapi_ds_strcmp (name, "spawned-total"))
+		return omapi_make_uint_value (value, name,
+					      class -> spawned_total, MDL);
+	if (!omapi_ds_strcmp (name, "spawned-evicted"))
+		return omapi_make_uint_value (value, name,
+					      class -> spawned_evicted, MDL);
 
 	/* Try to find some inner object that can provide the value. */
 	if (h -> inner && h -> inner -> type -> get_value) {
@@ -2024,6 +2054,7 @@ isc_result_t dhcp_class_destroy (omapi_object_t *h, const char *file, int line)
 						  file, line);
 	if (class -> superclass)
 		class_dereference (&class -> superclass, file, line);
+	release_class_id (class);
 
 	return ISC_R_SUCCESS;
 }
@@ -2147,10 +2178,36 @@ isc_result_t dhcp_class_stuff_values (omapi_object_t *c,
 				      omapi_object_t *id,
 				      omapi_object_t *h)
 {
+	struct class *class;
+	isc_result_t status;
+
 	if (h->type != dhcp_type_class)
 		return (DHCP_R_INVALIDARG);
+	class = (struct class *)h;
+
+	if (class->spawning) {
+		status = omapi_connection_put_named_uint32(c, "spawn-limit",
+							   ((u_int32_t)
+							    class->spawn_limit));
+		if (status != ISC_R_SUCCESS)
+			return (status);
 
-	/* add any class specific items here */
+		status = omapi_connection_put_named_uint32
+			(c, "spawned-subclasses",
+			 (u_int32_t)class->spawned_count);
+		if (status != ISC_R_SUCCESS)
+			return (status);
+
+		status = omapi_connection_put_named_uint32
+			(c, "spawned-total", class->spawned_total);
+		if (status != ISC_R_SUCCESS)
+			return (status);
+
+		status = omapi_connection_put_named_uint32
+			(c, "spawned-evicted", class->spawned_evicted);
+		if (status != ISC_R_SUCCESS)
+			return (status);
+	}
 
 	return (class_stuff_values(c, id, h));
 }
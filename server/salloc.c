@@ -230,6 +230,9 @@ void relinquish_free_lease_states ()
 }
 #endif
 
+/* Number of permits allocated so far; each permit gets the next index. */
+unsigned permit_count;
+
 struct permit *new_permit (file, line)
 	const char *file;
 	int line;
@@ -239,6 +242,7 @@ struct permit *new_permit (file, line)
 	if (!permit)
 		return permit;
 	memset (permit, 0, sizeof *permit);
+	permit -> index = permit_count++;
 	return permit;
 }
 
@@ -293,6 +293,14 @@ static struct option server_options[] = {
 	{ "bind-local-address6", "f",	&server_universe,  SV_BIND_LOCAL_ADDRESS6, 1 },
 	{ "ping-cltt-secs", "T",	&server_universe,  SV_PING_CLTT_SECS, 1 },
 	{ "ping-timeout-ms", "T",       &server_universe,  SV_PING_TIMEOUT_MS, 1 },
+	{ "receive-batch-size", "S",	&server_universe,  SV_RECEIVE_BATCH_SIZE, 1 },
+	{ "shard-count", "S",		&server_universe,  SV_SHARD_COUNT, 1 },
+	{ "shard-index", "S",		&server_universe,  SV_SHARD_INDEX, 1 },
+	{ "lease-file-format", "Nlease_file_formats.",	&server_universe,  SV_LEASE_FILE_FORMAT, 1 },
+	{ "lease-file-rewrite-interval", "T",	&server_universe,  SV_LEASE_REWRITE_INTERVAL, 1 },
+	{ "lease-file-rewrite-size", "L",	&server_universe,  SV_LEASE_REWRITE_SIZE, 1 },
+	{ "dense-pool-size", "L",	&server_universe,  SV_DENSE_POOL_SIZE, 1 },
+	{ "lease-expiry-batch-size", "L",	&server_universe,  SV_LEASE_EXPIRY_BATCH_SIZE, 1 },
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -381,6 +389,18 @@ struct enumeration prefix_length_modes = {
         prefix_length_modes_values
 };
 
+struct enumeration_value lease_file_formats_values[] = {
+	{ "text", LEASE_FILE_TEXT },
+	{ "binary", LEASE_FILE_BINARY },
+	{ (char *)0, 0 }
+};
+
+struct enumeration lease_file_formats = {
+	(struct enumeration *)0,
+	"lease_file_formats", 1,
+	lease_file_formats_values
+};
+
 struct enumeration_value syslog_values [] = {
 #if defined (LOG_KERN)
 	{ "kern", LOG_KERN },
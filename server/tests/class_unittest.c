@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2020 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test class matching.  Classes are declared through the config parser,
+ * and check_collection(), which indexes the classes whose match
+ * expressions compare an expression with a constant, must put packets
+ * in the same classes, in the same order, as evaluating every class's
+ * match expression in turn.
+ */
+
+#define NCLASSES	60
+
+static void
+parse_classes(const char *text)
+{
+	struct parse *cfile = NULL;
+	isc_result_t status;
+
+	status = new_parse(&cfile, -1, (char *)text, strlen(text),
+			   "test", 0);
+	if (status != ISC_R_SUCCESS)
+		atf_tc_fail("can't start parse");
+	status = conf_file_subparse(cfile, root_group, ROOT_GROUP);
+	end_parse(&cfile);
+	if (status != ISC_R_SUCCESS)
+		atf_tc_fail("can't parse %s", text);
+}
+
+static void
+setup(void)
+{
+	char *config, *cp;
+	int i;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+	initialize_server_option_spaces();
+	if (!group_allocate(&root_group, MDL))
+		atf_tc_fail("can't allocate root group");
+
+	/* Classes indexed on the whole of an option, on prefixes of two
+	   lengths, with the constant on either side, and some that can't
+	   be indexed.  Each group of six shares its constants. */
+	config = cp = dmalloc(NCLASSES * 200, MDL);
+	for (i = 0; i < NCLASSES; i++) {
+		cp += sprintf(cp, "class \"c%d\" { match if ", i);
+		switch (i % 6) {
+		      case 0:
+			cp += sprintf(cp, "option vendor-class-identifier"
+				      " = \"vc%d\"", i / 6);
+			break;
+		      case 1:
+			cp += sprintf(cp, "substring(option agent.circuit-id,"
+				      " 0, 4) = \"ci%02d\"", i / 6);
+			break;
+		      case 2:
+			cp += sprintf(cp, "substring(option agent.circuit-id,"
+				      " 0, 6) = \"ci%02d-x\"", i / 6);
+			break;
+		      case 3:
+			cp += sprintf(cp, "\"h%d\" = option host-name", i / 6);
+			break;
+		      case 4:
+			cp += sprintf(cp, "substring(option host-name, 0, 5)"
+				      " = \"h%d\"", i / 6);
+			break;
+		      case 5:
+			cp += sprintf(cp, "exists host-name and "
+				      "option vendor-class-identifier = "
+				      "\"vc%d\"", i / 6);
+			break;
+		}
+		cp += sprintf(cp, "; }\n");
+	}
+
+	/* A class with a submatch, found through the index. */
+	cp += sprintf(cp, "class \"sub\" { match if "
+		      "option vendor-class-identifier = \"vc3\"; "
+		      "match option host-name; }\n"
+		      "subclass \"sub\" \"h1\";\n");
+	parse_classes(config);
+	dfree(config, MDL);
+}
+
+static struct packet *
+make_packet(const char *vendor_class, const char *circuit_id,
+	    const char *host_name)
+{
+	static struct dhcp_packet raw;
+	struct packet *packet = NULL;
+
+	memset(&raw, 0, sizeof(raw));
+	if (!packet_allocate(&packet, MDL) ||
+	    !option_state_allocate(&packet->options, MDL))
+		atf_tc_fail("can't allocate packet");
+	packet->raw = &raw;
+	packet->packet_length = DHCP_FIXED_NON_UDP;
+
+	if (vendor_class != NULL &&
+	    !save_option_buffer(&dhcp_universe, packet->options, NULL,
+				(unsigned char *)vendor_class,
+				strlen(vendor_class),
+				DHO_VENDOR_CLASS_IDENTIFIER, 0))
+		atf_tc_fail("can't save vendor-class-identifier");
+	if (circuit_id != NULL &&
+	    !save_option_buffer(&agent_universe, packet->options, NULL,
+				(unsigned char *)circuit_id,
+				strlen(circuit_id), RAI_CIRCUIT_ID, 0))
+		atf_tc_fail("can't save circuit-id");
+	if (host_name != NULL &&
+	    !save_option_buffer(&dhcp_universe, packet->options, NULL,
+				(unsigned char *)host_name, strlen(host_name),
+				DHO_HOST_NAME, 0))
+		atf_tc_fail("can't save host-name");
+	return (packet);
+}
+
+/* The classes a packet is in when every match expression is evaluated
+   in turn, as check_collection() did before classes were indexed. */
+static int
+walk_classes(struct packet *packet, struct class **classes)
+{
+	struct class *class, *nc;
+	struct data_string data;
+	int count = 0, ignorep;
+
+	for (class = default_collection.classes; class != NULL;
+	     class = class->nic) {
+		if (class->expr != NULL &&
+		    !evaluate_boolean_expression_result(&ignorep, packet,
+							NULL, NULL,
+							packet->options,
+							NULL, &global_scope,
+							class->expr))
+			continue;
+		if (class->submatch == NULL) {
+			classes[count++] = class;
+			continue;
+		}
+		memset(&data, 0, sizeof(data));
+		nc = NULL;
+		if (evaluate_data_expression(&data, packet, NULL, NULL,
+					     packet->options, NULL,
+					     &global_scope, class->submatch,
+					     MDL) &&
+		    class_hash_lookup(&nc, class->hash,
+				      (const char *)data.data, data.len,
+				      MDL)) {
+			classes[count++] = nc;
+			class_dereference(&nc, MDL);
+		}
+		data_string_forget(&data, MDL);
+	}
+	return (count);
+}
+
+static void
+check_packet(const char *vendor_class, const char *circuit_id,
+	     const char *host_name, int expect_some)
+{
+	struct packet *packet;
+	struct class *expect[NCLASSES + 2];
+	int count, i;
+
+	packet = make_packet(vendor_class, circuit_id, host_name);
+	count = walk_classes(packet, expect);
+	if (expect_some && count == 0)
+		atf_tc_fail("%s/%s/%s: no classes match", vendor_class,
+			    circuit_id, host_name);
+
+	check_collection(packet, NULL, &default_collection);
+	if (packet->class_count != count)
+		atf_tc_fail("%s/%s/%s: in %d classes, expected %d",
+			    vendor_class, circuit_id, host_name,
+			    packet->class_count, count);
+	for (i = 0; i < count; i++) {
+		if (packet->classes[i] != expect[i])
+			atf_tc_fail("%s/%s/%s: class %d is %s, expected %s",
+				    vendor_class, circuit_id, host_name, i,
+				    packet->classes[i]->name,
+				    expect[i]->name);
+	}
+	packet_dereference(&packet, MDL);
+}
+
+ATF_TC(class_index);
+ATF_TC_HEAD(class_index, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify indexed class matching "
+			  "finds the same classes as checking each class");
+}
+
+ATF_TC_BODY(class_index, tc)
+{
+	struct class *class = NULL;
+
+	setup();
+
+	check_packet(NULL, NULL, NULL, 0);
+	check_packet("vc0", NULL, NULL, 1);
+	check_packet("vc3", NULL, "h1", 1);
+	check_packet("vc3", NULL, "h2", 1);
+	check_packet("vc5", "ci03", "h0", 1);
+	check_packet("vc", "ci0", "h", 0);
+	check_packet(NULL, "ci07-x", NULL, 1);
+	check_packet(NULL, "ci07-xyz", "h3", 1);
+	check_packet(NULL, "ci11-x", NULL, 0);
+	check_packet("vc1", "", "", 1);
+	check_packet("vc2x", "ci02", "h2x", 1);
+	check_packet("vc4", "ci04-x", "h4", 1);
+
+	/* Removing and adding classes must be seen by the index. */
+	if (find_class(&class, "c0", MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't find class c0");
+	unlink_class(&class);
+	check_packet("vc0", NULL, NULL, 0);
+
+	parse_classes("class \"late\" { match if "
+		      "option vendor-class-identifier = \"vc0\"; }\n");
+	check_packet("vc0", NULL, NULL, 1);
+	if (find_class(&class, "late", MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't find class late");
+	class_dereference(&class, MDL);
+}
+
+ATF_TC(class_set);
+ATF_TC_HEAD(class_set, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify a packet can be put in "
+			  "any number of classes");
+}
+
+ATF_TC_BODY(class_set, tc)
+{
+	struct class *classes[NCLASSES], *super = NULL, *other = NULL;
+	struct class *spawner = NULL;
+	struct packet *packet;
+	int i;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	/* Every third class, super and other are named in permit lists and
+	   so are found through the packet's class set.   The rest, and the
+	   subclasses of spawner, are found by searching its class list. */
+	if (class_allocate(&super, MDL) != ISC_R_SUCCESS ||
+	    class_allocate(&other, MDL) != ISC_R_SUCCESS ||
+	    class_allocate(&spawner, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate class");
+	permit_class_id(super);
+	permit_class_id(other);
+	for (i = 0; i < NCLASSES; i++) {
+		classes[i] = NULL;
+		if (class_allocate(&classes[i], MDL) != ISC_R_SUCCESS)
+			atf_tc_fail("can't allocate class");
+		if (i % 10 == 9)
+			class_reference(&classes[i]->superclass, super, MDL);
+		else if (i % 10 == 5)
+			class_reference(&classes[i]->superclass, spawner,
+					MDL);
+		if (i % 3 == 0)
+			permit_class_id(classes[i]);
+	}
+
+	packet = make_packet(NULL, NULL, NULL);
+	if (packet_class_member(packet, super, 1))
+		atf_tc_fail("packet is in a class before classification");
+
+	/* Put it in the odd numbered classes. */
+	for (i = 1; i < NCLASSES; i += 2)
+		classify(packet, classes[i]);
+
+	if (packet->class_count != NCLASSES / 2)
+		atf_tc_fail("packet in %d classes, expected %d",
+			    packet->class_count, NCLASSES / 2);
+	for (i = 0; i < NCLASSES; i++) {
+		if (i % 2 && packet->classes[i / 2] != classes[i])
+			atf_tc_fail("class %d out of order", i);
+		if (packet_class_member(packet, classes[i], 1) != (i % 2))
+			atf_tc_fail("class %d membership wrong", i);
+	}
+	if (packet_class_member(packet, super, 0) ||
+	    !packet_class_member(packet, super, 1))
+		atf_tc_fail("superclass membership wrong");
+	if (packet_class_member(packet, spawner, 0) ||
+	    !packet_class_member(packet, spawner, 1))
+		atf_tc_fail("spawning class membership wrong");
+	if (packet_class_member(packet, other, 1))
+		atf_tc_fail("packet in a class it wasn't put in");
+
+	/* Only the classes with ids take space in the class set. */
+	if (packet->class_set != packet->class_set_store)
+		atf_tc_fail("class set moved to the heap");
+
+	packet_dereference(&packet, MDL);
+	for (i = 0; i < NCLASSES; i++)
+		class_dereference(&classes[i], MDL);
+	class_dereference(&super, MDL);
+	class_dereference(&other, MDL);
+	class_dereference(&spawner, MDL);
+}
+
+/* Put a packet with the given host-name through classification and
+   return the spawned subclass it ends up in. */
+static struct class *
+spawn_packet(const char *host_name)
+{
+	struct packet *packet;
+	struct class *class;
+
+	packet = make_packet(NULL, NULL, host_name);
+	check_collection(packet, NULL, &default_collection);
+	if (packet->class_count != 1)
+		atf_tc_fail("%s: in %d classes, expected 1", host_name,
+			    packet->class_count);
+	class = packet->classes[0];
+	packet_dereference(&packet, MDL);
+	return (class);
+}
+
+static int
+spawned(struct class *class, const char *host_name)
+{
+	struct class *nc = NULL;
+
+	if (!class_hash_lookup(&nc, class->hash, host_name,
+			       strlen(host_name), MDL))
+		return (0);
+	class_dereference(&nc, MDL);
+	return (1);
+}
+
+ATF_TC(spawn_limit);
+ATF_TC_HEAD(spawn_limit, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify a spawning class keeps no "
+			  "more subclasses than its spawn limit, dropping "
+			  "the least recently matched ones without leases");
+}
+
+ATF_TC_BODY(spawn_limit, tc)
+{
+	struct class *class = NULL, *nc;
+	struct packet *packet;
+	char name[20];
+	int i;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+	initialize_server_option_spaces();
+	if (!group_allocate(&root_group, MDL))
+		atf_tc_fail("can't allocate root group");
+
+	parse_classes("class \"sp\" { match if exists host-name; "
+		      "spawn with option host-name; spawn limit 8; }\n");
+	if (find_class(&class, "sp", MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't find class sp");
+	if (class->spawn_limit != 8)
+		atf_tc_fail("spawn limit is %d, expected 8",
+			    class->spawn_limit);
+
+	/* h0 holds a lease and h1 keeps being seen, so neither is
+	   dropped as a thousand more subclasses are spawned. */
+	spawn_packet("h0")->leases_consumed = 1;
+	for (i = 1; i < 1000; i++) {
+		sprintf(name, "h%d", i);
+		nc = spawn_packet(name);
+		if (nc->superclass != class)
+			atf_tc_fail("%s wasn't spawned from sp", name);
+		if (!spawned(class, "h1"))
+			atf_tc_fail("h1 was dropped after %s", name);
+		spawn_packet("h1");
+		if (class->spawned_count > 8)
+			atf_tc_fail("%d subclasses after %s",
+				    class->spawned_count, name);
+	}
+
+	if (!spawned(class, "h0") || !spawned(class, "h1") ||
+	    !spawned(class, "h999"))
+		atf_tc_fail("subclass was dropped too soon");
+	if (spawned(class, "h2") || spawned(class, "h990"))
+		atf_tc_fail("subclass wasn't dropped");
+	if (class->spawned_total != 1000 ||
+	    class->spawned_evicted != 1000 - 8)
+		atf_tc_fail("spawned %u, dropped %u", class->spawned_total,
+			    class->spawned_evicted);
+
+	class_dereference(&class, MDL);
+
+	/* Without a limit the hash table grows to hold every subclass. */
+	parse_classes("class \"sv\" { match if "
+		      "exists vendor-class-identifier; "
+		      "spawn with option vendor-class-identifier; }\n");
+	if (find_class(&class, "sv", MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't find class sv");
+	for (i = 0; i < 3 * SCLASS_HASH_SIZE; i++) {
+		sprintf(name, "v%d", i);
+		packet = make_packet(name, NULL, NULL);
+		check_collection(packet, NULL, &default_collection);
+		packet_dereference(&packet, MDL);
+	}
+	if (class->spawned_count != 3 * SCLASS_HASH_SIZE ||
+	    class->spawned_evicted != 0)
+		atf_tc_fail("%d subclasses, %u dropped", class->spawned_count,
+			    class->spawned_evicted);
+	if (class->hash->hash_count <= SCLASS_HASH_SIZE)
+		atf_tc_fail("subclass hash table wasn't grown");
+	for (i = 0; i < 3 * SCLASS_HASH_SIZE; i++) {
+		sprintf(name, "v%d", i);
+		if (!spawned(class, name))
+			atf_tc_fail("%s lost when the hash table grew", name);
+	}
+	class_dereference(&class, MDL);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, class_index);
+	ATF_TP_ADD_TC(tp, class_set);
+	ATF_TP_ADD_TC(tp, spawn_limit);
+	return (atf_no_error());
+}
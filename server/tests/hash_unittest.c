@@ -594,12 +594,87 @@ ATF_TC_BODY(uid_hash_rt29851, tc) {
 }
 #endif
 
+static isc_result_t count_entry(const void *name, unsigned len, void *value)
+{
+    return ISC_R_SUCCESS;
+}
+
+ATF_TC(lease_hash_resize);
+
+ATF_TC_HEAD(lease_hash_resize, tc) {
+    atf_tc_set_md_var(tc, "descr", "Lease hash resizing tests");
+    /*
+     * Checks that a hash table grows as entries are added, and that
+     * entries can be found, deleted and walked while they are being
+     * moved to the new buckets.
+     */
+}
+
+ATF_TC_BODY(lease_hash_resize, tc) {
+
+#define RESIZE_LEASES 2000
+    lease_ip_hash_t *table = NULL;
+    struct lease *leases[RESIZE_LEASES], *found;
+    unsigned char addrs[RESIZE_LEASES][4];
+    int i, j, resizing = 0;
+
+    dhcp_db_objects_setup ();
+    dhcp_common_objects_setup ();
+
+    ATF_REQUIRE(lease_ip_new_hash(&table, 7, MDL));
+
+    for (i = 0; i < RESIZE_LEASES; i++) {
+        leases[i] = NULL;
+        ATF_REQUIRE(lease_allocate(&leases[i], MDL) == ISC_R_SUCCESS);
+        addrs[i][0] = 10;
+        addrs[i][1] = 0;
+        addrs[i][2] = i >> 8;
+        addrs[i][3] = i & 0xff;
+        lease_ip_hash_add(table, addrs[i], 4, leases[i], MDL);
+        if (table->old_buckets != NULL)
+            resizing++;
+
+        /* Everything added so far, less every third, is there. */
+        if (i % 3 == 2)
+            lease_ip_hash_delete(table, addrs[i - 1], 4, MDL);
+        if (i % 97 == 0) {
+            for (j = 0; j <= i; j++) {
+                found = NULL;
+                if (lease_ip_hash_lookup(&found, table, addrs[j], 4,
+                                         MDL) != (j % 3 != 1 || j == i)) {
+                    atf_tc_fail("lookup %d of %d wrong", j, i);
+                }
+                if (found != NULL) {
+                    ATF_CHECK(found == leases[j]);
+                    lease_dereference(&found, MDL);
+                }
+            }
+            ATF_CHECK_EQ(lease_ip_hash_foreach(table, count_entry),
+                         table->entries);
+        }
+    }
+
+    ATF_CHECK_EQ(table->entries, RESIZE_LEASES - RESIZE_LEASES / 3);
+    ATF_CHECK(table->resizes > 0);
+    ATF_CHECK(table->hash_count * 2 >= table->entries);
+    ATF_CHECK(resizing > 0);
+
+    finish_hash_resize(table);
+    ATF_CHECK(table->old_buckets == NULL);
+    ATF_CHECK_EQ(lease_ip_hash_foreach(table, count_entry), table->entries);
+
+    lease_ip_free_hash_table(&table, MDL);
+    for (i = 0; i < RESIZE_LEASES; i++)
+        lease_dereference(&leases[i], MDL);
+}
+
 ATF_TP_ADD_TCS(tp) {
     ATF_TP_ADD_TC(tp, lease_hash_basic_2hosts);
     ATF_TP_ADD_TC(tp, lease_hash_basic_3hosts);
     ATF_TP_ADD_TC(tp, lease_hash_string_2hosts);
     ATF_TP_ADD_TC(tp, lease_hash_string_3hosts);
     ATF_TP_ADD_TC(tp, lease_hash_negative1);
+    ATF_TP_ADD_TC(tp, lease_hash_resize);
 #if 0 /* see comment in function */
     ATF_TP_ADD_TC(tp, uid_hash_rt29851);
 #endif
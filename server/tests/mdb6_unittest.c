@@ -29,11 +29,14 @@
 #include <atf-c.h>
 
 #include <stdlib.h>
+#include <unistd.h>
 
 void build_prefix6(struct in6_addr *pref, const struct in6_addr *net_start_pref,
                    int pool_bits, int pref_bits,
                    const struct data_string *input);
 
+extern FILE *db_file;
+
 /*
  * Basic iaaddr manipulation.
  * Verify construction and referencing of an iaaddr.
@@ -862,6 +865,351 @@ ATF_TC_BODY(small_pool, tc)
     }
 }
 
+/*
+ * Dense pool.
+ * check that a pool with a bitmap hands out every address it has.
+ */
+
+ATF_TC(dense_pool);
+ATF_TC_HEAD(dense_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a dense "
+                      "pool can be filled completely.");
+}
+ATF_TC_BODY(dense_pool, tc)
+{
+    struct in6_addr addr, taken;
+    struct ipv6_pool *pool;
+    struct iasubopt *iaaddr;
+    struct iasubopt *released;
+    char uid[32];
+    struct data_string ds;
+    unsigned int attempts;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* a /120 loses ::0 to the reserved subnet router anycast IID */
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                           120, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    /* an address leased before the bitmap exists stays taken */
+    memset(&ds, 0, sizeof(ds));
+    ds.data = (const unsigned char *)"early";
+    ds.len = strlen("early");
+    iaaddr = NULL;
+    if (create_lease6(pool, &iaaddr, &attempts,
+                      &ds, 1) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    if (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+    }
+    taken = iaaddr->addr;
+    iasubopt_dereference(&iaaddr, MDL);
+    if (ipv6_pool_use_map(pool) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_use_map() %s:%d", MDL);
+    }
+    if ((pool->map_size != 256) || (pool->map_free != 254)) {
+        atf_tc_fail("ERROR: bad map_free %u %s:%d", pool->map_free, MDL);
+    }
+
+    released = NULL;
+    for (i = 0; i < 254; i++) {
+        snprintf(uid, sizeof(uid), "client%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+
+        iaaddr = NULL;
+        if (create_lease6(pool, &iaaddr, &attempts,
+                          &ds, 1) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() failed after %d %s:%d",
+                        i, MDL);
+        }
+        if (attempts > 2) {
+            atf_tc_fail("ERROR: %u attempts %s:%d", attempts, MDL);
+        }
+        if ((iaaddr->addr.s6_addr[15] == 0) ||
+            (memcmp(&iaaddr->addr, &taken, sizeof(taken)) == 0) ||
+            lease6_exists(pool, &iaaddr->addr)) {
+            atf_tc_fail("ERROR: handed out a used address %s:%d", MDL);
+        }
+        if (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+        }
+        if (i == 100) {
+            iasubopt_reference(&released, iaaddr, MDL);
+        }
+        iasubopt_dereference(&iaaddr, MDL);
+    }
+    if ((pool->num_active != 255) || (pool->map_free != 0)) {
+        atf_tc_fail("ERROR: pool is not full %s:%d", MDL);
+    }
+
+    /* full */
+    ds.data = (const unsigned char *)"latecomer";
+    ds.len = strlen("latecomer");
+    if (create_lease6(pool, &iaaddr, &attempts,
+                      &ds, 1) != ISC_R_NORESOURCES) {
+        atf_tc_fail("ERROR: create_lease6() on a full pool %s:%d", MDL);
+    }
+
+    /* a released address is the only one left */
+    if (release_lease6(pool, released) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: release_lease6() %s:%d", MDL);
+    }
+    if (pool->map_free != 1) {
+        atf_tc_fail("ERROR: bad map_free %u %s:%d", pool->map_free, MDL);
+    }
+    if (create_lease6(pool, &iaaddr, &attempts,
+                      &ds, 1) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    if (memcmp(&iaaddr->addr, &released->addr, sizeof(addr)) != 0) {
+        atf_tc_fail("ERROR: did not reuse released address %s:%d", MDL);
+    }
+
+    iasubopt_dereference(&iaaddr, MDL);
+    iasubopt_dereference(&released, MDL);
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Dense prefix pool.
+ * check that a prefix pool with a bitmap hands out every prefix it has.
+ */
+
+ATF_TC(dense_prefix_pool);
+ATF_TC_HEAD(dense_prefix_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a dense "
+                      "prefix pool can be filled completely.");
+}
+ATF_TC_BODY(dense_prefix_pool, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct iasubopt *iapref;
+    struct iasubopt *released;
+    char uid[32];
+    struct data_string ds;
+    unsigned int attempts;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* a /40 delegated as /56s, enough for several summary levels */
+    inet_pton(AF_INET6, "2001:db8:ab00::", &addr);
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_PD, &addr,
+                           40, 56, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    if (ipv6_pool_use_map(pool) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_use_map() %s:%d", MDL);
+    }
+    if ((pool->map_size != 65536) || (pool->map_free != 65536) ||
+        (pool->map_levels != 4)) {
+        atf_tc_fail("ERROR: bad map %s:%d", MDL);
+    }
+
+    memset(&ds, 0, sizeof(ds));
+    released = NULL;
+    for (i = 0; i < 65536; i++) {
+        snprintf(uid, sizeof(uid), "client%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+
+        iapref = NULL;
+        if (create_prefix6(pool, &iapref, &attempts,
+                           &ds, 1) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_prefix6() failed after %d %s:%d",
+                        i, MDL);
+        }
+        if ((iapref->plen != 56) ||
+            !ipv6_in_pool(&iapref->addr, pool) ||
+            (iapref->addr.s6_addr[7] != 0) ||
+            prefix6_exists(pool, &iapref->addr, 56)) {
+            atf_tc_fail("ERROR: handed out a bad prefix %s:%d", MDL);
+        }
+        if (renew_lease6(pool, iapref) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+        }
+        if (i == 30000) {
+            iasubopt_reference(&released, iapref, MDL);
+        }
+        iasubopt_dereference(&iapref, MDL);
+    }
+    if ((pool->num_active != 65536) || (pool->map_free != 0)) {
+        atf_tc_fail("ERROR: pool is not full %s:%d", MDL);
+    }
+
+    /* full */
+    ds.data = (const unsigned char *)"latecomer";
+    ds.len = strlen("latecomer");
+    if (create_prefix6(pool, &iapref, &attempts,
+                       &ds, 1) != ISC_R_NORESOURCES) {
+        atf_tc_fail("ERROR: create_prefix6() on a full pool %s:%d", MDL);
+    }
+
+    /* a released prefix is the only one left */
+    if (release_lease6(pool, released) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: release_lease6() %s:%d", MDL);
+    }
+    if (create_prefix6(pool, &iapref, &attempts,
+                       &ds, 1) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_prefix6() %s:%d", MDL);
+    }
+    if (memcmp(&iapref->addr, &released->addr, sizeof(addr)) != 0) {
+        atf_tc_fail("ERROR: did not reuse released prefix %s:%d", MDL);
+    }
+
+    iasubopt_dereference(&iapref, MDL);
+    iasubopt_dereference(&released, MDL);
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Sharded pools.
+ * check that a server only hands out its shard's share of a pool.
+ */
+
+ATF_TC(shard_pool);
+ATF_TC_HEAD(shard_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that pools "
+                      "are split between shards.");
+}
+ATF_TC_BODY(shard_pool, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *dense, *sparse, *narrow;
+    struct iasubopt *iaaddr;
+    char uid[32];
+    struct data_string ds;
+    unsigned int attempts;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    shard_count = 3;
+    shard_index = 1;
+
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    dense = NULL;
+    if (ipv6_pool_allocate(&dense, D6O_IA_NA, &addr,
+                           120, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    if (ipv6_pool_use_map(dense) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_use_map() %s:%d", MDL);
+    }
+    /* every third of 256 addresses starting at ::1 */
+    if (dense->map_free != 85) {
+        atf_tc_fail("ERROR: bad map_free %u %s:%d", dense->map_free, MDL);
+    }
+
+    inet_pton(AF_INET6, "1:2:3:5::", &addr);
+    sparse = NULL;
+    if (ipv6_pool_allocate(&sparse, D6O_IA_NA, &addr,
+                           64, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    memset(&ds, 0, sizeof(ds));
+    for (i = 0; i < 85; i++) {
+        snprintf(uid, sizeof(uid), "client%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+
+        iaaddr = NULL;
+        if (create_lease6(dense, &iaaddr, &attempts,
+                          &ds, 1) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+        }
+        if ((iaaddr->addr.s6_addr[15] % 3) != 1) {
+            atf_tc_fail("ERROR: address of another shard %s:%d", MDL);
+        }
+        if (renew_lease6(dense, iaaddr) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+        }
+        iasubopt_dereference(&iaaddr, MDL);
+
+        if (create_lease6(sparse, &iaaddr, &attempts,
+                          &ds, 1) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+        }
+        if ((getULong(&iaaddr->addr.s6_addr[12]) % 3) != 1) {
+            atf_tc_fail("ERROR: address of another shard %s:%d", MDL);
+        }
+        iasubopt_dereference(&iaaddr, MDL);
+    }
+
+    /* our share of the dense pool is used up */
+    if (create_lease6(dense, &iaaddr, &attempts,
+                      &ds, 1) != ISC_R_NORESOURCES) {
+        atf_tc_fail("ERROR: create_lease6() on a full share %s:%d", MDL);
+    }
+
+    /* an address a client asks for in another shard's share is refused,
+     * in either kind of pool */
+    inet_pton(AF_INET6, "1:2:3:4::2", &addr);
+    if (shard_owns_lease6(dense, &addr)) {
+        atf_tc_fail("ERROR: another shard's address accepted %s:%d", MDL);
+    }
+    inet_pton(AF_INET6, "1:2:3:4::4", &addr);
+    if (!shard_owns_lease6(dense, &addr)) {
+        atf_tc_fail("ERROR: our address refused %s:%d", MDL);
+    }
+    inet_pton(AF_INET6, "1:2:3:5::2", &addr);
+    if (shard_owns_lease6(sparse, &addr)) {
+        atf_tc_fail("ERROR: another shard's address accepted %s:%d", MDL);
+    }
+
+    /* candidates past the last of our addresses in a narrow pool are
+     * moved back to it: ::1 is the only one of ours in a /126 */
+    inet_pton(AF_INET6, "1:2:3:6::", &addr);
+    for (i = 0; i < 20; i++) {
+        snprintf(uid, sizeof(uid), "narrow%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+
+        narrow = NULL;
+        if (ipv6_pool_allocate(&narrow, D6O_IA_NA, &addr,
+                               126, 128, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+        }
+        iaaddr = NULL;
+        if (create_lease6(narrow, &iaaddr, &attempts,
+                          &ds, 1) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+        }
+        if ((iaaddr->addr.s6_addr[15] != 1) || (attempts != 1)) {
+            atf_tc_fail("ERROR: bad candidate in narrow pool %s:%d", MDL);
+        }
+        iasubopt_dereference(&iaaddr, MDL);
+        ipv6_pool_dereference(&narrow, MDL);
+    }
+
+    shard_count = 1;
+    shard_index = 0;
+    ipv6_pool_dereference(&dense, MDL);
+    ipv6_pool_dereference(&sparse, MDL);
+}
+
 /*
  * Address to pool mapping.
  * Verify that we find the proper pool for an address
@@ -955,6 +1303,506 @@ ATF_TC_BODY(many_pools, tc)
     }
 }
 
+/*
+ * Pool index.
+ * Verify that find_ipv6_pool() picks the right pool among many pools
+ * of several types, including pools that overlap.
+ */
+ATF_TC(pool_index);
+ATF_TC_HEAD(pool_index, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that the pool "
+                      "index finds the same pools as a scan.");
+}
+ATF_TC_BODY(pool_index, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool, *wide, *narrow, *ta;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* 4096 /56 prefix delegation pools under 2001:db8::/40 */
+    for (i = 0; i < 4096; i++) {
+        inet_pton(AF_INET6, "2001:db8::", &addr);
+        addr.s6_addr[5] = i >> 8;
+        addr.s6_addr[6] = i & 0xff;
+        pool = NULL;
+        if (ipv6_pool_allocate(&pool, D6O_IA_PD, &addr,
+                               56, 64, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+        }
+        if (add_ipv6_pool(pool) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: add_ipv6_pool() %s:%d", MDL);
+        }
+        ipv6_pool_dereference(&pool, MDL);
+    }
+
+    /* an address pool covering them all, and a narrower one after it */
+    inet_pton(AF_INET6, "2001:db8::", &addr);
+    wide = NULL;
+    if ((ipv6_pool_allocate(&wide, D6O_IA_NA, &addr,
+                            40, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(wide) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: adding pool %s:%d", MDL);
+    }
+    inet_pton(AF_INET6, "2001:db8:0:1200::", &addr);
+    narrow = NULL;
+    if ((ipv6_pool_allocate(&narrow, D6O_IA_NA, &addr,
+                            64, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(narrow) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: adding pool %s:%d", MDL);
+    }
+    inet_pton(AF_INET6, "2001:db8:0:1200::", &addr);
+    ta = NULL;
+    if ((ipv6_pool_allocate(&ta, D6O_IA_TA, &addr,
+                            64, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(ta) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: adding pool %s:%d", MDL);
+    }
+
+    /* each prefix delegation pool is found by its own prefixes */
+    for (i = 0; i < 4096; i++) {
+        inet_pton(AF_INET6, "2001:db8::", &addr);
+        addr.s6_addr[5] = i >> 8;
+        addr.s6_addr[6] = i & 0xff;
+        addr.s6_addr[7] = 0x42;
+        pool = NULL;
+        if (find_ipv6_pool(&pool, D6O_IA_PD, &addr) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: find_ipv6_pool() %s:%d", MDL);
+        }
+        if ((pool->bits != 56) ||
+            (memcmp(&pool->start_addr, &addr, 7) != 0)) {
+            atf_tc_fail("ERROR: wrong pool for prefix %d %s:%d", i, MDL);
+        }
+        ipv6_pool_dereference(&pool, MDL);
+    }
+
+    /* the earlier of two overlapping pools wins, as with a scan */
+    inet_pton(AF_INET6, "2001:db8:0:1200::5", &addr);
+    pool = NULL;
+    if ((find_ipv6_pool(&pool, D6O_IA_NA, &addr) != ISC_R_SUCCESS) ||
+        (pool != wide)) {
+        atf_tc_fail("ERROR: find_ipv6_pool() %s:%d", MDL);
+    }
+    ipv6_pool_dereference(&pool, MDL);
+
+    /* types are kept apart */
+    if ((find_ipv6_pool(&pool, D6O_IA_TA, &addr) != ISC_R_SUCCESS) ||
+        (pool != ta)) {
+        atf_tc_fail("ERROR: find_ipv6_pool() %s:%d", MDL);
+    }
+    ipv6_pool_dereference(&pool, MDL);
+    inet_pton(AF_INET6, "2001:db8:0:1300::5", &addr);
+    if (find_ipv6_pool(&pool, D6O_IA_TA, &addr) != ISC_R_NOTFOUND) {
+        atf_tc_fail("ERROR: find_ipv6_pool() %s:%d", MDL);
+    }
+    inet_pton(AF_INET6, "2001:db9::", &addr);
+    if ((find_ipv6_pool(&pool, D6O_IA_NA, &addr) != ISC_R_NOTFOUND) ||
+        (find_ipv6_pool(&pool, D6O_IA_PD, &addr) != ISC_R_NOTFOUND)) {
+        atf_tc_fail("ERROR: find_ipv6_pool() %s:%d", MDL);
+    }
+
+    ipv6_pool_dereference(&wide, MDL);
+    ipv6_pool_dereference(&narrow, MDL);
+    ipv6_pool_dereference(&ta, MDL);
+}
+
+/*
+ * Write an IA through the binary lease journal and read it back.
+ */
+ATF_TC(lease_journal);
+ATF_TC_HEAD(lease_journal, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that an IA "
+                      "written to a binary lease journal is read back.");
+}
+ATF_TC_BODY(lease_journal, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct ia_xx *ia, *found;
+    struct iasubopt *iaaddr;
+    struct binding *bnd;
+    unsigned int attempts;
+    char path[] = "/tmp/lease_journalXXXXXX";
+    int fd;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    local_family = AF_INET6;
+    if ((ia_na_active == NULL) &&
+        !ia_new_hash(&ia_na_active, DEFAULT_HASH_SIZE, MDL)) {
+        atf_tc_fail("ERROR: ia_new_hash() %s:%d", MDL);
+    }
+
+    inet_pton(AF_INET6, "2001:db8:7::", &addr);
+    pool = NULL;
+    if ((ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                            64, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(pool) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    /* an active lease with a binding in it */
+    ia = NULL;
+    if (ia_allocate(&ia, 1234, "client7", 7, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_allocate() %s:%d", MDL);
+    }
+    ia->ia_type = D6O_IA_NA;
+    iaaddr = NULL;
+    if ((create_lease6(pool, &iaaddr, &attempts,
+                       &ia->iaid_duid, 4000) != ISC_R_SUCCESS) ||
+        (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    iaaddr->prefer = 1800;
+    iaaddr->valid = 3600;
+    if (!binding_scope_allocate(&iaaddr->scope, MDL)) {
+        atf_tc_fail("ERROR: binding_scope_allocate() %s:%d", MDL);
+    }
+    bnd = dmalloc(sizeof(*bnd), MDL);
+    if ((bnd == NULL) || ((bnd->name = dmalloc(4, MDL)) == NULL) ||
+        !binding_value_allocate(&bnd->value, MDL)) {
+        atf_tc_fail("ERROR: binding_value_allocate() %s:%d", MDL);
+    }
+    strcpy(bnd->name, "foo");
+    bnd->value->type = binding_numeric;
+    bnd->value->value.intval = 42;
+    iaaddr->scope->bindings = bnd;
+    ia_add_iasubopt(ia, iaaddr, MDL);
+    ia_reference(&iaaddr->ia, ia, MDL);
+
+    /* write it, followed by a record that was never finished */
+    fd = mkstemp(path);
+    if ((fd < 0) || ((db_file = fdopen(fd, "w")) == NULL)) {
+        atf_tc_fail("ERROR: can't create %s %s:%d", path, MDL);
+    }
+    lease_file_format = LEASE_FILE_BINARY;
+    if (!write_ia(ia)) {
+        atf_tc_fail("ERROR: write_ia() %s:%d", MDL);
+    }
+    fwrite("\0\2\0\0", 4, 1, db_file);
+    fclose(db_file);
+    db_file = NULL;
+
+    if (read_conf_file(path, NULL, 0, 1) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: read_conf_file() %s:%d", MDL);
+    }
+    unlink(path);
+
+    found = NULL;
+    if (!ia_hash_lookup(&found, ia_na_active,
+                        (unsigned char *)ia->iaid_duid.data,
+                        ia->iaid_duid.len, MDL)) {
+        atf_tc_fail("ERROR: IA not read back %s:%d", MDL);
+    }
+    if ((found->num_iasubopt != 1) ||
+        (memcmp(&found->iasubopt[0]->addr, &iaaddr->addr,
+                sizeof(addr)) != 0) ||
+        (found->iasubopt[0]->state != FTS_ACTIVE) ||
+        (found->iasubopt[0]->prefer != 1800) ||
+        (found->iasubopt[0]->valid != 3600) ||
+        (found->iasubopt[0]->hard_lifetime_end_time != 4000)) {
+        atf_tc_fail("ERROR: IA read back wrong %s:%d", MDL);
+    }
+    if ((found->iasubopt[0]->scope == NULL) ||
+        ((bnd = find_binding(found->iasubopt[0]->scope, "foo")) == NULL) ||
+        (bnd->value->type != binding_numeric) ||
+        (bnd->value->value.intval != 42)) {
+        atf_tc_fail("ERROR: binding read back wrong %s:%d", MDL);
+    }
+
+    lease_file_format = LEASE_FILE_TEXT;
+    ia_dereference(&found, MDL);
+    iasubopt_dereference(&iaaddr, MDL);
+    ia_dereference(&ia, MDL);
+    ipv6_pool_dereference(&pool, MDL);
+}
+
+/*
+ * Renew an IA written to the binary lease journal and check that only
+ * its timers are written, until something else about it changes.
+ */
+ATF_TC(lease_journal_timers);
+ATF_TC_HEAD(lease_journal_timers, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that renewals "
+                      "are journaled as timers alone.");
+}
+ATF_TC_BODY(lease_journal_timers, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct ia_xx *ia, *found;
+    struct iasubopt *iaaddr;
+    struct binding *bnd;
+    unsigned int attempts;
+    unsigned char rec[2];
+    char path[] = "/tmp/lease_journalXXXXXX";
+    long full, renew;
+    int fd;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    local_family = AF_INET6;
+    if ((ia_na_active == NULL) &&
+        !ia_new_hash(&ia_na_active, DEFAULT_HASH_SIZE, MDL)) {
+        atf_tc_fail("ERROR: ia_new_hash() %s:%d", MDL);
+    }
+
+    inet_pton(AF_INET6, "2001:db8:8::", &addr);
+    pool = NULL;
+    if ((ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                            64, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(pool) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    ia = NULL;
+    if (ia_allocate(&ia, 1234, "client8", 7, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_allocate() %s:%d", MDL);
+    }
+    ia->ia_type = D6O_IA_NA;
+    iaaddr = NULL;
+    if ((create_lease6(pool, &iaaddr, &attempts,
+                       &ia->iaid_duid, 4000) != ISC_R_SUCCESS) ||
+        (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    iaaddr->prefer = 1800;
+    iaaddr->valid = 3600;
+    if (!binding_scope_allocate(&iaaddr->scope, MDL)) {
+        atf_tc_fail("ERROR: binding_scope_allocate() %s:%d", MDL);
+    }
+    bnd = dmalloc(sizeof(*bnd), MDL);
+    if ((bnd == NULL) || ((bnd->name = dmalloc(4, MDL)) == NULL) ||
+        !binding_value_allocate(&bnd->value, MDL)) {
+        atf_tc_fail("ERROR: binding_value_allocate() %s:%d", MDL);
+    }
+    strcpy(bnd->name, "foo");
+    bnd->value->type = binding_numeric;
+    bnd->value->value.intval = 42;
+    iaaddr->scope->bindings = bnd;
+    ia_add_iasubopt(ia, iaaddr, MDL);
+    ia_reference(&iaaddr->ia, ia, MDL);
+
+    fd = mkstemp(path);
+    if ((fd < 0) || ((db_file = fdopen(fd, "w+")) == NULL)) {
+        atf_tc_fail("ERROR: can't create %s %s:%d", path, MDL);
+    }
+    lease_file_format = LEASE_FILE_BINARY;
+
+    /* the first write is a full record, a renewal just the timers */
+    if (!write_ia(ia)) {
+        atf_tc_fail("ERROR: write_ia() %s:%d", MDL);
+    }
+    full = ftell(db_file);
+    ia->cltt = 2000;
+    iaaddr->prefer = 2000;
+    iaaddr->valid = 4000;
+    iaaddr->soft_lifetime_end_time = 6000;
+    if ((renew_lease6(pool, iaaddr) != ISC_R_SUCCESS) ||
+        !write_ia(ia)) {
+        atf_tc_fail("ERROR: write_ia() %s:%d", MDL);
+    }
+    renew = ftell(db_file);
+    if ((fseek(db_file, full, SEEK_SET) != 0) ||
+        (fread(rec, 2, 1, db_file) != 1) ||
+        (rec[0] != 0) || (rec[1] != 4) ||
+        (renew - full >= full)) {
+        atf_tc_fail("ERROR: renewal not written as timers %s:%d", MDL);
+    }
+
+    /* a changed binding needs the full record again */
+    fseek(db_file, 0, SEEK_END);
+    bnd->value->value.intval = 43;
+    if (!write_ia(ia)) {
+        atf_tc_fail("ERROR: write_ia() %s:%d", MDL);
+    }
+    if ((fseek(db_file, renew, SEEK_SET) != 0) ||
+        (fread(rec, 2, 1, db_file) != 1) ||
+        (rec[0] != 0) || (rec[1] != 3)) {
+        atf_tc_fail("ERROR: changed IA written as timers %s:%d", MDL);
+    }
+
+    /* and another renewal goes back to timers */
+    fseek(db_file, 0, SEEK_END);
+    renew = ftell(db_file);
+    iaaddr->soft_lifetime_end_time = 7000;
+    if ((renew_lease6(pool, iaaddr) != ISC_R_SUCCESS) ||
+        !write_ia(ia)) {
+        atf_tc_fail("ERROR: write_ia() %s:%d", MDL);
+    }
+    if ((fseek(db_file, renew, SEEK_SET) != 0) ||
+        (fread(rec, 2, 1, db_file) != 1) ||
+        (rec[0] != 0) || (rec[1] != 4)) {
+        atf_tc_fail("ERROR: renewal not written as timers %s:%d", MDL);
+    }
+    fclose(db_file);
+    db_file = NULL;
+
+    if (read_conf_file(path, NULL, 0, 1) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: read_conf_file() %s:%d", MDL);
+    }
+    unlink(path);
+
+    found = NULL;
+    if (!ia_hash_lookup(&found, ia_na_active,
+                        (unsigned char *)ia->iaid_duid.data,
+                        ia->iaid_duid.len, MDL)) {
+        atf_tc_fail("ERROR: IA not read back %s:%d", MDL);
+    }
+    if ((found->num_iasubopt != 1) ||
+        (found->cltt != 2000) ||
+        (memcmp(&found->iasubopt[0]->addr, &iaaddr->addr,
+                sizeof(addr)) != 0) ||
+        (found->iasubopt[0]->state != FTS_ACTIVE) ||
+        (found->iasubopt[0]->prefer != 2000) ||
+        (found->iasubopt[0]->valid != 4000) ||
+        (found->iasubopt[0]->hard_lifetime_end_time != 7000)) {
+        atf_tc_fail("ERROR: IA read back wrong %s:%d", MDL);
+    }
+    if ((found->iasubopt[0]->scope == NULL) ||
+        ((bnd = find_binding(found->iasubopt[0]->scope, "foo")) == NULL) ||
+        (bnd->value->value.intval != 43)) {
+        atf_tc_fail("ERROR: binding read back wrong %s:%d", MDL);
+    }
+
+    lease_file_format = LEASE_FILE_TEXT;
+    ia_dereference(&found, MDL);
+    iasubopt_dereference(&iaaddr, MDL);
+    ia_dereference(&ia, MDL);
+    ipv6_pool_dereference(&pool, MDL);
+}
+
+/*
+ * Expire the leases of a pool a batch at a time, writing each IA
+ * once per batch.
+ */
+ATF_TC(expire_batch);
+ATF_TC_HEAD(expire_batch, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that leases "
+                      "expire in batches of lease-expiry-batch-size.");
+}
+
+static int
+count_ia_writes(FILE *f)
+{
+    char line[256];
+    int count;
+
+    fflush(f);
+    rewind(f);
+    count = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "ia-na ", 6) == 0) {
+            count++;
+        }
+    }
+    fseek(f, 0, SEEK_END);
+    return count;
+}
+
+ATF_TC_BODY(expire_batch, tc)
+{
+    struct in6_addr addr;
+    struct ipv6_pool *pool;
+    struct ia_xx *ia;
+    struct iasubopt *iaaddr;
+    unsigned int attempts;
+    char path[] = "/tmp/expire_batchXXXXXX";
+    char duid[8];
+    int fd, i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+    local_family = AF_INET6;
+
+    inet_pton(AF_INET6, "2001:db8:9::", &addr);
+    pool = NULL;
+    if ((ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                            64, 128, MDL) != ISC_R_SUCCESS) ||
+        (add_ipv6_pool(pool) != ISC_R_SUCCESS)) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    /* 25 IAs with 26 leases between them, the first IA having two */
+    for (i = 0; i < 25; i++) {
+        snprintf(duid, sizeof(duid), "dev%04d", i);
+        ia = NULL;
+        if (ia_allocate(&ia, i, duid, 7, MDL) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: ia_allocate() %s:%d", MDL);
+        }
+        ia->ia_type = D6O_IA_NA;
+        do {
+            iaaddr = NULL;
+            if ((create_lease6(pool, &iaaddr, &attempts,
+                               &ia->iaid_duid,
+                               1000 + i) != ISC_R_SUCCESS) ||
+                (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS)) {
+                atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+            }
+            ia_add_iasubopt(ia, iaaddr, MDL);
+            ia_reference(&iaaddr->ia, ia, MDL);
+            iasubopt_dereference(&iaaddr, MDL);
+        } while ((i == 0) && (ia->num_iasubopt < 2));
+        ia_dereference(&ia, MDL);
+    }
+
+    fd = mkstemp(path);
+    if ((fd < 0) || ((db_file = fdopen(fd, "w+")) == NULL)) {
+        atf_tc_fail("ERROR: can't create %s %s:%d", path, MDL);
+    }
+    unlink(path);
+
+    cur_time = 2000;
+    lease_expiry_batch_size = 10;
+    schedule_lease_timeout(pool);
+    if ((pool->expiry_index == 0) || (pool->expiry_time != 1001)) {
+        atf_tc_fail("ERROR: pool not scheduled %s:%d", MDL);
+    }
+
+    /* the first batch holds both leases of the first IA */
+    lease_timeout_support(NULL);
+    if ((pool->num_active != 16) || (pool->num_inactive != 10) ||
+        (count_ia_writes(db_file) != 9)) {
+        atf_tc_fail("ERROR: first batch wrong %s:%d", MDL);
+    }
+    lease_timeout_support(NULL);
+    lease_timeout_support(NULL);
+    if ((pool->num_active != 0) || (pool->num_inactive != 26) ||
+        (count_ia_writes(db_file) != 25)) {
+        atf_tc_fail("ERROR: expiry incomplete %s:%d", MDL);
+    }
+    if ((pool->expiry_index == 0) ||
+        (pool->expiry_time != 1000 + EXPIRED_IPV6_CLEANUP_TIME)) {
+        atf_tc_fail("ERROR: cleanup not scheduled %s:%d", MDL);
+    }
+
+    /* and then they are cleaned up, also in batches */
+    cur_time = 2000 + EXPIRED_IPV6_CLEANUP_TIME;
+    lease_timeout_support(NULL);
+    if (pool->num_inactive != 16) {
+        atf_tc_fail("ERROR: first cleanup batch wrong %s:%d", MDL);
+    }
+    lease_timeout_support(NULL);
+    lease_timeout_support(NULL);
+    if ((pool->num_inactive != 0) || (pool->expiry_index != 0)) {
+        atf_tc_fail("ERROR: cleanup incomplete %s:%d", MDL);
+    }
+
+    fclose(db_file);
+    db_file = NULL;
+    ipv6_pool_dereference(&pool, MDL);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, iaaddr_basic);
@@ -966,8 +1814,15 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, ipv6_pool_negative);
     ATF_TP_ADD_TC(tp, expire_order);
     ATF_TP_ADD_TC(tp, expire_order_reduce);
+    ATF_TP_ADD_TC(tp, expire_batch);
     ATF_TP_ADD_TC(tp, small_pool);
+    ATF_TP_ADD_TC(tp, dense_pool);
+    ATF_TP_ADD_TC(tp, dense_prefix_pool);
+    ATF_TP_ADD_TC(tp, shard_pool);
     ATF_TP_ADD_TC(tp, many_pools);
+    ATF_TP_ADD_TC(tp, pool_index);
+    ATF_TP_ADD_TC(tp, lease_journal);
+    ATF_TP_ADD_TC(tp, lease_journal_timers);
 
     return (atf_no_error());
 }
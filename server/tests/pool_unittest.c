@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2020 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test the pool index used by allocate_lease().  Leases are moved
+ * between states with supersede_lease(), as the server would, and each
+ * time allocate_lease() must pick the same lease from the index as it
+ * does by walking the pools one at a time.
+ */
+
+#define NPOOLS	4
+
+static struct shared_network *share;
+static struct pool *test_pools[NPOOLS];
+static struct packet *packet;
+
+static void
+setup(void)
+{
+	struct pool *pool;
+	int i;
+
+	dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			    NULL, NULL);
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	time(&cur_time);
+	if (!lease_id_new_hash(&lease_hw_addr_hash, LEASE_HASH_SIZE, MDL))
+		atf_tc_fail("can't allocate lease/hw hash");
+
+	share = NULL;
+	if (shared_network_allocate(&share, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate shared network");
+	share->name = "test";
+
+	/* The pools are linked in order, as the config parser does. */
+	for (i = NPOOLS - 1; i >= 0; i--) {
+		pool = NULL;
+		if (pool_allocate(&pool, MDL) != ISC_R_SUCCESS)
+			atf_tc_fail("can't allocate pool");
+		shared_network_reference(&pool->shared_network, share, MDL);
+		if (share->pools != NULL) {
+			pool_reference(&pool->next, share->pools, MDL);
+			pool_dereference(&share->pools, MDL);
+		}
+		pool_reference(&share->pools, pool, MDL);
+		test_pools[i] = pool;
+		pool_dereference(&pool, MDL);
+	}
+
+	packet = NULL;
+	if (!packet_allocate(&packet, MDL))
+		atf_tc_fail("can't allocate packet");
+}
+
+/* Put a new lease in pool p, in the given state. */
+static struct lease *
+add_lease(int p, int host, binding_state_t state, TIME ends, int used)
+{
+	struct lease *lease = NULL;
+
+	if (lease_allocate(&lease, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate lease");
+	lease->ip_addr.len = 4;
+	lease->ip_addr.iabuf[0] = 10;
+	lease->ip_addr.iabuf[2] = p;
+	lease->ip_addr.iabuf[3] = host;
+	pool_reference(&lease->pool, test_pools[p], MDL);
+	lease->binding_state = state;
+	lease->next_binding_state = state;
+	lease->starts = lease->ends = ends;
+	if (used) {
+		lease->hardware_addr.hlen = 7;
+		lease->hardware_addr.hbuf[0] = HTYPE_ETHER;
+		lease->hardware_addr.hbuf[6] = host;
+	}
+	if (!lease_enqueue(lease))
+		atf_tc_fail("can't queue lease %s", piaddr(lease->ip_addr));
+	return (lease);
+}
+
+/* Move a lease to a new state and expiry as the server would.  This
+   says it comes from pool_timer(), since that would commit the lease and
+   there is no lease file here, so the test makes each move itself. */
+static void
+move_lease(struct lease *lease, binding_state_t state, TIME ends)
+{
+	struct lease *lt = NULL;
+
+	if (lease_allocate(&lt, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate lease");
+	lt->hardware_addr = lease->hardware_addr;
+	lt->starts = lease->starts;
+	lt->ends = ends;
+	lt->next_binding_state = state;
+	if (!supersede_lease(lease, lt, 0, 0, 0, 1))
+		atf_tc_fail("can't move lease %s", piaddr(lease->ip_addr));
+	lease_dereference(&lt, MDL);
+}
+
+/* Check that allocate_lease() picks expect, both from the index and by
+   walking the pools. */
+static void
+check_best(const char *what, struct lease *expect)
+{
+	struct lease *indexed = NULL, *walked = NULL;
+	int peer_has_leases = 0;
+
+	allocate_lease(&indexed, packet, share->pools, &peer_has_leases);
+	if (share->pools_indexed <= 0)
+		atf_tc_fail("%s: pools were not indexed", what);
+
+	share->pools_indexed = -1;
+	allocate_lease(&walked, packet, share->pools, &peer_has_leases);
+	share->pools_indexed = 1;
+
+	if (walked != expect)
+		atf_tc_fail("%s: pool walk found %s", what,
+			    walked ? piaddr(walked->ip_addr) : "nothing");
+	if (indexed != expect)
+		atf_tc_fail("%s: index found %s, expected %s", what,
+			    indexed ? piaddr(indexed->ip_addr) : "nothing",
+			    expect ? piaddr(expect->ip_addr) : "nothing");
+
+	if (indexed != NULL)
+		lease_dereference(&indexed, MDL);
+	if (walked != NULL)
+		lease_dereference(&walked, MDL);
+}
+
+ATF_TC(pool_index_tiers);
+ATF_TC_HEAD(pool_index_tiers, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the pool index prefers "
+			  "unused, then used, then abandoned leases");
+}
+
+ATF_TC_BODY(pool_index_tiers, tc)
+{
+	struct lease *unused, *used, *abandoned, *active;
+
+	setup();
+
+	unused = add_lease(0, 1, FTS_FREE, cur_time - 100, 0);
+	used = add_lease(1, 1, FTS_FREE, cur_time - 300, 1);
+	abandoned = add_lease(2, 1, FTS_ABANDONED, cur_time - 500, 0);
+	active = add_lease(3, 1, FTS_ACTIVE, cur_time + 3600, 1);
+	check_best("start", unused);
+
+	/* Handed to the failover peer. */
+	move_lease(unused, FTS_BACKUP, cur_time - 100);
+	check_best("unused to backup", used);
+
+	move_lease(used, FTS_ACTIVE, cur_time + 3600);
+	check_best("used to active", abandoned);
+
+	/* An expired lease isn't given out until it is free again. */
+	move_lease(active, FTS_EXPIRED, cur_time - 50);
+	check_best("active expired", abandoned);
+	move_lease(active, FTS_FREE, cur_time - 50);
+	check_best("expired to free", active);
+
+	move_lease(unused, FTS_FREE, cur_time - 100);
+	check_best("backup to free", unused);
+
+	move_lease(unused, FTS_ACTIVE, cur_time + 3600);
+	move_lease(active, FTS_ACTIVE, cur_time + 3600);
+	check_best("only abandoned left", abandoned);
+
+	move_lease(abandoned, FTS_ACTIVE, cur_time + 3600);
+	check_best("nothing free", NULL);
+}
+
+ATF_TC(pool_index_order);
+ATF_TC_HEAD(pool_index_order, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the pool index follows "
+			  "changes to the expiry of free leases");
+}
+
+ATF_TC_BODY(pool_index_order, tc)
+{
+	struct lease *l[NPOOLS][2];
+	int i;
+
+	setup();
+
+	/* Two used free leases in each pool, the oldest in pool 0. */
+	for (i = 0; i < NPOOLS; i++) {
+		l[i][0] = add_lease(i, 1, FTS_FREE, cur_time - 1000 + i, 1);
+		l[i][1] = add_lease(i, 2, FTS_FREE, cur_time - 500 + i, 1);
+	}
+	check_best("start", l[0][0]);
+
+	/* Offering a lease pushes its expiry forward, which moves its
+	   pool down the heap. */
+	move_lease(l[0][0], FTS_FREE, cur_time + 120);
+	check_best("offered", l[1][0]);
+
+	/* Equal expiries go to the pool declared first. */
+	move_lease(l[3][0], FTS_FREE, cur_time - 2000);
+	move_lease(l[2][0], FTS_FREE, cur_time - 2000);
+	check_best("tie", l[2][0]);
+
+	/* Abandoning a lease moves it out of the free heaps. */
+	move_lease(l[2][0], FTS_ABANDONED, cur_time + 3600);
+	check_best("abandoned", l[3][0]);
+
+	for (i = 0; i < NPOOLS; i++) {
+		move_lease(l[i][0], FTS_ACTIVE, cur_time + 3600);
+		move_lease(l[i][1], FTS_FREE, cur_time + 60 * (i + 1));
+	}
+	check_best("none expired", NULL);
+
+	/* Time passing brings them back in the order they expire. */
+	cur_time += 90;
+	check_best("first expired", l[0][1]);
+	cur_time += 60;
+	check_best("second expired", l[0][1]);
+	move_lease(l[0][1], FTS_ACTIVE, cur_time + 3600);
+	check_best("first taken", l[1][1]);
+}
+
+ATF_TC(pool_index_stale);
+ATF_TC_HEAD(pool_index_stale, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the pool index recovers "
+			  "from a lease changed in place");
+}
+
+ATF_TC_BODY(pool_index_stale, tc)
+{
+	struct lease *a, *b;
+
+	setup();
+
+	a = add_lease(0, 1, FTS_FREE, cur_time - 300, 1);
+	b = add_lease(1, 1, FTS_FREE, cur_time - 200, 1);
+	check_best("start", a);
+
+	/* Nothing should do this, but if something does the index must
+	   still not give out a lease that isn't free. */
+	a->ends = cur_time + 3600;
+	check_best("changed in place", b);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, pool_index_tiers);
+	ATF_TP_ADD_TC(tp, pool_index_order);
+	ATF_TP_ADD_TC(tp, pool_index_stale);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2020 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <sys/time.h>
+#include <atf-c.h>
+
+/*
+ * Test the subnet lookup code.  Subnets are entered with enter_subnet()
+ * as the config parser would, and find_subnet() and find_grouped_subnet()
+ * must return the most specific subnet containing an address, whatever
+ * order the subnets were declared in.
+ */
+
+static struct iaddr
+make_iaddr(const char *text)
+{
+	struct iaddr addr;
+
+	memset(&addr, 0, sizeof(addr));
+	if (inet_pton(AF_INET, text, addr.iabuf) == 1)
+		addr.len = 4;
+	else if (inet_pton(AF_INET6, text, addr.iabuf) == 1)
+		addr.len = 16;
+	else
+		atf_tc_fail("bad address %s", text);
+	return (addr);
+}
+
+static struct subnet *
+add_subnet(const char *net, const char *mask, struct shared_network *share)
+{
+	struct subnet *subnet = NULL;
+
+	if (subnet_allocate(&subnet, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate subnet");
+	subnet->net = make_iaddr(net);
+	subnet->netmask = make_iaddr(mask);
+	if (share != NULL) {
+		shared_network_reference(&subnet->shared_network, share, MDL);
+		if (share->subnets != NULL)
+			subnet_reference(&subnet->next_sibling,
+					 share->subnets, MDL);
+		subnet_dereference(&share->subnets, MDL);
+		subnet_reference(&share->subnets, subnet, MDL);
+	}
+	enter_subnet(subnet);
+	return (subnet);
+}
+
+static struct shared_network *
+add_share(const char *name)
+{
+	struct shared_network *share = NULL;
+
+	if (shared_network_allocate(&share, MDL) != ISC_R_SUCCESS)
+		atf_tc_fail("can't allocate shared network");
+	share->name = dmalloc(strlen(name) + 1, MDL);
+	strcpy(share->name, name);
+	return (share);
+}
+
+/* The lookup as it was done before subnets were indexed.  This only
+   finds the most specific subnet when narrower subnets were declared
+   after the wider ones containing them. */
+static struct subnet *
+walk_subnets(struct iaddr addr)
+{
+	struct subnet *rv;
+
+	for (rv = subnets; rv != NULL; rv = rv->next_subnet) {
+		if (addr.len != rv->netmask.len)
+			continue;
+		if (addr_eq(subnet_number(addr, rv->netmask), rv->net))
+			return (rv);
+	}
+	return (NULL);
+}
+
+static void
+check_lookup(const char *text, struct shared_network *share,
+	     struct subnet *expect)
+{
+	struct subnet *found = NULL;
+	struct iaddr addr;
+	int rv;
+
+	addr = make_iaddr(text);
+	if (share != NULL)
+		rv = find_grouped_subnet(&found, share, addr, MDL);
+	else
+		rv = find_subnet(&found, addr, MDL);
+
+	if (expect == NULL) {
+		if (rv != 0)
+			atf_tc_fail("%s found %s, expected nothing", text,
+				    piaddr(found->net));
+		return;
+	}
+	if (rv == 0)
+		atf_tc_fail("%s not found", text);
+	if (found != expect)
+		atf_tc_fail("%s found the wrong subnet, %s", text,
+			    piaddr(found->net));
+	subnet_dereference(&found, MDL);
+}
+
+ATF_TC(subnet_nested_v4);
+ATF_TC_HEAD(subnet_nested_v4, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the most specific IPv4 "
+			  "subnet is found");
+}
+
+ATF_TC_BODY(subnet_nested_v4, tc)
+{
+	struct subnet *s8, *s16, *s24, *s25, *s32, *other;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	/* Enter them out of order so enter_subnet() has sorting to do. */
+	s16 = add_subnet("10.1.0.0", "255.255.0.0", NULL);
+	other = add_subnet("192.168.0.0", "255.255.255.0", NULL);
+	s24 = add_subnet("10.1.2.0", "255.255.255.0", NULL);
+	s8 = add_subnet("10.0.0.0", "255.0.0.0", NULL);
+	s25 = add_subnet("10.1.2.128", "255.255.255.128", NULL);
+	s32 = add_subnet("172.16.0.1", "255.255.255.255", NULL);
+
+	check_lookup("10.9.9.9", NULL, s8);
+	check_lookup("10.1.9.9", NULL, s16);
+	check_lookup("10.1.2.3", NULL, s24);
+	check_lookup("10.1.2.200", NULL, s25);
+	check_lookup("192.168.0.255", NULL, other);
+	check_lookup("172.16.0.1", NULL, s32);
+	check_lookup("172.16.0.2", NULL, NULL);
+	check_lookup("11.0.0.1", NULL, NULL);
+	check_lookup("192.168.1.1", NULL, NULL);
+}
+
+ATF_TC(subnet_nested_v6);
+ATF_TC_HEAD(subnet_nested_v6, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the most specific IPv6 "
+			  "subnet is found");
+}
+
+ATF_TC_BODY(subnet_nested_v6, tc)
+{
+	struct subnet *s32, *s48, *s64, *v4;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	s32 = add_subnet("2001:db8::", "ffff:ffff::", NULL);
+	s64 = add_subnet("2001:db8:1:2::", "ffff:ffff:ffff:ffff::", NULL);
+	s48 = add_subnet("2001:db8:1::", "ffff:ffff:ffff::", NULL);
+	v4 = add_subnet("10.0.0.0", "255.0.0.0", NULL);
+
+	check_lookup("2001:db8:1:2::5", NULL, s64);
+	check_lookup("2001:db8:1:3::5", NULL, s48);
+	check_lookup("2001:db8:ffff::1", NULL, s32);
+	check_lookup("2001:db9::1", NULL, NULL);
+	/* IPv4 and IPv6 subnets don't see each other. */
+	check_lookup("::a00:1", NULL, NULL);
+	check_lookup("10.0.0.1", NULL, v4);
+}
+
+ATF_TC(subnet_grouped);
+ATF_TC_HEAD(subnet_grouped, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify lookups within a shared "
+			  "network only return its subnets");
+}
+
+ATF_TC_BODY(subnet_grouped, tc)
+{
+	struct shared_network *blue, *green;
+	struct subnet *b8, *g16, *b24, *g24;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	blue = add_share("blue");
+	green = add_share("green");
+
+	b8 = add_subnet("10.0.0.0", "255.0.0.0", blue);
+	g16 = add_subnet("10.1.0.0", "255.255.0.0", green);
+	b24 = add_subnet("10.1.2.0", "255.255.255.0", blue);
+
+	check_lookup("10.1.2.3", NULL, b24);
+	check_lookup("10.1.2.3", blue, b24);
+	check_lookup("10.1.2.3", green, g16);
+	check_lookup("10.1.3.3", blue, b8);
+	check_lookup("10.1.3.3", green, g16);
+	check_lookup("10.2.0.1", green, NULL);
+
+	/* A second copy of a subnet in another shared network is a
+	   configuration error, but lookups by network must still find
+	   the right copy. */
+	g24 = add_subnet("10.1.2.0", "255.255.255.0", green);
+	check_lookup("10.1.2.3", blue, b24);
+	check_lookup("10.1.2.3", green, g24);
+}
+
+ATF_TC(subnet_noncontiguous);
+ATF_TC_HEAD(subnet_noncontiguous, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify subnets with non-contiguous "
+			  "netmasks are still found");
+}
+
+ATF_TC_BODY(subnet_noncontiguous, tc)
+{
+	struct subnet *s8, *odd;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	s8 = add_subnet("10.0.0.0", "255.0.0.0", NULL);
+	odd = add_subnet("10.0.0.5", "255.0.0.255", NULL);
+
+	check_lookup("10.7.7.5", NULL, odd);
+	check_lookup("10.7.7.6", NULL, s8);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+ATF_TC(subnet_many);
+ATF_TC_HEAD(subnet_many, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Compare indexed lookups with a list "
+			  "walk over many subnets");
+}
+
+ATF_TC_BODY(subnet_many, tc)
+{
+#define NSUBNETS 4096
+#define NLOOKUPS 20000
+	struct subnet *found, *expect;
+	struct timeval start;
+	struct iaddr addr;
+	char buf[32];
+	double walk, trie;
+	int i;
+
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+
+	/* 4096 /24s inside a catch-all /8, declared widest first so
+	   that the list walk gets the same answers. */
+	add_subnet("10.0.0.0", "255.0.0.0", NULL);
+	for (i = 0; i < NSUBNETS; i++) {
+		snprintf(buf, sizeof(buf), "10.%d.%d.0", 1 + (i >> 8), i & 255);
+		add_subnet(buf, "255.255.255.0", NULL);
+	}
+
+	srandom(1);
+	addr.len = 4;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NLOOKUPS; i++) {
+		found = NULL;
+		addr.iabuf[0] = 10;
+		addr.iabuf[1] = random() % 20;
+		addr.iabuf[2] = random() & 255;
+		addr.iabuf[3] = random() & 255;
+		if (!find_subnet(&found, addr, MDL))
+			atf_tc_fail("%s not found", piaddr(addr));
+		subnet_dereference(&found, MDL);
+	}
+	trie = elapsed(&start);
+
+	srandom(1);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NLOOKUPS; i++) {
+		addr.iabuf[0] = 10;
+		addr.iabuf[1] = random() % 20;
+		addr.iabuf[2] = random() & 255;
+		addr.iabuf[3] = random() & 255;
+		if (walk_subnets(addr) == NULL)
+			atf_tc_fail("%s not found", piaddr(addr));
+	}
+	walk = elapsed(&start);
+
+	printf("%d lookups over %d subnets: index %.3fs, list walk %.3fs\n",
+	       NLOOKUPS, NSUBNETS + 1, trie, walk);
+
+	/* And check the answers agree. */
+	srandom(2);
+	for (i = 0; i < NLOOKUPS / 10; i++) {
+		found = NULL;
+		addr.iabuf[0] = 10;
+		addr.iabuf[1] = random() % 20;
+		addr.iabuf[2] = random() & 255;
+		addr.iabuf[3] = random() & 255;
+		expect = walk_subnets(addr);
+		if (!find_subnet(&found, addr, MDL) || found != expect)
+			atf_tc_fail("%s: index and list walk disagree",
+				    piaddr(addr));
+		subnet_dereference(&found, MDL);
+	}
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, subnet_nested_v4);
+	ATF_TP_ADD_TC(tp, subnet_nested_v6);
+	ATF_TP_ADD_TC(tp, subnet_grouped);
+	ATF_TP_ADD_TC(tp, subnet_noncontiguous);
+	ATF_TP_ADD_TC(tp, subnet_many);
+	return (atf_no_error());
+}